@@ -0,0 +1,362 @@
+#include "calibration.h"
+#include "memory.h"
+#include "jobs.h"
+#include <emmintrin.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <string>
+#include <fstream>
+
+static const uint32_t CALIBRATION_CHUNK_SIZE = 1 << 16;
+static const float LOG10_2 = 0.30102999566f;
+static const float LOG2_10 = 3.32192809489f;
+
+// log2 of positive normal floats: exponent plus atanh series of the mantissa around 1 (~1e-7 accuracy)
+static inline __m128 log2_ps(__m128 x)
+{
+    __m128i bits = _mm_castps_si128(x);
+    __m128i exponent = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+    __m128 mantissa = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)), _mm_set1_epi32(0x3F800000)));
+
+    // Keep the mantissa in [sqrt(1/2), sqrt(2)) so the series converges quickly
+    __m128 large = _mm_cmpgt_ps(mantissa, _mm_set1_ps(1.41421356f));
+    mantissa = _mm_or_ps(_mm_andnot_ps(large, mantissa), _mm_and_ps(large, _mm_mul_ps(mantissa, _mm_set1_ps(0.5f))));
+    exponent = _mm_sub_epi32(exponent, _mm_castps_si128(large)); // large is all ones (-1) where the mantissa was halved
+
+    __m128 t = _mm_div_ps(_mm_sub_ps(mantissa, _mm_set1_ps(1.0f)), _mm_add_ps(mantissa, _mm_set1_ps(1.0f)));
+    __m128 t2 = _mm_mul_ps(t, t);
+    __m128 series = _mm_add_ps(_mm_set1_ps(1.0f / 7.0f), _mm_mul_ps(t2, _mm_set1_ps(1.0f / 9.0f)));
+    series = _mm_add_ps(_mm_set1_ps(1.0f / 5.0f), _mm_mul_ps(t2, series));
+    series = _mm_add_ps(_mm_set1_ps(1.0f / 3.0f), _mm_mul_ps(t2, series));
+    series = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(t2, series));
+    __m128 log_mantissa = _mm_mul_ps(_mm_mul_ps(t, series), _mm_set1_ps(2.0f / 0.69314718056f));
+    return _mm_add_ps(_mm_cvtepi32_ps(exponent), log_mantissa);
+}
+
+// 2^x for x in the normal float range: integer part into the exponent, Taylor series of the remainder in [-0.5, 0.5]
+static inline __m128 exp2_ps(__m128 x)
+{
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0f)), _mm_set1_ps(127.0f));
+    __m128i integer = _mm_cvtps_epi32(x);
+    __m128 f = _mm_mul_ps(_mm_sub_ps(x, _mm_cvtepi32_ps(integer)), _mm_set1_ps(0.69314718056f));
+    __m128 p = _mm_add_ps(_mm_set1_ps(1.0f / 120.0f), _mm_mul_ps(f, _mm_set1_ps(1.0f / 720.0f)));
+    p = _mm_add_ps(_mm_set1_ps(1.0f / 24.0f), _mm_mul_ps(f, p));
+    p = _mm_add_ps(_mm_set1_ps(1.0f / 6.0f), _mm_mul_ps(f, p));
+    p = _mm_add_ps(_mm_set1_ps(0.5f), _mm_mul_ps(f, p));
+    p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(f, p));
+    p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(f, p));
+    __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(integer, _mm_set1_epi32(127)), 23));
+    return _mm_mul_ps(p, scale);
+}
+
+CalibrationSettings calibration::get_default_settings()
+{
+    CalibrationSettings settings = {};
+    settings.trace_bins = 128;
+    settings.reference_bins = 128;
+    settings.trace_floor = 1.0e-6f;
+    settings.reference_floor = 1.0e-6f;
+    settings.trace_log_min = 0.0f;
+    settings.trace_log_max = 0.0f;
+    settings.reference_log_min = 0.0f;
+    settings.reference_log_max = 0.0f;
+    return settings;
+}
+
+CalibrationHistogram calibration::build_histogram(float *trace, float *reference, size_t count, CalibrationSettings settings)
+{
+    uint32_t thread_count = jobs::get_thread_count();
+    uint32_t chunk_count = uint32_t((count + CALIBRATION_CHUNK_SIZE - 1) / CALIBRATION_CHUNK_SIZE);
+
+    // Derive the histogram ranges from the valid samples if not given
+    if (settings.trace_log_min >= settings.trace_log_max || settings.reference_log_min >= settings.reference_log_max) {
+        float *ranges = memory::alloc_heap<float>(4 * thread_count);
+        for (uint32_t t = 0; t < thread_count; ++t) {
+            ranges[4 * t + 0] = ranges[4 * t + 2] = 1.0e30f;
+            ranges[4 * t + 1] = ranges[4 * t + 3] = 0.0f;
+        }
+        jobs::parallel_for(chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+            float *range = ranges + 4 * thread_index;
+            size_t last = size_t(end) * CALIBRATION_CHUNK_SIZE < count ? size_t(end) * CALIBRATION_CHUNK_SIZE : count;
+            for (size_t i = size_t(begin) * CALIBRATION_CHUNK_SIZE; i < last; ++i) {
+                if (trace[i] <= settings.trace_floor || reference[i] <= settings.reference_floor)
+                    continue;
+                range[0] = trace[i] < range[0] ? trace[i] : range[0];
+                range[1] = trace[i] > range[1] ? trace[i] : range[1];
+                range[2] = reference[i] < range[2] ? reference[i] : range[2];
+                range[3] = reference[i] > range[3] ? reference[i] : range[3];
+            }
+        });
+        float trace_min = 1.0e30f, trace_max = 0.0f, reference_min = 1.0e30f, reference_max = 0.0f;
+        for (uint32_t t = 0; t < thread_count; ++t) {
+            trace_min = ranges[4 * t + 0] < trace_min ? ranges[4 * t + 0] : trace_min;
+            trace_max = ranges[4 * t + 1] > trace_max ? ranges[4 * t + 1] : trace_max;
+            reference_min = ranges[4 * t + 2] < reference_min ? ranges[4 * t + 2] : reference_min;
+            reference_max = ranges[4 * t + 3] > reference_max ? ranges[4 * t + 3] : reference_max;
+        }
+        memory::free_heap(ranges);
+        if (trace_max <= 0.0f) {
+            trace_min = reference_min = 1.0f;
+            trace_max = reference_max = 10.0f;
+        }
+        if (settings.trace_log_min >= settings.trace_log_max) {
+            settings.trace_log_min = log10f(trace_min);
+            settings.trace_log_max = fmaxf(log10f(trace_max), settings.trace_log_min + 1.0e-3f);
+        }
+        if (settings.reference_log_min >= settings.reference_log_max) {
+            settings.reference_log_min = log10f(reference_min);
+            settings.reference_log_max = fmaxf(log10f(reference_max), settings.reference_log_min + 1.0e-3f);
+        }
+    }
+
+    CalibrationHistogram histogram = {};
+    histogram.trace_bins = settings.trace_bins;
+    histogram.reference_bins = settings.reference_bins;
+    histogram.trace_log_min = settings.trace_log_min;
+    histogram.trace_log_max = settings.trace_log_max;
+    histogram.reference_log_min = settings.reference_log_min;
+    histogram.reference_log_max = settings.reference_log_max;
+
+    // Per-thread histograms, merged afterwards
+    uint32_t bin_count = settings.trace_bins * settings.reference_bins;
+    double *thread_counts = memory::alloc_heap<double>(thread_count * bin_count);
+    uint64_t *thread_samples = memory::alloc_heap<uint64_t>(thread_count);
+    memset(thread_counts, 0, thread_count * bin_count * sizeof(double));
+    memset(thread_samples, 0, thread_count * sizeof(uint64_t));
+    float trace_scale = float(settings.trace_bins) / (settings.trace_log_max - settings.trace_log_min);
+    float reference_scale = float(settings.reference_bins) / (settings.reference_log_max - settings.reference_log_min);
+
+    jobs::parallel_for(chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        double *counts = thread_counts + thread_index * bin_count;
+        size_t last = size_t(end) * CALIBRATION_CHUNK_SIZE < count ? size_t(end) * CALIBRATION_CHUNK_SIZE : count;
+        for (size_t i = size_t(begin) * CALIBRATION_CHUNK_SIZE; i < last; ++i) {
+            if (trace[i] <= settings.trace_floor || reference[i] <= settings.reference_floor)
+                continue;
+            int32_t t = int32_t((log10f(trace[i]) - settings.trace_log_min) * trace_scale);
+            int32_t r = int32_t((log10f(reference[i]) - settings.reference_log_min) * reference_scale);
+            t = t < 0 ? 0 : (t >= int32_t(settings.trace_bins) ? int32_t(settings.trace_bins) - 1 : t);
+            r = r < 0 ? 0 : (r >= int32_t(settings.reference_bins) ? int32_t(settings.reference_bins) - 1 : r);
+            counts[t * settings.reference_bins + r] += 1.0;
+            ++thread_samples[thread_index];
+        }
+    });
+
+    histogram.counts = memory::alloc_heap<double>(bin_count);
+    memset(histogram.counts, 0, bin_count * sizeof(double));
+    for (uint32_t t = 0; t < thread_count; ++t) {
+        for (uint32_t i = 0; i < bin_count; ++i) {
+            histogram.counts[i] += thread_counts[t * bin_count + i];
+        }
+        histogram.sample_count += thread_samples[t];
+    }
+    memory::free_heap(thread_counts);
+    memory::free_heap(thread_samples);
+    return histogram;
+}
+
+// Value of the reference axis below which `fraction` of the samples in a trace bin lie (linear within bins)
+static float get_quantile(double *row, uint32_t bin_count, double total, double fraction, float log_min, float bin_width)
+{
+    double target = fraction * total;
+    double cumulative = 0.0;
+    for (uint32_t r = 0; r < bin_count; ++r) {
+        if (row[r] > 0.0 && cumulative + row[r] >= target) {
+            double t = (target - cumulative) / row[r];
+            return log_min + (float(r) + float(t)) * bin_width;
+        }
+        cumulative += row[r];
+    }
+    return log_min + float(bin_count) * bin_width;
+}
+
+CalibrationMapping calibration::fit(CalibrationHistogram *histogram)
+{
+    uint32_t node_count = histogram->trace_bins;
+    CalibrationMapping mapping = {};
+    mapping.node_count = node_count;
+    mapping.log_trace_step = (histogram->trace_log_max - histogram->trace_log_min) / float(node_count);
+    mapping.log_trace_min = histogram->trace_log_min + 0.5f * mapping.log_trace_step;
+    mapping.log_reference = memory::alloc_heap<float>(node_count);
+    mapping.log_median = memory::alloc_heap<float>(node_count);
+    mapping.log_lower = memory::alloc_heap<float>(node_count);
+    mapping.log_upper = memory::alloc_heap<float>(node_count);
+    mapping.weights = memory::alloc_heap<double>(node_count);
+
+    // Conditional percentiles of the reference per trace bin
+    float reference_width = (histogram->reference_log_max - histogram->reference_log_min) / float(histogram->reference_bins);
+    for (uint32_t t = 0; t < node_count; ++t) {
+        double *row = histogram->counts + t * histogram->reference_bins;
+        double total = 0.0;
+        for (uint32_t r = 0; r < histogram->reference_bins; ++r) {
+            total += row[r];
+        }
+        mapping.weights[t] = total;
+        if (total > 0.0) {
+            mapping.log_median[t] = get_quantile(row, histogram->reference_bins, total, 0.5, histogram->reference_log_min, reference_width);
+            mapping.log_lower[t] = get_quantile(row, histogram->reference_bins, total, 0.16, histogram->reference_log_min, reference_width);
+            mapping.log_upper[t] = get_quantile(row, histogram->reference_bins, total, 0.84, histogram->reference_log_min, reference_width);
+        } else {
+            mapping.log_median[t] = mapping.log_lower[t] = mapping.log_upper[t] = 0.0f;
+        }
+    }
+
+    // Pool adjacent violators over the non-empty bins, weighted by their sample counts
+    uint32_t *block_start = memory::alloc_heap<uint32_t>(node_count);
+    double *block_value = memory::alloc_heap<double>(node_count);
+    double *block_weight = memory::alloc_heap<double>(node_count);
+    uint32_t block_count = 0;
+    for (uint32_t t = 0; t < node_count; ++t) {
+        if (mapping.weights[t] <= 0.0)
+            continue;
+        block_start[block_count] = t;
+        block_value[block_count] = mapping.log_median[t];
+        block_weight[block_count] = mapping.weights[t];
+        ++block_count;
+        while (block_count > 1 && block_value[block_count - 2] > block_value[block_count - 1]) {
+            double weight = block_weight[block_count - 2] + block_weight[block_count - 1];
+            block_value[block_count - 2] = (block_value[block_count - 2] * block_weight[block_count - 2]
+                                          + block_value[block_count - 1] * block_weight[block_count - 1]) / weight;
+            block_weight[block_count - 2] = weight;
+            --block_count;
+        }
+    }
+
+    // Expand blocks back to nodes; empty bins are interpolated between their neighbors and held constant at the ends
+    for (uint32_t t = 0; t < node_count; ++t) {
+        mapping.log_reference[t] = NAN;
+    }
+    for (uint32_t b = 0; b < block_count; ++b) {
+        uint32_t end = b + 1 < block_count ? block_start[b + 1] : node_count;
+        for (uint32_t t = block_start[b]; t < end; ++t) {
+            if (mapping.weights[t] > 0.0)
+                mapping.log_reference[t] = float(block_value[b]);
+        }
+    }
+    int32_t previous = -1;
+    for (uint32_t t = 0; t <= node_count; ++t) {
+        if (t < node_count && mapping.log_reference[t] != mapping.log_reference[t])
+            continue;
+        for (uint32_t e = uint32_t(previous + 1); e < t; ++e) {
+            if (previous < 0 && t == node_count) {
+                mapping.log_reference[e] = histogram->reference_log_min;
+            } else if (previous < 0) {
+                mapping.log_reference[e] = mapping.log_reference[t];
+            } else if (t == node_count) {
+                mapping.log_reference[e] = mapping.log_reference[previous];
+            } else {
+                float f = float(e - previous) / float(t - previous);
+                mapping.log_reference[e] = mapping.log_reference[previous] + f * (mapping.log_reference[t] - mapping.log_reference[previous]);
+            }
+        }
+        previous = int32_t(t);
+    }
+
+    memory::free_heap(block_start);
+    memory::free_heap(block_value);
+    memory::free_heap(block_weight);
+    return mapping;
+}
+
+float calibration::map(CalibrationMapping *mapping, float trace)
+{
+    float u = (log10f(fmaxf(trace, 1.0e-30f)) - mapping->log_trace_min) / mapping->log_trace_step;
+    u = fminf(fmaxf(u, 0.0f), float(mapping->node_count - 1));
+    uint32_t i = uint32_t(u);
+    i = i + 1 < mapping->node_count ? i : (mapping->node_count > 1 ? mapping->node_count - 2 : 0);
+    float f = u - float(i);
+    float next = mapping->node_count > 1 ? mapping->log_reference[i + 1] : mapping->log_reference[i];
+    return powf(10.0f, mapping->log_reference[i] * (1.0f - f) + next * f);
+}
+
+void calibration::apply(CalibrationMapping *mapping, float *trace, float *result, size_t count)
+{
+    // Pad the table by one node so interpolation at the last node needs no branch
+    float *table = memory::alloc_heap<float>(mapping->node_count + 1);
+    memcpy(table, mapping->log_reference, mapping->node_count * sizeof(float));
+    table[mapping->node_count] = mapping->log_reference[mapping->node_count - 1];
+
+    uint32_t chunk_count = uint32_t((count + CALIBRATION_CHUNK_SIZE - 1) / CALIBRATION_CHUNK_SIZE);
+    jobs::parallel_for(chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        size_t first = size_t(begin) * CALIBRATION_CHUNK_SIZE;
+        size_t last = size_t(end) * CALIBRATION_CHUNK_SIZE < count ? size_t(end) * CALIBRATION_CHUNK_SIZE : count;
+        const __m128 offset = _mm_set1_ps(mapping->log_trace_min / LOG10_2);
+        const __m128 scale = _mm_set1_ps(LOG10_2 / mapping->log_trace_step);
+        const __m128 max_u = _mm_set1_ps(float(mapping->node_count - 1));
+        const __m128 min_trace = _mm_set1_ps(1.0e-30f);
+        size_t i = first;
+        for (; i + 4 <= last; i += 4) {
+            __m128 value = _mm_max_ps(_mm_loadu_ps(trace + i), min_trace);
+            __m128 u = _mm_mul_ps(_mm_sub_ps(log2_ps(value), offset), scale);
+            u = _mm_min_ps(_mm_max_ps(u, _mm_setzero_ps()), max_u);
+            __m128i index = _mm_cvttps_epi32(u);
+            __m128 f = _mm_sub_ps(u, _mm_cvtepi32_ps(index));
+
+            int32_t indices[4];
+            float lower[4], upper[4];
+            _mm_storeu_si128((__m128i*)indices, index);
+            for (int32_t k = 0; k < 4; ++k) {
+                lower[k] = table[indices[k]];
+                upper[k] = table[indices[k] + 1];
+            }
+            __m128 a = _mm_loadu_ps(lower);
+            __m128 b = _mm_loadu_ps(upper);
+            __m128 log_reference = _mm_add_ps(a, _mm_mul_ps(f, _mm_sub_ps(b, a)));
+            _mm_storeu_ps(result + i, exp2_ps(_mm_mul_ps(log_reference, _mm_set1_ps(LOG2_10))));
+        }
+        for (; i < last; ++i) {
+            result[i] = map(mapping, trace[i]);
+        }
+    });
+    memory::free_heap(table);
+}
+
+void calibration::release(CalibrationHistogram *histogram)
+{
+    memory::free_heap(histogram->counts);
+    *histogram = CalibrationHistogram{};
+}
+
+void calibration::release(CalibrationMapping *mapping)
+{
+    memory::free_heap(mapping->log_reference);
+    memory::free_heap(mapping->log_median);
+    memory::free_heap(mapping->log_lower);
+    memory::free_heap(mapping->log_upper);
+    memory::free_heap(mapping->weights);
+    *mapping = CalibrationMapping{};
+}
+
+bool calibration::save(CalibrationHistogram *histogram, CalibrationMapping *mapping, const char *filename)
+{
+    std::string name(filename);
+    std::ofstream mapping_file((name + "_mapping.txt").c_str(), std::ios::out);
+    if (!mapping_file.is_open()) {
+        printf("Failed to write calibration mapping to %s_mapping.txt\n", filename);
+        return false;
+    }
+    mapping_file.precision(6);
+    mapping_file << "log10 Trace,log10 Reference (monotone fit),log10 Reference (median),16th percentile,84th percentile,Samples" << std::endl;
+    for (uint32_t t = 0; t < mapping->node_count; ++t) {
+        mapping_file << mapping->log_trace_min + float(t) * mapping->log_trace_step << ","
+            << mapping->log_reference[t] << ","
+            << mapping->log_median[t] << ","
+            << mapping->log_lower[t] << ","
+            << mapping->log_upper[t] << ","
+            << mapping->weights[t] << std::endl;
+    }
+    mapping_file.close();
+
+    std::ofstream histogram_file((name + "_histogram.txt").c_str(), std::ios::out);
+    histogram_file << "log10 trace range: " << histogram->trace_log_min << " " << histogram->trace_log_max << " (" << histogram->trace_bins << " rows)" << std::endl;
+    histogram_file << "log10 reference range: " << histogram->reference_log_min << " " << histogram->reference_log_max << " (" << histogram->reference_bins << " columns)" << std::endl;
+    histogram_file << "samples: " << histogram->sample_count << std::endl;
+    for (uint32_t t = 0; t < histogram->trace_bins; ++t) {
+        for (uint32_t r = 0; r < histogram->reference_bins; ++r) {
+            histogram_file << histogram->counts[t * histogram->reference_bins + r] << (r + 1 < histogram->reference_bins ? "," : "");
+        }
+        histogram_file << std::endl;
+    }
+    histogram_file.close();
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+struct CalibrationSettings
+{
+    uint32_t trace_bins;
+    uint32_t reference_bins;
+    float trace_floor; // Samples with trace or reference at or below the floors are left out of the fit
+    float reference_floor;
+    float trace_log_min; // log10 ranges of the joint histogram, derived from the samples when min >= max
+    float trace_log_max;
+    float reference_log_min;
+    float reference_log_max;
+};
+
+// Joint histogram of log10(trace) and log10(reference) over paired samples (voxels or halos)
+struct CalibrationHistogram
+{
+    uint32_t trace_bins;
+    uint32_t reference_bins;
+    float trace_log_min;
+    float trace_log_max;
+    float reference_log_min;
+    float reference_log_max;
+    uint64_t sample_count;
+    double *counts; // [trace_bin * reference_bins + reference_bin]
+};
+
+// Monotone (non-decreasing) mapping log10(trace) -> log10(reference), tabulated at the trace bin centers
+struct CalibrationMapping
+{
+    uint32_t node_count;
+    float log_trace_min; // Position of node 0
+    float log_trace_step;
+    float *log_reference; // Fitted monotone curve
+    float *log_median; // Conditional median before the monotone fit
+    float *log_lower; // 16th and 84th percentiles of the conditional distribution
+    float *log_upper;
+    double *weights; // Samples per node
+};
+
+// `calibration` namespace fits trace density against a reference density (simulation grid or halo catalog)
+namespace calibration
+{
+    CalibrationSettings get_default_settings();
+
+    // Bin `count` paired samples into a joint 2D histogram in parallel
+    CalibrationHistogram build_histogram(float *trace, float *reference, size_t count, CalibrationSettings settings);
+
+    // Fit conditional medians of the histogram and make them monotone by pool-adjacent-violators isotonic regression
+    CalibrationMapping fit(CalibrationHistogram *histogram);
+
+    // Map trace values to calibrated reference values (vectorized), e.g. over a whole trace grid
+    void apply(CalibrationMapping *mapping, float *trace, float *result, size_t count);
+
+    // Map a single trace value
+    float map(CalibrationMapping *mapping, float trace);
+
+    void release(CalibrationHistogram *histogram);
+    void release(CalibrationMapping *mapping);
+
+    // Write the mapping table (filename_mapping.txt) and the joint histogram (filename_histogram.txt)
+    bool save(CalibrationHistogram *histogram, CalibrationMapping *mapping, const char *filename);
+}
@@ -0,0 +1,101 @@
+#include "camera_path.h"
+#include "memory.h"
+#include <fstream>
+#include <stdio.h>
+
+static const uint32_t MAX_LINE_LENGTH = 1024;
+
+static bool is_keyframe_line(const char *line)
+{
+    while (*line == ' ' || *line == '\t' || *line == '\r')
+        ++line;
+    return *line != '\0' && *line != '#';
+}
+
+// Uniform Catmull-Rom segment from p1 (u = 0) to p2 (u = 1)
+static inline float catmull_rom(float p0, float p1, float p2, float p3, float u)
+{
+    float u2 = u * u, u3 = u2 * u;
+    return 0.5f * (2.0f * p1 + (p2 - p0) * u + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * u2 + (3.0f * p1 - p0 - 3.0f * p2 + p3) * u3);
+}
+
+bool camera_path::load(const char *filename, CameraPath *path)
+{
+    *path = CameraPath{};
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        printf("Failed to open camera path %s\n", filename);
+        return false;
+    }
+    char line[MAX_LINE_LENGTH];
+    uint32_t line_count = 0;
+    while (file.getline(line, sizeof(line)))
+        line_count += is_keyframe_line(line) ? 1 : 0;
+    if (line_count == 0) {
+        printf("Camera path %s has no keyframes\n", filename);
+        return false;
+    }
+
+    file.clear();
+    file.seekg(0);
+    path->keyframes = memory::alloc_heap<CameraKeyframe>(line_count);
+    while (path->keyframe_count < line_count && file.getline(line, sizeof(line))) {
+        if (!is_keyframe_line(line))
+            continue;
+        CameraKeyframe *keyframe = path->keyframes + path->keyframe_count;
+        float offset_z;
+        int parsed = sscanf(line, "%u %f %f %f %f %f %f %f %f %f %f %f %f", &keyframe->frame, &keyframe->polar,
+            &keyframe->azimuth, &keyframe->radius, &keyframe->offset[0], &keyframe->offset[1], &offset_z,
+            &keyframe->trim_min[0], &keyframe->trim_max[0], &keyframe->trim_min[1], &keyframe->trim_max[1],
+            &keyframe->trim_min[2], &keyframe->trim_max[2]);
+        if (parsed != 13) {
+            printf("Failed to parse keyframe %u of camera path %s\n", path->keyframe_count + 1, filename);
+            release(path);
+            return false;
+        }
+        if (path->keyframe_count > 0 && keyframe->frame <= keyframe[-1].frame) {
+            printf("Keyframe %u of camera path %s does not follow frame %u\n", path->keyframe_count + 1, filename, keyframe[-1].frame);
+            release(path);
+            return false;
+        }
+        ++path->keyframe_count;
+    }
+    path->frame_count = path->keyframes[path->keyframe_count - 1].frame + 1;
+    return true;
+}
+
+void camera_path::apply(CameraPath *path, uint32_t frame, VolpathSettings *settings)
+{
+    // Segment [k1, k2] containing the frame, with the neighbors k0 and k3 repeating the ends of the path
+    uint32_t last = path->keyframe_count - 1;
+    uint32_t segment = 0;
+    while (segment < last && path->keyframes[segment + 1].frame <= frame)
+        ++segment;
+    CameraKeyframe *k1 = path->keyframes + segment;
+    CameraKeyframe *k2 = path->keyframes + (segment < last ? segment + 1 : last);
+    CameraKeyframe *k0 = path->keyframes + (segment > 0 ? segment - 1 : 0);
+    CameraKeyframe *k3 = path->keyframes + (segment + 2 <= last ? segment + 2 : last);
+    float u = 0.0f;
+    if (k2->frame > k1->frame && frame > k1->frame)
+        u = frame < k2->frame ? float(frame - k1->frame) / float(k2->frame - k1->frame) : 1.0f;
+
+    float polar = catmull_rom(k0->polar, k1->polar, k2->polar, k3->polar, u);
+    float azimuth = catmull_rom(k0->azimuth, k1->azimuth, k2->azimuth, k3->azimuth, u);
+    float radius = catmull_rom(k0->radius, k1->radius, k2->radius, k3->radius, u);
+    // As in main.cpp: the polar angle stays off the poles and the radius positive
+    polar = polar < 0.01f ? 0.01f : (polar > 3.13159f ? 3.13159f : polar);
+    radius = radius > 0.01f ? radius : 0.01f;
+    volpath::set_orbit(settings, polar, azimuth, radius);
+    settings->camera_offset_x = catmull_rom(k0->offset[0], k1->offset[0], k2->offset[0], k3->offset[0], u);
+    settings->camera_offset_y = catmull_rom(k0->offset[1], k1->offset[1], k2->offset[1], k3->offset[1], u);
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        settings->trim_min[axis] = k1->trim_min[axis] + (k2->trim_min[axis] - k1->trim_min[axis]) * u;
+        settings->trim_max[axis] = k1->trim_max[axis] + (k2->trim_max[axis] - k1->trim_max[axis]) * u;
+    }
+}
+
+void camera_path::release(CameraPath *path)
+{
+    memory::free_heap(path->keyframes);
+    *path = CameraPath{};
+}
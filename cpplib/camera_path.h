@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include "volpath.h"
+
+// View of one keyframe, in the units of the view state Polyphorm saves with F9 (visu_state.tmp)
+struct CameraKeyframe
+{
+    uint32_t frame; // Frame the view is reached at
+    float polar; // Orbit camera around the domain center [rad], radius in units of the domain width
+    float azimuth;
+    float radius;
+    float offset[2]; // Screen-space pan (camera_offset)
+    float trim_min[3]; // Rendered part of the domain, as fractions of the grid
+    float trim_max[3];
+};
+
+// Keyframes ordered by frame; the path covers frames 0 to the frame of the last keyframe
+struct CameraPath
+{
+    CameraKeyframe *keyframes;
+    uint32_t keyframe_count;
+    uint32_t frame_count;
+};
+
+// `camera_path` namespace interpolates scripted camera flights for the offline renderers
+namespace camera_path
+{
+    // Load a path from a text file with one keyframe per line:
+    //   <frame> <polar> <azimuth> <radius> <offset x> <offset y> <offset z> <trim x min> <trim x max> <trim y min> ... <trim z max>
+    // The values after the frame are the first three lines of visu_state.tmp, so views saved with F9 can be pasted in.
+    // Empty lines and lines starting with # are skipped; frames must increase.
+    bool load(const char *filename, CameraPath *path);
+
+    // Set the camera and trim of `settings` to the view at `frame`. The orbit and the pan follow a Catmull-Rom spline
+    // through the keyframes, the trim is interpolated linearly; frames before the first keyframe hold its view.
+    void apply(CameraPath *path, uint32_t frame, VolpathSettings *settings);
+
+    void release(CameraPath *path);
+}
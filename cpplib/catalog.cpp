@@ -0,0 +1,576 @@
+#include "catalog.h"
+#include "memory.h"
+#include "jobs.h"
+#include <fstream>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+
+static const size_t PARSE_CHUNK_BYTES = MEGABYTES(1); // Text parsed by one job
+static const uint32_t MAX_SIGNIFICANT_DIGITS = 19; // Fits into uint64_t
+static const double PI = 3.14159265358979323846;
+
+static const double EXACT_POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Points of one chunk of text, stored per value so that the transform loops run over contiguous arrays
+struct CatalogChunk
+{
+    const char *begin;
+    const char *end;
+    float *values[CC_COUNT];
+    double *raw_mass; // Mass column before the threshold, masses may exceed the float range
+    uint32_t count;
+    uint64_t row_count;
+    uint64_t invalid_count;
+    float min[3];
+    float max[3];
+};
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Decimal number at p (after optional blanks); returns the end of the number or nullptr.
+// Up to 19 significant digits are accumulated as an integer and scaled once, which is exact for the common
+// short numbers and within an ulp of double (far below float precision) otherwise.
+static const char *parse_number(const char *p, const char *end, double *value)
+{
+    while (p < end && is_blank(*p))
+        ++p;
+    const char *start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+
+    uint64_t mantissa = 0;
+    uint32_t digit_count = 0;
+    int32_t exponent = 0;
+    bool any_digit = false;
+    for (; p < end && is_digit(*p); ++p) {
+        any_digit = true;
+        if (digit_count < MAX_SIGNIFICANT_DIGITS) {
+            mantissa = mantissa * 10 + uint64_t(*p - '0');
+            digit_count += mantissa > 0;
+        } else {
+            ++exponent;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && is_digit(*p); ++p) {
+            any_digit = true;
+            if (digit_count < MAX_SIGNIFICANT_DIGITS) {
+                mantissa = mantissa * 10 + uint64_t(*p - '0');
+                digit_count += mantissa > 0;
+                --exponent;
+            }
+        }
+    }
+
+    if (!any_digit) {
+        // nan, inf and other rare spellings go through the C library
+        char buffer[32];
+        size_t length = 0;
+        while (start + length < end && length + 1 < sizeof(buffer) && !is_blank(start[length]) && start[length] != ',')
+            buffer[length] = start[length], ++length;
+        buffer[length] = 0;
+        char *number_end;
+        *value = strtod(buffer, &number_end);
+        return number_end == buffer ? nullptr : start + (number_end - buffer);
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *exponent_start = p++;
+        bool negative_exponent = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative_exponent = *p == '-';
+            ++p;
+        }
+        if (p < end && is_digit(*p)) {
+            int32_t written_exponent = 0;
+            for (; p < end && is_digit(*p); ++p) {
+                if (written_exponent < 10000)
+                    written_exponent = written_exponent * 10 + (*p - '0');
+            }
+            exponent += negative_exponent ? -written_exponent : written_exponent;
+        } else {
+            p = exponent_start;
+        }
+    }
+
+    double result = double(mantissa);
+    if (mantissa == 0) {
+        result = 0.0;
+    } else if (exponent >= 0 && exponent <= 22) {
+        result *= EXACT_POWERS_OF_TEN[exponent];
+    } else if (exponent < 0 && exponent >= -22) {
+        result /= EXACT_POWERS_OF_TEN[-exponent];
+    } else {
+        result *= pow(10.0, double(exponent));
+    }
+    *value = negative ? -result : result;
+    return p;
+}
+
+static const char *find_line_end(const char *p, const char *end)
+{
+    const char *line_end = (const char*)memchr(p, '\n', end - p);
+    return line_end ? line_end : end;
+}
+
+// Lines that hold no data: empty ones and '#' comments; OBJ files hold data only in their vertex lines
+static bool is_data_line(const char *p, const char *line_end, CatalogFormat format)
+{
+    while (p < line_end && is_blank(*p))
+        ++p;
+    if (format == CF_OBJ)
+        return line_end - p > 1 && p[0] == 'v' && is_blank(p[1]);
+    return p < line_end && *p != '#';
+}
+
+// Uniform value in [0, 1) from the offset of a row in the file, the same for any chunking and thread count
+static double get_row_random(uint64_t offset)
+{
+    uint64_t z = offset + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z = z ^ (z >> 31);
+    return double(z >> 11) / double(1ull << 53);
+}
+
+// Start of the field following the one at p, or nullptr at the end of the line
+static const char *next_field(const char *p, const char *line_end, char separator)
+{
+    if (separator == ' ') {
+        while (p < line_end && !is_blank(*p))
+            ++p;
+        while (p < line_end && is_blank(*p))
+            ++p;
+        return p < line_end ? p : nullptr;
+    }
+    p = (const char*)memchr(p, separator, line_end - p);
+    return p ? p + 1 : nullptr;
+}
+
+static const char *first_field(const char *p, const char *line_end, char separator)
+{
+    if (separator == ' ') {
+        while (p < line_end && is_blank(*p))
+            ++p;
+    }
+    return p;
+}
+
+// Start of the rows: CSV skips its header lines, Rockstar comments are skipped line by line
+static const char *get_data_begin(const char *text, size_t size, CatalogSettings *settings)
+{
+    const char *p = text;
+    const char *end = text + size;
+    if (settings->format == CF_CSV) {
+        for (uint32_t line = 0; line < settings->header_lines && p < end; ++line) {
+            p = find_line_end(p, end);
+            p += p < end;
+        }
+    }
+    return p;
+}
+
+static void parse_chunk(CatalogChunk *chunk, const char *text, CatalogSettings *settings, int8_t *column_slots, int32_t last_column)
+{
+    char separator = settings->format == CF_CSV ? settings->separator : ' ';
+    bool has_mass = settings->columns[CC_MASS] >= 0;
+    bool has_color = settings->columns[CC_COLOR] >= 0;
+    float *x = chunk->values[CC_X];
+    float *y = chunk->values[CC_Y];
+    float *z = chunk->values[CC_Z];
+    float *weights = chunk->values[CC_MASS];
+    float *color = chunk->values[CC_COLOR];
+    double *raw_mass = chunk->raw_mass;
+
+    // Pass 1: fields into columns
+    double row[CC_COUNT];
+    uint32_t count = 0;
+    for (const char *p = chunk->begin; p < chunk->end;) {
+        const char *line_end = find_line_end(p, chunk->end);
+        if (is_data_line(p, line_end, settings->format)) {
+            ++chunk->row_count;
+            if (settings->keep_fraction < 1.0 && !(get_row_random(uint64_t(p - text)) < settings->keep_fraction)) {
+                p = line_end + 1;
+                continue;
+            }
+            uint32_t found = 0;
+            const char *field = first_field(p, line_end, separator);
+            for (int32_t column = 0; column <= last_column && field; ++column) {
+                int8_t slot = column_slots[column];
+                if (slot >= 0) {
+                    if (!parse_number(field, line_end, &row[slot]) || !isfinite(row[slot]))
+                        break;
+                    found |= 1 << slot;
+                }
+                field = next_field(field, line_end, separator);
+            }
+            uint32_t required = 7 | (has_mass ? 1 << CC_MASS : 0) | (has_color ? 1 << CC_COLOR : 0);
+            if ((found & required) == required) {
+                // Positions are scaled in double and rounded to float once
+                double position[3];
+                if (settings->spherical) {
+                    // Right ascension is the azimuth, declination is measured from the equator
+                    double azimuth = row[CC_X] / 180.0 * PI;
+                    double polar = (90.0 - row[CC_Y]) / 180.0 * PI;
+                    double radius = row[CC_Z];
+                    position[0] = radius * sin(polar) * cos(azimuth);
+                    position[1] = radius * sin(polar) * sin(azimuth);
+                    position[2] = radius * cos(polar);
+                } else {
+                    position[0] = row[CC_X];
+                    position[1] = row[CC_Y];
+                    position[2] = settings->format == CF_OBJ ? -row[CC_Z] : row[CC_Z];
+                }
+                x[count] = float(settings->position_scale * position[0]);
+                y[count] = float(settings->position_scale * position[1]);
+                z[count] = float(settings->position_scale * position[2]);
+                if (has_mass)
+                    raw_mass[count] = row[CC_MASS];
+                if (has_color)
+                    color[count] = float(row[CC_COLOR]);
+                ++count;
+            } else {
+                ++chunk->invalid_count;
+            }
+        }
+        p = line_end + 1;
+    }
+
+    // Pass 2: mass threshold, weights and region cut, compacting the columns in place
+    uint32_t kept = 0;
+    for (int32_t i = 0; i < 3; ++i) {
+        chunk->min[i] = FLT_MAX;
+        chunk->max[i] = -FLT_MAX;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        float weight = 1.0f;
+        if (has_mass) {
+            double value = raw_mass[i];
+            if (!(value > settings->mass_min))
+                continue;
+            weight = float((settings->log_mass ? pow(10.0, value) : value) / settings->mass_unit);
+        }
+        float position[3] = { x[i], y[i], z[i] };
+        if (settings->use_roi) {
+            bool inside = true;
+            for (int32_t a = 0; a < 3; ++a) {
+                inside = inside && position[a] >= settings->roi_min[a]
+                    && (settings->roi_exclusive_max ? position[a] < settings->roi_max[a] : position[a] <= settings->roi_max[a]);
+            }
+            if (!inside)
+                continue;
+        }
+        x[kept] = position[0];
+        y[kept] = position[1];
+        z[kept] = position[2];
+        weights[kept] = weight;
+        if (has_color)
+            color[kept] = color[i];
+        for (int32_t a = 0; a < 3; ++a) {
+            chunk->min[a] = position[a] < chunk->min[a] ? position[a] : chunk->min[a];
+            chunk->max[a] = position[a] > chunk->max[a] ? position[a] : chunk->max[a];
+        }
+        ++kept;
+    }
+    chunk->count = kept;
+}
+
+CatalogSettings catalog::get_default_settings(CatalogFormat format)
+{
+    CatalogSettings settings = {};
+    settings.format = format;
+    settings.separator = format == CF_CSV ? ',' : ' ';
+    settings.header_lines = format == CF_CSV ? 1 : 0;
+    if (format == CF_ROCKSTAR) {
+        // Rockstar halo list columns: #ID DescID Mvir Vmax Vrms Rvir Rs Np X Y Z VX VY VZ JX JY JZ Spin rs_klypin Mvir_all M200b ...
+        settings.columns[CC_X] = 8;
+        settings.columns[CC_Y] = 9;
+        settings.columns[CC_Z] = 10;
+        settings.columns[CC_MASS] = 20;
+    } else if (format == CF_OBJ) {
+        // v x y z: the file's y is the height, which becomes z
+        settings.columns[CC_X] = 1;
+        settings.columns[CC_Y] = 3;
+        settings.columns[CC_Z] = 2;
+        settings.columns[CC_MASS] = -1;
+    } else {
+        settings.columns[CC_X] = 0;
+        settings.columns[CC_Y] = 1;
+        settings.columns[CC_Z] = 2;
+        settings.columns[CC_MASS] = 3;
+    }
+    settings.columns[CC_COLOR] = -1;
+    settings.mass_min = -DBL_MAX;
+    settings.mass_unit = 1.0e12;
+    settings.position_scale = 1.0;
+    settings.keep_fraction = 1.0;
+    return settings;
+}
+
+int32_t catalog::find_column(const char *text, size_t size, CatalogSettings *settings, const char *name)
+{
+    const char *end = text + size;
+    const char *p = text;
+    if (settings->format == CF_OBJ) {
+        return -1;
+    } else if (settings->format == CF_CSV) {
+        if (settings->header_lines == 0)
+            return -1;
+    } else {
+        while (p < end && *p != '#')
+            p = find_line_end(p, end) + 1;
+        if (p >= end)
+            return -1;
+    }
+    const char *line_end = find_line_end(p, end);
+    if (p < line_end && *p == '#')
+        ++p;
+
+    char separator = settings->format == CF_CSV ? settings->separator : ' ';
+    size_t name_length = strlen(name);
+    const char *field = first_field(p, line_end, separator);
+    for (int32_t column = 0; field; ++column) {
+        // Trim blanks and quotes; a unit suffix in parentheses, e.g. "X(Mpc/h)", also matches "X"
+        const char *field_end = field;
+        while (field_end < line_end && *field_end != separator && !(separator == ' ' && is_blank(*field_end)))
+            ++field_end;
+        const char *token = field;
+        while (token < field_end && (is_blank(*token) || *token == '"'))
+            ++token;
+        const char *token_end = field_end;
+        while (token_end > token && (is_blank(token_end[-1]) || token_end[-1] == '"'))
+            --token_end;
+        const char *unit = (const char*)memchr(token, '(', token_end - token);
+        if ((size_t(token_end - token) == name_length && strncmp(token, name, name_length) == 0)
+            || (unit && size_t(unit - token) == name_length && strncmp(token, name, name_length) == 0))
+            return column;
+        field = next_field(field, line_end, separator);
+    }
+    return -1;
+}
+
+// Sum of floats in the order numpy adds a float32 array (pairwise, with eight partial sums for up to 128 values), so
+// the mean weight is the float32 value the former packing scripts computed
+static float get_pairwise_sum(const float *values, size_t count, size_t stride)
+{
+    if (count < 8) {
+        float sum = -0.0f;
+        for (size_t i = 0; i < count; ++i)
+            sum += values[i * stride];
+        return sum;
+    }
+    if (count <= 128) {
+        float partial[8];
+        for (size_t j = 0; j < 8; ++j)
+            partial[j] = values[j * stride];
+        size_t i = 8;
+        for (; i + 8 <= count; i += 8) {
+            for (size_t j = 0; j < 8; ++j)
+                partial[j] += values[(i + j) * stride];
+        }
+        float sum = ((partial[0] + partial[1]) + (partial[2] + partial[3])) + ((partial[4] + partial[5]) + (partial[6] + partial[7]));
+        for (; i < count; ++i)
+            sum += values[i * stride];
+        return sum;
+    }
+    size_t half = count / 2;
+    half -= half % 8;
+    return get_pairwise_sum(values, half, stride) + get_pairwise_sum(values + half * stride, count - half, stride);
+}
+
+bool catalog::load(const char *text, size_t size, CatalogSettings settings, Catalog *catalog)
+{
+    *catalog = Catalog{};
+    int32_t last_column = -1;
+    for (int32_t i = 0; i < CC_COUNT; ++i)
+        last_column = settings.columns[i] > last_column ? settings.columns[i] : last_column;
+    for (int32_t i = 0; i < 3; ++i) {
+        if (settings.columns[i] < 0) {
+            printf("Catalog position columns are not set\n");
+            return false;
+        }
+    }
+    int8_t *column_slots = memory::alloc_heap<int8_t>(last_column + 1);
+    memset(column_slots, -1, last_column + 1);
+    for (int32_t i = 0; i < CC_COUNT; ++i) {
+        if (settings.columns[i] >= 0)
+            column_slots[settings.columns[i]] = int8_t(i);
+    }
+
+    // Chunks start right after a line break, so every line is parsed by exactly one job
+    const char *data_begin = get_data_begin(text, size, &settings);
+    const char *text_end = text + size;
+    uint32_t chunk_count = uint32_t((text_end - data_begin) / PARSE_CHUNK_BYTES + 1);
+    CatalogChunk *chunks = memory::alloc_heap<CatalogChunk>(chunk_count);
+    for (uint32_t c = 0; c < chunk_count; ++c) {
+        chunks[c] = CatalogChunk{};
+        const char *begin = data_begin + c * PARSE_CHUNK_BYTES;
+        if (c > 0) {
+            begin = find_line_end(begin - 1, text_end);
+            begin += begin < text_end;
+        }
+        chunks[c].begin = begin;
+        if (c > 0)
+            chunks[c - 1].end = begin;
+    }
+    chunks[chunk_count - 1].end = text_end;
+
+    jobs::parallel_for(chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t c = begin; c < end; ++c) {
+            CatalogChunk *chunk = chunks + c;
+            uint32_t capacity = 1;
+            for (const char *p = chunk->begin; p < chunk->end; ++capacity) {
+                p = find_line_end(p, chunk->end) + 1;
+            }
+            float *storage = memory::alloc_heap<float>(capacity * CC_COUNT);
+            for (uint32_t i = 0; i < CC_COUNT; ++i)
+                chunk->values[i] = storage + i * capacity;
+            chunk->raw_mass = memory::alloc_heap<double>(capacity);
+            parse_chunk(chunk, text, &settings, column_slots, last_column);
+        }
+    });
+
+    // Gather the statistics and the output offsets of the chunks
+    bool has_color = settings.columns[CC_COLOR] >= 0;
+    catalog->stride = has_color ? 5 : 4;
+    for (int32_t i = 0; i < 3; ++i) {
+        catalog->min[i] = FLT_MAX;
+        catalog->max[i] = -FLT_MAX;
+    }
+    uint32_t *offsets = memory::alloc_heap<uint32_t>(chunk_count);
+    uint64_t total = 0;
+    for (uint32_t c = 0; c < chunk_count; ++c) {
+        CatalogChunk *chunk = chunks + c;
+        offsets[c] = uint32_t(total);
+        total += chunk->count;
+        catalog->row_count += chunk->row_count;
+        catalog->invalid_count += chunk->invalid_count;
+        for (int32_t i = 0; i < 3; ++i) {
+            catalog->min[i] = chunk->min[i] < catalog->min[i] ? chunk->min[i] : catalog->min[i];
+            catalog->max[i] = chunk->max[i] > catalog->max[i] ? chunk->max[i] : catalog->max[i];
+        }
+    }
+
+    bool success = total <= UINT32_MAX / catalog->stride;
+    if (success) {
+        catalog->count = uint32_t(total);
+        catalog->data = memory::alloc_heap<float>(catalog->count * catalog->stride + 1);
+        jobs::parallel_for(chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t c = begin; c < end; ++c) {
+                CatalogChunk *chunk = chunks + c;
+                float *out = catalog->data + size_t(offsets[c]) * catalog->stride;
+                for (uint32_t i = 0; i < chunk->count; ++i) {
+                    *out++ = chunk->values[CC_X][i];
+                    *out++ = chunk->values[CC_Y][i];
+                    *out++ = chunk->values[CC_Z][i];
+                    *out++ = chunk->values[CC_MASS][i];
+                    if (has_color)
+                        *out++ = chunk->values[CC_COLOR][i];
+                }
+            }
+        });
+        catalog->mean_weight = total > 0 ? get_pairwise_sum(catalog->data + 3, catalog->count, catalog->stride) / float(catalog->count) : 0.0;
+    } else {
+        printf("Catalog has too many points (%llu)\n", (unsigned long long)total);
+    }
+
+    for (uint32_t c = 0; c < chunk_count; ++c) {
+        if (chunks[c].values[CC_X])
+            memory::free_heap(chunks[c].values[CC_X]);
+        if (chunks[c].raw_mass)
+            memory::free_heap(chunks[c].raw_mass);
+    }
+    memory::free_heap(offsets);
+    memory::free_heap(chunks);
+    memory::free_heap(column_slots);
+    return success;
+}
+
+// Shortest decimal that reads back as the same float, positional between 1e-4 and 1e6 and scientific otherwise,
+// as numpy prints float32 values (so metadata matches the files the former packing scripts wrote)
+static void format_float(char *text, size_t size, float value)
+{
+    int32_t digits = 1;
+    char buffer[32];
+    for (; digits < 9; ++digits) {
+        snprintf(buffer, sizeof(buffer), "%.*e", digits - 1, value);
+        if (strtof(buffer, nullptr) == value)
+            break;
+    }
+    double magnitude = fabs(double(value));
+    if (value == 0.0f || (magnitude >= 1.0e-4 && magnitude < 1.0e6)) {
+        snprintf(buffer, sizeof(buffer), "%.*e", digits - 1, value);
+        int32_t exponent = atoi(strchr(buffer, 'e') + 1);
+        int32_t decimals = digits - 1 - exponent > 0 ? digits - 1 - exponent : 0;
+        snprintf(text, size, decimals > 0 ? "%.*f" : "%.*f.0", decimals, value);
+    } else {
+        snprintf(text, size, "%.*e", digits - 1, value);
+    }
+}
+
+bool catalog::save(Catalog *catalog, const char *filename)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s.bin", filename);
+    std::ofstream data_file(path, std::ios::out | std::ios::binary);
+    if (!data_file.is_open()) {
+        printf("Failed to write %s\n", path);
+        return false;
+    }
+    data_file.write((char*)catalog->data, uint64_t(catalog->count) * catalog->stride * sizeof(float));
+    bool success = data_file.good();
+    data_file.close();
+
+    // Same fields and order as main.cpp reads them
+    snprintf(path, sizeof(path), "%s_metadata.txt", filename);
+    std::ofstream metadata_file(path, std::ios::out);
+    if (!metadata_file.is_open()) {
+        printf("Failed to write %s\n", path);
+        return false;
+    }
+    char line[128];
+    bool empty = catalog->count == 0;
+    snprintf(line, sizeof(line), "Number of points = %u\n", catalog->count);
+    metadata_file << line;
+    const char *axes = "XYZ";
+    char min[32], max[32], mean[32];
+    for (int32_t i = 0; i < 3; ++i) {
+        format_float(min, sizeof(min), empty ? 0.0f : catalog->min[i]);
+        format_float(max, sizeof(max), empty ? 0.0f : catalog->max[i]);
+        snprintf(line, sizeof(line), "Min %c = %s\nMax %c = %s\n", axes[i], min, axes[i], max);
+        metadata_file << line;
+    }
+    format_float(mean, sizeof(mean), float(catalog->mean_weight));
+    snprintf(line, sizeof(line), "Mean weight = %s\n", mean);
+    metadata_file << line;
+    success = success && metadata_file.good();
+    metadata_file.close();
+
+    if (!success)
+        printf("Failed to write catalog %s\n", filename);
+    return success;
+}
+
+void catalog::release(Catalog *catalog)
+{
+    if (catalog->data)
+        memory::free_heap(catalog->data);
+    *catalog = Catalog{};
+}
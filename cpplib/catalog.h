@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+enum CatalogFormat
+{
+    CF_CSV = 0, // Delimited text, the first header line holds the column names
+    CF_ROCKSTAR = 1, // Rockstar halo list: whitespace separated, '#' lines are comments, the first one holds the column names
+    CF_OBJ = 2 // Wavefront OBJ: the 'v x y z' vertex lines are the points, turned from Y-up to Z-up as (x, z, -y)
+};
+
+enum CatalogColumn
+{
+    CC_X = 0,
+    CC_Y = 1,
+    CC_Z = 2,
+    CC_MASS = 3,
+    CC_COLOR = 4, // Optional 5th value per point, used by HALO_COLOR_ANALYSIS
+    CC_COUNT
+};
+
+struct CatalogSettings
+{
+    CatalogFormat format;
+    char separator; // CSV field separator, ' ' = any run of spaces and tabs
+    uint32_t header_lines; // CSV lines before the data
+    int32_t columns[CC_COUNT]; // Source column of each value, -1 = absent (mass defaults to 1, color is not written)
+    bool spherical; // X/Y/Z columns hold right ascension [deg], declination [deg] and distance
+    bool log_mass; // Mass column holds log10 of the mass
+    double mass_min; // Rows with mass column value <= mass_min are dropped (same units as the column)
+    double mass_unit; // Output weight = mass / mass_unit
+    double position_scale; // Output positions are multiplied by this
+    double keep_fraction; // Fraction of the rows kept by a pseudo-random subsampling that depends only on the row's place in the file
+    bool use_roi; // Keep only points inside [roi_min, roi_max] (output coordinates)
+    bool roi_exclusive_max; // The upper bound is outside the region: [roi_min, roi_max)
+    float roi_min[3];
+    float roi_max[3];
+};
+
+// Points in the layout main.cpp loads: x, y, z, weight (and color) per point, plus the metadata statistics
+struct Catalog
+{
+    float *data;
+    uint32_t count;
+    uint32_t stride; // 4, or 5 with a color column
+    uint64_t row_count; // Data rows in the source, including dropped and unparseable ones
+    uint64_t invalid_count; // Rows with missing or unparseable values
+    float min[3];
+    float max[3];
+    double mean_weight;
+};
+
+// `catalog` namespace converts point catalogs (CSV, Rockstar lists) into the binary input of the simulation
+namespace catalog
+{
+    CatalogSettings get_default_settings(CatalogFormat format);
+
+    // Index of the column called `name` in the header of `text`, or -1
+    int32_t find_column(const char *text, size_t size, CatalogSettings *settings, const char *name);
+
+    // Parse the catalog in parallel chunks, then transform, cut and compact the points
+    bool load(const char *text, size_t size, CatalogSettings settings, Catalog *catalog);
+
+    // Write filename.bin and filename_metadata.txt (values printed with the fewest digits that read back as the same float)
+    bool save(Catalog *catalog, const char *filename);
+
+    void release(Catalog *catalog);
+}
@@ -0,0 +1,479 @@
+#include "compression.h"
+#include "memory.h"
+#include <string.h>
+
+static const uint32_t LZ_MIN_MATCH = 4;
+static const uint32_t LZ_HASH_BITS = 15;
+static const size_t LZ_WINDOW = 65535; // Offsets are stored in 16 bits
+static const uint32_t HUFFMAN_MAX_LENGTH = 12; // Longest code, also the width of the decoding table index
+static const size_t HUFFMAN_HEADER_SIZE = 4 + 128; // LZ size and the packed code lengths
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Byte k of every value goes to plane k, trailing bytes that do not form a whole value are kept at the end
+static void shuffle(const uint8_t *source, size_t size, uint32_t element_size, uint8_t *target)
+{
+    size_t count = size / element_size;
+    for (uint32_t k = 0; k < element_size; ++k) {
+        uint8_t *plane = target + k * count;
+        for (size_t i = 0; i < count; ++i)
+            plane[i] = source[i * element_size + k];
+    }
+    memcpy(target + count * element_size, source + count * element_size, size - count * element_size);
+}
+
+static void unshuffle(const uint8_t *source, size_t size, uint32_t element_size, uint8_t *target)
+{
+    size_t count = size / element_size;
+    for (uint32_t k = 0; k < element_size; ++k) {
+        const uint8_t *plane = source + k * count;
+        for (size_t i = 0; i < count; ++i)
+            target[i * element_size + k] = plane[i];
+    }
+    memcpy(target + count * element_size, source + count * element_size, size - count * element_size);
+}
+
+//
+// LZ77 stage: sequences of [token][literal length+][literals][offset][match length+], the token holds 4 bits of
+// each length (15 = continued in extra bytes). Match nibble 0 marks the final, literals-only sequence.
+//
+
+static size_t get_lz_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+static uint8_t *write_length(uint8_t *out, size_t length)
+{
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = uint8_t(length);
+    return out;
+}
+
+static uint8_t *write_sequence(uint8_t *out, const uint8_t *literals, size_t literal_length, size_t match_length, size_t offset)
+{
+    size_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH + 1 : 0;
+    *out++ = uint8_t(((literal_length < 15 ? literal_length : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if (literal_length >= 15)
+        out = write_length(out, literal_length - 15);
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+    if (match_code > 0) {
+        *out++ = uint8_t(offset & 0xFF);
+        *out++ = uint8_t(offset >> 8);
+        if (match_code >= 15)
+            out = write_length(out, match_code - 15);
+    }
+    return out;
+}
+
+static size_t lz_encode(const uint8_t *source, size_t size, uint8_t *target, uint32_t *hash_table)
+{
+    memset(hash_table, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+    uint8_t *out = target;
+    size_t anchor = 0;
+    size_t position = 0;
+    while (position + LZ_MIN_MATCH <= size) {
+        uint32_t sequence = read32(source + position);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = hash_table[hash]; // Position + 1, 0 = empty
+        hash_table[hash] = uint32_t(position + 1);
+        if (candidate == 0 || position + 1 - candidate > LZ_WINDOW || read32(source + candidate - 1) != sequence) {
+            // Step faster through data that does not compress
+            position += 1 + ((position - anchor) >> 6);
+            continue;
+        }
+        candidate -= 1;
+        size_t match_length = LZ_MIN_MATCH;
+        while (position + match_length < size && source[candidate + match_length] == source[position + match_length])
+            ++match_length;
+        out = write_sequence(out, source + anchor, position - anchor, match_length, position - candidate);
+        position += match_length;
+        anchor = position;
+    }
+    out = write_sequence(out, source + anchor, size - anchor, 0, 0);
+    return out - target;
+}
+
+static bool read_length(const uint8_t **in, const uint8_t *in_end, size_t *length)
+{
+    uint8_t byte;
+    do {
+        if (*in >= in_end)
+            return false;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+static bool lz_decode(const uint8_t *source, size_t source_size, uint8_t *target, size_t size)
+{
+    const uint8_t *in = source;
+    const uint8_t *in_end = source + source_size;
+    uint8_t *out = target;
+    uint8_t *out_end = target + size;
+    while (in < in_end) {
+        uint8_t token = *in++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !read_length(&in, in_end, &literal_length))
+            return false;
+        if (literal_length > size_t(in_end - in) || literal_length > size_t(out_end - out))
+            return false;
+        memcpy(out, in, literal_length);
+        in += literal_length;
+        out += literal_length;
+
+        size_t match_code = token & 15;
+        if (match_code == 0)
+            break;
+        if (in_end - in < 2)
+            return false;
+        size_t offset = size_t(in[0]) | (size_t(in[1]) << 8);
+        in += 2;
+        if (match_code == 15 && !read_length(&in, in_end, &match_code))
+            return false;
+        size_t match_length = match_code + LZ_MIN_MATCH - 1;
+        if (offset == 0 || offset > size_t(out - target) || match_length > size_t(out_end - out))
+            return false;
+        const uint8_t *match = out - offset;
+        if (offset == 1) {
+            memset(out, *match, match_length);
+        } else if (offset >= match_length) {
+            memcpy(out, match, match_length);
+        } else {
+            for (size_t i = 0; i < match_length; ++i)
+                out[i] = match[i];
+        }
+        out += match_length;
+    }
+    return in == in_end && out == out_end;
+}
+
+//
+// Huffman stage: canonical, length-limited order-0 codes, bits written LSB first
+//
+
+static void build_code_lengths(const uint32_t *frequencies, uint8_t *lengths)
+{
+    uint32_t weights[256];
+    memcpy(weights, frequencies, sizeof(weights));
+    memset(lengths, 0, 256);
+
+    uint32_t used = 0;
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < 256; ++i) {
+        if (weights[i] > 0) {
+            ++used;
+            last = i;
+        }
+    }
+    if (used == 0)
+        return;
+    if (used == 1) {
+        lengths[last] = 1;
+        return;
+    }
+
+    for (;;) {
+        // Merge the two lightest active nodes until a single root is left
+        uint64_t node_weight[511];
+        int32_t parent[511];
+        bool active[511];
+        uint32_t node_count = 256;
+        for (uint32_t i = 0; i < 256; ++i) {
+            node_weight[i] = weights[i];
+            parent[i] = -1;
+            active[i] = weights[i] > 0;
+        }
+        for (uint32_t merge = 0; merge + 1 < used; ++merge) {
+            int32_t first = -1;
+            int32_t second = -1;
+            for (uint32_t i = 0; i < node_count; ++i) {
+                if (!active[i])
+                    continue;
+                if (first < 0 || node_weight[i] < node_weight[first]) {
+                    second = first;
+                    first = i;
+                } else if (second < 0 || node_weight[i] < node_weight[second]) {
+                    second = i;
+                }
+            }
+            node_weight[node_count] = node_weight[first] + node_weight[second];
+            parent[node_count] = -1;
+            active[node_count] = true;
+            active[first] = active[second] = false;
+            parent[first] = parent[second] = node_count;
+            ++node_count;
+        }
+
+        uint32_t max_length = 0;
+        for (uint32_t i = 0; i < 256; ++i) {
+            if (weights[i] == 0)
+                continue;
+            uint32_t length = 0;
+            for (int32_t node = i; parent[node] >= 0; node = parent[node])
+                ++length;
+            lengths[i] = uint8_t(length);
+            max_length = length > max_length ? length : max_length;
+        }
+        if (max_length <= HUFFMAN_MAX_LENGTH)
+            return;
+
+        // Flatten the distribution and try again
+        for (uint32_t i = 0; i < 256; ++i) {
+            if (weights[i] > 0)
+                weights[i] = (weights[i] + 1) / 2;
+        }
+    }
+}
+
+// Canonical codes, bit-reversed so they can be emitted LSB first. Returns false if the lengths do not form a prefix code.
+static bool build_codes(const uint8_t *lengths, uint16_t *codes)
+{
+    uint32_t length_counts[HUFFMAN_MAX_LENGTH + 1] = {};
+    for (uint32_t i = 0; i < 256; ++i) {
+        if (lengths[i] > HUFFMAN_MAX_LENGTH)
+            return false;
+        ++length_counts[lengths[i]];
+    }
+    length_counts[0] = 0;
+
+    uint32_t next_code[HUFFMAN_MAX_LENGTH + 1] = {};
+    uint32_t code = 0;
+    for (uint32_t length = 1; length <= HUFFMAN_MAX_LENGTH; ++length) {
+        code = (code + length_counts[length - 1]) << 1;
+        next_code[length] = code;
+        if (code + length_counts[length] > (1u << length))
+            return false;
+    }
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t length = lengths[i];
+        codes[i] = 0;
+        if (length == 0)
+            continue;
+        uint32_t canonical = next_code[length]++;
+        uint32_t reversed = 0;
+        for (uint32_t bit = 0; bit < length; ++bit)
+            reversed |= ((canonical >> bit) & 1) << (length - 1 - bit);
+        codes[i] = uint16_t(reversed);
+    }
+    return true;
+}
+
+// Returns the encoded size, or 0 if it would not fit into `capacity` bytes
+static size_t huffman_encode(const uint8_t *source, size_t size, uint8_t *target, size_t capacity)
+{
+    if (capacity <= HUFFMAN_HEADER_SIZE)
+        return 0;
+    uint32_t frequencies[256] = {};
+    for (size_t i = 0; i < size; ++i)
+        ++frequencies[source[i]];
+    uint8_t lengths[256];
+    uint16_t codes[256];
+    build_code_lengths(frequencies, lengths);
+    build_codes(lengths, codes);
+
+    uint32_t lz_size = uint32_t(size);
+    memcpy(target, &lz_size, sizeof(lz_size));
+    for (uint32_t i = 0; i < 128; ++i)
+        target[4 + i] = uint8_t(lengths[2 * i] | (lengths[2 * i + 1] << 4));
+
+    uint8_t *out = target + HUFFMAN_HEADER_SIZE;
+    uint8_t *out_end = target + capacity;
+    uint64_t bits = 0;
+    uint32_t bit_count = 0;
+    for (size_t i = 0; i < size; ++i) {
+        bits |= uint64_t(codes[source[i]]) << bit_count;
+        bit_count += lengths[source[i]];
+        if (bit_count >= 32) {
+            if (out_end - out < 4)
+                return 0;
+            uint32_t word = uint32_t(bits);
+            memcpy(out, &word, sizeof(word));
+            out += 4;
+            bits >>= 32;
+            bit_count -= 32;
+        }
+    }
+    while (bit_count > 0) {
+        if (out >= out_end)
+            return 0;
+        *out++ = uint8_t(bits);
+        bits >>= 8;
+        bit_count = bit_count > 8 ? bit_count - 8 : 0;
+    }
+    return out - target;
+}
+
+static bool huffman_decode(const uint8_t *source, size_t source_size, uint8_t *target, size_t size)
+{
+    uint8_t lengths[256];
+    uint16_t codes[256];
+    for (uint32_t i = 0; i < 128; ++i) {
+        lengths[2 * i] = source[4 + i] & 15;
+        lengths[2 * i + 1] = source[4 + i] >> 4;
+    }
+    if (!build_codes(lengths, codes))
+        return false;
+
+    // Every table index whose low bits match a code decodes to that code's symbol
+    const uint32_t table_size = 1u << HUFFMAN_MAX_LENGTH;
+    uint16_t *table = memory::alloc_heap<uint16_t>(table_size);
+    memset(table, 0, table_size * sizeof(uint16_t));
+    for (uint32_t i = 0; i < 256; ++i) {
+        if (lengths[i] == 0)
+            continue;
+        for (uint32_t entry = codes[i]; entry < table_size; entry += 1u << lengths[i])
+            table[entry] = uint16_t(i | (lengths[i] << 8));
+    }
+
+    const uint8_t *in = source + HUFFMAN_HEADER_SIZE;
+    const uint8_t *in_end = source + source_size;
+    uint64_t bits = 0;
+    uint32_t bit_count = 0;
+    bool success = true;
+    for (size_t i = 0; i < size; ++i) {
+        while (bit_count <= 56 && in < in_end) {
+            bits |= uint64_t(*in++) << bit_count;
+            bit_count += 8;
+        }
+        uint16_t entry = table[bits & (table_size - 1)];
+        uint32_t length = entry >> 8;
+        if (length == 0 || length > bit_count) {
+            success = false;
+            break;
+        }
+        target[i] = uint8_t(entry & 0xFF);
+        bits >>= length;
+        bit_count -= length;
+    }
+    memory::free_heap(table);
+    return success;
+}
+
+// One byte plane: [mode][uint32 stored size][data]
+static const size_t PLANE_HEADER_SIZE = 5;
+
+static size_t encode_plane(const uint8_t *source, size_t size, uint8_t *target, uint8_t *lz, uint32_t *hash_table)
+{
+    size_t lz_size = lz_encode(source, size, lz, hash_table);
+
+    // Entropy-code the LZ output when that beats both LZ alone and the plain bytes (noisy planes rarely repeat,
+    // but their byte histogram is often narrow)
+    size_t best = lz_size < size ? lz_size : size;
+    size_t huffman_size = huffman_encode(lz, lz_size, target + PLANE_HEADER_SIZE, best);
+    uint32_t stored_size;
+    if (huffman_size > 0 && huffman_size < best) {
+        target[0] = CM_LZ_HUFFMAN;
+        stored_size = uint32_t(huffman_size);
+    } else if (lz_size < size) {
+        target[0] = CM_LZ;
+        stored_size = uint32_t(lz_size);
+        memcpy(target + PLANE_HEADER_SIZE, lz, lz_size);
+    } else {
+        target[0] = CM_STORED;
+        stored_size = uint32_t(size);
+        memcpy(target + PLANE_HEADER_SIZE, source, size);
+    }
+    memcpy(target + 1, &stored_size, sizeof(stored_size));
+    return PLANE_HEADER_SIZE + stored_size;
+}
+
+static bool decode_plane(const uint8_t *source, size_t source_size, uint8_t *target, size_t size)
+{
+    uint8_t mode = source[0];
+    if (mode == CM_STORED) {
+        if (source_size != size)
+            return false;
+        memcpy(target, source + PLANE_HEADER_SIZE, size);
+        return true;
+    }
+    if (mode == CM_LZ)
+        return lz_decode(source + PLANE_HEADER_SIZE, source_size, target, size);
+    if (mode != CM_LZ_HUFFMAN || source_size < HUFFMAN_HEADER_SIZE)
+        return false;
+
+    const uint8_t *huffman = source + PLANE_HEADER_SIZE;
+    uint32_t lz_size;
+    memcpy(&lz_size, huffman, sizeof(lz_size));
+    if (lz_size == 0 || lz_size > get_lz_bound(size))
+        return false;
+    uint8_t *lz = memory::alloc_heap<uint8_t>(lz_size);
+    bool success = huffman_decode(huffman, source_size, lz, lz_size) && lz_decode(lz, lz_size, target, size);
+    memory::free_heap(lz);
+    return success;
+}
+
+// Planes are coded separately, the trailing bytes of a partial value go with the last plane
+static size_t get_plane_size(size_t size, uint32_t element_size, uint32_t plane)
+{
+    size_t count = size / element_size;
+    return plane + 1 < element_size ? count : size - count * (element_size - 1);
+}
+
+size_t compression::get_bound(size_t size)
+{
+    return size + PLANE_HEADER_SIZE * 16;
+}
+
+size_t compression::encode(const uint8_t *source, size_t size, uint32_t element_size, uint8_t *target)
+{
+    element_size = element_size > 0 && element_size <= 16 ? element_size : 1;
+    uint8_t *shuffled = memory::alloc_heap<uint8_t>(size + 1);
+    uint8_t *lz = memory::alloc_heap<uint8_t>(get_lz_bound(size));
+    uint32_t *hash_table = memory::alloc_heap<uint32_t>(1u << LZ_HASH_BITS);
+    shuffle(source, size, element_size, shuffled);
+
+    size_t result = 0;
+    size_t plane_offset = 0;
+    for (uint32_t plane = 0; plane < element_size; ++plane) {
+        size_t plane_size = get_plane_size(size, element_size, plane);
+        result += encode_plane(shuffled + plane_offset, plane_size, target + result, lz, hash_table);
+        plane_offset += plane_size;
+    }
+
+    memory::free_heap(shuffled);
+    memory::free_heap(lz);
+    memory::free_heap(hash_table);
+    return result;
+}
+
+bool compression::decode(const uint8_t *source, size_t source_size, uint32_t element_size, uint8_t *target, size_t size)
+{
+    element_size = element_size > 0 && element_size <= 16 ? element_size : 1;
+    uint8_t *shuffled = memory::alloc_heap<uint8_t>(size + 1);
+    bool success = true;
+    size_t offset = 0;
+    size_t plane_offset = 0;
+    for (uint32_t plane = 0; plane < element_size && success; ++plane) {
+        uint32_t stored_size = 0;
+        if (source_size - offset < PLANE_HEADER_SIZE) {
+            success = false;
+            break;
+        }
+        memcpy(&stored_size, source + offset + 1, sizeof(stored_size));
+        if (stored_size > source_size - offset - PLANE_HEADER_SIZE) {
+            success = false;
+            break;
+        }
+        size_t plane_size = get_plane_size(size, element_size, plane);
+        success = decode_plane(source + offset, stored_size, shuffled + plane_offset, plane_size);
+        offset += PLANE_HEADER_SIZE + stored_size;
+        plane_offset += plane_size;
+    }
+    success = success && offset == source_size;
+    if (success)
+        unshuffle(shuffled, size, element_size, target);
+    memory::free_heap(shuffled);
+    return success;
+}
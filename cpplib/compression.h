@@ -0,0 +1,31 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Encoded block layout: the input is byte-shuffled into element_size planes (byte k of every value in plane k), each
+// plane is stored as [uint8 mode][uint32 stored size][data] where data is
+//   CM_STORED:     the plane bytes as they are
+//   CM_LZ:         LZ77 sequences of the plane
+//   CM_LZ_HUFFMAN: uint32 LZ size, 256 4-bit Huffman code lengths, then the Huffman-coded LZ sequences
+enum CompressionMode
+{
+    CM_STORED = 0,
+    CM_LZ = 1,
+    CM_LZ_HUFFMAN = 2
+};
+
+// `compression` namespace is a small lossless coder for grid data. Shuffling puts the slowly varying sign/exponent bytes
+// of float data next to each other, where LZ77 catches the empty runs and Huffman coding the narrow byte histograms.
+// Blocks are independent, so callers compress and decompress several blocks in parallel.
+namespace compression
+{
+    // Upper bound of the encoded size of `size` input bytes
+    size_t get_bound(size_t size);
+
+    // Encode `size` bytes holding values of `element_size` bytes into `target` (at least get_bound(size) bytes).
+    // Returns the encoded size; the cheapest of the modes above is picked.
+    size_t encode(const uint8_t *source, size_t size, uint32_t element_size, uint8_t *target);
+
+    // Decode a block produced by encode() into exactly `size` bytes. Returns false for corrupt input.
+    bool decode(const uint8_t *source, size_t source_size, uint32_t element_size, uint8_t *target, size_t size);
+}
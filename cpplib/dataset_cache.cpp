@@ -0,0 +1,296 @@
+#include "dataset_cache.h"
+#include "memory.h"
+#include "jobs.h"
+#include <windows.h>
+#include <fstream>
+#include <string.h>
+#include <stdio.h>
+
+static const char DATASET_CACHE_MAGIC[8] = { 'P', 'P', 'D', 'C', 'A', 'C', 'H', 'E' };
+static const uint64_t PLANE_ALIGNMENT = 64;
+static const size_t HASH_BLOCK_BYTES = MEGABYTES(4); // Hashed by one job
+
+// 64-bit multiply-rotate hash with four independent lanes (the xxHash64 construction)
+static const uint64_t HASH_PRIME_1 = 11400714785074694791ULL;
+static const uint64_t HASH_PRIME_2 = 14029467366897019727ULL;
+static const uint64_t HASH_PRIME_3 = 1609587929392839161ULL;
+static const uint64_t HASH_PRIME_4 = 9650029242287828579ULL;
+static const uint64_t HASH_PRIME_5 = 2870177450012600261ULL;
+
+static uint64_t rotate_left(uint64_t value, uint32_t bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t read_u64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t hash_round(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * HASH_PRIME_2;
+    accumulator = rotate_left(accumulator, 31);
+    return accumulator * HASH_PRIME_1;
+}
+
+static uint64_t hash_merge(uint64_t accumulator, uint64_t lane)
+{
+    accumulator ^= hash_round(0, lane);
+    return accumulator * HASH_PRIME_1 + HASH_PRIME_4;
+}
+
+static uint64_t hash_block(const uint8_t *p, size_t size, uint64_t seed)
+{
+    const uint8_t *end = p + size;
+    uint64_t result;
+    if (size >= 32) {
+        uint64_t lanes[4] = { seed + HASH_PRIME_1 + HASH_PRIME_2, seed + HASH_PRIME_2, seed, seed - HASH_PRIME_1 };
+        for (; p + 32 <= end; p += 32) {
+            for (uint32_t l = 0; l < 4; ++l)
+                lanes[l] = hash_round(lanes[l], read_u64(p + 8 * l));
+        }
+        result = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+        for (uint32_t l = 0; l < 4; ++l)
+            result = hash_merge(result, lanes[l]);
+    } else {
+        result = seed + HASH_PRIME_5;
+    }
+    result += uint64_t(size);
+
+    for (; p + 8 <= end; p += 8)
+        result = rotate_left(result ^ hash_round(0, read_u64(p)), 27) * HASH_PRIME_1 + HASH_PRIME_4;
+    if (p + 4 <= end) {
+        result = rotate_left(result ^ (uint64_t(read_u32(p)) * HASH_PRIME_1), 23) * HASH_PRIME_2 + HASH_PRIME_3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+        result = rotate_left(result ^ (*p * HASH_PRIME_5), 11) * HASH_PRIME_1;
+
+    result ^= result >> 33;
+    result *= HASH_PRIME_2;
+    result ^= result >> 29;
+    result *= HASH_PRIME_3;
+    result ^= result >> 32;
+    return result;
+}
+
+// Read-only view of a whole file
+static void *map_file(const char *path, uint64_t *size, void **file_handle, void **mapping_handle)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return nullptr;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) {
+        CloseHandle(file);
+        return nullptr;
+    }
+    void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return nullptr;
+    }
+    *size = uint64_t(file_size.QuadPart);
+    *file_handle = file;
+    *mapping_handle = mapping;
+    return view;
+}
+
+static void unmap_file(void *view, void *file_handle, void *mapping_handle)
+{
+    UnmapViewOfFile(view);
+    CloseHandle((HANDLE)mapping_handle);
+    CloseHandle((HANDLE)file_handle);
+}
+
+static uint64_t get_plane_offset(uint32_t plane, uint32_t point_count)
+{
+    uint64_t header_size = (sizeof(DatasetCacheHeader) + PLANE_ALIGNMENT - 1) / PLANE_ALIGNMENT * PLANE_ALIGNMENT;
+    uint64_t plane_size = (uint64_t(point_count) * sizeof(float) + PLANE_ALIGNMENT - 1) / PLANE_ALIGNMENT * PLANE_ALIGNMENT;
+    return header_size + plane * plane_size;
+}
+
+// Whether the file holds all planes at the offsets this version writes them to
+static bool has_valid_layout(DatasetCacheHeader *header, uint64_t size)
+{
+    if (size < get_plane_offset(DCP_COUNT, header->point_count))
+        return false;
+    for (uint32_t plane = 0; plane < DCP_COUNT; ++plane) {
+        if (header->plane_offsets[plane] != get_plane_offset(plane, header->point_count))
+            return false;
+    }
+    return true;
+}
+
+static bool is_same_settings(DatasetCacheKey *a, DatasetCacheKey *b)
+{
+    return a->source_size == b->source_size && a->metadata_hash == b->metadata_hash && a->grid_resolution == b->grid_resolution
+        && a->grid_padding == b->grid_padding && a->input_stride == b->input_stride && a->conversion_version == b->conversion_version;
+}
+
+uint64_t dataset_cache::hash(const void *data, size_t size)
+{
+    if (size <= HASH_BLOCK_BYTES)
+        return hash_block((const uint8_t*)data, size, 0);
+
+    // Hash of the block hashes, seeded with the size
+    uint32_t block_count = uint32_t((size + HASH_BLOCK_BYTES - 1) / HASH_BLOCK_BYTES);
+    uint64_t *block_hashes = memory::alloc_heap<uint64_t>(block_count);
+    jobs::parallel_for(block_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t block = begin; block < end; ++block) {
+            size_t offset = size_t(block) * HASH_BLOCK_BYTES;
+            size_t block_size = size - offset < HASH_BLOCK_BYTES ? size - offset : HASH_BLOCK_BYTES;
+            block_hashes[block] = hash_block((const uint8_t*)data + offset, block_size, 0);
+        }
+    });
+    uint64_t result = hash_block((const uint8_t*)block_hashes, block_count * sizeof(uint64_t), uint64_t(size));
+    memory::free_heap(block_hashes);
+    return result;
+}
+
+bool dataset_cache::get_key(const char *source_path, const char *metadata, size_t metadata_size, uint32_t grid_resolution, float grid_padding, uint32_t input_stride,
+    uint32_t conversion_version, DatasetCacheKey *key)
+{
+    *key = DatasetCacheKey{};
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(source_path, GetFileExInfoStandard, &attributes))
+        return false;
+    key->source_size = (uint64_t(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+    key->source_time = (uint64_t(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+    key->metadata_hash = hash(metadata, metadata_size);
+    key->grid_resolution = grid_resolution;
+    key->grid_padding = grid_padding;
+    key->input_stride = input_stride;
+    key->conversion_version = conversion_version;
+    return true;
+}
+
+bool dataset_cache::open(const char *path, const char *source_path, DatasetCacheKey *key, DatasetCache *cache)
+{
+    *cache = DatasetCache{};
+    uint64_t size = 0;
+    void *view = map_file(path, &size, &cache->file_handle, &cache->mapping_handle);
+    if (!view)
+        return false;
+    cache->view = view;
+
+    DatasetCacheHeader *header = (DatasetCacheHeader*)view;
+    bool valid = size >= sizeof(DatasetCacheHeader) && memcmp(header->magic, DATASET_CACHE_MAGIC, sizeof(DATASET_CACHE_MAGIC)) == 0
+        && header->version == DATASET_CACHE_VERSION && is_same_settings(&header->key, key)
+        && has_valid_layout(header, size);
+    if (valid && header->key.source_time != key->source_time) {
+        // Rewritten (or copied) catalog: accept the cache only if the content is still the same
+        if (key->source_hash == 0) {
+            uint64_t source_size = 0;
+            void *source_file, *source_mapping;
+            void *source_view = map_file(source_path, &source_size, &source_file, &source_mapping);
+            if (source_view) {
+                key->source_hash = hash(source_view, size_t(source_size));
+                unmap_file(source_view, source_file, source_mapping);
+            }
+        }
+        valid = key->source_hash != 0 && key->source_hash == header->key.source_hash;
+    }
+    if (!valid) {
+        close(cache);
+        return false;
+    }
+
+    cache->header = *header;
+    for (uint32_t plane = 0; plane < DCP_COUNT; ++plane)
+        cache->planes[plane] = (float*)((uint8_t*)view + header->plane_offsets[plane]);
+    return true;
+}
+
+bool dataset_cache::load(const char *path, DatasetCache *cache)
+{
+    *cache = DatasetCache{};
+    uint64_t size = 0;
+    void *view = map_file(path, &size, &cache->file_handle, &cache->mapping_handle);
+    if (!view) {
+        printf("Failed to read dataset cache %s\n", path);
+        return false;
+    }
+    cache->view = view;
+
+    DatasetCacheHeader *header = (DatasetCacheHeader*)view;
+    if (size < sizeof(DatasetCacheHeader) || memcmp(header->magic, DATASET_CACHE_MAGIC, sizeof(DATASET_CACHE_MAGIC)) != 0
+        || header->version != DATASET_CACHE_VERSION || !has_valid_layout(header, size)) {
+        printf("Unsupported dataset cache %s (version %u expected)\n", path, DATASET_CACHE_VERSION);
+        close(cache);
+        return false;
+    }
+
+    cache->header = *header;
+    for (uint32_t plane = 0; plane < DCP_COUNT; ++plane)
+        cache->planes[plane] = (float*)((uint8_t*)view + header->plane_offsets[plane]);
+    return true;
+}
+
+void dataset_cache::create(DatasetCacheHeader header, DatasetCache *cache)
+{
+    *cache = DatasetCache{};
+    memcpy(header.magic, DATASET_CACHE_MAGIC, sizeof(header.magic));
+    header.version = DATASET_CACHE_VERSION;
+    for (uint32_t plane = 0; plane < DCP_COUNT; ++plane) {
+        header.plane_offsets[plane] = get_plane_offset(plane, header.point_count);
+        cache->planes[plane] = memory::alloc_heap<float>(header.point_count + 1);
+    }
+    cache->header = header;
+}
+
+bool dataset_cache::save(const char *path, DatasetCache *cache)
+{
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        printf("Failed to write dataset cache %s\n", path);
+        return false;
+    }
+
+    const char padding[PLANE_ALIGNMENT] = {};
+    file.write((char*)&cache->header, sizeof(DatasetCacheHeader));
+    uint64_t position = sizeof(DatasetCacheHeader);
+    for (uint32_t plane = 0; plane < DCP_COUNT; ++plane) {
+        file.write(padding, cache->header.plane_offsets[plane] - position);
+        file.write((char*)cache->planes[plane], uint64_t(cache->header.point_count) * sizeof(float));
+        position = cache->header.plane_offsets[plane] + uint64_t(cache->header.point_count) * sizeof(float);
+    }
+    file.write(padding, get_plane_offset(DCP_COUNT, cache->header.point_count) - position);
+
+    bool success = file.good();
+    file.close();
+    if (!success) {
+        printf("Failed to write dataset cache %s\n", path);
+        remove(path);
+    }
+    return success;
+}
+
+void dataset_cache::close(DatasetCache *cache)
+{
+    if (cache->view) {
+        unmap_file(cache->view, cache->file_handle, cache->mapping_handle);
+    } else {
+        for (uint32_t plane = 0; plane < DCP_COUNT; ++plane) {
+            if (cache->planes[plane])
+                memory::free_heap(cache->planes[plane]);
+        }
+    }
+    *cache = DatasetCache{};
+}
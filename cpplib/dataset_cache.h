@@ -0,0 +1,85 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Polyphorm dataset cache (.pcache) layout, all values little-endian:
+//   DatasetCacheHeader | DCP_COUNT planes of point_count float32 values, each plane starting at its 64-byte aligned offset
+// The planes hold the data points as the simulation consumes them (grid positions, normalized deposit weights),
+// so a valid cache is mapped and copied into the particle arrays without touching the catalog.
+
+const uint32_t DATASET_CACHE_VERSION = 1;
+
+enum DatasetCachePlane
+{
+    DCP_X = 0, // Grid position [vox]
+    DCP_Y = 1,
+    DCP_Z = 2,
+    DCP_WEIGHT = 3, // Deposit weight of the point
+    DCP_COLOR = 4, // Halo color flag, 0 without HALO_COLOR_ANALYSIS
+    DCP_MASS = 5, // Catalog weight as stored in the .bin (mass / 10^12)
+    DCP_COUNT
+};
+
+// Everything the cached planes depend on
+struct DatasetCacheKey
+{
+    uint64_t source_hash; // Content hash of the catalog .bin, 0 until computed
+    uint64_t source_size; // Bytes of the catalog .bin
+    uint64_t source_time; // Last write time of the catalog .bin; when it matches, the content is not rehashed
+    uint64_t metadata_hash; // Hash of the metadata text
+    uint32_t grid_resolution;
+    float grid_padding;
+    uint32_t input_stride; // Floats per catalog point
+    uint32_t conversion_version; // Version of the application's point conversion (weighting and normalization)
+};
+
+struct DatasetCacheHeader
+{
+    char magic[8]; // "PPDCACHE"
+    uint32_t version;
+    uint32_t point_count;
+    DatasetCacheKey key;
+    uint32_t grid_size[3]; // Derived simulation grid resolution [vox]
+    float world_size[3]; // Padded world extent of the grid [Mpc]
+    float world_center[3]; // [Mpc]
+    float mean_weight;
+    uint64_t plane_offsets[DCP_COUNT]; // Byte offsets of the planes from the start of the file
+};
+
+// Cached data points, either mapped from a cache file or allocated for building a new one
+struct DatasetCache
+{
+    DatasetCacheHeader header;
+    float *planes[DCP_COUNT];
+    void *view; // Mapped cache file, nullptr for heap planes
+    void *file_handle;
+    void *mapping_handle;
+};
+
+// `dataset_cache` namespace stores preprocessed data points keyed by the catalog content and the grid settings
+namespace dataset_cache
+{
+    // 64-bit hash of the data; large inputs are hashed in parallel blocks (the result does not depend on the thread count)
+    uint64_t hash(const void *data, size_t size);
+
+    // Key of the catalog at `source_path` with its metadata text, the grid settings and the version of the conversion that
+    // fills the planes; the content hash is left 0
+    bool get_key(const char *source_path, const char *metadata, size_t metadata_size, uint32_t grid_resolution, float grid_padding, uint32_t input_stride,
+        uint32_t conversion_version, DatasetCacheKey *key);
+
+    // Map the cache file at `path` if it was built for `key`. If the catalog was rewritten (different write time) its
+    // content is hashed into key->source_hash and the cache is still accepted when the content is unchanged.
+    bool open(const char *path, const char *source_path, DatasetCacheKey *key, DatasetCache *cache);
+
+    // Map the cache file at `path` whatever catalog it was built for, for tools that only read the points of a run
+    bool load(const char *path, DatasetCache *cache);
+
+    // Allocate heap planes for header.point_count points, to be filled and saved
+    void create(DatasetCacheHeader header, DatasetCache *cache);
+
+    // Write a cache file from heap planes
+    bool save(const char *path, DatasetCache *cache);
+
+    // Unmap or free the planes
+    void close(DatasetCache *cache);
+}
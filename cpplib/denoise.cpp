@@ -0,0 +1,159 @@
+#include "denoise.h"
+#include "memory.h"
+#include "jobs.h"
+#include <math.h>
+#include <string.h>
+
+static const float KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f }; // B3 spline
+static const float VARIANCE_KERNEL[3] = { 0.25f, 0.5f, 0.25f }; // Smooths the variance estimate of few samples
+static const float LUMINANCE_EPSILON = 1.e-3f; // Keeps converged pixels from stopping every edge
+static const float DEPTH_EPSILON = 1.0f; // [vox]
+
+// Display and radiance colors of a pixel while it is filtered
+struct DenoisePixel
+{
+    float display[3];
+    float radiance[3];
+    float variance; // Of the display luminance
+};
+
+static inline float get_luminance(const float *color)
+{
+    return 0.2126f * color[0] + 0.7152f * color[1] + 0.0722f * color[2];
+}
+
+DenoiseSettings denoise::get_default_settings()
+{
+    DenoiseSettings settings = {};
+    settings.iteration_count = 3;
+    settings.sigma_luminance = 1.5f;
+    settings.sigma_depth = 0.01f;
+    settings.sigma_density = 0.05f;
+    settings.sigma_albedo = 0.05f;
+    return settings;
+}
+
+void denoise::filter(VolpathImage *image, DenoiseSettings *settings, VolpathImage *output)
+{
+    uint32_t width = image->width, height = image->height;
+    uint32_t pixel_count = width * height;
+    DenoisePixel *current = memory::alloc_heap<DenoisePixel>(pixel_count);
+    DenoisePixel *next = memory::alloc_heap<DenoisePixel>(pixel_count);
+    float *log_density = memory::alloc_heap<float>(pixel_count);
+    float *deviation = memory::alloc_heap<float>(pixel_count);
+
+    // Variance of the mean display luminance from the second moment of the samples
+    jobs::parallel_for(height, 16, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t pixel = begin * width; pixel < end * width; ++pixel) {
+            DenoisePixel *p = current + pixel;
+            memcpy(p->display, image->display + 3 * size_t(pixel), sizeof(p->display));
+            memcpy(p->radiance, image->radiance + 3 * size_t(pixel), sizeof(p->radiance));
+            float luminance = get_luminance(p->display);
+            uint32_t n = image->samples[pixel] > 0 ? image->samples[pixel] : 1;
+            p->variance = fmaxf(image->moment[pixel] - luminance * luminance, 0.0f) / float(n);
+            log_density[pixel] = logf(1.0f + image->density[pixel]);
+        }
+    });
+
+    float density_scale = 1.0f / settings->sigma_density;
+    float albedo_scale = 1.0f / settings->sigma_albedo;
+    for (uint32_t iteration = 0; iteration < settings->iteration_count; ++iteration) {
+        int32_t step = 1 << iteration;
+        jobs::parallel_for(height, 16, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t y = begin; y < end; ++y) {
+                for (uint32_t x = 0; x < width; ++x) {
+                    float variance = 0.0f, weight_sum = 0.0f;
+                    for (int32_t dy = -1; dy <= 1; ++dy) {
+                        int32_t qy = int32_t(y) + dy;
+                        if (qy < 0 || qy >= int32_t(height))
+                            continue;
+                        for (int32_t dx = -1; dx <= 1; ++dx) {
+                            int32_t qx = int32_t(x) + dx;
+                            if (qx < 0 || qx >= int32_t(width))
+                                continue;
+                            float weight = VARIANCE_KERNEL[dx + 1] * VARIANCE_KERNEL[dy + 1];
+                            variance += weight * current[uint32_t(qy) * width + uint32_t(qx)].variance;
+                            weight_sum += weight;
+                        }
+                    }
+                    deviation[y * width + x] = sqrtf(variance / weight_sum);
+                }
+            }
+        });
+
+        jobs::parallel_for(height, 4, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t y = begin; y < end; ++y) {
+                for (uint32_t x = 0; x < width; ++x) {
+                    uint32_t pixel = y * width + x;
+                    DenoisePixel *p = current + pixel;
+                    float luminance = get_luminance(p->display);
+                    float luminance_scale = 1.0f / (settings->sigma_luminance * deviation[pixel] + LUMINANCE_EPSILON);
+                    float depth = image->depth[pixel];
+                    const float *albedo = image->albedo + 3 * size_t(pixel);
+
+                    DenoisePixel sum = {};
+                    float weight_sum = 0.0f;
+                    for (int32_t dy = -2; dy <= 2; ++dy) {
+                        int32_t qy = int32_t(y) + dy * step;
+                        if (qy < 0 || qy >= int32_t(height))
+                            continue;
+                        for (int32_t dx = -2; dx <= 2; ++dx) {
+                            int32_t qx = int32_t(x) + dx * step;
+                            if (qx < 0 || qx >= int32_t(width))
+                                continue;
+                            uint32_t neighbor = uint32_t(qy) * width + uint32_t(qx);
+                            DenoisePixel *q = current + neighbor;
+                            const float *neighbor_albedo = image->albedo + 3 * size_t(neighbor);
+                            float neighbor_depth = image->depth[neighbor];
+                            float da0 = albedo[0] - neighbor_albedo[0];
+                            float da1 = albedo[1] - neighbor_albedo[1];
+                            float da2 = albedo[2] - neighbor_albedo[2];
+                            float edge = fabsf(luminance - get_luminance(q->display)) * luminance_scale
+                                + fabsf(depth - neighbor_depth) / (settings->sigma_depth * fmaxf(depth, neighbor_depth) + DEPTH_EPSILON)
+                                + fabsf(log_density[pixel] - log_density[neighbor]) * density_scale
+                                + sqrtf(da0 * da0 + da1 * da1 + da2 * da2) * albedo_scale;
+                            float weight = KERNEL[dx + 2] * KERNEL[dy + 2] * expf(-edge);
+                            for (uint32_t c = 0; c < 3; ++c) {
+                                sum.display[c] += weight * q->display[c];
+                                sum.radiance[c] += weight * q->radiance[c];
+                            }
+                            sum.variance += weight * weight * q->variance;
+                            weight_sum += weight;
+                        }
+                    }
+
+                    // The center tap always contributes, so the weight sum is positive
+                    float weight_inv = 1.0f / weight_sum;
+                    DenoisePixel *out = next + pixel;
+                    for (uint32_t c = 0; c < 3; ++c) {
+                        out->display[c] = sum.display[c] * weight_inv;
+                        out->radiance[c] = sum.radiance[c] * weight_inv;
+                    }
+                    out->variance = sum.variance * weight_inv * weight_inv;
+                }
+            }
+        });
+        DenoisePixel *swap = current;
+        current = next;
+        next = swap;
+    }
+
+    jobs::parallel_for(height, 16, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t pixel = begin * width; pixel < end * width; ++pixel) {
+            memcpy(output->display + 3 * size_t(pixel), current[pixel].display, sizeof(current[pixel].display));
+            memcpy(output->radiance + 3 * size_t(pixel), current[pixel].radiance, sizeof(current[pixel].radiance));
+        }
+    });
+    memcpy(output->moment, image->moment, pixel_count * sizeof(float));
+    memcpy(output->depth, image->depth, pixel_count * sizeof(float));
+    memcpy(output->density, image->density, pixel_count * sizeof(float));
+    memcpy(output->albedo, image->albedo, 3 * size_t(pixel_count) * sizeof(float));
+    memcpy(output->samples, image->samples, pixel_count * sizeof(uint32_t));
+    output->sample_count = image->sample_count;
+    output->total_samples = image->total_samples;
+    output->trace_fetches = image->trace_fetches;
+    memory::free_heap(current);
+    memory::free_heap(next);
+    memory::free_heap(log_density);
+    memory::free_heap(deviation);
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+#include "volpath.h"
+
+// Edge-stopping parameters of the filter; larger values blur across larger differences
+struct DenoiseSettings
+{
+    uint32_t iteration_count; // A-trous passes, the footprint grows to 4 * 2^iteration_count + 1 px
+    float sigma_luminance; // Luminance difference in standard deviations of the pixel's noise
+    float sigma_depth; // Relative depth difference
+    float sigma_density; // Difference of log(1 + trace density)
+    float sigma_albedo; // Distance of the emission colors
+};
+
+// `denoise` namespace is an edge-avoiding A-trous wavelet filter for progressively rendered images, guided by the
+// per-pixel variance and the depth, density and albedo features of the path tracer (cs_denoise.hlsl on the GPU)
+namespace denoise
+{
+    DenoiseSettings get_default_settings();
+
+    // Filter the radiance and the display colors of `image` into `output`, an image of the same size. Every pass
+    // convolves with a 5 x 5 B3-spline kernel whose taps are 2^pass px apart, weighted down across feature edges and
+    // luminance differences the pixel's variance (blurred over 3 x 3 px, as few samples estimate it poorly) does not
+    // explain; the variance is filtered along.
+    void filter(VolpathImage *image, DenoiseSettings *settings, VolpathImage *output);
+}
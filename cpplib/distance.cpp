@@ -0,0 +1,122 @@
+#include "distance.h"
+#include "memory.h"
+#include "jobs.h"
+#include <math.h>
+
+static const float DISTANCE_INFINITY = 1.0e30f;
+
+// Squared distance transform of a 1D sampled function: out(p) = min_q (in(q) + (spacing * (p - q))^2).
+// `sites` and `bounds` are scratch arrays of `count` and `count + 1` elements.
+static void transform_line(float *in, float *out, uint32_t count, float spacing, uint32_t *sites, float *bounds)
+{
+    float spacing_squared = spacing * spacing;
+    int32_t k = -1;
+    for (uint32_t q = 0; q < count; ++q) {
+        if (in[q] >= DISTANCE_INFINITY)
+            continue;
+        // Drop parabolas hidden by the new one, then append it to the lower envelope
+        float intersection = -DISTANCE_INFINITY;
+        while (k >= 0) {
+            uint32_t v = sites[k];
+            intersection = ((in[q] / spacing_squared + float(q) * float(q)) - (in[v] / spacing_squared + float(v) * float(v))) / (2.0f * float(q) - 2.0f * float(v));
+            if (intersection > bounds[k])
+                break;
+            --k;
+        }
+        ++k;
+        sites[k] = q;
+        bounds[k] = k == 0 ? -DISTANCE_INFINITY : intersection;
+        bounds[k + 1] = DISTANCE_INFINITY;
+    }
+
+    if (k < 0) {
+        for (uint32_t p = 0; p < count; ++p) {
+            out[p] = DISTANCE_INFINITY;
+        }
+        return;
+    }
+    int32_t j = 0;
+    for (uint32_t p = 0; p < count; ++p) {
+        while (bounds[j + 1] < float(p)) {
+            ++j;
+        }
+        float offset = spacing * (float(p) - float(sites[j]));
+        out[p] = offset * offset + in[sites[j]];
+    }
+}
+
+Volume distance::transform(Volume *field, float threshold, float voxel_size_x, float voxel_size_y, float voxel_size_z)
+{
+    const uint32_t width = field->width;
+    const uint32_t height = field->height;
+    const uint32_t depth = field->depth;
+    Volume result = volume::get(width, height, depth);
+    if (!result.data)
+        return result;
+
+    uint32_t line_length = width > height ? width : height;
+    line_length = line_length > depth ? line_length : depth;
+    uint32_t thread_count = jobs::get_thread_count();
+    size_t scratch_stride = 4 * size_t(line_length) + 2;
+    float *scratch = memory::alloc_heap<float>(thread_count * scratch_stride);
+
+    // Pass x: initialize from the threshold and transform rows in place
+    jobs::parallel_for(depth, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        float *line_in = scratch + thread_index * scratch_stride;
+        float *bounds = line_in + line_length;
+        uint32_t *sites = (uint32_t*)(bounds + line_length + 1);
+        for (uint32_t z = begin; z < end; ++z) {
+            for (uint32_t y = 0; y < height; ++y) {
+                size_t row = volume::get_index(field, 0, y, z);
+                for (uint32_t x = 0; x < width; ++x) {
+                    line_in[x] = field->data[row + x] >= threshold ? 0.0f : DISTANCE_INFINITY;
+                }
+                transform_line(line_in, result.data + row, width, voxel_size_x, sites, bounds);
+            }
+        }
+    });
+
+    // Pass y: columns of each z-slice
+    jobs::parallel_for(depth, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        float *line_in = scratch + thread_index * scratch_stride;
+        float *bounds = line_in + line_length;
+        uint32_t *sites = (uint32_t*)(bounds + line_length + 1);
+        float *line_out = (float*)(sites + line_length);
+        for (uint32_t z = begin; z < end; ++z) {
+            for (uint32_t x = 0; x < width; ++x) {
+                size_t column = volume::get_index(&result, x, 0, z);
+                for (uint32_t y = 0; y < height; ++y) {
+                    line_in[y] = result.data[column + size_t(y) * width];
+                }
+                transform_line(line_in, line_out, height, voxel_size_y, sites, bounds);
+                for (uint32_t y = 0; y < height; ++y) {
+                    result.data[column + size_t(y) * width] = line_out[y];
+                }
+            }
+        }
+    });
+
+    // Pass z: pencils of each y-row, followed by the square root
+    size_t slice_size = size_t(width) * height;
+    jobs::parallel_for(height, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        float *line_in = scratch + thread_index * scratch_stride;
+        float *bounds = line_in + line_length;
+        uint32_t *sites = (uint32_t*)(bounds + line_length + 1);
+        float *line_out = (float*)(sites + line_length);
+        for (uint32_t y = begin; y < end; ++y) {
+            for (uint32_t x = 0; x < width; ++x) {
+                size_t pencil = volume::get_index(&result, x, y, 0);
+                for (uint32_t z = 0; z < depth; ++z) {
+                    line_in[z] = result.data[pencil + z * slice_size];
+                }
+                transform_line(line_in, line_out, depth, voxel_size_z, sites, bounds);
+                for (uint32_t z = 0; z < depth; ++z) {
+                    result.data[pencil + z * slice_size] = line_out[z] >= DISTANCE_INFINITY ? INFINITY : sqrtf(line_out[z]);
+                }
+            }
+        }
+    });
+
+    memory::free_heap(scratch);
+    return result;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+#include "volume.h"
+
+// `distance` namespace computes exact Euclidean distance transforms of thresholded grids
+namespace distance
+{
+    // Distance from every voxel center to the nearest voxel with `field` >= `threshold`, in the units of the voxel sizes.
+    // Separable lower-envelope transform (Felzenszwalb & Huttenlocher) along x, y and z, each pass parallel over grid lines.
+    // Voxels of a grid without any feature get INFINITY.
+    Volume transform(Volume *field, float threshold, float voxel_size_x, float voxel_size_y, float voxel_size_z);
+}
@@ -1,74 +1,146 @@
-#include <stdio.h>
-#include <string.h>
 #include "export.h"
-#include "file_system.h"
 #include "memory.h"
-#ifdef CPPLIB_DEBUG_PRINTS
-#include "logging.h"
-#define PRINT_DEBUG(message, ...) logging::print_error(message, ##__VA_ARGS__)
-#else
-#define PRINT_DEBUG(message, ...)
-#endif
+#include "jobs.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fstream>
 
-#define print_to_string sprintf_s
+static const uint32_t STREAM_CHUNK_RECORDS = 8192; // Records (lines or binary elements) formatted by one job
+static const uint32_t STREAM_RECORD_CAPACITY = 128; // Upper bound of the bytes of one record
 
-bool exports::export_to_obj(char *filename, Vector4 *vertices, uint32_t vertex_count, uint32_t vertex_stride, uint16_t *indices, uint32_t index_count)
+// Print into a record, truncating instead of overflowing it
+static uint32_t print_record(char *out, const char *format, ...)
 {
-    uint32_t number_of_lines = vertex_count * 2 + index_count / 3;
-    uint32_t max_line_length = 50; // Should suffice for +-10000
-    
-    uint32_t total_file_size = number_of_lines * max_line_length;
+    va_list arguments;
+    va_start(arguments, format);
+    int32_t length = vsnprintf(out, STREAM_RECORD_CAPACITY, format, arguments);
+    va_end(arguments);
+    if (length < 0)
+        return 0;
+    return uint32_t(length) < STREAM_RECORD_CAPACITY ? uint32_t(length) : STREAM_RECORD_CAPACITY - 1;
+}
 
-    char *file_memory = memory::alloc_heap<char>(total_file_size);
-    char *file_ptr = file_memory;
+// Append `count` records produced by `format_record(record, out)`, which returns the bytes written. A batch of chunks is
+// formatted in parallel into one buffer and written out before the next batch, so memory does not grow with the mesh.
+template <typename F>
+static void write_records(std::ofstream &file, uint32_t count, F format_record)
+{
+    uint32_t batch_chunks = 2 * jobs::get_thread_count();
+    size_t chunk_capacity = size_t(STREAM_CHUNK_RECORDS) * STREAM_RECORD_CAPACITY;
+    char *buffer = memory::alloc_heap<char>(batch_chunks * chunk_capacity);
+    size_t *chunk_sizes = memory::alloc_heap<size_t>(batch_chunks);
+    uint64_t batch_records = uint64_t(batch_chunks) * STREAM_CHUNK_RECORDS;
+    for (uint64_t first = 0; first < count; first += batch_records) {
+        uint32_t last = count - first < batch_records ? count : uint32_t(first + batch_records);
+        uint32_t chunk_count = (last - uint32_t(first) + STREAM_CHUNK_RECORDS - 1) / STREAM_CHUNK_RECORDS;
+        jobs::parallel_for(chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t chunk = begin; chunk < end; ++chunk) {
+                char *out = buffer + chunk * chunk_capacity;
+                uint32_t chunk_first = uint32_t(first) + chunk * STREAM_CHUNK_RECORDS;
+                uint32_t chunk_last = last - chunk_first < STREAM_CHUNK_RECORDS ? last : chunk_first + STREAM_CHUNK_RECORDS;
+                for (uint32_t record = chunk_first; record < chunk_last; ++record)
+                    out += format_record(record, out);
+                chunk_sizes[chunk] = out - (buffer + chunk * chunk_capacity);
+            }
+        });
+        for (uint32_t chunk = 0; chunk < chunk_count; ++chunk)
+            file.write(buffer + chunk * chunk_capacity, chunk_sizes[chunk]);
+    }
+    memory::free_heap(chunk_sizes);
+    memory::free_heap(buffer);
+}
 
-    int32_t size_left = total_file_size;
-    for (uint32_t i = 0; i < vertex_count; ++i)
-    {
-        Vector4 vertex_position = vertices[i * 2];
-        uint32_t bytes_written = print_to_string(file_ptr, size_left, "v %.4f %.4f %.4f %.4f\n", vertex_position.x, vertex_position.y, vertex_position.z, vertex_position.w);
-        if (bytes_written > max_line_length)
-        {
-            PRINT_DEBUG("export_to_obj: expected maximum output line length was %d, actual was %d. This may or may not cause errors.", max_line_length, bytes_written);
-        }
-        file_ptr += bytes_written;
-        size_left -= bytes_written;
-        if (size_left <= 0)
-        {
-            PRINT_DEBUG("Buffer overflow while exporting to OBJ!");
-        }
+bool exports::export_mesh(const char *filename, MeshFileFormat format, float *positions, float *normals, uint32_t vertex_count, uint32_t *indices, uint32_t triangle_count)
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        printf("Failed to write mesh %s\n", filename);
+        return false;
     }
-    for (uint32_t i = 0; i < vertex_count; ++i)
-    {
-        Vector4 vertex_normal = vertices[i * 2 + 1];
-        uint32_t bytes_written = print_to_string(file_ptr, size_left, "vn %.4f %.4f %.4f %.4f\n", vertex_normal.x, vertex_normal.y, vertex_normal.z, vertex_normal.w);
-        file_ptr += bytes_written;
-        size_left -= bytes_written;
-        if (size_left <= 0)
-        {
-            PRINT_DEBUG("Buffer overflow while exporting to OBJ!");
+
+    if (format == MFF_OBJ) {
+        file << "# " << vertex_count << " vertices, " << triangle_count << " triangles\n";
+        write_records(file, vertex_count, [&](uint32_t i, char *out) {
+            return print_record(out, "v %.7g %.7g %.7g\n", positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]);
+        });
+        if (normals) {
+            write_records(file, vertex_count, [&](uint32_t i, char *out) {
+                return print_record(out, "vn %.5f %.5f %.5f\n", normals[3 * i], normals[3 * i + 1], normals[3 * i + 2]);
+            });
         }
-    }
+        // OBJ indices are 1-based; faces reference the normal with the same index as the position
+        write_records(file, triangle_count, [&](uint32_t i, char *out) {
+            uint32_t a = indices[3 * i] + 1, b = indices[3 * i + 1] + 1, c = indices[3 * i + 2] + 1;
+            return normals ? print_record(out, "f %u//%u %u//%u %u//%u\n", a, a, b, b, c, c) : print_record(out, "f %u %u %u\n", a, b, c);
+        });
+    } else {
+        bool binary = format == MFF_PLY_BINARY;
+        file << "ply\n" << (binary ? "format binary_little_endian 1.0\n" : "format ascii 1.0\n");
+        file << "element vertex " << vertex_count << "\n";
+        file << "property float x\nproperty float y\nproperty float z\n";
+        if (normals)
+            file << "property float nx\nproperty float ny\nproperty float nz\n";
+        file << "element face " << triangle_count << "\n";
+        file << "property list uchar uint vertex_indices\nend_header\n";
 
-    for (uint32_t i = 0; i < index_count; i += 3)
-    {
-        uint16_t i1 = indices[i] + 1;
-        uint16_t i2 = indices[i + 1] + 1;
-        uint16_t i3 = indices[i + 2] + 1;
-        uint32_t bytes_written = print_to_string(file_ptr, size_left, "f %d//%d %d//%d %d//%d\n", i1, i1, i2, i2, i3, i3);
-        file_ptr += bytes_written;
-        size_left -= bytes_written;
-        if (size_left <= 0)
-        {
-            PRINT_DEBUG("Buffer overflow while exporting to OBJ!");
+        if (binary) {
+            write_records(file, vertex_count, [&](uint32_t i, char *out) {
+                memcpy(out, positions + 3 * size_t(i), 3 * sizeof(float));
+                if (!normals)
+                    return uint32_t(3 * sizeof(float));
+                memcpy(out + 3 * sizeof(float), normals + 3 * size_t(i), 3 * sizeof(float));
+                return uint32_t(6 * sizeof(float));
+            });
+            write_records(file, triangle_count, [&](uint32_t i, char *out) {
+                out[0] = 3;
+                memcpy(out + 1, indices + 3 * size_t(i), 3 * sizeof(uint32_t));
+                return uint32_t(1 + 3 * sizeof(uint32_t));
+            });
+        } else {
+            write_records(file, vertex_count, [&](uint32_t i, char *out) {
+                const float *p = positions + 3 * size_t(i);
+                if (!normals)
+                    return print_record(out, "%.7g %.7g %.7g\n", p[0], p[1], p[2]);
+                const float *n = normals + 3 * size_t(i);
+                return print_record(out, "%.7g %.7g %.7g %.5f %.5f %.5f\n", p[0], p[1], p[2], n[0], n[1], n[2]);
+            });
+            write_records(file, triangle_count, [&](uint32_t i, char *out) {
+                return print_record(out, "3 %u %u %u\n", indices[3 * i], indices[3 * i + 1], indices[3 * i + 2]);
+            });
         }
     }
 
-    if (!file_system::write_file(filename, file_memory, total_file_size - size_left))
-    {
-        PRINT_DEBUG("Could not write mesh to %s.", filename);
+    bool success = file.good();
+    file.close();
+    if (!success)
+        printf("Failed to write mesh %s\n", filename);
+    return success;
+}
+
+bool exports::export_to_obj(char *filename, Vector4 *vertices, uint32_t vertex_count, uint32_t vertex_stride, uint32_t *indices, uint32_t index_count)
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        printf("Failed to write mesh %s\n", filename);
         return false;
     }
-    memory::free_heap(file_memory);
-    return true;
-}
\ No newline at end of file
+    write_records(file, vertex_count, [&](uint32_t i, char *out) {
+        Vector4 position = vertices[i * 2];
+        return print_record(out, "v %.4f %.4f %.4f %.4f\n", position.x, position.y, position.z, position.w);
+    });
+    write_records(file, vertex_count, [&](uint32_t i, char *out) {
+        Vector4 normal = vertices[i * 2 + 1];
+        return print_record(out, "vn %.4f %.4f %.4f %.4f\n", normal.x, normal.y, normal.z, normal.w);
+    });
+    write_records(file, index_count / 3, [&](uint32_t i, char *out) {
+        uint32_t a = indices[3 * i] + 1, b = indices[3 * i + 1] + 1, c = indices[3 * i + 2] + 1;
+        return print_record(out, "f %u//%u %u//%u %u//%u\n", a, a, b, b, c, c);
+    });
+
+    bool success = file.good();
+    file.close();
+    if (!success)
+        printf("Failed to write mesh %s\n", filename);
+    return success;
+}
@@ -1,7 +1,20 @@
 #pragma once
+#include <stdint.h>
 #include "maths.h"
 
+enum MeshFileFormat
+{
+    MFF_OBJ = 0, // Wavefront OBJ text
+    MFF_PLY_TEXT = 1, // ASCII PLY
+    MFF_PLY_BINARY = 2 // Little-endian binary PLY, compact and fastest to write and load
+};
+
 namespace exports
 {
-    bool export_to_obj(char *filename, Vector4 *vertices, uint32_t vertex_count, uint32_t vertex_stride, uint16_t *indices, uint32_t index_count);
-}
\ No newline at end of file
+    // Write a triangle mesh (3 indices per triangle, 32-bit) with optional per-vertex normals (nullptr = none).
+    // The file is streamed through a bounded buffer: batches of lines are formatted in parallel and written in order.
+    bool export_mesh(const char *filename, MeshFileFormat format, float *positions, float *normals, uint32_t vertex_count, uint32_t *indices, uint32_t triangle_count);
+
+    // Write interleaved (position, normal) vertices as OBJ with 4-component positions and normals
+    bool export_to_obj(char *filename, Vector4 *vertices, uint32_t vertex_count, uint32_t vertex_stride, uint32_t *indices, uint32_t index_count);
+}
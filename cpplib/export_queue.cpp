@@ -0,0 +1,111 @@
+#include "export_queue.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+struct ExportQueueEntry
+{
+    ExportTask task;
+    uint64_t staging_bytes;
+};
+
+// Ring buffer of submitted tasks plus the counters of reserved room, guarded by `mutex`
+static std::mutex mutex;
+static std::condition_variable queue_changed;
+static std::thread writer_thread;
+static ExportQueueEntry *entries = nullptr;
+static uint32_t capacity = 0;
+static uint32_t head = 0;
+static uint32_t queued_count = 0;
+static uint32_t pending_count = 0; // Reserved snapshots, queued or not yet finished
+static uint64_t pending_bytes = 0;
+static uint64_t max_bytes = 0;
+static bool is_running = false;
+
+static void run_writer()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        queue_changed.wait(lock, [] { return queued_count > 0 || !is_running; });
+        if (queued_count == 0)
+            break;
+        ExportQueueEntry entry = entries[head];
+        entries[head].task = nullptr;
+        head = (head + 1) % capacity;
+        --queued_count;
+
+        lock.unlock();
+        entry.task();
+        lock.lock();
+
+        --pending_count;
+        pending_bytes -= entry.staging_bytes;
+        queue_changed.notify_all();
+    }
+}
+
+void export_queue::start(uint32_t max_tasks, uint64_t max_staging_bytes)
+{
+    if (is_running)
+        return;
+    capacity = max_tasks > 0 ? max_tasks : 1;
+    max_bytes = max_staging_bytes;
+    entries = new ExportQueueEntry[capacity];
+    head = queued_count = pending_count = 0;
+    pending_bytes = 0;
+    is_running = true;
+    writer_thread = std::thread(run_writer);
+}
+
+void export_queue::reserve(uint64_t staging_bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!is_running)
+        return;
+    queue_changed.wait(lock, [staging_bytes] {
+        return pending_count == 0 || (pending_count < capacity && pending_bytes + staging_bytes <= max_bytes);
+    });
+    ++pending_count;
+    pending_bytes += staging_bytes;
+}
+
+void export_queue::submit(ExportTask task, uint64_t staging_bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (is_running) {
+            entries[(head + queued_count) % capacity] = { task, staging_bytes };
+            ++queued_count;
+            queue_changed.notify_all();
+            return;
+        }
+    }
+    task();
+}
+
+uint32_t export_queue::get_pending_count()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending_count;
+}
+
+void export_queue::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    queue_changed.wait(lock, [] { return queued_count == 0 && pending_count == 0; });
+}
+
+void export_queue::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!is_running)
+            return;
+        is_running = false;
+        queue_changed.notify_all();
+    }
+    writer_thread.join();
+    delete[] entries;
+    entries = nullptr;
+    capacity = 0;
+}
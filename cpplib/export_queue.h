@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+
+// Work done off the main thread on data already snapshotted into staging memory: formatting, compression and disk I/O.
+// The task owns its staging memory and releases it when done.
+typedef std::function<void()> ExportTask;
+
+// `export_queue` namespace runs export tasks in submission order on one background thread, so the simulation only pays
+// for taking the snapshot. The queue is bounded by a task count and a staging memory budget.
+namespace export_queue
+{
+    // Start the background thread, allowing at most `max_tasks` snapshots holding `max_staging_bytes` in flight
+    void start(uint32_t max_tasks, uint64_t max_staging_bytes);
+
+    // Reserve room for a snapshot of `staging_bytes` before allocating it. Blocks while the queue is full (back-pressure);
+    // a snapshot larger than the whole budget is admitted once everything before it has been written.
+    void reserve(uint64_t staging_bytes);
+
+    // Queue a task for a snapshot reserved with the same `staging_bytes`; the reservation is released when the task
+    // finishes. Without a running queue the task is executed right away.
+    void submit(ExportTask task, uint64_t staging_bytes);
+
+    // Number of tasks reserved, queued or running
+    uint32_t get_pending_count();
+
+    // Wait until all submitted tasks have finished
+    void flush();
+
+    // Finish the submitted tasks and stop the background thread
+    void stop();
+}
@@ -0,0 +1,169 @@
+#include "fft.h"
+#include "memory.h"
+#include <math.h>
+#include <string.h>
+
+static const double FFT_PI = 3.14159265358979323846;
+
+static bool is_power_of_two(uint32_t n)
+{
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+// Iterative radix-2 transform of plan->padded_size elements, `inverse` transforms with conjugated twiddles (unnormalized)
+static void transform_radix2(FFTPlan *plan, Complex *data, bool inverse)
+{
+    uint32_t n = plan->padded_size;
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t j = plan->bit_reverse[i];
+        if (j > i) {
+            Complex t = data[i];
+            data[i] = data[j];
+            data[j] = t;
+        }
+    }
+
+    for (uint32_t length = 2; length <= n; length <<= 1) {
+        uint32_t half = length >> 1;
+        uint32_t twiddle_step = n / length;
+        for (uint32_t start = 0; start < n; start += length) {
+            for (uint32_t k = 0; k < half; ++k) {
+                Complex w = plan->twiddles[k * twiddle_step];
+                if (inverse) w.im = -w.im;
+                Complex *u = data + start + k;
+                Complex *v = data + start + k + half;
+                float vr = v->re * w.re - v->im * w.im;
+                float vi = v->re * w.im + v->im * w.re;
+                v->re = u->re - vr;
+                v->im = u->im - vi;
+                u->re += vr;
+                u->im += vi;
+            }
+        }
+    }
+}
+
+FFTPlan fft::get_plan(uint32_t size)
+{
+    FFTPlan plan = {};
+    plan.size = size;
+    plan.padded_size = size;
+    if (!is_power_of_two(size)) {
+        plan.padded_size = 1;
+        while (plan.padded_size < 2 * size - 1)
+            plan.padded_size <<= 1;
+    }
+
+    uint32_t n = plan.padded_size;
+    uint32_t bits = 0;
+    while ((1u << bits) < n) ++bits;
+    plan.bit_reverse = memory::alloc_heap<uint32_t>(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t r = 0;
+        for (uint32_t b = 0; b < bits; ++b) {
+            if (i & (1u << b)) r |= 1u << (bits - 1 - b);
+        }
+        plan.bit_reverse[i] = r;
+    }
+    plan.twiddles = memory::alloc_heap<Complex>(n / 2 + 1);
+    for (uint32_t k = 0; k <= n / 2; ++k) {
+        double angle = -2.0 * FFT_PI * double(k) / double(n);
+        plan.twiddles[k].re = float(cos(angle));
+        plan.twiddles[k].im = float(sin(angle));
+    }
+
+    if (n != size) {
+        // Bluestein: X_k = c_k * sum_n (x_n c_n) conj(c_{k-n}) with c_n = exp(-i pi n^2 / N)
+        plan.chirp = memory::alloc_heap<Complex>(size);
+        for (uint32_t i = 0; i < size; ++i) {
+            uint64_t i_squared = (uint64_t(i) * i) % (2 * uint64_t(size)); // Keeps the angle exact for large i
+            double angle = -FFT_PI * double(i_squared) / double(size);
+            plan.chirp[i].re = float(cos(angle));
+            plan.chirp[i].im = float(sin(angle));
+        }
+        plan.chirp_spectrum = memory::alloc_heap<Complex>(n);
+        memset(plan.chirp_spectrum, 0, n * sizeof(Complex));
+        plan.chirp_spectrum[0].re = plan.chirp[0].re;
+        plan.chirp_spectrum[0].im = -plan.chirp[0].im;
+        for (uint32_t i = 1; i < size; ++i) {
+            plan.chirp_spectrum[i].re = plan.chirp[i].re;
+            plan.chirp_spectrum[i].im = -plan.chirp[i].im;
+            plan.chirp_spectrum[n - i] = plan.chirp_spectrum[i];
+        }
+        transform_radix2(&plan, plan.chirp_spectrum, false);
+    }
+    return plan;
+}
+
+void fft::release(FFTPlan *plan)
+{
+    memory::free_heap(plan->bit_reverse);
+    memory::free_heap(plan->twiddles);
+    if (plan->chirp) memory::free_heap(plan->chirp);
+    if (plan->chirp_spectrum) memory::free_heap(plan->chirp_spectrum);
+    *plan = FFTPlan{};
+}
+
+uint32_t fft::get_scratch_size(FFTPlan *plan)
+{
+    // Bluestein convolution buffer plus room for the paired real transform
+    return plan->padded_size + plan->size;
+}
+
+void fft::transform(FFTPlan *plan, Complex *data, Complex *scratch)
+{
+    if (plan->padded_size == plan->size) {
+        transform_radix2(plan, data, false);
+        return;
+    }
+
+    uint32_t n = plan->padded_size;
+    Complex *buffer = scratch;
+    for (uint32_t i = 0; i < plan->size; ++i) {
+        Complex c = plan->chirp[i];
+        buffer[i].re = data[i].re * c.re - data[i].im * c.im;
+        buffer[i].im = data[i].re * c.im + data[i].im * c.re;
+    }
+    memset(buffer + plan->size, 0, (n - plan->size) * sizeof(Complex));
+
+    transform_radix2(plan, buffer, false);
+    for (uint32_t i = 0; i < n; ++i) {
+        Complex a = buffer[i];
+        Complex b = plan->chirp_spectrum[i];
+        buffer[i].re = a.re * b.re - a.im * b.im;
+        buffer[i].im = a.re * b.im + a.im * b.re;
+    }
+    transform_radix2(plan, buffer, true);
+
+    float inv_n = 1.0f / float(n);
+    for (uint32_t i = 0; i < plan->size; ++i) {
+        Complex a = buffer[i];
+        Complex c = plan->chirp[i];
+        data[i].re = (a.re * c.re - a.im * c.im) * inv_n;
+        data[i].im = (a.re * c.im + a.im * c.re) * inv_n;
+    }
+}
+
+void fft::transform_real_pair(FFTPlan *plan, float *a, float *b, Complex *spectrum_a, Complex *spectrum_b, Complex *scratch)
+{
+    // Transform z = a + ib, then split using the Hermitian symmetry of real spectra:
+    // A_k = (Z_k + conj(Z_{N-k})) / 2, B_k = (Z_k - conj(Z_{N-k})) / 2i
+    uint32_t n = plan->size;
+    Complex *z = scratch + plan->padded_size;
+    for (uint32_t i = 0; i < n; ++i) {
+        z[i].re = a[i];
+        z[i].im = b ? b[i] : 0.0f;
+    }
+    transform(plan, z, scratch);
+
+    for (uint32_t k = 0; k <= n / 2; ++k) {
+        Complex zk = z[k];
+        Complex zn = z[(n - k) % n];
+        spectrum_a[k].re = 0.5f * (zk.re + zn.re);
+        spectrum_a[k].im = 0.5f * (zk.im - zn.im);
+        if (spectrum_b) {
+            spectrum_b[k].re = 0.5f * (zk.im + zn.im);
+            spectrum_b[k].im = -0.5f * (zk.re - zn.re);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+struct Complex
+{
+    float re;
+    float im;
+};
+
+// FFTPlan holds precomputed tables for forward transforms of a fixed size.
+// Power-of-two sizes use an iterative radix-2 transform, other sizes (e.g. 784 or 416 grid sides)
+// go through Bluestein's chirp-z algorithm on top of a power-of-two transform.
+struct FFTPlan
+{
+    uint32_t size;
+    uint32_t padded_size; // Power-of-two size of the internal transform
+    uint32_t *bit_reverse;
+    Complex *twiddles;
+    Complex *chirp; // Bluestein only: exp(-i pi n^2 / size)
+    Complex *chirp_spectrum; // Bluestein only: transformed conjugate chirp
+};
+
+// `fft` namespace implements 1D complex and paired real transforms used by the spectral analyses
+namespace fft
+{
+    // Precompute tables for transforms of `size` elements
+    FFTPlan get_plan(uint32_t size);
+
+    // Release plan tables
+    void release(FFTPlan *plan);
+
+    // Number of Complex elements of scratch memory required by `transform`
+    uint32_t get_scratch_size(FFTPlan *plan);
+
+    // In-place forward transform X_k = sum_n x_n exp(-2 pi i n k / size)
+    void transform(FFTPlan *plan, Complex *data, Complex *scratch);
+
+    // Forward transform of two real sequences at the cost of one complex transform.
+    // Writes the non-redundant halves (size / 2 + 1 coefficients) of both spectra.
+    void transform_real_pair(FFTPlan *plan, float *a, float *b, Complex *spectrum_a, Complex *spectrum_b, Complex *scratch);
+}
@@ -635,6 +635,21 @@ void graphics::save_texture3D(Texture3D *texture, std::string filename)
 	image.Release();
 }
 
+bool graphics::capture_texture3D(Texture3D *texture, void *data, size_t size)
+{
+	DirectX::ScratchImage image;
+	if (!SUCCEEDED(DirectX::CaptureTexture(graphics_context->device, graphics_context->context, texture->texture, image))) {
+		PRINT_DEBUG("Failed to capture 3D texture.\n");
+		printf("Failed to capture 3D texture.\n");
+		return false;
+	}
+
+	size_t tex_byte_size = image.GetPixelsSize();
+	memcpy(data, image.GetPixels(), tex_byte_size < size ? tex_byte_size : size);
+	image.Release();
+	return true;
+}
+
 uint32_t graphics::capture_current_frame()
 {
 	ID3D11Texture2D* pBuffer;
@@ -901,6 +916,58 @@ void graphics::capture_structured_buffer(StructuredBuffer *buffer, void *mapped_
 	graphics_context->context->Unmap(buffer->buffer, 0);
 }
 
+StagingBuffer graphics::get_staging_buffer(uint32_t size)
+{
+	StagingBuffer staging = {};
+	staging.size = size;
+
+	D3D11_BUFFER_DESC buffer_desc = {};
+	buffer_desc.ByteWidth = size;
+	buffer_desc.Usage = D3D11_USAGE_STAGING;
+	buffer_desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+
+	HRESULT hr = graphics_context->device->CreateBuffer(&buffer_desc, NULL, &staging.buffer);
+	if (FAILED(hr)) {
+		PRINT_DEBUG("Failed to create staging buffer.");
+		return StagingBuffer{};
+	}
+
+	D3D11_QUERY_DESC query_desc = {};
+	query_desc.Query = D3D11_QUERY_EVENT;
+	hr = graphics_context->device->CreateQuery(&query_desc, &staging.fence);
+	if (FAILED(hr)) {
+		PRINT_DEBUG("Failed to create staging buffer query.");
+		RELEASE_DX_RESOURCE(staging.buffer);
+		return StagingBuffer{};
+	}
+
+	return staging;
+}
+
+void graphics::copy_to_staging_buffer(StructuredBuffer *source, StagingBuffer *staging)
+{
+	D3D11_BOX box = { 0, 0, 0, source->size < staging->size ? source->size : staging->size, 1, 1 };
+	graphics_context->context->CopySubresourceRegion(staging->buffer, 0, 0, 0, 0, source->buffer, 0, &box);
+	graphics_context->context->End(staging->fence);
+}
+
+bool graphics::is_staging_buffer_ready(StagingBuffer *staging)
+{
+	return graphics_context->context->GetData(staging->fence, NULL, 0, D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK;
+}
+
+bool graphics::read_staging_buffer(StagingBuffer *staging, void *data, size_t size)
+{
+	D3D11_MAPPED_SUBRESOURCE ms;
+	if (!SUCCEEDED(graphics_context->context->Map(staging->buffer, 0, D3D11_MAP_READ, 0, &ms))) {
+		PRINT_DEBUG("Failed to map staging buffer.");
+		return false;
+	}
+	memcpy(data, ms.pData, size < staging->size ? size : staging->size);
+	graphics_context->context->Unmap(staging->buffer, 0);
+	return true;
+}
+
 void graphics::update_constant_buffer(ConstantBuffer *buffer, void *data)
 {
 	D3D11_MAPPED_SUBRESOURCE mapped_buffer;
@@ -1261,6 +1328,12 @@ void graphics::release(StructuredBuffer *buffer)
 	RELEASE_DX_RESOURCE(buffer->ua_view);
 }
 
+void graphics::release(StagingBuffer *buffer)
+{
+	RELEASE_DX_RESOURCE(buffer->buffer);
+	RELEASE_DX_RESOURCE(buffer->fence);
+}
+
 void graphics::release(TextureSampler *sampler)
 {
 	RELEASE_DX_RESOURCE(sampler->sampler);
@@ -117,6 +117,14 @@ struct StructuredBuffer
 	uint32_t size;
 };
 
+// CPU-readable copy of a StructuredBuffer, with an event query that signals when the GPU has written it
+struct StagingBuffer
+{
+	ID3D11Buffer *buffer;
+	ID3D11Query *fence;
+	uint32_t size;
+};
+
 // VertexInputDesc represents a single input to a vertex shader.
 // Needs semantic name and a format:
 // Example: 
@@ -274,6 +282,9 @@ namespace graphics
 	void save_texture3D(Texture3D *texture, std::string filename);
 	void save_texture2D(Texture2D *texture, std::string filename);
 	void save_texture2D_HDR(Texture2D *texture, std::string filename);
+
+	// Download a 3D texture into preallocated, tightly packed CPU memory of `size` bytes
+	bool capture_texture3D(Texture3D *texture, void *data, size_t size);
 	uint32_t capture_current_frame();
 
 	// Set texture to accessible from shaders
@@ -318,6 +329,18 @@ namespace graphics
 	// Download a structured buffer from GPU to preallocated CPU memory
 	void capture_structured_buffer(StructuredBuffer *buffer, void *mapped_data, unsigned int num_elements, size_t element_size);
 
+	// Get StagingBuffer of `size` bytes
+	StagingBuffer get_staging_buffer(uint32_t size);
+
+	// Queue a GPU copy of a structured buffer into a staging buffer; the pipeline does not wait for it
+	void copy_to_staging_buffer(StructuredBuffer *source, StagingBuffer *staging);
+
+	// Whether the last copy into a staging buffer has completed, so reading it will not stall
+	bool is_staging_buffer_ready(StagingBuffer *staging);
+
+	// Copy `size` bytes of a staging buffer to CPU memory, waiting for the last copy into it if necessary
+	bool read_staging_buffer(StagingBuffer *staging, void *data, size_t size);
+
 	// Update ConstantBuffer with data
 	void update_constant_buffer(ConstantBuffer *buffer, void *data);
 
@@ -421,6 +444,7 @@ namespace graphics
 	void release(Mesh *mesh);
 	void release(ConstantBuffer *buffer);
 	void release(StructuredBuffer *buffer);
+	void release(StagingBuffer *buffer);
 	void release(VertexShader *shader);
 	void release(PixelShader *shader);
 	void release(GeometryShader *shader);
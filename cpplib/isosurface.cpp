@@ -0,0 +1,357 @@
+#include "isosurface.h"
+#include "memory.h"
+#include "jobs.h"
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+
+const uint32_t MAX_CUBE_TRIANGLES = 8;
+
+// Cube corner i sits at offset (i & 1, i >> 1 & 1, i >> 2 & 1). Edge e runs along axis e / 4 from the corner whose
+// other two coordinates are the bits of e % 4 (lower axis in bit 0).
+struct CubeTables
+{
+    uint8_t edge_corner[12]; // Lower corner of each edge
+    uint8_t triangle_count[256]; // Per case (bit i set = corner i inside)
+    uint8_t triangle_edges[256][MAX_CUBE_TRIANGLES * 3];
+};
+
+static uint32_t get_edge(uint32_t corner_a, uint32_t corner_b)
+{
+    uint32_t axis = (corner_a ^ corner_b) == 1 ? 0 : ((corner_a ^ corner_b) == 2 ? 1 : 2);
+    uint32_t base = corner_a & corner_b;
+    uint32_t u = axis == 0 ? 1 : 0;
+    uint32_t v = axis == 2 ? 1 : 2;
+    return axis * 4 + ((base >> u) & 1) + 2 * ((base >> v) & 1);
+}
+
+// Bit mask of the two cube faces (2 * axis + side) containing edge e
+static uint32_t get_edge_faces(uint32_t e)
+{
+    uint32_t axis = e / 4;
+    uint32_t u = axis == 0 ? 1 : 0;
+    uint32_t v = axis == 2 ? 1 : 2;
+    return (1u << (2 * u + (e & 1))) | (1u << (2 * v + ((e >> 1) & 1)));
+}
+
+// The case table is derived rather than typed in: on every cube face the crossed edges are joined by segments that cut
+// off the runs of outside corners (a face with two diagonal inside corners thus keeps them connected). Faces are walked
+// counter-clockwise seen from outside, which orients the segments into closed loops that are fanned into triangles.
+// Both cubes sharing a face make the same choice, so the surface has no cracks. The fan starts at the loop vertex whose
+// diagonals avoid lying in a cube face, where they could coincide with a segment of the neighboring cube.
+static CubeTables get_cube_tables()
+{
+    CubeTables tables = {};
+    for (uint32_t e = 0; e < 12; ++e) {
+        uint32_t axis = e / 4;
+        uint32_t u = axis == 0 ? 1 : 0;
+        uint32_t v = axis == 2 ? 1 : 2;
+        tables.edge_corner[e] = uint8_t(((e & 1) << u) | (((e >> 1) & 1) << v));
+    }
+
+    for (uint32_t cube_case = 0; cube_case < 256; ++cube_case) {
+        int32_t next_edge[12];
+        for (uint32_t e = 0; e < 12; ++e)
+            next_edge[e] = -1;
+
+        for (uint32_t face = 0; face < 6; ++face) {
+            uint32_t axis = face / 2;
+            uint32_t side = face % 2;
+            uint32_t u = (axis + 1) % 3;
+            uint32_t v = (axis + 2) % 3;
+            const uint32_t ccw[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+            uint32_t corners[4];
+            bool inside[4];
+            for (uint32_t k = 0; k < 4; ++k) {
+                uint32_t p = side ? ccw[k][0] : ccw[k][1];
+                uint32_t q = side ? ccw[k][1] : ccw[k][0];
+                corners[k] = (side << axis) | (p << u) | (q << v);
+                inside[k] = ((cube_case >> corners[k]) & 1) != 0;
+            }
+            for (uint32_t k = 0; k < 4; ++k) {
+                if (inside[k] || !inside[(k + 3) % 4])
+                    continue;
+                uint32_t last = k;
+                while (!inside[(last + 1) % 4])
+                    last = (last + 1) % 4;
+                uint32_t edge_in = get_edge(corners[(k + 3) % 4], corners[k]);
+                uint32_t edge_out = get_edge(corners[last], corners[(last + 1) % 4]);
+                next_edge[edge_out] = int32_t(edge_in);
+            }
+        }
+
+        uint32_t triangle_count = 0;
+        bool visited[12] = {};
+        for (uint32_t e = 0; e < 12; ++e) {
+            if (next_edge[e] < 0 || visited[e])
+                continue;
+            uint32_t loop[12];
+            uint32_t loop_length = 0;
+            for (uint32_t edge = e; !visited[edge]; edge = uint32_t(next_edge[edge])) {
+                visited[edge] = true;
+                loop[loop_length++] = edge;
+            }
+            uint32_t fan_start = 0;
+            uint32_t fewest_face_diagonals = 12;
+            for (uint32_t start = 0; start < loop_length; ++start) {
+                uint32_t face_diagonals = 0;
+                for (uint32_t i = 2; i + 1 < loop_length; ++i) {
+                    if (get_edge_faces(loop[start]) & get_edge_faces(loop[(start + i) % loop_length]))
+                        ++face_diagonals;
+                }
+                if (face_diagonals < fewest_face_diagonals) {
+                    fewest_face_diagonals = face_diagonals;
+                    fan_start = start;
+                }
+            }
+            for (uint32_t i = 1; i + 1 < loop_length; ++i) {
+                uint8_t *triangle = tables.triangle_edges[cube_case] + 3 * triangle_count++;
+                triangle[0] = uint8_t(loop[fan_start]);
+                triangle[1] = uint8_t(loop[(fan_start + i) % loop_length]);
+                triangle[2] = uint8_t(loop[(fan_start + i + 1) % loop_length]);
+            }
+        }
+        tables.triangle_count[cube_case] = uint8_t(triangle_count);
+    }
+    return tables;
+}
+
+static const CubeTables &get_tables()
+{
+    static CubeTables tables = get_cube_tables();
+    return tables;
+}
+
+static uint32_t get_cube_case(const float *cube, size_t row, size_t plane, float iso_value)
+{
+    return (cube[0] >= iso_value ? 1 : 0) | (cube[1] >= iso_value ? 2 : 0)
+        | (cube[row] >= iso_value ? 4 : 0) | (cube[row + 1] >= iso_value ? 8 : 0)
+        | (cube[plane] >= iso_value ? 16 : 0) | (cube[plane + 1] >= iso_value ? 32 : 0)
+        | (cube[plane + row] >= iso_value ? 64 : 0) | (cube[plane + row + 1] >= iso_value ? 128 : 0);
+}
+
+// Vertices on the edges starting at the voxels of plane z
+static uint64_t count_plane_vertices(Volume *field, uint32_t z, float iso_value)
+{
+    uint32_t w = field->width, h = field->height;
+    const float *plane = field->data + volume::get_index(field, 0, 0, z);
+    const float *next_plane = z + 1 < field->depth ? plane + size_t(w) * h : nullptr;
+    uint64_t count = 0;
+    for (uint32_t y = 0; y < h; ++y) {
+        for (uint32_t x = 0; x < w; ++x) {
+            size_t i = size_t(y) * w + x;
+            bool inside = plane[i] >= iso_value;
+            if (x + 1 < w && (plane[i + 1] >= iso_value) != inside) ++count;
+            if (y + 1 < h && (plane[i + w] >= iso_value) != inside) ++count;
+            if (next_plane && (next_plane[i] >= iso_value) != inside) ++count;
+        }
+    }
+    return count;
+}
+
+// Triangles of the cubes between planes z and z + 1
+static uint64_t count_layer_triangles(Volume *field, uint32_t z, float iso_value, const CubeTables &tables)
+{
+    uint32_t w = field->width, h = field->height;
+    size_t plane_size = size_t(w) * h;
+    const float *plane = field->data + volume::get_index(field, 0, 0, z);
+    uint64_t count = 0;
+    for (uint32_t y = 0; y + 1 < h; ++y) {
+        for (uint32_t x = 0; x + 1 < w; ++x)
+            count += tables.triangle_count[get_cube_case(plane + size_t(y) * w + x, w, plane_size, iso_value)];
+    }
+    return count;
+}
+
+// Field gradient at a voxel in world units, central differences inside the grid and one-sided at its faces
+static void get_gradient(Volume *field, IsosurfaceSettings *settings, uint32_t x, uint32_t y, uint32_t z, float *gradient)
+{
+    uint32_t x0 = x > 0 ? x - 1 : x, x1 = x + 1 < field->width ? x + 1 : x;
+    uint32_t y0 = y > 0 ? y - 1 : y, y1 = y + 1 < field->height ? y + 1 : y;
+    uint32_t z0 = z > 0 ? z - 1 : z, z1 = z + 1 < field->depth ? z + 1 : z;
+    float *data = field->data;
+    gradient[0] = x1 > x0 ? (data[volume::get_index(field, x1, y, z)] - data[volume::get_index(field, x0, y, z)]) / (float(x1 - x0) * settings->voxel_size_x) : 0.0f;
+    gradient[1] = y1 > y0 ? (data[volume::get_index(field, x, y1, z)] - data[volume::get_index(field, x, y0, z)]) / (float(y1 - y0) * settings->voxel_size_y) : 0.0f;
+    gradient[2] = z1 > z0 ? (data[volume::get_index(field, x, y, z1)] - data[volume::get_index(field, x, y, z0)]) / (float(z1 - z0) * settings->voxel_size_z) : 0.0f;
+}
+
+// Assign consecutive indices from `first_vertex` to the vertices of plane z (edges along x, y, z per voxel in x-fastest
+// order), storing them in `ids` (3 per voxel). With a mesh the vertices are also computed into it.
+static void number_plane_vertices(Volume *field, IsosurfaceSettings *settings, uint32_t z, uint32_t first_vertex, uint32_t *ids, IsosurfaceMesh *mesh)
+{
+    uint32_t w = field->width, h = field->height;
+    size_t plane_size = size_t(w) * h;
+    const float *plane = field->data + volume::get_index(field, 0, 0, z);
+    bool has_next_plane = z + 1 < field->depth;
+    const size_t step[3] = { 1, w, plane_size };
+    const float voxel_size[3] = { settings->voxel_size_x, settings->voxel_size_y, settings->voxel_size_z };
+    const float origin[3] = { settings->origin_x, settings->origin_y, settings->origin_z };
+    float iso_value = settings->iso_value;
+
+    uint32_t vertex = first_vertex;
+    for (uint32_t y = 0; y < h; ++y) {
+        for (uint32_t x = 0; x < w; ++x) {
+            size_t i = size_t(y) * w + x;
+            float value = plane[i];
+            bool inside = value >= iso_value;
+            bool has_edge[3] = { x + 1 < w, y + 1 < h, has_next_plane };
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                if (!has_edge[axis] || (plane[i + step[axis]] >= iso_value) == inside)
+                    continue;
+                ids[3 * i + axis] = vertex;
+                if (mesh) {
+                    float next_value = plane[i + step[axis]];
+                    float t = (iso_value - value) / (next_value - value);
+                    float position[3] = { float(x) + 0.5f, float(y) + 0.5f, float(z) + 0.5f };
+                    position[axis] += t;
+                    float *out = mesh->positions + 3 * size_t(vertex);
+                    for (uint32_t a = 0; a < 3; ++a)
+                        out[a] = origin[a] + position[a] * voxel_size[a];
+
+                    if (mesh->normals) {
+                        float gradient[3], next_gradient[3];
+                        get_gradient(field, settings, x, y, z, gradient);
+                        get_gradient(field, settings, x + (axis == 0), y + (axis == 1), z + (axis == 2), next_gradient);
+                        float normal[3];
+                        for (uint32_t a = 0; a < 3; ++a)
+                            normal[a] = -(gradient[a] + t * (next_gradient[a] - gradient[a]));
+                        float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+                        float scale = length > 0.0f ? 1.0f / length : 0.0f;
+                        float *out_normal = mesh->normals + 3 * size_t(vertex);
+                        for (uint32_t a = 0; a < 3; ++a)
+                            out_normal[a] = normal[a] * scale;
+                    }
+                }
+                ++vertex;
+            }
+        }
+    }
+}
+
+// Write the triangles of the cubes between planes z (vertex ids in `ids`) and z + 1 (`next_ids`) from `first_triangle`
+static void write_layer_triangles(Volume *field, float iso_value, uint32_t z, uint32_t *ids, uint32_t *next_ids, uint32_t first_triangle, IsosurfaceMesh *mesh, const CubeTables &tables)
+{
+    uint32_t w = field->width, h = field->height;
+    size_t plane_size = size_t(w) * h;
+    const float *plane = field->data + volume::get_index(field, 0, 0, z);
+    uint32_t *out = mesh->indices + 3 * size_t(first_triangle);
+
+    // Offset of the id of every cube edge relative to the lower corner of the cube, and the plane it is stored in
+    size_t edge_offset[12];
+    bool edge_upper[12];
+    for (uint32_t e = 0; e < 12; ++e) {
+        uint32_t corner = tables.edge_corner[e];
+        edge_offset[e] = 3 * (size_t((corner >> 1) & 1) * w + (corner & 1)) + e / 4;
+        edge_upper[e] = (corner & 4) != 0;
+    }
+
+    for (uint32_t y = 0; y + 1 < h; ++y) {
+        for (uint32_t x = 0; x + 1 < w; ++x) {
+            size_t i = size_t(y) * w + x;
+            uint32_t cube_case = get_cube_case(plane + i, w, plane_size, iso_value);
+            uint32_t index_count = 3 * tables.triangle_count[cube_case];
+            const uint8_t *edges = tables.triangle_edges[cube_case];
+            for (uint32_t k = 0; k < index_count; ++k) {
+                uint32_t e = edges[k];
+                *out++ = (edge_upper[e] ? next_ids : ids)[3 * i + edge_offset[e]];
+            }
+        }
+    }
+}
+
+IsosurfaceSettings isosurface::get_default_settings()
+{
+    IsosurfaceSettings settings = {};
+    settings.iso_value = 1.0f;
+    settings.compute_normals = true;
+    settings.voxel_size_x = 1.0f;
+    settings.voxel_size_y = 1.0f;
+    settings.voxel_size_z = 1.0f;
+    settings.origin_x = 0.0f;
+    settings.origin_y = 0.0f;
+    settings.origin_z = 0.0f;
+    return settings;
+}
+
+bool isosurface::extract(Volume *field, IsosurfaceSettings settings, IsosurfaceMesh *mesh)
+{
+    *mesh = IsosurfaceMesh{};
+    uint32_t w = field->width, h = field->height, d = field->depth;
+    if (w < 2 || h < 2 || d < 2)
+        return true;
+    const CubeTables &tables = get_tables();
+
+    // Counting pass: vertex and triangle totals per plane give every plane its first vertex and triangle index
+    uint64_t *vertex_offsets = memory::alloc_heap<uint64_t>(d + 1);
+    uint64_t *triangle_offsets = memory::alloc_heap<uint64_t>(d);
+    triangle_offsets[d - 1] = 0;
+    jobs::parallel_for(d, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t z = begin; z < end; ++z) {
+            vertex_offsets[z] = count_plane_vertices(field, z, settings.iso_value);
+            if (z + 1 < d)
+                triangle_offsets[z] = count_layer_triangles(field, z, settings.iso_value, tables);
+        }
+    });
+    uint64_t vertex_count = 0, triangle_count = 0;
+    for (uint32_t z = 0; z < d; ++z) {
+        uint64_t plane_vertices = vertex_offsets[z];
+        uint64_t layer_triangles = triangle_offsets[z];
+        vertex_offsets[z] = vertex_count;
+        triangle_offsets[z] = triangle_count;
+        vertex_count += plane_vertices;
+        triangle_count += layer_triangles;
+    }
+    vertex_offsets[d] = vertex_count;
+    if (3 * vertex_count > UINT32_MAX || 3 * triangle_count > UINT32_MAX) {
+        printf("Isosurface too large: %llu vertices, %llu triangles\n", (unsigned long long)vertex_count, (unsigned long long)triangle_count);
+        memory::free_heap(vertex_offsets);
+        memory::free_heap(triangle_offsets);
+        return false;
+    }
+
+    mesh->vertex_count = uint32_t(vertex_count);
+    mesh->triangle_count = uint32_t(triangle_count);
+    mesh->positions = memory::alloc_heap<float>(3 * mesh->vertex_count + 1);
+    mesh->normals = settings.compute_normals ? memory::alloc_heap<float>(3 * mesh->vertex_count + 1) : nullptr;
+    mesh->indices = memory::alloc_heap<uint32_t>(3 * mesh->triangle_count + 1);
+
+    // Polygonizing pass over slabs of planes. Each slab computes the vertices of its own planes and only numbers those of
+    // the first plane of the next slab, so every vertex is written once. Scratch is two planes of edge ids per thread.
+    uint32_t thread_count = jobs::get_thread_count();
+    uint32_t slab_depth = (d + 4 * thread_count - 1) / (4 * thread_count);
+    uint32_t slab_count = (d + slab_depth - 1) / slab_depth;
+    size_t plane_ids = 3 * size_t(w) * h;
+    uint32_t *scratch = memory::alloc_heap<uint32_t>(2 * plane_ids * thread_count);
+    jobs::parallel_for(slab_count, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        uint32_t *ids = scratch + 2 * plane_ids * thread_index;
+        uint32_t *next_ids = ids + plane_ids;
+        for (uint32_t slab = begin; slab < end; ++slab) {
+            uint32_t z_begin = slab * slab_depth;
+            uint32_t z_end = z_begin + slab_depth < d ? z_begin + slab_depth : d;
+            number_plane_vertices(field, &settings, z_begin, uint32_t(vertex_offsets[z_begin]), ids, mesh);
+            for (uint32_t z = z_begin; z < z_end && z + 1 < d; ++z) {
+                number_plane_vertices(field, &settings, z + 1, uint32_t(vertex_offsets[z + 1]), next_ids, z + 1 < z_end ? mesh : nullptr);
+                write_layer_triangles(field, settings.iso_value, z, ids, next_ids, uint32_t(triangle_offsets[z]), mesh, tables);
+                uint32_t *swap = ids;
+                ids = next_ids;
+                next_ids = swap;
+            }
+        }
+    });
+
+    memory::free_heap(scratch);
+    memory::free_heap(vertex_offsets);
+    memory::free_heap(triangle_offsets);
+    return true;
+}
+
+void isosurface::release(IsosurfaceMesh *mesh)
+{
+    if (mesh->positions)
+        memory::free_heap(mesh->positions);
+    if (mesh->normals)
+        memory::free_heap(mesh->normals);
+    if (mesh->indices)
+        memory::free_heap(mesh->indices);
+    *mesh = IsosurfaceMesh{};
+}
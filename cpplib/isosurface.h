@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+#include "volume.h"
+
+struct IsosurfaceSettings
+{
+    float iso_value; // Surface where the field crosses this value; voxels with field >= iso_value are inside
+    bool compute_normals; // Per-vertex normals from the field gradient
+    float voxel_size_x; // World size of a voxel and position of the grid corner, used for the vertex positions
+    float voxel_size_y;
+    float voxel_size_z;
+    float origin_x;
+    float origin_y;
+    float origin_z;
+};
+
+// Indexed triangle mesh with 32-bit indices
+struct IsosurfaceMesh
+{
+    float *positions; // x, y, z per vertex [world units]
+    float *normals; // Unit x, y, z per vertex pointing towards lower field values, nullptr without compute_normals
+    uint32_t vertex_count;
+    uint32_t *indices; // 3 per triangle, counter-clockwise when seen from the side the normals point to
+    uint32_t triangle_count;
+};
+
+// `isosurface` namespace extracts density isosurfaces of a grid as triangle meshes (marching cubes)
+namespace isosurface
+{
+    IsosurfaceSettings get_default_settings();
+
+    // Polygonize the cubes between voxel centers. Every vertex lies on a grid edge and is stored once, so triangles of
+    // neighboring cubes share vertices and the surface is closed except where it leaves the grid. Vertices are counted
+    // per z-plane first, then slabs of planes are polygonized in parallel straight into the final arrays; the result does
+    // not depend on the thread count. Returns false if the mesh does not fit 32-bit indices.
+    bool extract(Volume *field, IsosurfaceSettings settings, IsosurfaceMesh *mesh);
+
+    // Release mesh memory
+    void release(IsosurfaceMesh *mesh);
+}
@@ -0,0 +1,54 @@
+#include "jobs.h"
+#include <thread>
+#include <atomic>
+
+static uint32_t thread_count_override = 0;
+
+uint32_t jobs::get_thread_count()
+{
+    if (thread_count_override > 0)
+        return thread_count_override;
+    uint32_t hardware_threads = std::thread::hardware_concurrency();
+    return hardware_threads > 0 ? hardware_threads : 1;
+}
+
+void jobs::set_thread_count(uint32_t thread_count)
+{
+    thread_count_override = thread_count;
+}
+
+void jobs::parallel_for(uint32_t count, uint32_t chunk_size, Job job)
+{
+    if (count == 0)
+        return;
+    if (chunk_size == 0)
+        chunk_size = 1;
+
+    uint32_t chunk_count = (count + chunk_size - 1) / chunk_size;
+    uint32_t thread_count = get_thread_count();
+    if (thread_count > chunk_count)
+        thread_count = chunk_count;
+
+    // Workers pull chunks from a shared counter, so uneven chunks balance themselves
+    std::atomic<uint32_t> next_chunk(0);
+    auto worker = [&](uint32_t thread_index) {
+        for (;;) {
+            uint32_t chunk = next_chunk.fetch_add(1);
+            if (chunk >= chunk_count)
+                break;
+            uint32_t begin = chunk * chunk_size;
+            uint32_t end = (count - begin > chunk_size) ? begin + chunk_size : count;
+            job(begin, end, thread_index);
+        }
+    };
+
+    std::thread *threads = new std::thread[thread_count];
+    for (uint32_t t = 1; t < thread_count; ++t) {
+        threads[t] = std::thread(worker, t);
+    }
+    worker(0);
+    for (uint32_t t = 1; t < thread_count; ++t) {
+        threads[t].join();
+    }
+    delete[] threads;
+}
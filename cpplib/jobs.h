@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+
+// Job is a callback processing the index range [begin, end) on worker thread `thread_index`.
+// Thread index is always smaller than jobs::get_thread_count(), so it can be used to address per-thread scratch memory.
+typedef std::function<void(uint32_t begin, uint32_t end, uint32_t thread_index)> Job;
+
+// `jobs` namespace spreads CPU-side loops over all hardware threads
+namespace jobs
+{
+    // Number of worker threads used by parallel_for (including the calling thread)
+    uint32_t get_thread_count();
+
+    // Override the number of worker threads, 0 restores the hardware default
+    void set_thread_count(uint32_t thread_count);
+
+    // Split [0, count) into chunks of `chunk_size` items and process them on all worker threads.
+    // Returns once every chunk has been processed.
+    void parallel_for(uint32_t count, uint32_t chunk_size, Job job);
+}
@@ -0,0 +1,281 @@
+#include "kdtree.h"
+#include "memory.h"
+#include "jobs.h"
+#include <algorithm>
+#include <math.h>
+
+static const uint32_t KDTREE_MAX_DEPTH = 64;
+
+struct KDTreeBuildTask
+{
+    uint32_t node;
+    uint32_t begin;
+    uint32_t end;
+};
+
+static uint32_t get_subtree_node_count(uint32_t count, uint32_t leaf_size)
+{
+    if (count <= leaf_size)
+        return 1;
+    return 1 + get_subtree_node_count(count / 2, leaf_size) + get_subtree_node_count(count - count / 2, leaf_size);
+}
+
+// Split the node at the median of its widest axis; returns false for leaves
+static bool split_node(KDTree *tree, float **coordinates, uint32_t *order, uint32_t node, uint32_t begin, uint32_t end)
+{
+    KDTreeNode *current = tree->nodes + node;
+    current->begin = begin;
+    current->end = end;
+    if (end - begin <= tree->leaf_size) {
+        current->axis = KDTREE_LEAF;
+        current->split = 0.0f;
+        current->right = 0;
+        return false;
+    }
+
+    float min[3] = { 1.0e30f, 1.0e30f, 1.0e30f };
+    float max[3] = { -1.0e30f, -1.0e30f, -1.0e30f };
+    for (uint32_t i = begin; i < end; ++i) {
+        for (uint32_t a = 0; a < 3; ++a) {
+            float value = coordinates[a][order[i]];
+            min[a] = value < min[a] ? value : min[a];
+            max[a] = value > max[a] ? value : max[a];
+        }
+    }
+    uint32_t axis = 0;
+    if (max[1] - min[1] > max[axis] - min[axis]) axis = 1;
+    if (max[2] - min[2] > max[axis] - min[axis]) axis = 2;
+
+    uint32_t middle = begin + (end - begin) / 2;
+    float *values = coordinates[axis];
+    std::nth_element(order + begin, order + middle, order + end, [values](uint32_t a, uint32_t b) { return values[a] < values[b]; });
+    current->axis = axis;
+    current->split = values[order[middle]];
+    current->right = node + 1 + get_subtree_node_count(middle - begin, tree->leaf_size);
+    return true;
+}
+
+static void build_subtree(KDTree *tree, float **coordinates, uint32_t *order, uint32_t node, uint32_t begin, uint32_t end)
+{
+    if (!split_node(tree, coordinates, order, node, begin, end))
+        return;
+    uint32_t middle = begin + (end - begin) / 2;
+    build_subtree(tree, coordinates, order, node + 1, begin, middle);
+    build_subtree(tree, coordinates, order, tree->nodes[node].right, middle, end);
+}
+
+KDTree kdtree::build(float *x, float *y, float *z, uint32_t count, uint32_t leaf_size)
+{
+    KDTree tree = {};
+    tree.point_count = count;
+    tree.leaf_size = leaf_size < 1 ? 1 : leaf_size;
+    tree.node_count = get_subtree_node_count(count, tree.leaf_size);
+    tree.nodes = memory::alloc_heap<KDTreeNode>(tree.node_count);
+    tree.x = memory::alloc_heap<float>(count);
+    tree.y = memory::alloc_heap<float>(count);
+    tree.z = memory::alloc_heap<float>(count);
+    tree.indices = memory::alloc_heap<uint32_t>(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        tree.indices[i] = i;
+    }
+    float *coordinates[3] = { x, y, z };
+
+    // Split the top levels serially until there are enough independent subtrees to keep all threads busy
+    uint32_t target_task_count = 8 * jobs::get_thread_count();
+    KDTreeBuildTask *tasks = memory::alloc_heap<KDTreeBuildTask>(2 * target_task_count);
+    KDTreeBuildTask *next_tasks = memory::alloc_heap<KDTreeBuildTask>(2 * target_task_count);
+    uint32_t task_count = 1;
+    tasks[0] = { 0, 0, count };
+    while (task_count < target_task_count) {
+        uint32_t next_count = 0;
+        for (uint32_t t = 0; t < task_count; ++t) {
+            KDTreeBuildTask task = tasks[t];
+            if (split_node(&tree, coordinates, tree.indices, task.node, task.begin, task.end)) {
+                uint32_t middle = task.begin + (task.end - task.begin) / 2;
+                next_tasks[next_count++] = { task.node + 1, task.begin, middle };
+                next_tasks[next_count++] = { tree.nodes[task.node].right, middle, task.end };
+            }
+        }
+        std::swap(tasks, next_tasks);
+        task_count = next_count;
+        if (task_count == 0)
+            break;
+    }
+    jobs::parallel_for(task_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t t = begin; t < end; ++t) {
+            build_subtree(&tree, coordinates, tree.indices, tasks[t].node, tasks[t].begin, tasks[t].end);
+        }
+    });
+    memory::free_heap(tasks);
+    memory::free_heap(next_tasks);
+
+    // Reorder the points so leaves are contiguous
+    jobs::parallel_for(count, 4096, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            tree.x[i] = x[tree.indices[i]];
+            tree.y[i] = y[tree.indices[i]];
+            tree.z[i] = z[tree.indices[i]];
+        }
+    });
+    return tree;
+}
+
+void kdtree::release(KDTree *tree)
+{
+    memory::free_heap(tree->nodes);
+    memory::free_heap(tree->x);
+    memory::free_heap(tree->y);
+    memory::free_heap(tree->z);
+    memory::free_heap(tree->indices);
+    *tree = KDTree{};
+}
+
+struct KDTreeStackEntry
+{
+    uint32_t node;
+    float distance_squared; // Lower bound of the squared distance to anything in the node
+};
+
+uint32_t kdtree::find_nearest(KDTree *tree, float x, float y, float z, uint32_t k, uint32_t *indices, float *distances)
+{
+    if (tree->point_count == 0 || k == 0)
+        return 0;
+
+    // `distances` holds a max-heap of squared distances while searching
+    uint32_t found = 0;
+    float query[3] = { x, y, z };
+    KDTreeStackEntry stack[KDTREE_MAX_DEPTH];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = { 0, 0.0f };
+
+    while (stack_size > 0) {
+        KDTreeStackEntry entry = stack[--stack_size];
+        if (found == k && entry.distance_squared >= distances[0])
+            continue;
+
+        KDTreeNode *node = tree->nodes + entry.node;
+        while (node->axis != KDTREE_LEAF) {
+            float difference = query[node->axis] - node->split;
+            uint32_t near_child = difference < 0.0f ? uint32_t(node - tree->nodes) + 1 : node->right;
+            uint32_t far_child = difference < 0.0f ? node->right : uint32_t(node - tree->nodes) + 1;
+            float far_distance = difference * difference;
+            if (far_distance < entry.distance_squared) far_distance = entry.distance_squared;
+            if (found < k || far_distance < distances[0])
+                stack[stack_size++] = { far_child, far_distance };
+            node = tree->nodes + near_child;
+        }
+
+        for (uint32_t i = node->begin; i < node->end; ++i) {
+            float dx = tree->x[i] - x;
+            float dy = tree->y[i] - y;
+            float dz = tree->z[i] - z;
+            float distance_squared = dx * dx + dy * dy + dz * dz;
+            if (found < k) {
+                // Sift up
+                uint32_t child = found++;
+                while (child > 0) {
+                    uint32_t parent = (child - 1) / 2;
+                    if (distances[parent] >= distance_squared) break;
+                    distances[child] = distances[parent];
+                    indices[child] = indices[parent];
+                    child = parent;
+                }
+                distances[child] = distance_squared;
+                indices[child] = i;
+            } else if (distance_squared < distances[0]) {
+                // Replace the farthest and sift down
+                uint32_t parent = 0;
+                while (true) {
+                    uint32_t child = 2 * parent + 1;
+                    if (child >= k) break;
+                    if (child + 1 < k && distances[child + 1] > distances[child]) ++child;
+                    if (distances[child] <= distance_squared) break;
+                    distances[parent] = distances[child];
+                    indices[parent] = indices[child];
+                    parent = child;
+                }
+                distances[parent] = distance_squared;
+                indices[parent] = i;
+            }
+        }
+    }
+
+    // Heap sort into ascending order and convert to original indices and distances
+    for (uint32_t end = found; end > 1; --end) {
+        std::swap(distances[0], distances[end - 1]);
+        std::swap(indices[0], indices[end - 1]);
+        uint32_t parent = 0;
+        while (true) {
+            uint32_t child = 2 * parent + 1;
+            if (child >= end - 1) break;
+            if (child + 1 < end - 1 && distances[child + 1] > distances[child]) ++child;
+            if (distances[child] <= distances[parent]) break;
+            std::swap(distances[parent], distances[child]);
+            std::swap(indices[parent], indices[child]);
+            parent = child;
+        }
+    }
+    for (uint32_t i = 0; i < found; ++i) {
+        distances[i] = sqrtf(distances[i]);
+        indices[i] = tree->indices[indices[i]];
+    }
+    return found;
+}
+
+void kdtree::find_nearest_batch(KDTree *tree, float *x, float *y, float *z, uint32_t query_count, uint32_t k, uint32_t *indices, float *distances)
+{
+    jobs::parallel_for(query_count, 256, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t q = begin; q < end; ++q) {
+            uint32_t found = find_nearest(tree, x[q], y[q], z[q], k, indices + size_t(q) * k, distances + size_t(q) * k);
+            for (uint32_t i = found; i < k; ++i) {
+                indices[size_t(q) * k + i] = UINT32_MAX;
+                distances[size_t(q) * k + i] = INFINITY;
+            }
+        }
+    });
+}
+
+uint32_t kdtree::find_radius(KDTree *tree, float x, float y, float z, float radius, uint32_t *indices, uint32_t max_count)
+{
+    if (tree->point_count == 0)
+        return 0;
+
+    uint32_t found = 0;
+    float radius_squared = radius * radius;
+    float query[3] = { x, y, z };
+    uint32_t stack[KDTREE_MAX_DEPTH];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+        KDTreeNode *node = tree->nodes + stack[--stack_size];
+        while (node->axis != KDTREE_LEAF) {
+            float difference = query[node->axis] - node->split;
+            uint32_t near_child = difference < 0.0f ? uint32_t(node - tree->nodes) + 1 : node->right;
+            uint32_t far_child = difference < 0.0f ? node->right : uint32_t(node - tree->nodes) + 1;
+            if (difference * difference <= radius_squared)
+                stack[stack_size++] = far_child;
+            node = tree->nodes + near_child;
+        }
+        for (uint32_t i = node->begin; i < node->end; ++i) {
+            float dx = tree->x[i] - x;
+            float dy = tree->y[i] - y;
+            float dz = tree->z[i] - z;
+            if (dx * dx + dy * dy + dz * dz <= radius_squared) {
+                if (indices && found < max_count)
+                    indices[found] = tree->indices[i];
+                ++found;
+            }
+        }
+    }
+    return found;
+}
+
+void kdtree::count_radius_batch(KDTree *tree, float *x, float *y, float *z, uint32_t query_count, float radius, uint32_t *counts)
+{
+    jobs::parallel_for(query_count, 256, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t q = begin; q < end; ++q) {
+            counts[q] = find_radius(tree, x[q], y[q], z[q], radius, NULL, 0);
+        }
+    });
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+
+// Inner nodes keep their left child right after themselves (pre-order), leaves reference a contiguous point range
+struct KDTreeNode
+{
+    float split;
+    uint32_t axis; // 0, 1, 2 for inner nodes, KDTREE_LEAF for leaves
+    uint32_t right; // Index of the right child (inner nodes)
+    uint32_t begin; // Point range covered by the node
+    uint32_t end;
+};
+
+// KDTree is a static k-d tree over 3D points with the points reordered (SoA) so that every leaf is contiguous in memory
+struct KDTree
+{
+    uint32_t point_count;
+    uint32_t node_count;
+    uint32_t leaf_size;
+    float *x;
+    float *y;
+    float *z;
+    uint32_t *indices; // Original index of each reordered point
+    KDTreeNode *nodes;
+};
+
+const uint32_t KDTREE_LEAF = 3;
+
+// `kdtree` namespace builds and queries k-d trees over point sets such as the catalog data in grid space
+namespace kdtree
+{
+    // Build the tree in parallel (subtrees below the top levels are built by separate jobs)
+    KDTree build(float *x, float *y, float *z, uint32_t count, uint32_t leaf_size = 8);
+
+    // Release tree memory
+    void release(KDTree *tree);
+
+    // `k` nearest neighbors of a single point, sorted by distance. Writes original point indices and (non-squared) distances,
+    // returns the number of neighbors found (less than `k` only for small trees).
+    uint32_t find_nearest(KDTree *tree, float x, float y, float z, uint32_t k, uint32_t *indices, float *distances);
+
+    // Batched `find_nearest` for `query_count` points in parallel; results are stored `k` per query
+    void find_nearest_batch(KDTree *tree, float *x, float *y, float *z, uint32_t query_count, uint32_t k, uint32_t *indices, float *distances);
+
+    // Points within `radius` of a single point. Writes at most `max_count` original indices, returns the total number found.
+    uint32_t find_radius(KDTree *tree, float x, float y, float z, float radius, uint32_t *indices, uint32_t max_count);
+
+    // Number of points within `radius` of each query point, in parallel
+    void count_radius_batch(KDTree *tree, float *x, float *y, float *z, uint32_t query_count, float radius, uint32_t *counts);
+}
@@ -0,0 +1,165 @@
+#include "light_bvh.h"
+#include "memory.h"
+#include <algorithm>
+
+static const float ONE_MINUS_EPSILON = 0.99999994f; // Largest float below 1
+static const uint32_t MAX_LEAF_SIZE = 64; // Lights weighed at once when a leaf is sampled
+
+static uint32_t get_subtree_node_count(uint32_t count, uint32_t leaf_size)
+{
+    if (count <= leaf_size)
+        return 1;
+    return 1 + get_subtree_node_count(count / 2, leaf_size) + get_subtree_node_count(count - count / 2, leaf_size);
+}
+
+// Fill the node and its subtree from the lights order[begin, end), splitting at the median of the widest axis
+static void build_subtree(LightBVH *tree, float **coordinates, float *power, uint32_t *order, uint32_t node, uint32_t begin, uint32_t end)
+{
+    LightBVHNode *current = tree->nodes + node;
+    current->begin = begin;
+    current->end = end;
+    if (end - begin <= tree->leaf_size) {
+        current->right = 0;
+        current->power = 0.0f;
+        for (uint32_t a = 0; a < 3; ++a) {
+            current->bounds_min[a] = begin < end ? 1.0e30f : 0.0f;
+            current->bounds_max[a] = begin < end ? -1.0e30f : 0.0f;
+        }
+        for (uint32_t i = begin; i < end; ++i) {
+            for (uint32_t a = 0; a < 3; ++a) {
+                float value = coordinates[a][order[i]];
+                current->bounds_min[a] = value < current->bounds_min[a] ? value : current->bounds_min[a];
+                current->bounds_max[a] = value > current->bounds_max[a] ? value : current->bounds_max[a];
+            }
+            current->power += power[order[i]];
+        }
+        return;
+    }
+
+    float min[3] = { 1.0e30f, 1.0e30f, 1.0e30f };
+    float max[3] = { -1.0e30f, -1.0e30f, -1.0e30f };
+    for (uint32_t i = begin; i < end; ++i) {
+        for (uint32_t a = 0; a < 3; ++a) {
+            float value = coordinates[a][order[i]];
+            min[a] = value < min[a] ? value : min[a];
+            max[a] = value > max[a] ? value : max[a];
+        }
+    }
+    uint32_t axis = 0;
+    if (max[1] - min[1] > max[axis] - min[axis]) axis = 1;
+    if (max[2] - min[2] > max[axis] - min[axis]) axis = 2;
+
+    uint32_t middle = begin + (end - begin) / 2;
+    float *values = coordinates[axis];
+    std::nth_element(order + begin, order + middle, order + end, [values](uint32_t a, uint32_t b) { return values[a] < values[b]; });
+    uint32_t left = node + 1;
+    uint32_t right = node + 1 + get_subtree_node_count(middle - begin, tree->leaf_size);
+    build_subtree(tree, coordinates, power, order, left, begin, middle);
+    build_subtree(tree, coordinates, power, order, right, middle, end);
+
+    current->right = right;
+    current->power = tree->nodes[left].power + tree->nodes[right].power;
+    for (uint32_t a = 0; a < 3; ++a) {
+        current->bounds_min[a] = min[a];
+        current->bounds_max[a] = max[a];
+    }
+}
+
+LightBVH light_bvh::build(float *x, float *y, float *z, float *power, uint32_t count, uint32_t leaf_size)
+{
+    LightBVH tree = {};
+    tree.leaf_size = std::min(std::max(leaf_size, uint32_t(1)), MAX_LEAF_SIZE);
+    tree.indices = memory::alloc_heap<uint32_t>(count + 1);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (power[i] > 0.0f)
+            tree.indices[tree.light_count++] = i;
+    }
+    tree.node_count = get_subtree_node_count(tree.light_count, tree.leaf_size);
+    tree.nodes = memory::alloc_heap<LightBVHNode>(tree.node_count);
+    tree.lights = memory::alloc_heap<LightBVHPoint>(tree.light_count + 1);
+
+    float *coordinates[3] = { x, y, z };
+    build_subtree(&tree, coordinates, power, tree.indices, 0, 0, tree.light_count);
+
+    // Reorder the lights so leaves are contiguous
+    for (uint32_t i = 0; i < tree.light_count; ++i) {
+        uint32_t index = tree.indices[i];
+        tree.lights[i] = { x[index], y[index], z[index], power[index] };
+    }
+    return tree;
+}
+
+void light_bvh::release(LightBVH *tree)
+{
+    memory::free_heap(tree->nodes);
+    memory::free_heap(tree->lights);
+    memory::free_heap(tree->indices);
+    *tree = LightBVH{};
+}
+
+// Power over the squared distance to the node center, which is clamped by the node extent for points in or near the node
+static float get_importance(const LightBVHNode *node, float x, float y, float z)
+{
+    float dx = x - 0.5f * (node->bounds_min[0] + node->bounds_max[0]);
+    float dy = y - 0.5f * (node->bounds_min[1] + node->bounds_max[1]);
+    float dz = z - 0.5f * (node->bounds_min[2] + node->bounds_max[2]);
+    float ex = 0.5f * (node->bounds_max[0] - node->bounds_min[0]);
+    float ey = 0.5f * (node->bounds_max[1] - node->bounds_min[1]);
+    float ez = 0.5f * (node->bounds_max[2] - node->bounds_min[2]);
+    float distance_squared = std::max(std::max(dx * dx + dy * dy + dz * dz, ex * ex + ey * ey + ez * ez), 1.0f);
+    return node->power / distance_squared;
+}
+
+uint32_t light_bvh::sample(LightBVH *tree, float x, float y, float z, float xi, float *pmf)
+{
+    *pmf = 0.0f;
+    if (tree->node_count == 0 || !(tree->nodes[0].power > 0.0f))
+        return LIGHT_BVH_NONE;
+
+    // The random number is rescaled to the chosen interval at every level instead of drawing a new one
+    float probability = 1.0f;
+    xi = std::min(std::max(xi, 0.0f), ONE_MINUS_EPSILON);
+    const LightBVHNode *node = tree->nodes;
+    while (node->right != 0) {
+        const LightBVHNode *left = node + 1;
+        const LightBVHNode *right = tree->nodes + node->right;
+        float importance_left = get_importance(left, x, y, z);
+        float importance_right = get_importance(right, x, y, z);
+        float importance_sum = importance_left + importance_right;
+        if (!(importance_sum > 0.0f))
+            return LIGHT_BVH_NONE;
+        float p_left = importance_left / importance_sum;
+        if (xi < p_left) {
+            xi = xi / p_left;
+            probability *= p_left;
+            node = left;
+        } else {
+            xi = (xi - p_left) / (1.0f - p_left);
+            probability *= 1.0f - p_left;
+            node = right;
+        }
+        xi = std::min(xi, ONE_MINUS_EPSILON);
+    }
+
+    // Pick within the leaf by the exact falloff of every light
+    float weights[MAX_LEAF_SIZE];
+    uint32_t count = node->end - node->begin;
+    float weight_sum = 0.0f;
+    for (uint32_t i = 0; i < count; ++i) {
+        LightBVHPoint *light = tree->lights + node->begin + i;
+        float dx = x - light->x, dy = y - light->y, dz = z - light->z;
+        weights[i] = light->power / std::max(dx * dx + dy * dy + dz * dz, 1.0f);
+        weight_sum += weights[i];
+    }
+    if (!(weight_sum > 0.0f))
+        return LIGHT_BVH_NONE;
+    float target = xi * weight_sum;
+    uint32_t picked = 0;
+    float sum = weights[0];
+    while (picked + 1 < count && sum <= target)
+        sum += weights[++picked];
+    while (picked > 0 && weights[picked] <= 0.0f)
+        --picked;
+    *pmf = probability * weights[picked] / weight_sum;
+    return node->begin + picked;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+
+// Point light with its emitted power
+struct LightBVHPoint
+{
+    float x;
+    float y;
+    float z;
+    float power;
+};
+
+// Inner nodes keep their left child right after themselves (pre-order), leaves reference a contiguous light range.
+// 40 bytes, uploaded as is to the structured buffer of cs_volpath.hlsl.
+struct LightBVHNode
+{
+    float bounds_min[3]; // Bounds of the lights below the node
+    float power; // Total power of the lights below the node
+    float bounds_max[3];
+    uint32_t right; // Index of the right child, 0 for leaves
+    uint32_t begin; // Light range covered by the node
+    uint32_t end;
+};
+
+// LightBVH is a bounding volume hierarchy over point lights with the lights reordered so that every leaf is contiguous
+struct LightBVH
+{
+    uint32_t light_count;
+    uint32_t node_count;
+    uint32_t leaf_size;
+    LightBVHPoint *lights;
+    uint32_t *indices; // Original index of each reordered light
+    LightBVHNode *nodes;
+};
+
+const uint32_t LIGHT_BVH_NONE = 0xffffffff;
+
+// `light_bvh` namespace picks one of many point lights (such as the catalog points in grid space) with a probability
+// that approximates its contribution to a receiving point, for next-event estimation in the path tracer
+namespace light_bvh
+{
+    // Build the hierarchy by median splits of the widest axis (leaves of at most 64 lights); lights without power are left out
+    LightBVH build(float *x, float *y, float *z, float *power, uint32_t count, uint32_t leaf_size = 4);
+
+    // Release tree memory
+    void release(LightBVH *tree);
+
+    // Pick a light for the receiving point (x, y, z) with the uniform random number `xi`. The traversal descends into
+    // a child with a probability proportional to its power over the squared distance to its center, clamped by the
+    // child's extent; in a leaf every light is weighted by its power over the squared distance (at least 1).
+    // Returns the index into tree->lights and writes the probability of the pick, LIGHT_BVH_NONE if there is no power.
+    uint32_t sample(LightBVH *tree, float x, float y, float z, float xi, float *pmf);
+}
@@ -19,7 +19,7 @@ extern StackAllocator allocator_temp;
 namespace memory
 {
     template <typename T>
-    T *alloc_heap(uint32_t count)
+    T *alloc_heap(size_t count)
     {
         T *mem = (T *)malloc(count * sizeof(T));
         return mem;
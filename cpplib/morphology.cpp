@@ -0,0 +1,373 @@
+#include "morphology.h"
+#include "memory.h"
+#include "jobs.h"
+#include <emmintrin.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <fstream>
+
+static const float PI2_3 = 2.09439510f;
+static const float SQRT3_2 = 0.866025404f;
+
+MorphologySettings morphology::get_default_settings()
+{
+    MorphologySettings settings = {};
+    settings.sigma = 2.0f;
+    settings.eigenvalue_threshold = 0.01f;
+    settings.log_density = true;
+    settings.trace_floor = 1.0e-3f;
+    settings.slab_depth = 32;
+    return settings;
+}
+
+void morphology::get_symmetric_eigenvalues(float xx, float yy, float zz, float xy, float xz, float yz, float *eigenvalues)
+{
+    // Closed-form trigonometric solution of the characteristic cubic (Smith 1961)
+    float q = (xx + yy + zz) / 3.0f;
+    float p1 = xy * xy + xz * xz + yz * yz;
+    float dxx = xx - q, dyy = yy - q, dzz = zz - q;
+    float p2 = dxx * dxx + dyy * dyy + dzz * dzz + 2.0f * p1;
+    float p = sqrtf(p2 / 6.0f);
+    if (p < 1.0e-20f) {
+        eigenvalues[0] = eigenvalues[1] = eigenvalues[2] = q;
+        return;
+    }
+    float det = dxx * (dyy * dzz - yz * yz) - xy * (xy * dzz - yz * xz) + xz * (xy * yz - dyy * xz);
+    float r = 0.5f * det / (p * p * p);
+    r = r < -1.0f ? -1.0f : (r > 1.0f ? 1.0f : r);
+    float phi = acosf(r) / 3.0f;
+    eigenvalues[2] = q + 2.0f * p * cosf(phi);
+    eigenvalues[0] = q + 2.0f * p * cosf(phi + PI2_3);
+    eigenvalues[1] = 3.0f * q - eigenvalues[0] - eigenvalues[2];
+}
+
+// SSE version of get_symmetric_eigenvalues for 4 voxels at once.
+// acos uses the Abramowitz-Stegun 4.4.46 polynomial and cos/sin of phi in [0, pi/3] use short Taylor series,
+// both accurate to well below the float16 precision of the trace.
+static void get_symmetric_eigenvalues_sse(__m128 xx, __m128 yy, __m128 zz, __m128 xy, __m128 xz, __m128 yz,
+                                          __m128 *e0, __m128 *e1, __m128 *e2)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 three = _mm_set1_ps(3.0f);
+
+    __m128 q = _mm_div_ps(_mm_add_ps(_mm_add_ps(xx, yy), zz), three);
+    __m128 p1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(xy, xy), _mm_mul_ps(xz, xz)), _mm_mul_ps(yz, yz));
+    __m128 dxx = _mm_sub_ps(xx, q), dyy = _mm_sub_ps(yy, q), dzz = _mm_sub_ps(zz, q);
+    __m128 p2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dxx, dxx), _mm_mul_ps(dyy, dyy)), _mm_add_ps(_mm_mul_ps(dzz, dzz), _mm_mul_ps(two, p1)));
+    __m128 p = _mm_sqrt_ps(_mm_div_ps(p2, _mm_set1_ps(6.0f)));
+    __m128 degenerate = _mm_cmplt_ps(p, _mm_set1_ps(1.0e-20f));
+    __m128 p_safe = _mm_or_ps(_mm_and_ps(degenerate, one), _mm_andnot_ps(degenerate, p));
+
+    __m128 det = _mm_sub_ps(_mm_mul_ps(dxx, _mm_sub_ps(_mm_mul_ps(dyy, dzz), _mm_mul_ps(yz, yz))),
+                            _mm_mul_ps(xy, _mm_sub_ps(_mm_mul_ps(xy, dzz), _mm_mul_ps(yz, xz))));
+    det = _mm_add_ps(det, _mm_mul_ps(xz, _mm_sub_ps(_mm_mul_ps(xy, yz), _mm_mul_ps(dyy, xz))));
+    __m128 r = _mm_div_ps(_mm_mul_ps(_mm_set1_ps(0.5f), det), _mm_mul_ps(_mm_mul_ps(p_safe, p_safe), p_safe));
+    r = _mm_min_ps(_mm_max_ps(r, _mm_set1_ps(-1.0f)), one);
+
+    // acos(|r|) = sqrt(1 - |r|) * poly(|r|), mirrored for negative r
+    __m128 sign_mask = _mm_set1_ps(-0.0f);
+    __m128 r_abs = _mm_andnot_ps(sign_mask, r);
+    __m128 poly = _mm_set1_ps(-0.0012624911f);
+    poly = _mm_add_ps(_mm_mul_ps(poly, r_abs), _mm_set1_ps(0.0066700901f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, r_abs), _mm_set1_ps(-0.0170881256f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, r_abs), _mm_set1_ps(0.0308918810f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, r_abs), _mm_set1_ps(-0.0501743046f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, r_abs), _mm_set1_ps(0.0889789874f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, r_abs), _mm_set1_ps(-0.2145988016f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, r_abs), _mm_set1_ps(1.5707963050f));
+    __m128 acos_abs = _mm_mul_ps(_mm_sqrt_ps(_mm_sub_ps(one, r_abs)), poly);
+    __m128 negative = _mm_cmplt_ps(r, _mm_setzero_ps());
+    __m128 acos_r = _mm_or_ps(_mm_and_ps(negative, _mm_sub_ps(_mm_set1_ps(3.14159265f), acos_abs)), _mm_andnot_ps(negative, acos_abs));
+    __m128 phi = _mm_div_ps(acos_r, three);
+
+    __m128 phi2 = _mm_mul_ps(phi, phi);
+    __m128 cos_phi = _mm_set1_ps(1.0f / 40320.0f);
+    cos_phi = _mm_add_ps(_mm_mul_ps(cos_phi, phi2), _mm_set1_ps(-1.0f / 720.0f));
+    cos_phi = _mm_add_ps(_mm_mul_ps(cos_phi, phi2), _mm_set1_ps(1.0f / 24.0f));
+    cos_phi = _mm_add_ps(_mm_mul_ps(cos_phi, phi2), _mm_set1_ps(-0.5f));
+    cos_phi = _mm_add_ps(_mm_mul_ps(cos_phi, phi2), one);
+    __m128 sin_phi = _mm_set1_ps(1.0f / 362880.0f);
+    sin_phi = _mm_add_ps(_mm_mul_ps(sin_phi, phi2), _mm_set1_ps(-1.0f / 5040.0f));
+    sin_phi = _mm_add_ps(_mm_mul_ps(sin_phi, phi2), _mm_set1_ps(1.0f / 120.0f));
+    sin_phi = _mm_add_ps(_mm_mul_ps(sin_phi, phi2), _mm_set1_ps(-1.0f / 6.0f));
+    sin_phi = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(sin_phi, phi2), one), phi);
+
+    // cos(phi + 2pi/3) = -cos(phi)/2 - sin(phi)*sqrt(3)/2
+    __m128 cos_phi_shifted = _mm_sub_ps(_mm_mul_ps(cos_phi, _mm_set1_ps(-0.5f)), _mm_mul_ps(sin_phi, _mm_set1_ps(SQRT3_2)));
+    __m128 two_p = _mm_andnot_ps(degenerate, _mm_mul_ps(two, p));
+    *e2 = _mm_add_ps(q, _mm_mul_ps(two_p, cos_phi));
+    *e0 = _mm_add_ps(q, _mm_mul_ps(two_p, cos_phi_shifted));
+    *e1 = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(three, q), *e0), *e2);
+}
+
+static inline int32_t clamp_index(int32_t i, int32_t size)
+{
+    return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
+
+static inline void accumulate_voxel(MorphologyStatistics *statistics, uint8_t *classes, size_t index, float trace,
+                                    float e0, float e1, float e2, float threshold)
+{
+    uint8_t morphology_class = uint8_t((e0 < -threshold) + (e1 < -threshold) + (e2 < -threshold));
+    classes[index] = morphology_class;
+    statistics->voxel_count[morphology_class]++;
+    statistics->trace_sum[morphology_class] += trace;
+    statistics->mean_eigenvalues[morphology_class][0] += e0;
+    statistics->mean_eigenvalues[morphology_class][1] += e1;
+    statistics->mean_eigenvalues[morphology_class][2] += e2;
+}
+
+// Slab-streamed classification of a grid whose voxels are read through `load_trace(index)`, so only the slab and its
+// halo of radius + 1 slices on each side are ever held in float
+template <typename LoadTrace>
+static MorphologyStatistics classify_grid(int32_t width, int32_t height, int32_t depth, LoadTrace load_trace, MorphologySettings settings, uint8_t *classes)
+{
+    const size_t slice_size = size_t(width) * height;
+    const uint32_t thread_count = jobs::get_thread_count();
+
+    // Normalized Gaussian kernel
+    int32_t radius = int32_t(ceilf(3.0f * settings.sigma));
+    if (radius < 1) radius = 1;
+    float *kernel = memory::alloc_heap<float>(2 * radius + 1);
+    float kernel_sum = 0.0f;
+    for (int32_t k = -radius; k <= radius; ++k) {
+        float w = settings.sigma > 0.0f ? expf(-0.5f * float(k * k) / (settings.sigma * settings.sigma)) : (k == 0 ? 1.0f : 0.0f);
+        kernel[k + radius] = w;
+        kernel_sum += w;
+    }
+    for (int32_t k = 0; k <= 2 * radius; ++k) {
+        kernel[k] /= kernel_sum;
+    }
+
+    // Scale-normalized second derivatives (times sigma^2) keep the threshold meaningful across smoothing scales. Below one
+    // voxel the central differences themselves set the scale, so the factor stays at 1 there; both branches meet at
+    // sigma = 1, the normalization is continuous and only its slope changes.
+    const float hessian_scale = settings.sigma > 1.0f ? settings.sigma * settings.sigma : 1.0f;
+    const float threshold = settings.eigenvalue_threshold;
+
+    int32_t slab_depth = int32_t(settings.slab_depth > 0 ? settings.slab_depth : 32);
+    if (slab_depth > depth) slab_depth = depth;
+    const int32_t xy_slot_count = slab_depth + 2 + 2 * radius;
+    const int32_t smooth_slot_count = slab_depth + 2;
+    float *xy_smoothed = memory::alloc_heap<float>(xy_slot_count * slice_size);
+    float *smoothed = memory::alloc_heap<float>(smooth_slot_count * slice_size);
+    float *row_scratch = memory::alloc_heap<float>(thread_count * (slice_size + width));
+
+    MorphologyStatistics *thread_statistics = memory::alloc_heap<MorphologyStatistics>(thread_count);
+    memset(thread_statistics, 0, thread_count * sizeof(MorphologyStatistics));
+
+    for (int32_t z0 = 0; z0 < depth; z0 += slab_depth) {
+        int32_t z1 = z0 + slab_depth < depth ? z0 + slab_depth : depth;
+        int32_t xy_first = z0 - 1 - radius;
+        int32_t smooth_first = z0 - 1;
+        int32_t xy_count = (z1 - z0) + 2 + 2 * radius;
+        int32_t smooth_count = (z1 - z0) + 2;
+
+        // 1) Smooth the source slices of this slab (plus halo) along x and y
+        jobs::parallel_for(xy_count, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+            float *scratch = row_scratch + thread_index * (slice_size + width);
+            float *row = scratch + slice_size;
+            for (uint32_t slot = begin; slot < end; ++slot) {
+                int32_t z = clamp_index(xy_first + int32_t(slot), depth);
+                float *dst = xy_smoothed + slot * slice_size;
+                for (int32_t y = 0; y < height; ++y) {
+                    size_t src_row = size_t(z) * slice_size + size_t(y) * width;
+                    for (int32_t x = 0; x < width; ++x) {
+                        float value = load_trace(src_row + x);
+                        if (settings.log_density)
+                            value = log10f(settings.trace_floor + (value > 0.0f ? value : 0.0f));
+                        row[x] = value;
+                    }
+                    for (int32_t x = 0; x < width; ++x) {
+                        float sum = 0.0f;
+                        for (int32_t k = -radius; k <= radius; ++k) {
+                            sum += kernel[k + radius] * row[clamp_index(x + k, width)];
+                        }
+                        scratch[size_t(y) * width + x] = sum;
+                    }
+                }
+                for (int32_t y = 0; y < height; ++y) {
+                    float *dst_row = dst + size_t(y) * width;
+                    memset(dst_row, 0, width * sizeof(float));
+                    for (int32_t k = -radius; k <= radius; ++k) {
+                        float *src_row = scratch + size_t(clamp_index(y + k, height)) * width;
+                        float w = kernel[k + radius];
+                        for (int32_t x = 0; x < width; ++x) {
+                            dst_row[x] += w * src_row[x];
+                        }
+                    }
+                }
+            }
+        });
+
+        // 2) Smooth along z into the slab's smoothed slices (one slice of halo on each side for the derivatives)
+        jobs::parallel_for(smooth_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t slot = begin; slot < end; ++slot) {
+                int32_t z = smooth_first + int32_t(slot);
+                float *dst = smoothed + slot * slice_size;
+                memset(dst, 0, slice_size * sizeof(float));
+                for (int32_t k = -radius; k <= radius; ++k) {
+                    // The xy buffer already holds clamped source slices for the whole halo
+                    float *src = xy_smoothed + size_t(z + k - xy_first) * slice_size;
+                    float w = kernel[k + radius];
+                    for (size_t i = 0; i < slice_size; ++i) {
+                        dst[i] += w * src[i];
+                    }
+                }
+            }
+        });
+
+        // 3) Hessian by central differences, eigenvalues and classification
+        uint32_t row_count = uint32_t((z1 - z0) * height);
+        jobs::parallel_for(row_count, 16, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+            MorphologyStatistics *statistics = thread_statistics + thread_index;
+            for (uint32_t row = begin; row < end; ++row) {
+                int32_t z = z0 + int32_t(row) / height;
+                int32_t y = int32_t(row) % height;
+                int32_t slot = z - smooth_first;
+                int32_t ym = clamp_index(y - 1, height), yp = clamp_index(y + 1, height);
+                float *c = smoothed + size_t(slot) * slice_size;
+                float *zm = c - slice_size;
+                float *zp = c + slice_size;
+                if (z == 0) zm = c;
+                if (z == depth - 1) zp = c;
+                float *c_row = c + size_t(y) * width;
+                float *c_ym = c + size_t(ym) * width, *c_yp = c + size_t(yp) * width;
+                float *zm_row = zm + size_t(y) * width, *zp_row = zp + size_t(y) * width;
+                float *zm_ym = zm + size_t(ym) * width, *zm_yp = zm + size_t(yp) * width;
+                float *zp_ym = zp + size_t(ym) * width, *zp_yp = zp + size_t(yp) * width;
+                size_t out_row = (size_t(z) * height + y) * width;
+
+                auto scalar_voxel = [&](int32_t x) {
+                    int32_t xm = clamp_index(x - 1, width), xp = clamp_index(x + 1, width);
+                    float hxx = c_row[xp] - 2.0f * c_row[x] + c_row[xm];
+                    float hyy = c_yp[x] - 2.0f * c_row[x] + c_ym[x];
+                    float hzz = zp_row[x] - 2.0f * c_row[x] + zm_row[x];
+                    float hxy = 0.25f * (c_yp[xp] - c_yp[xm] - c_ym[xp] + c_ym[xm]);
+                    float hxz = 0.25f * (zp_row[xp] - zp_row[xm] - zm_row[xp] + zm_row[xm]);
+                    float hyz = 0.25f * (zp_yp[x] - zp_ym[x] - zm_yp[x] + zm_ym[x]);
+                    float e[3];
+                    morphology::get_symmetric_eigenvalues(hessian_scale * hxx, hessian_scale * hyy, hessian_scale * hzz,
+                                                          hessian_scale * hxy, hessian_scale * hxz, hessian_scale * hyz, e);
+                    accumulate_voxel(statistics, classes, out_row + x, load_trace(out_row + x), e[0], e[1], e[2], threshold);
+                };
+
+                // Border voxels need clamped x-neighbours, the interior goes 4 voxels at a time
+                scalar_voxel(0);
+                int32_t x = 1;
+                const __m128 scale = _mm_set1_ps(hessian_scale);
+                const __m128 quarter = _mm_set1_ps(0.25f);
+                const __m128 two = _mm_set1_ps(2.0f);
+                for (; x + 4 < width; x += 4) {
+                    __m128 center = _mm_loadu_ps(c_row + x);
+                    __m128 hxx = _mm_add_ps(_mm_sub_ps(_mm_loadu_ps(c_row + x + 1), _mm_mul_ps(two, center)), _mm_loadu_ps(c_row + x - 1));
+                    __m128 hyy = _mm_add_ps(_mm_sub_ps(_mm_loadu_ps(c_yp + x), _mm_mul_ps(two, center)), _mm_loadu_ps(c_ym + x));
+                    __m128 hzz = _mm_add_ps(_mm_sub_ps(_mm_loadu_ps(zp_row + x), _mm_mul_ps(two, center)), _mm_loadu_ps(zm_row + x));
+                    __m128 hxy = _mm_mul_ps(quarter, _mm_add_ps(_mm_sub_ps(_mm_loadu_ps(c_yp + x + 1), _mm_loadu_ps(c_yp + x - 1)),
+                                                                _mm_sub_ps(_mm_loadu_ps(c_ym + x - 1), _mm_loadu_ps(c_ym + x + 1))));
+                    __m128 hxz = _mm_mul_ps(quarter, _mm_add_ps(_mm_sub_ps(_mm_loadu_ps(zp_row + x + 1), _mm_loadu_ps(zp_row + x - 1)),
+                                                                _mm_sub_ps(_mm_loadu_ps(zm_row + x - 1), _mm_loadu_ps(zm_row + x + 1))));
+                    __m128 hyz = _mm_mul_ps(quarter, _mm_add_ps(_mm_sub_ps(_mm_loadu_ps(zp_yp + x), _mm_loadu_ps(zp_ym + x)),
+                                                                _mm_sub_ps(_mm_loadu_ps(zm_ym + x), _mm_loadu_ps(zm_yp + x))));
+                    __m128 e0, e1, e2;
+                    get_symmetric_eigenvalues_sse(_mm_mul_ps(scale, hxx), _mm_mul_ps(scale, hyy), _mm_mul_ps(scale, hzz),
+                                                  _mm_mul_ps(scale, hxy), _mm_mul_ps(scale, hxz), _mm_mul_ps(scale, hyz), &e0, &e1, &e2);
+                    float e0_lanes[4], e1_lanes[4], e2_lanes[4];
+                    _mm_storeu_ps(e0_lanes, e0);
+                    _mm_storeu_ps(e1_lanes, e1);
+                    _mm_storeu_ps(e2_lanes, e2);
+                    for (int32_t lane = 0; lane < 4; ++lane) {
+                        accumulate_voxel(statistics, classes, out_row + x + lane, load_trace(out_row + x + lane),
+                                         e0_lanes[lane], e1_lanes[lane], e2_lanes[lane], threshold);
+                    }
+                }
+                for (; x < width; ++x) {
+                    scalar_voxel(x);
+                }
+            }
+        });
+    }
+
+    // Merge per-thread statistics
+    MorphologyStatistics statistics = {};
+    for (uint32_t t = 0; t < thread_count; ++t) {
+        for (int32_t c = 0; c < MC_COUNT; ++c) {
+            statistics.voxel_count[c] += thread_statistics[t].voxel_count[c];
+            statistics.trace_sum[c] += thread_statistics[t].trace_sum[c];
+            for (int32_t e = 0; e < 3; ++e) {
+                statistics.mean_eigenvalues[c][e] += thread_statistics[t].mean_eigenvalues[c][e];
+            }
+        }
+    }
+    double total_voxels = double(slice_size) * depth;
+    double total_trace = 0.0;
+    for (int32_t c = 0; c < MC_COUNT; ++c) {
+        total_trace += statistics.trace_sum[c];
+    }
+    for (int32_t c = 0; c < MC_COUNT; ++c) {
+        statistics.volume_fraction[c] = double(statistics.voxel_count[c]) / total_voxels;
+        statistics.trace_fraction[c] = total_trace > 0.0 ? statistics.trace_sum[c] / total_trace : 0.0;
+        for (int32_t e = 0; e < 3; ++e) {
+            if (statistics.voxel_count[c] > 0)
+                statistics.mean_eigenvalues[c][e] /= double(statistics.voxel_count[c]);
+        }
+    }
+
+    memory::free_heap(thread_statistics);
+    memory::free_heap(row_scratch);
+    memory::free_heap(smoothed);
+    memory::free_heap(xy_smoothed);
+    memory::free_heap(kernel);
+    return statistics;
+}
+
+MorphologyStatistics morphology::classify(Volume *trace, MorphologySettings settings, uint8_t *classes)
+{
+    float *data = trace->data;
+    return classify_grid(int32_t(trace->width), int32_t(trace->height), int32_t(trace->depth),
+        [data](size_t index) { return data[index]; }, settings, classes);
+}
+
+MorphologyStatistics morphology::classify_half(uint16_t *data, uint32_t width, uint32_t height, uint32_t depth, uint32_t channel_count,
+                                               uint32_t channel, MorphologySettings settings, uint8_t *classes)
+{
+    return classify_grid(int32_t(width), int32_t(height), int32_t(depth),
+        [data, channel_count, channel](size_t index) { return volume::half_to_float(data[index * channel_count + channel]); }, settings, classes);
+}
+
+bool morphology::save(uint8_t *classes, Volume *trace, MorphologySettings settings, MorphologyStatistics *statistics, const char *filename)
+{
+    std::string name(filename);
+    std::ofstream bin_file((name + ".bin").c_str(), std::ios::out | std::ios::binary);
+    if (!bin_file.is_open()) {
+        printf("Failed to write morphology classes to %s.bin\n", filename);
+        return false;
+    }
+    bin_file.write((char*)classes, volume::get_voxel_count(trace));
+    bin_file.close();
+
+    const char *class_names[MC_COUNT] = { "void", "sheet", "filament", "knot" };
+    std::ofstream stats_file((name + "_statistics.txt").c_str(), std::ios::out);
+    stats_file << "grid resolution: " << trace->width << " x " << trace->height << " x " << trace->depth << " [vox]" << std::endl;
+    stats_file << "class volume: uint8, 0 = void, 1 = sheet, 2 = filament, 3 = knot" << std::endl;
+    stats_file << "smoothing scale: " << settings.sigma << " [vox]" << std::endl;
+    stats_file << "eigenvalue threshold: " << settings.eigenvalue_threshold << std::endl;
+    stats_file << "log density: " << (settings.log_density ? 1 : 0) << std::endl;
+    stats_file << std::endl;
+    stats_file << "Class,Voxels,Volume fraction,Trace fraction,Mean trace,Mean lambda1,Mean lambda2,Mean lambda3" << std::endl;
+    for (int32_t c = 0; c < MC_COUNT; ++c) {
+        double mean_trace = statistics->voxel_count[c] > 0 ? statistics->trace_sum[c] / double(statistics->voxel_count[c]) : 0.0;
+        stats_file << class_names[c] << ","
+            << statistics->voxel_count[c] << ","
+            << statistics->volume_fraction[c] << ","
+            << statistics->trace_fraction[c] << ","
+            << mean_trace << ","
+            << statistics->mean_eigenvalues[c][0] << ","
+            << statistics->mean_eigenvalues[c][1] << ","
+            << statistics->mean_eigenvalues[c][2] << std::endl;
+    }
+    stats_file.close();
+    return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include "volume.h"
+
+// Cosmic web morphology classes, given by the number of significantly negative Hessian eigenvalues of the smoothed field
+enum MorphologyClass
+{
+    MC_VOID = 0,
+    MC_SHEET = 1,
+    MC_FILAMENT = 2,
+    MC_KNOT = 3,
+    MC_COUNT = 4
+};
+
+struct MorphologySettings
+{
+    float sigma; // Gaussian smoothing scale [vox]
+    float eigenvalue_threshold; // Eigenvalues below -threshold count as collapsed directions (scale-normalized units)
+    bool log_density; // Classify log10(trace_floor + trace) instead of the raw trace
+    float trace_floor; // Added to the trace before taking the log
+    uint32_t slab_depth; // Number of z-slices processed at once, bounds the scratch memory
+};
+
+struct MorphologyStatistics
+{
+    uint64_t voxel_count[MC_COUNT];
+    double volume_fraction[MC_COUNT];
+    double trace_sum[MC_COUNT];
+    double trace_fraction[MC_COUNT];
+    double mean_eigenvalues[MC_COUNT][3]; // Sorted ascending
+};
+
+// `morphology` namespace classifies grid voxels into void/sheet/filament/knot by Hessian eigenanalysis (T-web style)
+namespace morphology
+{
+    MorphologySettings get_default_settings();
+
+    // Classify every voxel of `trace`. `classes` must hold width * height * depth bytes, one MorphologyClass per voxel.
+    // The volume is streamed in z-slabs, so scratch memory scales with the slab, not with the whole grid.
+    MorphologyStatistics classify(Volume *trace, MorphologySettings settings, uint8_t *classes);
+
+    // Classify one channel of an interleaved float16 grid (a captured texture) slab by slab, without a float copy of it
+    MorphologyStatistics classify_half(uint16_t *data, uint32_t width, uint32_t height, uint32_t depth, uint32_t channel_count,
+                                       uint32_t channel, MorphologySettings settings, uint8_t *classes);
+
+    // Eigenvalues (ascending) of the symmetric 3x3 matrix [[xx xy xz] [xy yy yz] [xz yz zz]], scalar reference path
+    void get_symmetric_eigenvalues(float xx, float yy, float zz, float xy, float xz, float yz, float *eigenvalues);
+
+    // Write the class volume as a raw uint8 grid and the statistics as text; only the size of `trace` is used
+    bool save(uint8_t *classes, Volume *trace, MorphologySettings settings, MorphologyStatistics *statistics, const char *filename);
+}
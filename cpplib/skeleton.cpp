@@ -0,0 +1,748 @@
+#include "skeleton.h"
+#include "memory.h"
+#include "array.h"
+#include "jobs.h"
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <string>
+#include <fstream>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Mask values during graph construction
+const uint8_t SKELETON_EMPTY = 0;
+const uint8_t SKELETON_REGULAR = 1; // Voxel with exactly two skeleton neighbors
+const uint8_t SKELETON_VISITED = 2; // Regular voxel already assigned to an edge
+const uint8_t SKELETON_NODE = 3; // End point or junction voxel
+const uint8_t SKELETON_KEPT = 4; // Voxel of an edge or node that survived the pruning
+
+const uint32_t NEIGHBORHOOD_CENTER = 13;
+
+// 3x3x3 neighborhood as bit masks, bit i <-> offset (i % 3 - 1, i / 3 % 3 - 1, i / 9 - 1)
+struct NeighborhoodTables
+{
+    int32_t dx[27];
+    int32_t dy[27];
+    int32_t dz[27];
+    uint32_t adjacent26[27]; // Neighborhood positions 26-adjacent to position i (center excluded)
+    uint32_t adjacent6[27]; // Positions of the 18-neighborhood 6-adjacent to position i
+    uint32_t n6; // 6-neighbors of the center
+    uint32_t n18;
+};
+
+static NeighborhoodTables get_neighborhood_tables()
+{
+    NeighborhoodTables tables = {};
+    for (int32_t i = 0; i < 27; ++i) {
+        tables.dx[i] = i % 3 - 1;
+        tables.dy[i] = i / 3 % 3 - 1;
+        tables.dz[i] = i / 9 - 1;
+    }
+    for (int32_t i = 0; i < 27; ++i) {
+        int32_t manhattan = abs(tables.dx[i]) + abs(tables.dy[i]) + abs(tables.dz[i]);
+        if (manhattan == 1) tables.n6 |= 1u << i;
+        if (manhattan == 1 || manhattan == 2) tables.n18 |= 1u << i;
+    }
+    for (int32_t i = 0; i < 27; ++i) {
+        for (int32_t j = 0; j < 27; ++j) {
+            if (i == j || j == int32_t(NEIGHBORHOOD_CENTER))
+                continue;
+            int32_t ax = abs(tables.dx[i] - tables.dx[j]);
+            int32_t ay = abs(tables.dy[i] - tables.dy[j]);
+            int32_t az = abs(tables.dz[i] - tables.dz[j]);
+            if (ax <= 1 && ay <= 1 && az <= 1)
+                tables.adjacent26[i] |= 1u << j;
+            if (ax + ay + az == 1 && (tables.n18 & (1u << j)))
+                tables.adjacent6[i] |= 1u << j;
+        }
+    }
+    return tables;
+}
+
+static const NeighborhoodTables &get_tables()
+{
+    static NeighborhoodTables tables = get_neighborhood_tables();
+    return tables;
+}
+
+static inline uint32_t get_lowest_bit_index(uint32_t bits)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return uint32_t(index);
+#else
+    return uint32_t(__builtin_ctz(bits));
+#endif
+}
+
+static inline uint32_t get_bit_count(uint32_t bits)
+{
+    bits = bits - ((bits >> 1) & 0x55555555);
+    bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+    return (((bits + (bits >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+// Bits of `set` reachable from `seed` through the given adjacency
+static uint32_t get_reachable(uint32_t set, uint32_t seed, const uint32_t *adjacency)
+{
+    uint32_t visited = seed;
+    uint32_t frontier = seed;
+    while (frontier) {
+        uint32_t expanded = 0;
+        while (frontier) {
+            expanded |= adjacency[get_lowest_bit_index(frontier)];
+            frontier &= frontier - 1;
+        }
+        frontier = expanded & set & ~visited;
+        visited |= frontier;
+    }
+    return visited;
+}
+
+// Simple point test for (26, 6) connectivity: the object neighbors form one 26-component
+// and the background 6-neighbors belong to a single 6-component of the background within the 18-neighborhood
+static bool is_simple(uint32_t object)
+{
+    const NeighborhoodTables &tables = get_tables();
+    if (object == 0)
+        return false;
+    if (get_reachable(object, object & (0u - object), tables.adjacent26) != object)
+        return false;
+
+    uint32_t background = ~object & tables.n18;
+    uint32_t background6 = background & tables.n6;
+    if (background6 == 0)
+        return false;
+    uint32_t reached = get_reachable(background, background6 & (0u - background6), tables.adjacent6);
+    return (reached & background6) == background6;
+}
+
+struct GridShape
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    int64_t offsets[27]; // Linear index offsets of the neighborhood positions
+};
+
+static GridShape get_grid_shape(uint32_t width, uint32_t height, uint32_t depth)
+{
+    const NeighborhoodTables &tables = get_tables();
+    GridShape shape = { width, height, depth, {} };
+    for (int32_t i = 0; i < 27; ++i) {
+        shape.offsets[i] = (int64_t(tables.dz[i]) * height + tables.dy[i]) * width + tables.dx[i];
+    }
+    return shape;
+}
+
+// Bits of the non-empty voxels around `index` (center excluded), the outside of the grid counts as empty
+static inline uint32_t get_neighborhood(uint8_t *mask, GridShape *shape, size_t index, uint32_t x, uint32_t y, uint32_t z)
+{
+    const NeighborhoodTables &tables = get_tables();
+    uint32_t bits = 0;
+    bool interior = x > 0 && y > 0 && z > 0 && x + 1 < shape->width && y + 1 < shape->height && z + 1 < shape->depth;
+    for (uint32_t i = 0; i < 27; ++i) {
+        if (i == NEIGHBORHOOD_CENTER)
+            continue;
+        if (!interior) {
+            int32_t nx = int32_t(x) + tables.dx[i];
+            int32_t ny = int32_t(y) + tables.dy[i];
+            int32_t nz = int32_t(z) + tables.dz[i];
+            if (nx < 0 || ny < 0 || nz < 0 || nx >= int32_t(shape->width) || ny >= int32_t(shape->height) || nz >= int32_t(shape->depth))
+                continue;
+        }
+        if (mask[int64_t(index) + shape->offsets[i]])
+            bits |= 1u << i;
+    }
+    return bits;
+}
+
+static inline void get_coordinates(GridShape *shape, size_t index, uint32_t *x, uint32_t *y, uint32_t *z)
+{
+    *x = uint32_t(index % shape->width);
+    *y = uint32_t((index / shape->width) % shape->height);
+    *z = uint32_t(index / (size_t(shape->width) * shape->height));
+}
+
+// Fill background pockets that are not 6-connected to the grid boundary (level-synchronous flood fill from the boundary)
+static void fill_cavities(uint8_t *mask, GridShape *shape)
+{
+    const uint8_t OUTSIDE = 2;
+    const NeighborhoodTables &tables = get_tables();
+    Array<uint32_t> frontier = array::get<uint32_t>(1024);
+    Array<uint32_t> next_frontier = array::get<uint32_t>(1024);
+    for (uint32_t z = 0; z < shape->depth; ++z) {
+        for (uint32_t y = 0; y < shape->height; ++y) {
+            for (uint32_t x = 0; x < shape->width; ++x) {
+                bool boundary = x == 0 || y == 0 || z == 0 || x + 1 == shape->width || y + 1 == shape->height || z + 1 == shape->depth;
+                if (!boundary) {
+                    x = shape->width - 2; // Jump to the last column
+                    continue;
+                }
+                size_t index = (size_t(z) * shape->height + y) * shape->width + x;
+                if (mask[index] == 0) {
+                    mask[index] = OUTSIDE;
+                    array::add(&frontier, uint32_t(index));
+                }
+            }
+        }
+    }
+
+    while (frontier.count > 0) {
+        array::reset(&next_frontier);
+        for (uint32_t f = 0; f < frontier.count; ++f) {
+            uint32_t x, y, z;
+            get_coordinates(shape, frontier[f], &x, &y, &z);
+            for (uint32_t i = 0; i < 27; ++i) {
+                if (!(tables.n6 & (1u << i)))
+                    continue;
+                int32_t nx = int32_t(x) + tables.dx[i];
+                int32_t ny = int32_t(y) + tables.dy[i];
+                int32_t nz = int32_t(z) + tables.dz[i];
+                if (nx < 0 || ny < 0 || nz < 0 || nx >= int32_t(shape->width) || ny >= int32_t(shape->height) || nz >= int32_t(shape->depth))
+                    continue;
+                size_t neighbor = size_t(int64_t(frontier[f]) + shape->offsets[i]);
+                if (mask[neighbor] == 0) {
+                    mask[neighbor] = OUTSIDE;
+                    array::add(&next_frontier, uint32_t(neighbor));
+                }
+            }
+        }
+        Array<uint32_t> swap = frontier;
+        frontier = next_frontier;
+        next_frontier = swap;
+    }
+    array::release(&frontier);
+    array::release(&next_frontier);
+
+    size_t slice_size = size_t(shape->width) * shape->height;
+    jobs::parallel_for(shape->depth, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (size_t i = begin * slice_size; i < end * slice_size; ++i) {
+            mask[i] = mask[i] == OUTSIDE ? 0 : 1;
+        }
+    });
+}
+
+SkeletonSettings skeleton::get_default_settings()
+{
+    SkeletonSettings settings = {};
+    settings.threshold = 1.0f;
+    settings.fill_cavities = true;
+    settings.min_branch_length = 2.0f;
+    settings.voxel_size_x = 1.0f;
+    settings.voxel_size_y = 1.0f;
+    settings.voxel_size_z = 1.0f;
+    settings.origin_x = 0.0f;
+    settings.origin_y = 0.0f;
+    settings.origin_z = 0.0f;
+    return settings;
+}
+
+uint32_t skeleton::thin(Volume *field, SkeletonSettings settings, uint8_t *mask)
+{
+    GridShape shape = get_grid_shape(field->width, field->height, field->depth);
+    size_t slice_size = size_t(shape.width) * shape.height;
+    uint32_t thread_count = jobs::get_thread_count();
+
+    jobs::parallel_for(shape.depth, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (size_t i = begin * slice_size; i < end * slice_size; ++i) {
+            mask[i] = field->data[i] >= settings.threshold ? 1 : 0;
+        }
+    });
+    if (settings.fill_cavities)
+        fill_cavities(mask, &shape);
+
+    // Border directions in the order -x, +x, -y, +y, -z, +z
+    const uint32_t border_positions[6] = { 12, 14, 10, 16, 4, 22 };
+    uint32_t *slice_counts = memory::alloc_heap<uint32_t>(shape.depth * 8);
+    uint32_t *slice_offsets = memory::alloc_heap<uint32_t>(shape.depth * 8);
+    uint64_t *thread_deleted = memory::alloc_heap<uint64_t>(thread_count);
+    uint32_t iteration = 0;
+
+    while (true) {
+        // Collect border voxels, bucketed by parity sub-field
+        auto scan_border = [&](uint32_t *candidates) {
+            jobs::parallel_for(shape.depth, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+                for (uint32_t z = begin; z < end; ++z) {
+                    uint32_t counts[8] = {};
+                    for (uint32_t y = 0; y < shape.height; ++y) {
+                        for (uint32_t x = 0; x < shape.width; ++x) {
+                            size_t index = z * slice_size + size_t(y) * shape.width + x;
+                            if (!mask[index])
+                                continue;
+                            bool border = x == 0 || y == 0 || z == 0 || x + 1 == shape.width || y + 1 == shape.height || z + 1 == shape.depth
+                                || !mask[index - 1] || !mask[index + 1] || !mask[index - shape.width] || !mask[index + shape.width]
+                                || !mask[index - slice_size] || !mask[index + slice_size];
+                            if (!border)
+                                continue;
+                            uint32_t subfield = (x & 1) | ((y & 1) << 1) | ((z & 1) << 2);
+                            if (candidates)
+                                candidates[slice_offsets[z * 8 + subfield] + counts[subfield]] = uint32_t(index);
+                            ++counts[subfield];
+                        }
+                    }
+                    if (!candidates)
+                        memcpy(slice_counts + z * 8, counts, sizeof(counts));
+                }
+            });
+        };
+        scan_border(NULL);
+
+        uint32_t subfield_begin[9] = {};
+        uint32_t total = 0;
+        for (uint32_t s = 0; s < 8; ++s) {
+            subfield_begin[s] = total;
+            for (uint32_t z = 0; z < shape.depth; ++z) {
+                slice_offsets[z * 8 + s] = total;
+                total += slice_counts[z * 8 + s];
+            }
+        }
+        subfield_begin[8] = total;
+        if (total == 0)
+            break;
+        uint32_t *candidates = memory::alloc_heap<uint32_t>(total);
+        scan_border(candidates);
+
+        memset(thread_deleted, 0, thread_count * sizeof(uint64_t));
+        for (uint32_t direction = 0; direction < 6; ++direction) {
+            uint32_t border_bit = 1u << border_positions[direction];
+            for (uint32_t s = 0; s < 8; ++s) {
+                uint32_t count = subfield_begin[s + 1] - subfield_begin[s];
+                uint32_t *subfield = candidates + subfield_begin[s];
+                jobs::parallel_for(count, 4096, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+                    for (uint32_t c = begin; c < end; ++c) {
+                        uint32_t index = subfield[c];
+                        if (!mask[index])
+                            continue;
+                        uint32_t x, y, z;
+                        get_coordinates(&shape, index, &x, &y, &z);
+                        uint32_t object = get_neighborhood(mask, &shape, index, x, y, z);
+                        // Only voxels exposed in the current direction; end points are kept so that curves do not shrink
+                        if ((object & border_bit) || get_bit_count(object) <= 1)
+                            continue;
+                        if (is_simple(object)) {
+                            mask[index] = 0;
+                            ++thread_deleted[thread_index];
+                        }
+                    }
+                });
+            }
+        }
+        memory::free_heap(candidates);
+        ++iteration;
+
+        uint64_t deleted = 0;
+        for (uint32_t t = 0; t < thread_count; ++t) {
+            deleted += thread_deleted[t];
+        }
+        if (deleted == 0)
+            break;
+    }
+
+    memory::free_heap(slice_counts);
+    memory::free_heap(slice_offsets);
+    memory::free_heap(thread_deleted);
+    return iteration;
+}
+
+// Index of `voxel` in the sorted voxel list, or UINT32_MAX
+static uint32_t find_voxel(uint32_t *voxels, uint32_t count, uint32_t voxel)
+{
+    uint32_t lower = 0, upper = count;
+    while (lower < upper) {
+        uint32_t middle = lower + (upper - lower) / 2;
+        if (voxels[middle] < voxel) lower = middle + 1; else upper = middle;
+    }
+    return lower < count && voxels[lower] == voxel ? lower : UINT32_MAX;
+}
+
+static uint32_t find_root(uint32_t *parents, uint32_t i)
+{
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+SkeletonGraph skeleton::build_graph(uint8_t *mask, Volume *field, SkeletonSettings settings)
+{
+    const NeighborhoodTables &tables = get_tables();
+    GridShape shape = get_grid_shape(field->width, field->height, field->depth);
+    size_t slice_size = size_t(shape.width) * shape.height;
+    uint32_t thread_count = jobs::get_thread_count();
+    SkeletonGraph graph = {};
+
+    float step_lengths[27];
+    for (uint32_t i = 0; i < 27; ++i) {
+        float sx = tables.dx[i] * settings.voxel_size_x;
+        float sy = tables.dy[i] * settings.voxel_size_y;
+        float sz = tables.dz[i] * settings.voxel_size_z;
+        step_lengths[i] = sqrtf(sx * sx + sy * sy + sz * sz);
+    }
+
+    // Classify skeleton voxels by their number of skeleton neighbors
+    uint32_t *slice_node_counts = memory::alloc_heap<uint32_t>(shape.depth + 1);
+    jobs::parallel_for(shape.depth, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t z = begin; z < end; ++z) {
+            uint32_t node_count = 0;
+            for (uint32_t y = 0; y < shape.height; ++y) {
+                for (uint32_t x = 0; x < shape.width; ++x) {
+                    size_t index = z * slice_size + size_t(y) * shape.width + x;
+                    if (!mask[index])
+                        continue;
+                    uint32_t degree = get_bit_count(get_neighborhood(mask, &shape, index, x, y, z));
+                    if (degree == 0) { // Isolated voxels carry no network information
+                        mask[index] = SKELETON_EMPTY;
+                        continue;
+                    }
+                    if (degree != 2) {
+                        mask[index] = SKELETON_NODE;
+                        ++node_count;
+                    } else {
+                        mask[index] = SKELETON_REGULAR;
+                    }
+                }
+            }
+            slice_node_counts[z] = node_count;
+        }
+    });
+
+    // Sorted list of node voxels
+    uint32_t node_voxel_count = 0;
+    for (uint32_t z = 0; z < shape.depth; ++z) {
+        uint32_t count = slice_node_counts[z];
+        slice_node_counts[z] = node_voxel_count;
+        node_voxel_count += count;
+    }
+    uint32_t *node_voxels = memory::alloc_heap<uint32_t>(node_voxel_count + 1);
+    jobs::parallel_for(shape.depth, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t z = begin; z < end; ++z) {
+            uint32_t offset = slice_node_counts[z];
+            for (size_t i = z * slice_size; i < (z + 1) * slice_size; ++i) {
+                if (mask[i] == SKELETON_NODE)
+                    node_voxels[offset++] = uint32_t(i);
+            }
+        }
+    });
+    memory::free_heap(slice_node_counts);
+
+    // Merge adjacent node voxels into clusters
+    uint32_t *parents = memory::alloc_heap<uint32_t>(node_voxel_count + 1);
+    for (uint32_t i = 0; i < node_voxel_count; ++i) {
+        parents[i] = i;
+    }
+    for (uint32_t i = 0; i < node_voxel_count; ++i) {
+        uint32_t x, y, z;
+        get_coordinates(&shape, node_voxels[i], &x, &y, &z);
+        uint32_t neighbors = get_neighborhood(mask, &shape, node_voxels[i], x, y, z);
+        for (uint32_t bits = neighbors & ~((2u << NEIGHBORHOOD_CENTER) - 1); bits; bits &= bits - 1) {
+            size_t neighbor = size_t(int64_t(node_voxels[i]) + shape.offsets[get_lowest_bit_index(bits)]);
+            if (mask[neighbor] != SKELETON_NODE)
+                continue;
+            uint32_t a = find_root(parents, i);
+            uint32_t b = find_root(parents, find_voxel(node_voxels, node_voxel_count, uint32_t(neighbor)));
+            if (a != b)
+                parents[a > b ? a : b] = a < b ? a : b;
+        }
+    }
+    Array<SkeletonNode> nodes = array::get<SkeletonNode>(node_voxel_count + 1);
+    uint32_t *voxel_nodes = memory::alloc_heap<uint32_t>(node_voxel_count + 1); // Node id of every node voxel
+    for (uint32_t i = 0; i < node_voxel_count; ++i) {
+        uint32_t root = find_root(parents, i);
+        if (root == i) {
+            voxel_nodes[i] = nodes.count;
+            array::add(&nodes, SkeletonNode{});
+        } else {
+            voxel_nodes[i] = voxel_nodes[root]; // Roots are the smallest index of their cluster, so already assigned
+        }
+        uint32_t x, y, z;
+        get_coordinates(&shape, node_voxels[i], &x, &y, &z);
+        SkeletonNode *node = &nodes[voxel_nodes[i]];
+        node->x += x + 0.5f;
+        node->y += y + 0.5f;
+        node->z += z + 0.5f;
+        ++node->voxel_count;
+    }
+    memory::free_heap(parents);
+
+    // Trace the chains of regular voxels leaving every node voxel
+    Array<SkeletonEdge> edges = array::get<SkeletonEdge>(nodes.count + 1);
+    Array<uint32_t> edge_voxels = array::get<uint32_t>(nodes.count + 1); // First chain voxel of every edge
+    Array<uint32_t> loop_voxels = array::get<uint32_t>(16); // Nodes created for closed loops without junctions, sorted
+    Array<uint32_t> loop_nodes = array::get<uint32_t>(16);
+    auto get_node = [&](size_t voxel) {
+        uint32_t i = find_voxel(node_voxels, node_voxel_count, uint32_t(voxel));
+        if (i != UINT32_MAX)
+            return voxel_nodes[i];
+        return loop_nodes[find_voxel(loop_voxels.data, loop_voxels.count, uint32_t(voxel))];
+    };
+    auto trace_from = [&](size_t start) {
+        uint32_t start_node = get_node(start);
+        uint32_t x, y, z;
+        get_coordinates(&shape, start, &x, &y, &z);
+        uint32_t neighbors = get_neighborhood(mask, &shape, start, x, y, z);
+        for (; neighbors; neighbors &= neighbors - 1) {
+            uint32_t direction = get_lowest_bit_index(neighbors);
+            size_t current = size_t(int64_t(start) + shape.offsets[direction]);
+            if (mask[current] != SKELETON_REGULAR)
+                continue;
+
+            SkeletonEdge edge = {};
+            edge.from = start_node;
+            edge.to = UINT32_MAX;
+            edge.length = step_lengths[direction];
+            size_t first = current;
+            size_t previous = start;
+            while (true) {
+                mask[current] = SKELETON_VISITED;
+                edge.mean_density += field->data[current];
+                ++edge.voxel_count;
+
+                uint32_t cx, cy, cz;
+                get_coordinates(&shape, current, &cx, &cy, &cz);
+                uint32_t next_bits = get_neighborhood(mask, &shape, current, cx, cy, cz);
+                size_t next = SIZE_MAX;
+                uint32_t next_direction = 0;
+                for (; next_bits; next_bits &= next_bits - 1) {
+                    uint32_t d = get_lowest_bit_index(next_bits);
+                    size_t candidate = size_t(int64_t(current) + shape.offsets[d]);
+                    if (candidate == previous)
+                        continue;
+                    if (mask[candidate] == SKELETON_NODE) {
+                        edge.to = get_node(candidate);
+                        edge.length += step_lengths[d];
+                        break;
+                    }
+                    if (mask[candidate] == SKELETON_REGULAR && next == SIZE_MAX) {
+                        next = candidate;
+                        next_direction = d;
+                    }
+                }
+                if (edge.to != UINT32_MAX || next == SIZE_MAX)
+                    break;
+                edge.length += step_lengths[next_direction];
+                previous = current;
+                current = next;
+            }
+            if (edge.to == UINT32_MAX)
+                continue; // Dead end without a node, cannot occur in a clean skeleton
+            edge.mean_density /= float(edge.voxel_count);
+            array::add(&edges, edge);
+            array::add(&edge_voxels, uint32_t(first));
+        }
+    };
+    for (uint32_t i = 0; i < node_voxel_count; ++i) {
+        trace_from(node_voxels[i]);
+    }
+    // Remaining regular voxels form loops without any junction, break each at its first voxel
+    for (uint32_t z = 0; z < shape.depth; ++z) {
+        for (size_t i = z * slice_size; i < (z + 1) * slice_size; ++i) {
+            if (mask[i] != SKELETON_REGULAR)
+                continue;
+            uint32_t x, y, loop_z;
+            get_coordinates(&shape, i, &x, &y, &loop_z);
+            mask[i] = SKELETON_NODE;
+            array::add(&loop_voxels, uint32_t(i));
+            array::add(&loop_nodes, nodes.count);
+            array::add(&nodes, SkeletonNode{ x + 0.5f, y + 0.5f, loop_z + 0.5f, 1, 0 });
+            trace_from(i);
+        }
+    }
+
+    // Prune short terminal branches and short self-loops, then drop nodes left without edges
+    for (uint32_t e = 0; e < edges.count; ++e) {
+        ++nodes[edges[e].from].degree;
+        ++nodes[edges[e].to].degree;
+    }
+    uint32_t kept_edges = 0;
+    for (uint32_t e = 0; e < edges.count; ++e) {
+        SkeletonEdge edge = edges[e];
+        bool terminal = nodes[edge.from].degree == 1 || nodes[edge.to].degree == 1 || edge.from == edge.to;
+        if (terminal && edge.length < settings.min_branch_length) {
+            --nodes[edge.from].degree;
+            --nodes[edge.to].degree;
+            continue;
+        }
+        edge_voxels[kept_edges] = edge_voxels[e];
+        edges[kept_edges++] = edge;
+    }
+    edges.count = kept_edges;
+
+    // Mark the voxels left in the graph: the chains of the remaining edges and the clusters of nodes still attached to one.
+    // Chain voxels have exactly two skeleton neighbors, so each chain is walked from its first voxel without branching.
+    for (uint32_t e = 0; e < edges.count; ++e) {
+        size_t current = edge_voxels[e];
+        while (current != SIZE_MAX) {
+            mask[current] = SKELETON_KEPT;
+            uint32_t x, y, z;
+            get_coordinates(&shape, current, &x, &y, &z);
+            size_t next = SIZE_MAX;
+            for (uint32_t bits = get_neighborhood(mask, &shape, current, x, y, z); bits; bits &= bits - 1) {
+                size_t candidate = size_t(int64_t(current) + shape.offsets[get_lowest_bit_index(bits)]);
+                if (mask[candidate] == SKELETON_VISITED) {
+                    next = candidate;
+                    break;
+                }
+            }
+            current = next;
+        }
+    }
+    for (uint32_t i = 0; i < node_voxel_count; ++i) {
+        if (nodes[voxel_nodes[i]].degree > 0)
+            mask[node_voxels[i]] = SKELETON_KEPT;
+    }
+    for (uint32_t i = 0; i < loop_voxels.count; ++i) {
+        if (nodes[loop_nodes[i]].degree > 0)
+            mask[loop_voxels[i]] = SKELETON_KEPT;
+    }
+    array::release(&edge_voxels);
+    memory::free_heap(node_voxels);
+    memory::free_heap(voxel_nodes);
+    array::release(&loop_voxels);
+    array::release(&loop_nodes);
+
+    // Merge edges through nodes of degree 2 (pass-through clusters on staircase diagonals or left over by the pruning)
+    uint32_t *incidence_offsets = memory::alloc_heap<uint32_t>(nodes.count + 1);
+    uint32_t *incidence = memory::alloc_heap<uint32_t>(2 * edges.count + 1);
+    bool *edge_alive = memory::alloc_heap<bool>(edges.count + 1);
+    incidence_offsets[0] = 0;
+    for (uint32_t n = 0; n < nodes.count; ++n) {
+        incidence_offsets[n + 1] = incidence_offsets[n] + nodes[n].degree;
+        nodes[n].degree = 0;
+    }
+    for (uint32_t e = 0; e < edges.count; ++e) {
+        incidence[incidence_offsets[edges[e].from] + nodes[edges[e].from].degree++] = e;
+        incidence[incidence_offsets[edges[e].to] + nodes[edges[e].to].degree++] = e;
+        edge_alive[e] = true;
+    }
+    for (uint32_t n = 0; n < nodes.count; ++n) {
+        if (nodes[n].degree != 2)
+            continue;
+        uint32_t *incident = incidence + incidence_offsets[n];
+        uint32_t first = incident[0], second = incident[1];
+        if (first == second)
+            continue; // Self-loop
+        SkeletonEdge *a = &edges[first];
+        SkeletonEdge *b = &edges[second];
+        uint32_t a_other = a->from == n ? a->to : a->from;
+        uint32_t b_other = b->from == n ? b->to : b->from;
+        float voxel_count = float(a->voxel_count + b->voxel_count);
+        a->mean_density = (a->mean_density * a->voxel_count + b->mean_density * b->voxel_count) / voxel_count;
+        a->voxel_count += b->voxel_count;
+        a->length += b->length;
+        a->from = a_other;
+        a->to = b_other;
+        edge_alive[second] = false;
+        nodes[n].degree = 0;
+        uint32_t *other_incident = incidence + incidence_offsets[b_other];
+        for (uint32_t i = 0; i < nodes[b_other].degree; ++i) {
+            if (other_incident[i] == second) {
+                other_incident[i] = first;
+                break;
+            }
+        }
+    }
+    kept_edges = 0;
+    for (uint32_t e = 0; e < edges.count; ++e) {
+        if (edge_alive[e])
+            edges[kept_edges++] = edges[e];
+    }
+    edges.count = kept_edges;
+    memory::free_heap(incidence_offsets);
+    memory::free_heap(incidence);
+    memory::free_heap(edge_alive);
+
+    uint32_t *node_remap = memory::alloc_heap<uint32_t>(nodes.count + 1);
+    uint32_t kept_nodes = 0;
+    for (uint32_t n = 0; n < nodes.count; ++n) {
+        SkeletonNode node = nodes[n];
+        if (node.degree == 0) {
+            node_remap[n] = UINT32_MAX;
+            continue;
+        }
+        node.x /= float(node.voxel_count);
+        node.y /= float(node.voxel_count);
+        node.z /= float(node.voxel_count);
+        node_remap[n] = kept_nodes;
+        nodes[kept_nodes++] = node;
+    }
+    for (uint32_t e = 0; e < edges.count; ++e) {
+        edges[e].from = node_remap[edges[e].from];
+        edges[e].to = node_remap[edges[e].to];
+    }
+    memory::free_heap(node_remap);
+
+    // Mask back to plain skeleton voxels, clearing pruned branches, isolated voxels and chains that never reached a node
+    uint64_t *thread_voxels = memory::alloc_heap<uint64_t>(thread_count);
+    memset(thread_voxels, 0, thread_count * sizeof(uint64_t));
+    jobs::parallel_for(shape.depth, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        for (size_t i = begin * slice_size; i < end * slice_size; ++i) {
+            mask[i] = mask[i] == SKELETON_KEPT ? 1 : 0;
+            thread_voxels[thread_index] += mask[i];
+        }
+    });
+    for (uint32_t t = 0; t < thread_count; ++t) {
+        graph.skeleton_voxel_count += thread_voxels[t];
+    }
+    memory::free_heap(thread_voxels);
+
+    graph.nodes = nodes.data;
+    graph.node_count = kept_nodes;
+    graph.edges = edges.data;
+    graph.edge_count = edges.count;
+    return graph;
+}
+
+void skeleton::release(SkeletonGraph *graph)
+{
+    memory::free_heap(graph->nodes);
+    memory::free_heap(graph->edges);
+    *graph = SkeletonGraph{};
+}
+
+bool skeleton::save(SkeletonGraph *graph, uint8_t *mask, Volume *field, SkeletonSettings settings, const char *filename)
+{
+    std::string name(filename);
+    std::ofstream bin_file((name + ".bin").c_str(), std::ios::out | std::ios::binary);
+    if (!bin_file.is_open()) {
+        printf("Failed to write skeleton to %s.bin\n", filename);
+        return false;
+    }
+    bin_file.write((char*)mask, volume::get_voxel_count(field));
+    bin_file.close();
+
+    std::ofstream nodes_file((name + "_nodes.csv").c_str(), std::ios::out);
+    nodes_file.precision(7);
+    nodes_file << "Node,X world,Y world,Z world,X grid [vox],Y grid [vox],Z grid [vox],Degree,Voxels" << std::endl;
+    for (uint32_t n = 0; n < graph->node_count; ++n) {
+        SkeletonNode *node = graph->nodes + n;
+        nodes_file << n << ","
+            << settings.origin_x + node->x * settings.voxel_size_x << ","
+            << settings.origin_y + node->y * settings.voxel_size_y << ","
+            << settings.origin_z + node->z * settings.voxel_size_z << ","
+            << node->x << ","
+            << node->y << ","
+            << node->z << ","
+            << node->degree << ","
+            << node->voxel_count << std::endl;
+    }
+    nodes_file.close();
+
+    std::ofstream edges_file((name + "_edges.csv").c_str(), std::ios::out);
+    edges_file.precision(7);
+    edges_file << "From,To,Length world,Mean density,Voxels" << std::endl;
+    for (uint32_t e = 0; e < graph->edge_count; ++e) {
+        SkeletonEdge *edge = graph->edges + e;
+        edges_file << edge->from << ","
+            << edge->to << ","
+            << edge->length << ","
+            << edge->mean_density << ","
+            << edge->voxel_count << std::endl;
+    }
+    edges_file.close();
+    return true;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include "volume.h"
+
+struct SkeletonSettings
+{
+    float threshold; // Voxels with field >= threshold form the object that gets thinned
+    bool fill_cavities; // Fill enclosed background pockets first, otherwise they survive thinning as closed surfaces
+    float min_branch_length; // Terminal branches shorter than this are pruned from the graph [world units]
+    float voxel_size_x; // World size of a voxel and position of the grid corner, used for lengths and exported positions
+    float voxel_size_y;
+    float voxel_size_z;
+    float origin_x;
+    float origin_y;
+    float origin_z;
+};
+
+// Junction (3+ branches) or end point of the skeleton; adjacent junction voxels are merged into a single node
+struct SkeletonNode
+{
+    float x; // Centroid in grid coordinates
+    float y;
+    float z;
+    uint32_t voxel_count;
+    uint32_t degree; // Number of incident edges after pruning
+};
+
+// Spine segment between two nodes
+struct SkeletonEdge
+{
+    uint32_t from;
+    uint32_t to;
+    uint32_t voxel_count; // Interior voxels of the segment (pass-through node voxels excluded)
+    float length; // Polyline length [world units]
+    float mean_density; // Mean field value over the interior voxels
+};
+
+struct SkeletonGraph
+{
+    SkeletonNode *nodes;
+    uint32_t node_count;
+    SkeletonEdge *edges;
+    uint32_t edge_count;
+    uint64_t skeleton_voxel_count; // Voxels left at 1 in the mask
+};
+
+// `skeleton` namespace extracts the filament network from a thresholded grid as a graph of spine segments and junctions
+namespace skeleton
+{
+    SkeletonSettings get_default_settings();
+
+    // Curve thinning of the thresholded field into a one voxel thick, topology-preserving skeleton (1 = skeleton in `mask`).
+    // Border voxels are removed in six directional sub-iterations; within each, the 8 parity sub-fields are processed one
+    // after another and the voxels of a sub-field in parallel (they are never 26-adjacent, so deletions cannot interact).
+    // Returns the number of thinning iterations.
+    uint32_t thin(Volume *field, SkeletonSettings settings, uint8_t *mask);
+
+    // Trace the skeleton into nodes and edges, measuring edge lengths and mean densities along `field`.
+    // `mask` is used as traversal state and afterwards holds 1 only for the voxels of the returned edges and nodes: pruned
+    // branches, isolated voxels and unattached chains are cleared, so the grid matches the node and edge lists.
+    SkeletonGraph build_graph(uint8_t *mask, Volume *field, SkeletonSettings settings);
+
+    // Release graph memory
+    void release(SkeletonGraph *graph);
+
+    // Write nodes (filename_nodes.csv), edges (filename_edges.csv) and the skeleton as a raw uint8 grid (filename.bin)
+    bool save(SkeletonGraph *graph, uint8_t *mask, Volume *field, SkeletonSettings settings, const char *filename);
+}
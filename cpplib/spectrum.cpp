@@ -0,0 +1,338 @@
+#include "spectrum.h"
+#include "fft.h"
+#include "memory.h"
+#include "jobs.h"
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <fstream>
+#include <mutex>
+
+static const double SPECTRUM_PI = 3.14159265358979323846;
+
+struct SpectrumBins
+{
+    double *k_sum;
+    double *count;
+    double *power_a;
+    double *power_b;
+    double *power_cross;
+};
+
+static int32_t fold_frequency(uint32_t i, uint32_t n)
+{
+    return i <= n / 2 ? int32_t(i) : int32_t(i) - int32_t(n);
+}
+
+PowerSpectrumSettings spectrum::get_default_settings(float box_size_x, float box_size_y, float box_size_z)
+{
+    PowerSpectrumSettings settings = {};
+    settings.box_size_x = box_size_x;
+    settings.box_size_y = box_size_y;
+    settings.box_size_z = box_size_z;
+    settings.bin_count = 0;
+    settings.memory_budget = size_t(4) * 1024 * 1024 * 1024;
+    settings.scratch_path = "export/power_spectrum_scratch.tmp";
+    return settings;
+}
+
+PowerSpectrum spectrum::compute(Volume *field_a, Volume *field_b, PowerSpectrumSettings settings)
+{
+    const uint32_t nx = field_a->width;
+    const uint32_t ny = field_a->height;
+    const uint32_t nz = field_a->depth;
+    const uint32_t hx = nx / 2 + 1;
+    const uint32_t field_count = field_b ? 2 : 1;
+    const uint32_t thread_count = jobs::get_thread_count();
+
+    // Slice layout of the intermediate spectra: [y][field][kx]
+    const size_t row_elements = size_t(field_count) * hx;
+    const size_t slice_elements = row_elements * ny;
+    const size_t total_bytes = slice_elements * nz * sizeof(Complex);
+    const bool out_of_core = total_bytes > settings.memory_budget;
+
+    FFTPlan plan_x = fft::get_plan(nx);
+    FFTPlan plan_y = fft::get_plan(ny);
+    FFTPlan plan_z = fft::get_plan(nz);
+    uint32_t scratch_size = fft::get_scratch_size(&plan_x);
+    if (fft::get_scratch_size(&plan_y) > scratch_size) scratch_size = fft::get_scratch_size(&plan_y);
+    if (fft::get_scratch_size(&plan_z) > scratch_size) scratch_size = fft::get_scratch_size(&plan_z);
+
+    double mean_a = volume::get_mean(field_a);
+    double mean_b = field_b ? volume::get_mean(field_b) : 1.0;
+    float inv_mean_a = mean_a > 0.0 ? float(1.0 / mean_a) : 0.0f;
+    float inv_mean_b = mean_b > 0.0 ? float(1.0 / mean_b) : 0.0f;
+
+    // Per-thread scratch: FFT scratch, two real rows, a column/pencil buffer per field
+    uint32_t pencil_length = ny > nz ? ny : nz;
+    size_t thread_scratch_floats = 2 * size_t(scratch_size) + 2 * size_t(nx) + 2 * size_t(pencil_length) * field_count;
+    float *thread_scratch = memory::alloc_heap<float>(thread_count * thread_scratch_floats);
+
+    Complex *spectra = NULL;
+    std::fstream scratch_file;
+    std::mutex scratch_mutex;
+    if (out_of_core) {
+        scratch_file.open(settings.scratch_path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!scratch_file.is_open()) {
+            printf("Failed to open spectrum scratch file %s\n", settings.scratch_path);
+            return PowerSpectrum{};
+        }
+    } else {
+        spectra = memory::alloc_heap<Complex>(slice_elements * nz);
+    }
+
+    // Pass 1: real-to-complex transform along x and complex transform along y, one z-slice per job
+    Complex *slice_buffers = out_of_core ? memory::alloc_heap<Complex>(thread_count * slice_elements) : NULL;
+    jobs::parallel_for(nz, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        float *scratch_base = thread_scratch + thread_index * thread_scratch_floats;
+        Complex *fft_scratch = (Complex*)scratch_base;
+        float *row_a = scratch_base + 2 * size_t(scratch_size);
+        float *row_b = row_a + nx;
+        Complex *column = (Complex*)(row_b + nx);
+
+        for (uint32_t z = begin; z < end; ++z) {
+            Complex *slice = out_of_core ? slice_buffers + thread_index * slice_elements : spectra + z * slice_elements;
+            float *source_a = field_a->data + size_t(z) * nx * ny;
+            float *source_b = field_b ? field_b->data + size_t(z) * nx * ny : NULL;
+
+            for (uint32_t y = 0; y < ny; ++y) {
+                if (field_b) {
+                    // Both fields' rows go through a single complex transform
+                    for (uint32_t x = 0; x < nx; ++x) {
+                        row_a[x] = source_a[y * nx + x] * inv_mean_a - 1.0f;
+                        row_b[x] = source_b[y * nx + x] * inv_mean_b - 1.0f;
+                    }
+                    fft::transform_real_pair(&plan_x, row_a, row_b, slice + y * row_elements, slice + y * row_elements + hx, fft_scratch);
+                } else {
+                    // Pair consecutive rows of the single field
+                    uint32_t y_next = y + 1 < ny ? y + 1 : y;
+                    for (uint32_t x = 0; x < nx; ++x) {
+                        row_a[x] = source_a[y * nx + x] * inv_mean_a - 1.0f;
+                        row_b[x] = source_a[y_next * nx + x] * inv_mean_a - 1.0f;
+                    }
+                    fft::transform_real_pair(&plan_x, row_a, row_b, slice + y * row_elements,
+                                             y_next != y ? slice + y_next * row_elements : NULL, fft_scratch);
+                    y = y_next;
+                }
+            }
+
+            for (uint32_t f = 0; f < field_count; ++f) {
+                for (uint32_t kx = 0; kx < hx; ++kx) {
+                    for (uint32_t y = 0; y < ny; ++y) {
+                        column[y] = slice[y * row_elements + f * hx + kx];
+                    }
+                    fft::transform(&plan_y, column, fft_scratch);
+                    for (uint32_t y = 0; y < ny; ++y) {
+                        slice[y * row_elements + f * hx + kx] = column[y];
+                    }
+                }
+            }
+
+            if (out_of_core) {
+                std::lock_guard<std::mutex> lock(scratch_mutex);
+                scratch_file.seekp(std::streamoff(z) * std::streamoff(slice_elements * sizeof(Complex)));
+                scratch_file.write((char*)slice, slice_elements * sizeof(Complex));
+            }
+        }
+    });
+    if (slice_buffers) memory::free_heap(slice_buffers);
+
+    // Spherical bins: one fundamental mode of the longest side wide, up to the Nyquist frequency of the coarsest axis
+    const double kfx = 2.0 * SPECTRUM_PI / settings.box_size_x;
+    const double kfy = 2.0 * SPECTRUM_PI / settings.box_size_y;
+    const double kfz = 2.0 * SPECTRUM_PI / settings.box_size_z;
+    double bin_width = kfx < kfy ? kfx : kfy;
+    bin_width = bin_width < kfz ? bin_width : kfz;
+    double k_nyquist = kfx * (nx / 2);
+    if (kfy * (ny / 2) < k_nyquist) k_nyquist = kfy * (ny / 2);
+    if (kfz * (nz / 2) < k_nyquist) k_nyquist = kfz * (nz / 2);
+    uint32_t bin_count = settings.bin_count;
+    if (bin_count == 0) {
+        bin_count = uint32_t(k_nyquist / bin_width);
+        if (bin_count < 1) bin_count = 1;
+    } else {
+        bin_width = k_nyquist / double(bin_count);
+    }
+
+    const uint32_t bin_array_count = 5;
+    double *thread_bins = memory::alloc_heap<double>(thread_count * bin_count * bin_array_count);
+    memset(thread_bins, 0, thread_count * bin_count * bin_array_count * sizeof(double));
+    auto get_bins = [&](uint32_t thread_index) {
+        double *base = thread_bins + thread_index * bin_count * bin_array_count;
+        SpectrumBins bins = { base, base + bin_count, base + 2 * bin_count, base + 3 * bin_count, base + 4 * bin_count };
+        return bins;
+    };
+
+    // Pass 2: z-transforms of pencils, block of y rows at a time, binned as soon as they are transformed
+    uint32_t block_rows = ny;
+    if (out_of_core) {
+        size_t bytes_per_row = size_t(nz) * row_elements * sizeof(Complex);
+        block_rows = uint32_t((settings.memory_budget / 2) / bytes_per_row);
+        block_rows = block_rows < 1 ? 1 : (block_rows > ny ? ny : block_rows);
+    }
+    Complex *block = out_of_core ? memory::alloc_heap<Complex>(size_t(block_rows) * row_elements * nz) : spectra;
+    const double normalization = double(settings.box_size_x) * settings.box_size_y * settings.box_size_z
+                               / (double(nx) * ny * nz) / (double(nx) * ny * nz);
+
+    for (uint32_t y0 = 0; y0 < ny; y0 += block_rows) {
+        uint32_t y1 = y0 + block_rows < ny ? y0 + block_rows : ny;
+        size_t block_slice_elements = out_of_core ? size_t(y1 - y0) * row_elements : slice_elements;
+        size_t block_row_offset = out_of_core ? 0 : size_t(y0) * row_elements;
+        if (out_of_core) {
+            for (uint32_t z = 0; z < nz; ++z) {
+                scratch_file.seekg(std::streamoff(z) * std::streamoff(slice_elements * sizeof(Complex))
+                                 + std::streamoff(size_t(y0) * row_elements * sizeof(Complex)));
+                scratch_file.read((char*)(block + z * block_slice_elements), block_slice_elements * sizeof(Complex));
+            }
+        }
+
+        uint32_t pencil_count = (y1 - y0) * hx;
+        jobs::parallel_for(pencil_count, 64, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+            float *scratch_base = thread_scratch + thread_index * thread_scratch_floats;
+            Complex *fft_scratch = (Complex*)scratch_base;
+            Complex *pencil_a = (Complex*)(scratch_base + 2 * size_t(scratch_size) + 2 * size_t(nx));
+            Complex *pencil_b = pencil_a + nz;
+            SpectrumBins bins = get_bins(thread_index);
+
+            for (uint32_t pencil = begin; pencil < end; ++pencil) {
+                uint32_t y = y0 + pencil / hx;
+                uint32_t kx = pencil % hx;
+                size_t offset = block_row_offset + size_t(y - y0) * row_elements + kx;
+                for (uint32_t z = 0; z < nz; ++z) {
+                    pencil_a[z] = block[z * block_slice_elements + offset];
+                    if (field_b) pencil_b[z] = block[z * block_slice_elements + offset + hx];
+                }
+                fft::transform(&plan_z, pencil_a, fft_scratch);
+                if (field_b) fft::transform(&plan_z, pencil_b, fft_scratch);
+
+                // Modes with 0 < kx < nx/2 stand in for their Hermitian twins
+                double weight = (kx == 0 || (nx % 2 == 0 && kx == nx / 2)) ? 1.0 : 2.0;
+                double k_x = kfx * kx;
+                double k_y = kfy * fold_frequency(y, ny);
+                for (uint32_t z = 0; z < nz; ++z) {
+                    double k_z = kfz * fold_frequency(z, nz);
+                    double k = sqrt(k_x * k_x + k_y * k_y + k_z * k_z);
+                    uint32_t bin = uint32_t(k / bin_width + 0.5) - 1; // Bin i is centered at (i + 1) * bin_width
+                    if (k < 0.5 * bin_width || bin >= bin_count)
+                        continue;
+                    Complex a = pencil_a[z];
+                    bins.k_sum[bin] += weight * k;
+                    bins.count[bin] += weight;
+                    bins.power_a[bin] += weight * (double(a.re) * a.re + double(a.im) * a.im);
+                    if (field_b) {
+                        Complex b = pencil_b[z];
+                        bins.power_b[bin] += weight * (double(b.re) * b.re + double(b.im) * b.im);
+                        bins.power_cross[bin] += weight * (double(a.re) * b.re + double(a.im) * b.im);
+                    }
+                }
+            }
+        });
+    }
+
+    // Merge per-thread bins and normalize
+    PowerSpectrum result = {};
+    result.bin_count = bin_count;
+    result.out_of_core = out_of_core;
+    result.k = memory::alloc_heap<double>(bin_count);
+    result.mode_count = memory::alloc_heap<double>(bin_count);
+    result.power_a = memory::alloc_heap<double>(bin_count);
+    result.power_b = memory::alloc_heap<double>(bin_count);
+    result.power_cross = memory::alloc_heap<double>(bin_count);
+    result.r = memory::alloc_heap<double>(bin_count);
+    result.correlation_a = memory::alloc_heap<double>(bin_count);
+    result.correlation_b = memory::alloc_heap<double>(bin_count);
+    result.correlation_cross = memory::alloc_heap<double>(bin_count);
+    for (uint32_t i = 0; i < bin_count; ++i) {
+        double k_sum = 0.0, count = 0.0, power_a = 0.0, power_b = 0.0, power_cross = 0.0;
+        for (uint32_t t = 0; t < thread_count; ++t) {
+            SpectrumBins bins = get_bins(t);
+            k_sum += bins.k_sum[i];
+            count += bins.count[i];
+            power_a += bins.power_a[i];
+            power_b += bins.power_b[i];
+            power_cross += bins.power_cross[i];
+        }
+        result.mode_count[i] = count;
+        result.k[i] = count > 0.0 ? k_sum / count : (i + 1) * bin_width;
+        result.power_a[i] = count > 0.0 ? normalization * power_a / count : 0.0;
+        result.power_b[i] = count > 0.0 ? normalization * power_b / count : 0.0;
+        result.power_cross[i] = count > 0.0 ? normalization * power_cross / count : 0.0;
+    }
+
+    // xi(r) = 1/V sum_k P(k) exp(i k.r), evaluated isotropically from the binned modes
+    double box_volume = double(settings.box_size_x) * settings.box_size_y * settings.box_size_z;
+    double box_min = settings.box_size_x < settings.box_size_y ? settings.box_size_x : settings.box_size_y;
+    box_min = box_min < settings.box_size_z ? box_min : settings.box_size_z;
+    double r_width = 0.5 * box_min / double(bin_count);
+    for (uint32_t j = 0; j < bin_count; ++j) {
+        double r = (j + 0.5) * r_width;
+        double xi_a = 0.0, xi_b = 0.0, xi_cross = 0.0;
+        for (uint32_t i = 0; i < bin_count; ++i) {
+            double kr = result.k[i] * r;
+            double sinc = kr > 1.0e-8 ? sin(kr) / kr : 1.0;
+            double modes = result.mode_count[i] * sinc / box_volume;
+            xi_a += modes * result.power_a[i];
+            xi_b += modes * result.power_b[i];
+            xi_cross += modes * result.power_cross[i];
+        }
+        result.r[j] = r;
+        result.correlation_a[j] = xi_a;
+        result.correlation_b[j] = xi_b;
+        result.correlation_cross[j] = xi_cross;
+    }
+
+    if (out_of_core) {
+        memory::free_heap(block);
+        scratch_file.close();
+        remove(settings.scratch_path);
+    } else {
+        memory::free_heap(spectra);
+    }
+    memory::free_heap(thread_bins);
+    memory::free_heap(thread_scratch);
+    fft::release(&plan_x);
+    fft::release(&plan_y);
+    fft::release(&plan_z);
+    return result;
+}
+
+void spectrum::release(PowerSpectrum *spectrum)
+{
+    memory::free_heap(spectrum->k);
+    memory::free_heap(spectrum->mode_count);
+    memory::free_heap(spectrum->power_a);
+    memory::free_heap(spectrum->power_b);
+    memory::free_heap(spectrum->power_cross);
+    memory::free_heap(spectrum->r);
+    memory::free_heap(spectrum->correlation_a);
+    memory::free_heap(spectrum->correlation_b);
+    memory::free_heap(spectrum->correlation_cross);
+    *spectrum = PowerSpectrum{};
+}
+
+bool spectrum::save(PowerSpectrum *spectrum, const char *filename)
+{
+    std::ofstream file(filename, std::ios::out);
+    if (!file.is_open()) {
+        printf("Failed to write power spectrum to %s\n", filename);
+        return false;
+    }
+    file.precision(7);
+    file << "k [1/Mpc],Modes,P_a [Mpc^3],P_b [Mpc^3],P_ab [Mpc^3],r_ab,r [Mpc],xi_a,xi_b,xi_ab" << std::endl;
+    for (uint32_t i = 0; i < spectrum->bin_count; ++i) {
+        double denominator = sqrt(spectrum->power_a[i] * spectrum->power_b[i]);
+        double coefficient = denominator > 0.0 ? spectrum->power_cross[i] / denominator : 0.0;
+        file << spectrum->k[i] << ","
+            << spectrum->mode_count[i] << ","
+            << spectrum->power_a[i] << ","
+            << spectrum->power_b[i] << ","
+            << spectrum->power_cross[i] << ","
+            << coefficient << ","
+            << spectrum->r[i] << ","
+            << spectrum->correlation_a[i] << ","
+            << spectrum->correlation_b[i] << ","
+            << spectrum->correlation_cross[i] << std::endl;
+    }
+    file.close();
+    return true;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "volume.h"
+
+struct PowerSpectrumSettings
+{
+    float box_size_x; // Physical extent of the grid [Mpc]
+    float box_size_y;
+    float box_size_z;
+    uint32_t bin_count; // Number of spherical k (and r) bins, 0 picks one bin per fundamental mode
+    size_t memory_budget; // Bytes of intermediate spectra kept in RAM, larger transforms spill to `scratch_path`
+    const char *scratch_path;
+};
+
+// Spherically binned auto-spectra of two fields (e.g. trace and deposit), their cross-spectrum
+// and the corresponding two-point correlation functions. Spectra of field B are zero when it is not given.
+struct PowerSpectrum
+{
+    uint32_t bin_count;
+    double *k; // Mean wavenumber of the modes in the bin [1/Mpc]
+    double *mode_count; // Number of modes (both Hermitian halves counted)
+    double *power_a; // [Mpc^3]
+    double *power_b;
+    double *power_cross; // Real part of <delta_a delta_b*>
+    double *r; // Bin center of the correlation functions [Mpc]
+    double *correlation_a;
+    double *correlation_b;
+    double *correlation_cross;
+    bool out_of_core; // True when the intermediate spectra went through the scratch file
+};
+
+// `spectrum` namespace computes power spectra of simulation grids with a slab-decomposed 3D FFT
+namespace spectrum
+{
+    PowerSpectrumSettings get_default_settings(float box_size_x, float box_size_y, float box_size_z);
+
+    // Power spectra of the overdensities delta = rho / mean(rho) - 1 of `field_a` and (optionally) `field_b`.
+    // Slices are transformed in x and y in parallel and stored (in RAM or the scratch file), then z-pencils are
+    // transformed block by block and binned directly, so the full 3D spectrum never needs to be resident.
+    PowerSpectrum compute(Volume *field_a, Volume *field_b, PowerSpectrumSettings settings);
+
+    // Release spectrum arrays
+    void release(PowerSpectrum *spectrum);
+
+    // Write the spectrum table as text
+    bool save(PowerSpectrum *spectrum, const char *filename);
+}
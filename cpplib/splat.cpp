@@ -0,0 +1,222 @@
+#include "splat.h"
+#include "memory.h"
+#include "jobs.h"
+#include "maths.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+static const uint32_t MIN_PARTICLE_CHUNK = 1 << 16; // Particles projected and binned by one job
+static const uint32_t CHUNKS_PER_THREAD = 4; // Bounds the per-chunk tile counts of large images
+static const uint32_t MAX_TILE_SIZE = 128;
+static const uint32_t AGENT_INCREMENT = 10; // Counter increments of cs_particles_transform
+static const uint32_t DATA_INCREMENT = 10000;
+static const float GALAXY_WEIGHT_EPSILON = 0.001f; // Data points are skipped at lower galaxy_weight
+static const uint32_t CULLED = 0xffffffff;
+
+static inline float clamp01(float value)
+{
+    return value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+}
+
+static inline float linear_to_srgb(float value)
+{
+    value = clamp01(value);
+    return value <= 0.0031308f ? 12.92f * value : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+}
+
+// Color of a pixel counter: cs_particles_blit scales agent-only counters, ps_particles_color shows data points in red
+static Vector3 get_color(uint32_t counter, float sample_weight)
+{
+    float v = float(counter);
+    if (v < 10000.0f)
+        v *= sample_weight;
+    if (v > 9999.0f)
+        return Vector3(1.0f - expf(-0.0001f * v), 0.0f, 0.0f);
+    v /= 3.0f;
+    return Vector3(0.6f * v, v, 0.7f * v);
+}
+
+static void reserve(uint32_t **buffer, uint32_t *capacity, uint32_t count)
+{
+    if (count <= *capacity)
+        return;
+    memory::free_heap(*buffer);
+    *buffer = memory::alloc_heap<uint32_t>(count);
+    *capacity = count;
+}
+
+void splat::render(SplatParticles *particles, VolpathSettings *settings, SplatBuffers *buffers, VolpathImage *image)
+{
+    uint32_t width = image->width, height = image->height;
+    uint32_t tile_size = settings->tile_size > 0 ? settings->tile_size : 32;
+    tile_size = tile_size < MAX_TILE_SIZE ? tile_size : MAX_TILE_SIZE;
+    uint32_t tiles_x = (width + tile_size - 1) / tile_size;
+    uint32_t tiles_y = (height + tile_size - 1) / tile_size;
+    uint32_t tile_count = tiles_x * tiles_y;
+
+    // Codes hold the tile above the tile-local pixel and the kind bit
+    uint32_t local_bits = 1;
+    while ((1U << (local_bits - 1)) < tile_size * tile_size)
+        ++local_bits;
+    uint32_t local_mask = (1U << local_bits) - 1;
+    if (local_bits >= 32 || uint64_t(tile_count) << local_bits > uint64_t(CULLED)) {
+        printf("Particle image %u x %u is too large for tiles of %u px\n", width, height, tile_size);
+        return;
+    }
+
+    uint32_t thread_count = jobs::get_thread_count();
+    uint32_t chunk_count = (particles->count + MIN_PARTICLE_CHUNK - 1) / MIN_PARTICLE_CHUNK;
+    chunk_count = chunk_count < CHUNKS_PER_THREAD * thread_count ? chunk_count : CHUNKS_PER_THREAD * thread_count;
+    uint32_t chunk_size = chunk_count > 0 ? (particles->count + chunk_count - 1) / chunk_count : 0;
+    if (particles->count > buffers->particle_capacity) {
+        memory::free_heap(buffers->codes);
+        memory::free_heap(buffers->binned);
+        buffers->codes = memory::alloc_heap<uint32_t>(particles->count);
+        buffers->binned = memory::alloc_heap<uint32_t>(particles->count);
+        buffers->particle_capacity = particles->count;
+    }
+    reserve(&buffers->offsets, &buffers->offset_capacity, chunk_count * tile_count);
+    reserve(&buffers->tile_start, &buffers->tile_capacity, tile_count + 1);
+    reserve(&buffers->accumulators, &buffers->accumulator_capacity, thread_count * tile_size * tile_size);
+    uint32_t *codes = buffers->codes, *binned = buffers->binned, *offsets = buffers->offsets, *tile_start = buffers->tile_start;
+
+    // Project the particles as cs_particles_transform does, with the camera of the path tracer
+    float projection[12];
+    Volume grid = {};
+    grid.width = particles->grid_size[0];
+    grid.height = particles->grid_size[1];
+    grid.depth = particles->grid_size[2];
+    volpath::get_camera_projection(settings, &grid, width, height, projection);
+    float grid_size_inv[3] = { 1.0f / float(grid.width), 1.0f / float(grid.height), 1.0f / float(grid.depth) };
+    bool data_visible = settings->galaxy_weight > GALAXY_WEIGHT_EPSILON;
+    jobs::parallel_for(chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t chunk = begin; chunk < end; ++chunk) {
+            uint32_t *counts = offsets + size_t(chunk) * tile_count;
+            memset(counts, 0, tile_count * sizeof(uint32_t));
+            uint32_t first = chunk * chunk_size;
+            uint32_t last = first + chunk_size < particles->count ? first + chunk_size : particles->count;
+            for (uint32_t i = first; i < last; ++i) {
+                codes[i] = CULLED;
+                float x = particles->x[i], y = particles->y[i], z = particles->z[i];
+                bool is_data = particles->t && particles->t[i] < 0.0f;
+                float fx = x * grid_size_inv[0], fy = y * grid_size_inv[1], fz = z * grid_size_inv[2];
+                if ((is_data && !data_visible)
+                    || fx < settings->trim_min[0] || fx > settings->trim_max[0]
+                    || fy < settings->trim_min[1] || fy > settings->trim_max[1]
+                    || fz < settings->trim_min[2] || fz > settings->trim_max[2])
+                    continue;
+                float w = projection[8] * x + projection[9] * y + projection[10] * z + projection[11];
+                if (!(w > 0.0f))
+                    continue;
+                float w_inv = 1.0f / w;
+                float sx = (projection[0] * x + projection[1] * y + projection[2] * z + projection[3]) * w_inv;
+                float sy = (projection[4] * x + projection[5] * y + projection[6] * z + projection[7]) * w_inv;
+                if (!(sx >= 0.0f && sx < float(width) && sy >= 0.0f && sy < float(height)))
+                    continue;
+                uint32_t px = uint32_t(sx), py = uint32_t(sy);
+                px = px < width ? px : width - 1;
+                py = py < height ? py : height - 1;
+                uint32_t tx = px / tile_size, ty = py / tile_size;
+                uint32_t tile = ty * tiles_x + tx;
+                uint32_t local = (py - ty * tile_size) * tile_size + (px - tx * tile_size);
+                codes[i] = (tile << local_bits) | (local << 1) | (is_data ? 1 : 0);
+                ++counts[tile];
+            }
+        }
+    });
+
+    // Exclusive prefix sum in tile order: every chunk gets its own range inside the range of every tile
+    uint32_t binned_count = 0;
+    for (uint32_t tile = 0; tile < tile_count; ++tile) {
+        tile_start[tile] = binned_count;
+        for (uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+            uint32_t *offset = offsets + size_t(chunk) * tile_count + tile;
+            uint32_t count = *offset;
+            *offset = binned_count;
+            binned_count += count;
+        }
+    }
+    tile_start[tile_count] = binned_count;
+
+    // Scatter the codes into the tile ranges, in particle order within every tile
+    jobs::parallel_for(chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t chunk = begin; chunk < end; ++chunk) {
+            uint32_t *write_offsets = offsets + size_t(chunk) * tile_count;
+            uint32_t first = chunk * chunk_size;
+            uint32_t last = first + chunk_size < particles->count ? first + chunk_size : particles->count;
+            for (uint32_t i = first; i < last; ++i) {
+                uint32_t code = codes[i];
+                if (code != CULLED)
+                    binned[write_offsets[code >> local_bits]++] = code & local_mask;
+            }
+        }
+    });
+
+    // Agent-only counters are multiples of AGENT_INCREMENT below DATA_INCREMENT, resolved by a table
+    const uint32_t table_size = DATA_INCREMENT / AGENT_INCREMENT;
+    float *table = memory::alloc_heap<float>(6 * table_size);
+    for (uint32_t i = 0; i < table_size; ++i) {
+        Vector3 color = get_color(i * AGENT_INCREMENT, settings->sample_weight);
+        float *entry = table + 6 * i;
+        entry[0] = color.x;
+        entry[1] = color.y;
+        entry[2] = color.z;
+        entry[3] = linear_to_srgb(color.x);
+        entry[4] = linear_to_srgb(color.y);
+        entry[5] = linear_to_srgb(color.z);
+    }
+
+    // Accumulate every tile in the tile buffer of its thread and resolve it into the image
+    jobs::parallel_for(tile_count, 1, [&](uint32_t begin, uint32_t end, uint32_t thread) {
+        uint32_t *counters = buffers->accumulators + size_t(thread) * tile_size * tile_size;
+        for (uint32_t tile = begin; tile < end; ++tile) {
+            memset(counters, 0, tile_size * tile_size * sizeof(uint32_t));
+            for (uint32_t i = tile_start[tile]; i < tile_start[tile + 1]; ++i) {
+                uint32_t entry = binned[i];
+                counters[entry >> 1] += (entry & 1) ? DATA_INCREMENT : AGENT_INCREMENT;
+            }
+
+            uint32_t x0 = (tile % tiles_x) * tile_size, y0 = (tile / tiles_x) * tile_size;
+            uint32_t x1 = x0 + tile_size < width ? x0 + tile_size : width;
+            uint32_t y1 = y0 + tile_size < height ? y0 + tile_size : height;
+            for (uint32_t y = y0; y < y1; ++y) {
+                const uint32_t *row = counters + (y - y0) * tile_size;
+                float *radiance = image->radiance + 3 * (size_t(y) * width + x0);
+                float *display = image->display + 3 * (size_t(y) * width + x0);
+                for (uint32_t x = x0; x < x1; ++x, radiance += 3, display += 3) {
+                    uint32_t counter = row[x - x0];
+                    if (counter < DATA_INCREMENT) {
+                        const float *entry = table + 6 * (counter / AGENT_INCREMENT);
+                        radiance[0] = entry[0];
+                        radiance[1] = entry[1];
+                        radiance[2] = entry[2];
+                        display[0] = entry[3];
+                        display[1] = entry[4];
+                        display[2] = entry[5];
+                    } else {
+                        Vector3 color = get_color(counter, settings->sample_weight);
+                        radiance[0] = color.x;
+                        radiance[1] = color.y;
+                        radiance[2] = color.z;
+                        display[0] = linear_to_srgb(color.x);
+                        display[1] = linear_to_srgb(color.y);
+                        display[2] = linear_to_srgb(color.z);
+                    }
+                }
+            }
+        }
+    });
+    memory::free_heap(table);
+    image->sample_count = 1;
+}
+
+void splat::release(SplatBuffers *buffers)
+{
+    memory::free_heap(buffers->codes);
+    memory::free_heap(buffers->binned);
+    memory::free_heap(buffers->offsets);
+    memory::free_heap(buffers->tile_start);
+    memory::free_heap(buffers->accumulators);
+    *buffers = SplatBuffers{};
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include "volpath.h"
+
+// Particles to splat: positions in simulation grid coordinates [vox], as in the particle buffers of main.cpp
+struct SplatParticles
+{
+    float *x;
+    float *y;
+    float *z;
+    float *t; // Negative for data points (particles_theta); nullptr when all particles are agents
+    uint32_t count;
+    uint32_t grid_size[3]; // Simulation grid resolution (world_width, world_height and world_depth of the shaders)
+};
+
+// Scratch memory of the binning passes, kept between frames so that rendering a sequence does not reallocate it
+struct SplatBuffers
+{
+    uint32_t *codes; // Per particle: pixel and kind, or culled
+    uint32_t *binned; // Tile-local pixels and kinds, ordered by tile
+    uint32_t *offsets; // Per chunk of particles and tile: particles first, then write positions in `binned`
+    uint32_t *tile_start; // First binned entry of every tile, tile_count + 1 entries
+    uint32_t *accumulators; // One tile of counters per thread
+    uint32_t particle_capacity;
+    uint32_t offset_capacity;
+    uint32_t tile_capacity;
+    uint32_t accumulator_capacity;
+};
+
+// `splat` namespace is a CPU version of the particle mode (cs_particles_transform, cs_particles_blit and
+// ps_particles_color) for rendering particle frames headless. Particles are projected with the camera of the path tracer.
+namespace splat
+{
+    // Render the particles in three parallel passes: project them and count them per screen tile, bin them by tile, and
+    // splat every tile into a tile buffer of its thread, which is then resolved into the image. Counters add up exactly
+    // as the atomics of the shader do, so the image does not depend on the thread count.
+    // Fills image->radiance with the colors of ps_particles_color and image->display with their sRGB encoding.
+    void render(SplatParticles *particles, VolpathSettings *settings, SplatBuffers *buffers, VolpathImage *image);
+
+    void release(SplatBuffers *buffers);
+}
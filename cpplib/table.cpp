@@ -0,0 +1,93 @@
+#include "table.h"
+#include "memory.h"
+#include "jobs.h"
+#include <fstream>
+#include <string.h>
+#include <stdio.h>
+
+static const char TABLE_FILE_MAGIC[8] = { 'P', 'P', 'C', 'O', 'L', 'U', 'M', 'N' };
+static const uint32_t TEXT_CHUNK_ROWS = 8192; // Rows formatted by one job
+static const uint32_t TEXT_VALUE_CAPACITY = 18; // Longest "%.9g" float plus the separator
+
+bool table::save_binary(const char *filename, TableColumn *columns, uint32_t column_count, uint32_t row_count)
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        printf("Failed to write table %s\n", filename);
+        return false;
+    }
+
+    TableFileHeader header = {};
+    memcpy(header.magic, TABLE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TABLE_FILE_VERSION;
+    header.column_count = column_count;
+    header.row_count = row_count;
+    file.write((char*)&header, sizeof(header));
+
+    uint64_t offset = sizeof(TableFileHeader) + uint64_t(column_count) * sizeof(TableColumnSchema);
+    for (uint32_t c = 0; c < column_count; ++c) {
+        TableColumnSchema schema = {};
+        strncpy(schema.name, columns[c].name, sizeof(schema.name) - 1);
+        if (columns[c].unit)
+            strncpy(schema.unit, columns[c].unit, sizeof(schema.unit) - 1);
+        schema.offset = offset;
+        file.write((char*)&schema, sizeof(schema));
+        offset += uint64_t(row_count) * sizeof(float);
+    }
+    for (uint32_t c = 0; c < column_count; ++c) {
+        file.write((char*)columns[c].data, uint64_t(row_count) * sizeof(float));
+    }
+
+    bool success = file.good();
+    file.close();
+    if (!success)
+        printf("Failed to write table %s\n", filename);
+    return success;
+}
+
+bool table::save_text(const char *filename, TableColumn *columns, uint32_t column_count, uint32_t row_count)
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        printf("Failed to write table %s\n", filename);
+        return false;
+    }
+
+    for (uint32_t c = 0; c < column_count; ++c) {
+        file << (c > 0 ? "," : "") << columns[c].name;
+        if (columns[c].unit && columns[c].unit[0] != 0)
+            file << " [" << columns[c].unit << "]";
+    }
+    file << "\n";
+
+    // Each chunk of rows is printed into its own slice of one large buffer, then the slices are written in order
+    uint32_t chunk_count = (row_count + TEXT_CHUNK_ROWS - 1) / TEXT_CHUNK_ROWS;
+    size_t chunk_capacity = size_t(TEXT_CHUNK_ROWS) * (column_count * TEXT_VALUE_CAPACITY + 1);
+    char *text = memory::alloc_heap<char>(chunk_count * chunk_capacity + 1);
+    size_t *chunk_sizes = memory::alloc_heap<size_t>(chunk_count + 1);
+    jobs::parallel_for(chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t chunk = begin; chunk < end; ++chunk) {
+            char *out = text + chunk * chunk_capacity;
+            uint32_t first_row = chunk * TEXT_CHUNK_ROWS;
+            uint32_t last_row = row_count - first_row < TEXT_CHUNK_ROWS ? row_count : first_row + TEXT_CHUNK_ROWS;
+            for (uint32_t row = first_row; row < last_row; ++row) {
+                for (uint32_t c = 0; c < column_count; ++c) {
+                    out += snprintf(out, TEXT_VALUE_CAPACITY, c + 1 < column_count ? "%.9g," : "%.9g", columns[c].data[row]);
+                }
+                *out++ = '\n';
+            }
+            chunk_sizes[chunk] = out - (text + chunk * chunk_capacity);
+        }
+    });
+    for (uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+        file.write(text + chunk * chunk_capacity, chunk_sizes[chunk]);
+    }
+    memory::free_heap(chunk_sizes);
+    memory::free_heap(text);
+
+    bool success = file.good();
+    file.close();
+    if (!success)
+        printf("Failed to write table %s\n", filename);
+    return success;
+}
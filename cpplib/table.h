@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+
+// Polyphorm columnar table (.pcol) layout, all values little-endian:
+//   TableFileHeader | TableColumnSchema[column_count] | column data, each column a contiguous float32[row_count]
+
+const uint32_t TABLE_FILE_VERSION = 1;
+
+struct TableFileHeader
+{
+    char magic[8]; // "PPCOLUMN"
+    uint32_t version;
+    uint32_t column_count;
+    uint64_t row_count;
+};
+
+struct TableColumnSchema
+{
+    char name[48]; // Zero-terminated
+    char unit[16]; // Zero-terminated, empty if dimensionless
+    uint32_t type; // 0 = float32
+    uint32_t reserved;
+    uint64_t offset; // Byte offset of the column data from the start of the file
+};
+
+// Named column of `row_count` values
+struct TableColumn
+{
+    const char *name;
+    const char *unit;
+    float *data;
+};
+
+// `table` namespace writes per-row measurements either as a columnar binary file or as CSV text
+namespace table
+{
+    // Write the columns as a columnar binary file with a schema header
+    bool save_binary(const char *filename, TableColumn *columns, uint32_t column_count, uint32_t row_count);
+
+    // Write the columns as comma-separated text with a header line of names (and units in brackets).
+    // Values are printed with 9 significant digits, enough to restore each float32 exactly; rows are formatted in parallel.
+    bool save_text(const char *filename, TableColumn *columns, uint32_t column_count, uint32_t row_count);
+}
@@ -0,0 +1,270 @@
+#include "trajectory.h"
+#include "memory.h"
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+static const char TRAJECTORY_FILE_MAGIC[8] = { 'P', 'P', 'T', 'R', 'A', 'J', 'E', 'C' };
+static const uint32_t TRAJECTORY_PLANES = 4; // x, y, z, weight
+static const uint32_t VARINT_MAX_BYTES = 5;
+static const uint32_t TRAJECTORY_MAX_AGENTS = 0xffffffffu / (TRAJECTORY_PLANES * VARINT_MAX_BYTES) - 1; // Keeps the step buffer size within 32 bits
+
+static uint8_t *write_varint(uint8_t *out, uint32_t value)
+{
+    while (value >= 0x80) {
+        *out++ = uint8_t(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = uint8_t(value);
+    return out;
+}
+
+static const uint8_t *read_varint(const uint8_t *in, const uint8_t *in_end, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (uint32_t shift = 0; shift < 7 * VARINT_MAX_BYTES && in < in_end; shift += 7) {
+        uint8_t byte = *in++;
+        result |= uint32_t(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return in;
+        }
+    }
+    return nullptr;
+}
+
+static uint32_t float_bits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static float bits_float(uint32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static bool is_quantized(TrajectoryFile *file, uint32_t plane)
+{
+    return plane < 3 && file->header.quantization_bits > 0;
+}
+
+static uint32_t get_max_code(TrajectoryFile *file)
+{
+    return uint32_t((uint64_t(1) << file->header.quantization_bits) - 1);
+}
+
+// Code of a value: quantized grid position or raw float bits
+static uint32_t encode_value(TrajectoryFile *file, uint32_t plane, float value)
+{
+    if (!is_quantized(file, plane))
+        return float_bits(value);
+    float max_code = float(get_max_code(file));
+    float code = roundf(value / file->header.grid_size[plane] * max_code);
+    code = code < 0.0f ? 0.0f : (code > max_code ? max_code : code);
+    return uint32_t(code);
+}
+
+static float decode_value(TrajectoryFile *file, uint32_t plane, uint32_t code)
+{
+    if (!is_quantized(file, plane))
+        return bits_float(code);
+    return float(code) / float(get_max_code(file)) * file->header.grid_size[plane];
+}
+
+// Difference against the previous step: zigzag for quantized positions, XOR for float bits
+static uint32_t get_delta(TrajectoryFile *file, uint32_t plane, uint32_t code, uint32_t previous)
+{
+    if (!is_quantized(file, plane))
+        return code ^ previous;
+    int32_t difference = int32_t(code - previous);
+    return (uint32_t(difference) << 1) ^ uint32_t(difference >> 31);
+}
+
+static uint32_t apply_delta(TrajectoryFile *file, uint32_t plane, uint32_t delta, uint32_t previous)
+{
+    if (!is_quantized(file, plane))
+        return delta ^ previous;
+    int32_t difference = int32_t(delta >> 1) ^ -int32_t(delta & 1);
+    return previous + uint32_t(difference);
+}
+
+// Largest payload of a step, every value encoded with the longest varint
+static uint64_t get_max_payload_size(uint32_t agent_count)
+{
+    return uint64_t(TRAJECTORY_PLANES) * agent_count * VARINT_MAX_BYTES;
+}
+
+// The agent count must be at most TRAJECTORY_MAX_AGENTS
+static void allocate_state(TrajectoryFile *file)
+{
+    uint32_t agent_count = file->header.agent_count;
+    file->agent_ids = memory::alloc_heap<uint32_t>(agent_count + 1);
+    file->previous = memory::alloc_heap<uint32_t>(TRAJECTORY_PLANES * agent_count + 1);
+    file->buffer = memory::alloc_heap<uint8_t>(get_max_payload_size(agent_count) + 1);
+    file->step_count = 0;
+}
+
+uint32_t trajectory::select(float *x, float *y, float *z, uint32_t agent_count, TrajectorySelection selection, uint32_t *indices)
+{
+    uint32_t selected_count = 0;
+    if (selection.mode == TSM_COUNT) {
+        selected_count = selection.count < agent_count ? selection.count : agent_count;
+        for (uint32_t i = 0; i < selected_count; ++i)
+            indices[i] = i;
+    } else if (selection.mode == TSM_STRIDE) {
+        uint32_t stride = selection.stride > 0 ? selection.stride : 1;
+        for (uint32_t i = 0; i < agent_count; i += stride)
+            indices[selected_count++] = i;
+    } else if (selection.mode == TSM_REGION) {
+        for (uint32_t i = 0; i < agent_count && selected_count < selection.count; ++i) {
+            if (x[i] >= selection.region_min[0] && x[i] < selection.region_max[0]
+                && y[i] >= selection.region_min[1] && y[i] < selection.region_max[1]
+                && z[i] >= selection.region_min[2] && z[i] < selection.region_max[2])
+                indices[selected_count++] = i;
+        }
+    }
+    return selected_count;
+}
+
+bool trajectory::create(const char *filename, TrajectoryFileHeader header, uint32_t *agent_ids, TrajectoryFile *file)
+{
+    *file = TrajectoryFile{};
+    if (header.agent_count > TRAJECTORY_MAX_AGENTS) {
+        printf("Failed to write trajectory file %s: too many agents (%u)\n", filename, header.agent_count);
+        return false;
+    }
+    file->output = new std::ofstream(filename, std::ios::out | std::ios::binary);
+    if (!file->output->is_open()) {
+        printf("Failed to write trajectory file %s\n", filename);
+        close(file);
+        return false;
+    }
+    memcpy(header.magic, TRAJECTORY_FILE_MAGIC, sizeof(header.magic));
+    header.version = TRAJECTORY_FILE_VERSION;
+    header.quantization_bits = header.quantization_bits > 24 ? 24 : header.quantization_bits;
+    header.keyframe_interval = header.keyframe_interval > 0 ? header.keyframe_interval : 1;
+    file->header = header;
+    allocate_state(file);
+    memcpy(file->agent_ids, agent_ids, header.agent_count * sizeof(uint32_t));
+
+    file->output->write((char*)&file->header, sizeof(TrajectoryFileHeader));
+    file->output->write((char*)file->agent_ids, header.agent_count * sizeof(uint32_t));
+    return file->output->good();
+}
+
+bool trajectory::write_step(TrajectoryFile *file, int32_t iteration, float *x, float *y, float *z, float *weights)
+{
+    uint32_t agent_count = file->header.agent_count;
+    TrajectoryStepHeader step = {};
+    step.iteration = iteration;
+    step.is_keyframe = file->step_count % file->header.keyframe_interval == 0;
+
+    float *planes[TRAJECTORY_PLANES] = { x, y, z, weights };
+    uint8_t *out = file->buffer;
+    for (uint32_t plane = 0; plane < TRAJECTORY_PLANES; ++plane) {
+        uint32_t *previous = file->previous + plane * agent_count;
+        for (uint32_t i = 0; i < agent_count; ++i) {
+            uint32_t code = encode_value(file, plane, planes[plane][i]);
+            out = write_varint(out, step.is_keyframe ? code : get_delta(file, plane, code, previous[i]));
+            previous[i] = code;
+        }
+    }
+    step.payload_size = uint32_t(out - file->buffer);
+
+    file->output->write((char*)&step, sizeof(step));
+    file->output->write((char*)file->buffer, step.payload_size);
+    ++file->step_count;
+    return file->output->good();
+}
+
+bool trajectory::open(const char *filename, TrajectoryFile *file)
+{
+    *file = TrajectoryFile{};
+    file->input = new std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!file->input->is_open()) {
+        printf("Failed to open trajectory file %s\n", filename);
+        close(file);
+        return false;
+    }
+    file->input->read((char*)&file->header, sizeof(TrajectoryFileHeader));
+    if (!file->input->good() || memcmp(file->header.magic, TRAJECTORY_FILE_MAGIC, sizeof(TRAJECTORY_FILE_MAGIC)) != 0
+        || file->header.version > TRAJECTORY_FILE_VERSION || file->header.quantization_bits > 24) {
+        printf("%s is not a supported trajectory file\n", filename);
+        close(file);
+        return false;
+    }
+    // The agent ids must fit in the file before any state is allocated for them
+    file->input->seekg(0, std::ios::end);
+    uint64_t file_size = uint64_t(file->input->tellg());
+    file->input->seekg(sizeof(TrajectoryFileHeader), std::ios::beg);
+    if (file->header.agent_count > TRAJECTORY_MAX_AGENTS
+        || uint64_t(file->header.agent_count) * sizeof(uint32_t) > file_size - sizeof(TrajectoryFileHeader)) {
+        printf("%s has an invalid agent count (%u)\n", filename, file->header.agent_count);
+        close(file);
+        return false;
+    }
+    allocate_state(file);
+    file->input->read((char*)file->agent_ids, file->header.agent_count * sizeof(uint32_t));
+    if (!file->input->good()) {
+        printf("Failed to read the agent ids of %s\n", filename);
+        close(file);
+        return false;
+    }
+    return true;
+}
+
+bool trajectory::read_step(TrajectoryFile *file, int32_t *iteration, float *x, float *y, float *z, float *weights)
+{
+    uint32_t agent_count = file->header.agent_count;
+    TrajectoryStepHeader step;
+    file->input->read((char*)&step, sizeof(step));
+    if (!file->input->good() || step.payload_size > get_max_payload_size(agent_count))
+        return false;
+    if (!step.is_keyframe && file->step_count == 0)
+        return false;
+    file->input->read((char*)file->buffer, step.payload_size);
+    if (!file->input->good())
+        return false;
+
+    float *planes[TRAJECTORY_PLANES] = { x, y, z, weights };
+    const uint8_t *in = file->buffer;
+    const uint8_t *in_end = file->buffer + step.payload_size;
+    for (uint32_t plane = 0; plane < TRAJECTORY_PLANES; ++plane) {
+        uint32_t *previous = file->previous + plane * agent_count;
+        for (uint32_t i = 0; i < agent_count; ++i) {
+            uint32_t value;
+            in = read_varint(in, in_end, &value);
+            if (!in)
+                return false;
+            uint32_t code = step.is_keyframe ? value : apply_delta(file, plane, value, previous[i]);
+            previous[i] = code;
+            planes[plane][i] = decode_value(file, plane, code);
+        }
+    }
+    *iteration = step.iteration;
+    ++file->step_count;
+    return in == in_end;
+}
+
+void trajectory::close(TrajectoryFile *file)
+{
+    if (file->output) {
+        file->output->close();
+        delete file->output;
+    }
+    if (file->input) {
+        file->input->close();
+        delete file->input;
+    }
+    if (file->agent_ids)
+        memory::free_heap(file->agent_ids);
+    if (file->previous)
+        memory::free_heap(file->previous);
+    if (file->buffer)
+        memory::free_heap(file->buffer);
+    *file = TrajectoryFile{};
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <fstream>
+
+// Polyphorm trajectory file (.ptraj) layout, all values little-endian:
+//   TrajectoryFileHeader | uint32 agent ids[agent_count] | per step: TrajectoryStepHeader + payload
+// The payload holds four planes (x, y, z, weight) of agent_count varint codes each. Positions are grid coordinates,
+// either as float32 bits or quantized to quantization_bits over the grid extent; weights are float32 bits.
+// Keyframes store the codes as they are, other steps store zigzag differences (quantized positions) or XOR (float bits)
+// against the previous step, so slowly moving agents take one or two bytes per value.
+
+const uint32_t TRAJECTORY_FILE_VERSION = 1;
+
+enum TrajectorySelectionMode
+{
+    TSM_COUNT = 0, // The first `count` agents (agents are initialized independently, so this is a random sample)
+    TSM_STRIDE = 1, // Every `stride`-th agent
+    TSM_REGION = 2 // Agents inside the region when the capture starts, at most `count` of them
+};
+
+struct TrajectorySelection
+{
+    TrajectorySelectionMode mode;
+    uint32_t count;
+    uint32_t stride;
+    float region_min[3]; // Grid coordinates
+    float region_max[3];
+};
+
+struct TrajectoryFileHeader
+{
+    char magic[8]; // "PPTRAJEC"
+    uint32_t version;
+    uint32_t agent_count;
+    uint32_t quantization_bits; // 0 = float32 positions
+    uint32_t keyframe_interval; // Steps between keyframes
+    float grid_size[3]; // Grid resolution [vox], the range of the quantized positions
+    float world_size[3]; // World extent of the grid [Mpc]
+    float world_center[3]; // [Mpc]
+};
+
+struct TrajectoryStepHeader
+{
+    int32_t iteration; // Simulation iteration of the step
+    uint32_t is_keyframe;
+    uint32_t payload_size; // Bytes of the varint planes that follow
+};
+
+// Trajectory file open for writing or reading, with the codes of the previous step as the delta reference
+struct TrajectoryFile
+{
+    std::ofstream *output;
+    std::ifstream *input;
+    TrajectoryFileHeader header;
+    uint32_t *agent_ids;
+    uint32_t *previous;
+    uint8_t *buffer;
+    uint32_t step_count;
+};
+
+// `trajectory` namespace streams positions of a fixed agent subset over many simulation steps into a compact binary file
+namespace trajectory
+{
+    // Indices of the selected agents among `agent_count` agents with grid positions x/y/z; returns the selected count.
+    // `indices` must hold agent_count entries.
+    uint32_t select(float *x, float *y, float *z, uint32_t agent_count, TrajectorySelection selection, uint32_t *indices);
+
+    // Create a trajectory file for the agents `agent_ids`; `header` provides quantization, keyframes and the grid placement
+    bool create(const char *filename, TrajectoryFileHeader header, uint32_t *agent_ids, TrajectoryFile *file);
+
+    // Append one step with the grid positions and weights of the selected agents (in agent_ids order)
+    bool write_step(TrajectoryFile *file, int32_t iteration, float *x, float *y, float *z, float *weights);
+
+    // Open a trajectory file and load its header and agent ids; fails if the agent count does not fit the file
+    bool open(const char *filename, TrajectoryFile *file);
+
+    // Read the next step; returns false at the end of the file
+    bool read_step(TrajectoryFile *file, int32_t *iteration, float *x, float *y, float *z, float *weights);
+
+    // Close the file and release its memory
+    void close(TrajectoryFile *file);
+}
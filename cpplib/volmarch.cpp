@@ -0,0 +1,484 @@
+#include "volmarch.h"
+#include "memory.h"
+#include "jobs.h"
+#include "maths.h"
+#include <math.h>
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+
+static const float MARCH_STEP = 1.0f; // Sample spacing [vox], one sample per slice of the slice renderer
+static const float OPAQUE_TRANSMITTANCE = 0.002f; // Rays stop below this, under half a display level of what is behind
+static const int32_t BRICK_APRON = 2; // Voxels around a brick that its samples read
+static const float SKIP_EPSILON = 1.e-5f; // Relative ray parameter past a cell boundary that puts a point into the next cell
+
+static const char *MODE_NAMES[VMM_COUNT] = { "trace", "highlight", "overdensity", "velocity", "halocolor" };
+
+// Colors of ps_volume_overdensity, alpha in w
+static const Vector4 COLOR_UNDERDENSE = Vector4(0.0f, 0.0f, 25.0f, 0.08f);
+static const Vector4 COLOR_MIDDENSE = Vector4(0.0f, 2.0f, 0.0f, 0.06f);
+static const Vector4 COLOR_OVERDENSE = Vector4(10.0f, 0.0f, 0.0f, 0.15f);
+
+// Everything a render derives from the settings once
+struct MarchContext
+{
+    VolmarchScene *scene;
+    VolpathSettings *settings;
+    VolmarchMode mode;
+    uint8_t *occupied[VOLMARCH_MAX_LEVELS]; // Per cell of the hierarchy: some sample inside may be visible
+    float step_voxels; // Simulation voxels per sample, the exponent of the opacity correction
+    uint64_t trace_fetches; // Counted per job, every job works on its own copy of the context
+};
+
+// Sample of a transfer function, as the slice renderer blends it
+struct Fragment
+{
+    Vector3 color;
+    float alpha;
+};
+
+static inline float remap(float value, float slope)
+{
+    return 1.0f - expf(-slope * value);
+}
+
+static inline float clamp01(float value)
+{
+    return value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+}
+
+static inline float smoothstep(float edge0, float edge1, float x)
+{
+    float t = clamp01((x - edge0) / (edge1 - edge0));
+    return t * t * (3.0f - 2.0f * t);
+}
+
+static inline float linear_to_srgb(float value)
+{
+    value = clamp01(value);
+    return value <= 0.0031308f ? 12.92f * value : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+}
+
+// Point-sampled palette entry at u in [0, 1]
+static inline Vector3 get_palette(const float *palette, uint32_t size, float u)
+{
+    int32_t index = int32_t(u * float(size));
+    index = index < 0 ? 0 : (index >= int32_t(size) ? int32_t(size) - 1 : index);
+    return Vector3(palette[3 * index], palette[3 * index + 1], palette[3 * index + 2]);
+}
+
+static inline float get_trace(MarchContext *context, float x, float y, float z)
+{
+    ++context->trace_fetches;
+    return volume::sample_trilinear(&context->scene->trace, x, y, z);
+}
+
+// The main() of the ps_volume_* shader of the mode at grid coordinates p, fragments outside the trimmed domain aside
+static Fragment get_fragment(MarchContext *context, Vector3 p)
+{
+    VolmarchScene *scene = context->scene;
+    VolpathSettings *settings = context->settings;
+    Fragment fragment = { Vector3(0.0f, 0.0f, 0.0f), 0.0f };
+    switch (context->mode) {
+        case VMM_TRACE: {
+            float trace = get_trace(context, p.x, p.y, p.z);
+            if (trace < settings->trim_density)
+                return fragment;
+            float t = (trace - settings->trim_density) * settings->sample_weight;
+            fragment.color = get_palette(scene->palette_trace, scene->palette_trace_size, remap(t, 1.0f));
+            fragment.alpha = settings->optical_thickness * remap(t, 1.0f);
+            break;
+        }
+        case VMM_HIGHLIGHT: {
+            float trace = get_trace(context, p.x, p.y, p.z);
+            float t = settings->sample_weight * (trace - settings->trim_density);
+            float d = settings->galaxy_weight * volume::sample_trilinear(&scene->deposit, p.x, p.y, p.z);
+            fragment.color = remap(t, 0.3f) * Vector3(0.6f, 0.05f, 0.9f) + remap(d, 0.2f) * Vector3(1.0f, 0.6f, 0.0f);
+            fragment.alpha = (0.2f * t + 0.1f * d) * settings->optical_thickness;
+
+            float highlight_low = settings->highlight_density / sqrtf(settings->histogram_base);
+            float highlight_high = settings->highlight_density * sqrtf(settings->histogram_base);
+            if (trace > highlight_low && trace < highlight_high) {
+                float band = highlight_high - highlight_low;
+                float smooth_weight = smoothstep(highlight_low, highlight_low + 0.1f * band, trace)
+                    * (1.0f - smoothstep(highlight_high - 0.1f * band, highlight_high, trace));
+                fragment.color = (1.0f - smooth_weight) * fragment.color + (smooth_weight * remap(trace, 10.0f)) * Vector3(0.0f, 1.0f, 0.0f);
+                fragment.alpha = (1.0f - smooth_weight) * fragment.alpha + smooth_weight * remap(trace, 10.0f) * settings->optical_thickness;
+            }
+            break;
+        }
+        case VMM_OVERDENSITY: {
+            float trace = get_trace(context, p.x, p.y, p.z);
+            if (trace < settings->trim_density)
+                return fragment;
+            Vector4 color = trace < settings->overdensity_threshold_low ? COLOR_UNDERDENSE
+                : (trace < settings->overdensity_threshold_high ? COLOR_MIDDENSE : COLOR_OVERDENSE);
+            fragment.color = remap(2.71f, settings->sample_weight) * Vector3(color.x, color.y, color.z);
+            fragment.alpha = color.w * settings->optical_thickness * remap(trace, 1.0f);
+            break;
+        }
+        case VMM_VELOCITY: {
+            float phase_r = get_trace(context, p.x, p.y, p.z);
+            float vx = volume::sample_trilinear(&scene->velocity[0], p.x, p.y, p.z);
+            float vy = volume::sample_trilinear(&scene->velocity[1], p.x, p.y, p.z);
+            float vz = volume::sample_trilinear(&scene->velocity[2], p.x, p.y, p.z);
+            fragment.color = settings->sample_weight * Vector3(0.6f * vx * vx, 0.5f * vy * vy, 1.0f * vz * vz);
+            fragment.alpha = remap(0.1f * phase_r, settings->optical_thickness);
+            break;
+        }
+        case VMM_HALOCOLOR: {
+            // Sharpened by the six neighbors one voxel away
+            float trace = 2.0f * get_trace(context, p.x, p.y, p.z);
+            trace -= 0.166f * (get_trace(context, p.x + 1.0f, p.y, p.z) + get_trace(context, p.x - 1.0f, p.y, p.z)
+                + get_trace(context, p.x, p.y + 1.0f, p.z) + get_trace(context, p.x, p.y - 1.0f, p.z)
+                + get_trace(context, p.x, p.y, p.z + 1.0f) + get_trace(context, p.x, p.y, p.z - 1.0f));
+            float t = settings->sample_weight * (trace - settings->trim_density);
+            float d = settings->galaxy_weight * volume::sample_trilinear(&scene->deposit, p.x, p.y, p.z);
+            float d_color = volume::sample_trilinear(&scene->halo_color, p.x, p.y, p.z);
+            fragment.color = remap(t, 0.6f) * Vector3(0.5f, 0.5f, 0.5f);
+            fragment.color += settings->galaxy_weight * d_color > 0.0f ? remap(d, 0.1f) * Vector3(0.0f, 0.0f, 0.8f) : remap(d, 0.1f) * Vector3(0.7f, 0.0f, 0.0f);
+            fragment.alpha = (0.3f * t + 0.15f * d) * settings->optical_thickness;
+            break;
+        }
+        default:
+            break;
+    }
+
+    // Compensation for drawing one stack of slices; the 8-bit render target clamps what the shader returns
+    fragment.color = Vector3(clamp01(2.0f * fragment.color.x), clamp01(2.0f * fragment.color.y), clamp01(2.0f * fragment.color.z));
+    fragment.alpha = clamp01(fragment.alpha);
+    return fragment;
+}
+
+// Whether a sample with trace in [trace_min, trace_max] and deposit up to deposit_max can have a nonzero opacity;
+// follows the alpha of get_fragment for non-negative weights and thickness
+static bool may_be_visible(MarchContext *context, float trace_min, float trace_max, float deposit_max)
+{
+    VolpathSettings *settings = context->settings;
+    if (!(settings->optical_thickness > 0.0f))
+        return false;
+    float d = settings->galaxy_weight * deposit_max;
+    switch (context->mode) {
+        case VMM_TRACE:
+            return trace_max > settings->trim_density && settings->sample_weight > 0.0f;
+        case VMM_HIGHLIGHT: {
+            float t = settings->sample_weight * (trace_max - settings->trim_density);
+            float highlight_low = settings->highlight_density / sqrtf(settings->histogram_base);
+            float highlight_high = settings->highlight_density * sqrtf(settings->histogram_base);
+            bool in_band = trace_max > highlight_low && trace_min < highlight_high && trace_max > 0.0f;
+            return 0.2f * t + 0.1f * d > 0.0f || in_band;
+        }
+        case VMM_OVERDENSITY:
+            return trace_max >= settings->trim_density && trace_max > 0.0f;
+        case VMM_VELOCITY:
+            return trace_max > 0.0f;
+        case VMM_HALOCOLOR: {
+            float t = settings->sample_weight * (2.0f * trace_max - 0.996f * trace_min - settings->trim_density);
+            return 0.3f * t + 0.15f * d > 0.0f;
+        }
+        default:
+            return true;
+    }
+}
+
+// Brick (level 0 cell) that contains p, clamped to the grid; its parents are the cell coordinates shifted by the level
+static inline void get_brick_cell(VolmarchBricks *bricks, Vector3 p, int32_t cell[3])
+{
+    float size_inv = 1.0f / float(bricks->block_size);
+    int32_t cell_count[3] = { int32_t(bricks->width[0]), int32_t(bricks->height[0]), int32_t(bricks->depth[0]) };
+    float coordinates[3] = { p.x, p.y, p.z };
+    for (uint32_t a = 0; a < 3; ++a) {
+        int32_t c = int32_t(floorf(coordinates[a] * size_inv));
+        cell[a] = c < 0 ? 0 : (c >= cell_count[a] ? cell_count[a] - 1 : c);
+    }
+}
+
+static inline size_t get_brick_index(VolmarchBricks *bricks, uint32_t level, const int32_t cell[3])
+{
+    return (size_t(cell[2]) * bricks->height[level] + cell[1]) * bricks->width[level] + cell[0];
+}
+
+// Ray parameter where the ray leaves a cell of a hierarchy level
+static inline float get_brick_exit(VolmarchBricks *bricks, uint32_t level, const int32_t cell[3], Vector3 rp, Vector3 rd)
+{
+    float size = float(bricks->block_size << level);
+    float origin[3] = { rp.x, rp.y, rp.z };
+    float direction[3] = { rd.x, rd.y, rd.z };
+    float t_exit = FLT_MAX;
+    for (uint32_t a = 0; a < 3; ++a) {
+        if (direction[a] == 0.0f)
+            continue;
+        float boundary = float(cell[a] + (direction[a] > 0.0f ? 1 : 0)) * size;
+        t_exit = fminf(t_exit, (boundary - origin[a]) / direction[a]);
+    }
+    return t_exit;
+}
+
+// Composite the samples t_near + (k + 0.5) * MARCH_STEP in [t_begin, t_end) front to back, starting at *sample_index.
+// The first index is rounded down, so rounding never drops the sample on a boundary between two marched segments; a
+// sample before t_begin can only come from an empty cell.
+static void march_segment(MarchContext *context, Vector3 rp, Vector3 rd, float t_near, float t_begin, float t_end,
+    uint32_t *sample_index, Vector3 *color, float *transmittance)
+{
+    float first = floorf((t_begin - t_near) / MARCH_STEP - 0.5f);
+    uint32_t k = first > float(*sample_index) ? uint32_t(first) : *sample_index;
+    for (float t = t_near + (float(k) + 0.5f) * MARCH_STEP; t < t_end; t = t_near + (float(++k) + 0.5f) * MARCH_STEP) {
+        Fragment fragment = get_fragment(context, rp + t * rd);
+        if (fragment.alpha <= 0.0f)
+            continue;
+        // The fragment alpha is the opacity of one simulation voxel
+        float alpha = fragment.alpha;
+        if (context->step_voxels != 1.0f && alpha < 1.0f)
+            alpha = 1.0f - powf(1.0f - alpha, context->step_voxels);
+        *color += (*transmittance * alpha) * fragment.color;
+        *transmittance *= 1.0f - alpha;
+        if (*transmittance < OPAQUE_TRANSMITTANCE) {
+            ++k;
+            break;
+        }
+    }
+    *sample_index = k;
+}
+
+// Blended color of a camera ray and the transmittance to the background
+static Vector3 march_ray(MarchContext *context, Vector3 rp, Vector3 rd, float t_near, float t_far, float *transmittance)
+{
+    Vector3 color(0.0f, 0.0f, 0.0f);
+    *transmittance = 1.0f;
+    uint32_t sample_index = 0;
+    VolmarchBricks *bricks = &context->scene->bricks;
+    if (bricks->level_count == 0) {
+        march_segment(context, rp, rd, t_near, t_near, t_far, &sample_index, &color, transmittance);
+        return color;
+    }
+
+    // March the samples of occupied bricks; from an empty brick, climb to the coarsest empty cell containing it and cross
+    // that in one step
+    float t = t_near;
+    while (t < t_far && *transmittance >= OPAQUE_TRANSMITTANCE) {
+        float t_nudge = SKIP_EPSILON * (1.0f + fabsf(t));
+        int32_t cell[3];
+        get_brick_cell(bricks, rp + (t + t_nudge) * rd, cell);
+        uint32_t level = 0;
+        bool empty = !context->occupied[0][get_brick_index(bricks, 0, cell)];
+        while (empty && level + 1 < bricks->level_count) {
+            int32_t parent[3] = { cell[0] >> 1, cell[1] >> 1, cell[2] >> 1 };
+            if (context->occupied[level + 1][get_brick_index(bricks, level + 1, parent)])
+                break;
+            cell[0] = parent[0];
+            cell[1] = parent[1];
+            cell[2] = parent[2];
+            ++level;
+        }
+        float t_exit = fminf(fmaxf(get_brick_exit(bricks, level, cell, rp, rd), t + t_nudge), t_far);
+        if (!empty)
+            march_segment(context, rp, rd, t_near, t, t_exit, &sample_index, &color, transmittance);
+        t = t_exit;
+    }
+    return color;
+}
+
+bool volmarch::get_mode(const char *name, VolmarchMode *mode)
+{
+    for (uint32_t m = 0; m < VMM_COUNT; ++m) {
+        if (strcmp(name, MODE_NAMES[m]) == 0) {
+            *mode = VolmarchMode(m);
+            return true;
+        }
+    }
+    return false;
+}
+
+void volmarch::build_bricks(VolmarchScene *scene, uint32_t block_size)
+{
+    release(&scene->bricks);
+    Volume *trace = &scene->trace, *deposit = &scene->deposit;
+    bool has_deposit = deposit->data && deposit->width == trace->width && deposit->height == trace->height && deposit->depth == trace->depth;
+    VolmarchBricks *bricks = &scene->bricks;
+    bricks->block_size = block_size;
+    bricks->width[0] = (trace->width + block_size - 1) / block_size;
+    bricks->height[0] = (trace->height + block_size - 1) / block_size;
+    bricks->depth[0] = (trace->depth + block_size - 1) / block_size;
+    bricks->level_count = 1;
+    while (bricks->level_count < VOLMARCH_MAX_LEVELS) {
+        uint32_t level = bricks->level_count - 1;
+        if (bricks->width[level] == 1 && bricks->height[level] == 1 && bricks->depth[level] == 1)
+            break;
+        bricks->width[level + 1] = (bricks->width[level] + 1) / 2;
+        bricks->height[level + 1] = (bricks->height[level] + 1) / 2;
+        bricks->depth[level + 1] = (bricks->depth[level] + 1) / 2;
+        ++bricks->level_count;
+    }
+    for (uint32_t level = 0; level < bricks->level_count; ++level) {
+        uint32_t cell_count = bricks->width[level] * bricks->height[level] * bricks->depth[level];
+        bricks->trace_min[level] = memory::alloc_heap<float>(cell_count);
+        bricks->trace_max[level] = memory::alloc_heap<float>(cell_count);
+        bricks->deposit_max[level] = memory::alloc_heap<float>(cell_count);
+    }
+
+    // Level 0: cells of one row per job, every cell scans its brick and the apron
+    jobs::parallel_for(bricks->height[0] * bricks->depth[0], 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t row = begin; row < end; ++row) {
+            uint32_t cy = row % bricks->height[0], cz = row / bricks->height[0];
+            for (uint32_t cx = 0; cx < bricks->width[0]; ++cx) {
+                int32_t x0 = int32_t(cx * block_size) - BRICK_APRON, x1 = int32_t((cx + 1) * block_size) + BRICK_APRON - 1;
+                int32_t y0 = int32_t(cy * block_size) - BRICK_APRON, y1 = int32_t((cy + 1) * block_size) + BRICK_APRON - 1;
+                int32_t z0 = int32_t(cz * block_size) - BRICK_APRON, z1 = int32_t((cz + 1) * block_size) + BRICK_APRON - 1;
+                x0 = x0 < 0 ? 0 : x0;
+                y0 = y0 < 0 ? 0 : y0;
+                z0 = z0 < 0 ? 0 : z0;
+                x1 = x1 < int32_t(trace->width) ? x1 : int32_t(trace->width) - 1;
+                y1 = y1 < int32_t(trace->height) ? y1 : int32_t(trace->height) - 1;
+                z1 = z1 < int32_t(trace->depth) ? z1 : int32_t(trace->depth) - 1;
+                float trace_min = FLT_MAX, trace_max = -FLT_MAX, deposit_max = has_deposit ? -FLT_MAX : 0.0f;
+                for (int32_t z = z0; z <= z1; ++z) {
+                    for (int32_t y = y0; y <= y1; ++y) {
+                        size_t first = volume::get_index(trace, 0, y, z);
+                        for (int32_t x = x0; x <= x1; ++x) {
+                            trace_min = fminf(trace_min, trace->data[first + x]);
+                            trace_max = fmaxf(trace_max, trace->data[first + x]);
+                        }
+                        if (has_deposit) {
+                            for (int32_t x = x0; x <= x1; ++x)
+                                deposit_max = fmaxf(deposit_max, deposit->data[first + x]);
+                        }
+                    }
+                }
+                size_t cell = size_t(row) * bricks->width[0] + cx;
+                bricks->trace_min[0][cell] = trace_min;
+                bricks->trace_max[0][cell] = trace_max;
+                bricks->deposit_max[0][cell] = deposit_max;
+            }
+        }
+    });
+
+    // Every further level bounds the (up to) 2 x 2 x 2 cells below it
+    for (uint32_t level = 1; level < bricks->level_count; ++level) {
+        uint32_t width = bricks->width[level], height = bricks->height[level];
+        uint32_t child_width = bricks->width[level - 1], child_height = bricks->height[level - 1], child_depth = bricks->depth[level - 1];
+        jobs::parallel_for(height * bricks->depth[level], 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t row = begin; row < end; ++row) {
+                uint32_t cy = row % height, cz = row / height;
+                for (uint32_t cx = 0; cx < width; ++cx) {
+                    float trace_min = FLT_MAX, trace_max = -FLT_MAX, deposit_max = -FLT_MAX;
+                    for (uint32_t z = 2 * cz; z < 2 * cz + 2 && z < child_depth; ++z) {
+                        for (uint32_t y = 2 * cy; y < 2 * cy + 2 && y < child_height; ++y) {
+                            for (uint32_t x = 2 * cx; x < 2 * cx + 2 && x < child_width; ++x) {
+                                size_t child = (size_t(z) * child_height + y) * child_width + x;
+                                trace_min = fminf(trace_min, bricks->trace_min[level - 1][child]);
+                                trace_max = fmaxf(trace_max, bricks->trace_max[level - 1][child]);
+                                deposit_max = fmaxf(deposit_max, bricks->deposit_max[level - 1][child]);
+                            }
+                        }
+                    }
+                    size_t cell = size_t(row) * width + cx;
+                    bricks->trace_min[level][cell] = trace_min;
+                    bricks->trace_max[level][cell] = trace_max;
+                    bricks->deposit_max[level][cell] = deposit_max;
+                }
+            }
+        });
+    }
+}
+
+void volmarch::release(VolmarchBricks *bricks)
+{
+    for (uint32_t level = 0; level < bricks->level_count; ++level) {
+        memory::free_heap(bricks->trace_min[level]);
+        memory::free_heap(bricks->trace_max[level]);
+        memory::free_heap(bricks->deposit_max[level]);
+    }
+    *bricks = VolmarchBricks{};
+}
+
+// Grids the mode reads, all of the trace's size
+static bool has_mode_grids(VolmarchScene *scene, VolmarchMode mode)
+{
+    Volume *trace = &scene->trace;
+    auto matches = [trace](Volume *grid) {
+        return grid->data && grid->width == trace->width && grid->height == trace->height && grid->depth == trace->depth;
+    };
+    if (!trace->data || trace->width < 2 || trace->height < 2 || trace->depth < 2)
+        return false;
+    switch (mode) {
+        case VMM_TRACE:
+            return scene->palette_trace && scene->palette_trace_size > 0;
+        case VMM_HIGHLIGHT:
+            return matches(&scene->deposit);
+        case VMM_VELOCITY:
+            return matches(&scene->velocity[0]) && matches(&scene->velocity[1]) && matches(&scene->velocity[2]);
+        case VMM_HALOCOLOR:
+            return matches(&scene->deposit) && matches(&scene->halo_color);
+        default:
+            return true;
+    }
+}
+
+void volmarch::render(VolmarchScene *scene, VolpathSettings *settings, VolmarchMode mode, VolpathImage *image)
+{
+    if (!has_mode_grids(scene, mode)) {
+        printf("Volume mode %s needs its grids (at least 2 voxels per axis, all of the same size)\n", MODE_NAMES[mode]);
+        return;
+    }
+    MarchContext context = {};
+    context.scene = scene;
+    context.settings = settings;
+    context.mode = mode;
+    context.step_voxels = MARCH_STEP * settings->voxel_scale;
+
+    // Which cells of the hierarchy the current transfer function leaves empty
+    VolmarchBricks *bricks = &scene->bricks;
+    for (uint32_t level = 0; level < bricks->level_count; ++level) {
+        uint32_t cell_count = bricks->width[level] * bricks->height[level] * bricks->depth[level];
+        uint8_t *occupied = memory::alloc_heap<uint8_t>(cell_count);
+        for (uint32_t cell = 0; cell < cell_count; ++cell)
+            occupied[cell] = may_be_visible(&context, bricks->trace_min[level][cell], bricks->trace_max[level][cell], bricks->deposit_max[level][cell]);
+        context.occupied[level] = occupied;
+    }
+
+    uint32_t tile_size = settings->tile_size > 0 ? settings->tile_size : 32;
+    uint32_t tiles_x = (image->width + tile_size - 1) / tile_size;
+    uint32_t tiles_y = (image->height + tile_size - 1) / tile_size;
+    uint32_t tile_count = tiles_x * tiles_y;
+    uint64_t *tile_fetches = memory::alloc_heap<uint64_t>(tile_count);
+    float background = settings->background;
+
+    jobs::parallel_for(tile_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t tile = begin; tile < end; ++tile) {
+            MarchContext tile_context = context;
+            uint32_t x0 = (tile % tiles_x) * tile_size, y0 = (tile / tiles_x) * tile_size;
+            uint32_t x1 = x0 + tile_size < image->width ? x0 + tile_size : image->width;
+            uint32_t y1 = y0 + tile_size < image->height ? y0 + tile_size : image->height;
+            for (uint32_t y = y0; y < y1; ++y) {
+                for (uint32_t x = x0; x < x1; ++x) {
+                    float origin[3], direction[3], t_near, t_far;
+                    volpath::get_camera_ray(settings, &scene->trace, image->width, image->height, float(x) + 0.5f, float(y) + 0.5f,
+                        origin, direction, &t_near, &t_far);
+                    Vector3 color(0.0f, 0.0f, 0.0f);
+                    float transmittance = 1.0f;
+                    if (t_far >= 0.0f) {
+                        Vector3 rp(origin[0], origin[1], origin[2]), rd(direction[0], direction[1], direction[2]);
+                        color = march_ray(&tile_context, rp, rd, fmaxf(t_near, 0.0f), t_far, &transmittance);
+                    }
+                    color += Vector3(background, background, background) * transmittance;
+                    size_t pixel = size_t(y) * image->width + x;
+                    float *radiance = image->radiance + 3 * pixel;
+                    float *display = image->display + 3 * pixel;
+                    radiance[0] = color.x;
+                    radiance[1] = color.y;
+                    radiance[2] = color.z;
+                    display[0] = linear_to_srgb(color.x);
+                    display[1] = linear_to_srgb(color.y);
+                    display[2] = linear_to_srgb(color.z);
+                }
+            }
+            tile_fetches[tile] = tile_context.trace_fetches;
+        }
+    });
+    for (uint32_t tile = 0; tile < tile_count; ++tile)
+        image->trace_fetches += tile_fetches[tile];
+    image->sample_count = 1;
+    memory::free_heap(tile_fetches);
+    for (uint32_t level = 0; level < bricks->level_count; ++level)
+        memory::free_heap(context.occupied[level]);
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <stdint.h>
+#include "volume.h"
+#include "volpath.h"
+
+// Transfer functions of the slice renderer, the ps_volume_*.hlsl shaders (same order as VisualizationMode)
+enum VolmarchMode
+{
+    VMM_TRACE = 0, // Trace through the trace palette (ps_volume_trace)
+    VMM_HIGHLIGHT = 1, // Trace and deposit with a highlighted density band (ps_volume_highlight)
+    VMM_OVERDENSITY = 2, // Trace classified by the overdensity thresholds (ps_volume_overdensity)
+    VMM_VELOCITY = 3, // Agent velocities of VELOCITY_ANALYSIS builds (ps_volume_velocity)
+    VMM_HALOCOLOR = 4, // Sharpened trace and colored halos of HALO_COLOR_ANALYSIS builds (ps_volume_halocolor)
+    VMM_COUNT
+};
+
+const uint32_t VOLMARCH_BRICK = 8; // Voxels per brick and axis at the finest level of the brick hierarchy
+const uint32_t VOLMARCH_MAX_LEVELS = 8;
+
+// Min/max hierarchy of the trace and deposit. Level 0 bounds bricks of block_size voxels including the two-voxel apron
+// that trilinear lookups and the halocolor neighbors reach; every further level bounds 2 x 2 x 2 cells of the one below.
+struct VolmarchBricks
+{
+    float *trace_min[VOLMARCH_MAX_LEVELS];
+    float *trace_max[VOLMARCH_MAX_LEVELS];
+    float *deposit_max[VOLMARCH_MAX_LEVELS];
+    uint32_t width[VOLMARCH_MAX_LEVELS]; // Cells per axis
+    uint32_t height[VOLMARCH_MAX_LEVELS];
+    uint32_t depth[VOLMARCH_MAX_LEVELS];
+    uint32_t level_count; // 0 = no hierarchy, every ray marches the whole trimmed domain
+    uint32_t block_size;
+};
+
+// Grids the marcher samples; only the ones the mode reads have to be loaded
+struct VolmarchScene
+{
+    Volume trace; // Trace channel 0 (phase.r of velocity builds)
+    Volume deposit; // Deposit channel 0, for VMM_HIGHLIGHT and VMM_HALOCOLOR
+    Volume velocity[3]; // Trace channels 1-3, for VMM_VELOCITY
+    Volume halo_color; // Deposit channel 1 (positive = blue halo), for VMM_HALOCOLOR
+    float *palette_trace; // RGB entries, for VMM_TRACE
+    uint32_t palette_trace_size;
+    VolmarchBricks bricks; // Optional, enables empty-space skipping
+};
+
+// `volmarch` namespace is a CPU emission-absorption ray marcher with the transfer functions of the slice renderer, for
+// rendering the volume modes headless. Rays use the camera of the path tracer.
+namespace volmarch
+{
+    // Mode by the name used on command lines: trace, highlight, overdensity, velocity or halocolor
+    bool get_mode(const char *name, VolmarchMode *mode);
+
+    // Compute the brick hierarchy of the scene's trace and deposit in parallel; rebuild it whenever they change
+    void build_bricks(VolmarchScene *scene, uint32_t block_size = VOLMARCH_BRICK);
+    void release(VolmarchBricks *bricks);
+
+    // Render the image in parallel screen tiles. A fragment of the slice renderer becomes a sample whose opacity holds
+    // for one voxel of path length; samples are composited front to back and rays stop once they are opaque.
+    // Fills image->radiance with the linear colors and image->display with their sRGB encoding (what the window shows).
+    void render(VolmarchScene *scene, VolpathSettings *settings, VolmarchMode mode, VolpathImage *image);
+}
@@ -0,0 +1,1105 @@
+#include "volpath.h"
+#include "memory.h"
+#include "jobs.h"
+#include "maths.h"
+#include <math.h>
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <chrono>
+
+// Constants of cs_volpath.hlsl
+static const float VP_PI2 = 6.283184f;
+static const float RAY_EPSILON = 1.e-5f;
+static const float INTENSITY_EPSILON = 1.e-4f;
+static const float NUMERICAL_EPSILON = 1.e-4f;
+static const float SCREEN_DISTANCE = 4.5f;
+static const float CAMERA_OFFSET_RATIO = 0.45f;
+static const float MARCH_STEP = 1.71f; // Emission-absorption step [vox]
+static const float RATIO_TRACKING_RR_THRESHOLD = 0.1f; // Transmittance estimates below this play Russian roulette
+static const uint32_t RR_START_ORDER = 2;
+static const uint32_t MAX_PASS_SAMPLES = 16; // Samples per pixel of one render() pass, bounds the time budget overshoot
+static const float FEATURE_OPTICAL_DEPTH = 7.0f; // Feature rays stop where less than 0.1% of the light gets through
+static const uint32_t FEATURE_RAYS = 4;
+static const uint32_t MIN_ADAPTIVE_SAMPLES = 16; // Samples per pixel before a tile may stop, so sparse bright paths are seen
+static const float ERROR_LUMINANCE_FLOOR = 0.01f; // Pixels darker than this need an absolute error, not a relative one
+static const float POINT_LIGHT_INTENSITY = 100.0f; // Of the POINT light, before galaxy_weight
+static const float GALAXY_LIGHT_SCALE = 1.e-4f; // Galaxy intensity per deposit weight; the weights sum to 10^6, the POINT light's 100
+static const float FEATURE_RAY_OFFSETS[FEATURE_RAYS][2] = { { 0.375f, 0.125f }, { 0.875f, 0.375f }, { 0.125f, 0.625f }, { 0.625f, 0.875f } }; // Rotated grid
+
+// Multiply-with-carry generator of the shader
+struct Rng
+{
+    uint32_t w;
+    uint32_t z;
+};
+
+static void set_seed(Rng *rng, uint32_t seed1, uint32_t seed2)
+{
+    rng->w = seed1;
+    rng->z = seed2;
+    if (rng->w == 0U || rng->w == 0x464fffffU) ++rng->w;
+    if (rng->w == 0U || rng->z == 0x9068ffffU) ++rng->z;
+}
+
+static uint32_t random_uint(Rng *rng)
+{
+    rng->z = 36969U * (rng->z & 65535U) + (rng->z >> 16U);
+    rng->w = 18000U * (rng->w & 65535U) + (rng->w >> 16U);
+    return (rng->z << 16U) + rng->w;
+}
+
+static float random_float(Rng *rng)
+{
+    return float(random_uint(rng)) / float(0xFFFFFFFFU);
+}
+
+static uint32_t wang_hash(uint32_t seed)
+{
+    seed = (seed ^ 61U) ^ (seed >> 16U);
+    seed *= 9U;
+    seed = seed ^ (seed >> 4U);
+    seed *= 0x27d4eb2dU;
+    seed = seed ^ (seed >> 15U);
+    return seed;
+}
+
+// Component-wise product
+static inline Vector3 mul(Vector3 a, Vector3 b)
+{
+    return Vector3(a.x * b.x, a.y * b.y, a.z * b.z);
+}
+
+// Everything a pass derives from the settings once
+struct VolpathContext
+{
+    VolpathScene *scene;
+    VolpathSettings *settings;
+    Vector3 camera;
+    Vector3 camera_x; // Camera basis
+    Vector3 camera_y;
+    Vector3 camera_z;
+    Vector3 grid_size; // Grid resolution, the texture coordinates of the shader [vox]
+    Vector3 domain_low; // Domain box centered at the origin with unit width
+    Vector3 domain_high;
+    Vector3 box_low; // Trimmed domain [vox]
+    Vector3 box_high;
+    Vector3 light; // POINT light position [vox]
+    float sigma_s; // Per scene voxel
+    float sigma_a;
+    float albedo;
+    float rho_max_inv;
+    float sigma_max_inv;
+    float aspect_ratio;
+    uint64_t trace_fetches; // Counted per job, every job works on its own copy of the context
+};
+
+// DDA walk through the majorant grid along a ray
+struct MajorantWalk
+{
+    int32_t cell[3];
+    int32_t step[3];
+    float t_next[3]; // Ray parameter of the next cell boundary per axis
+    float t_delta[3]; // Ray parameter between boundaries per axis
+};
+
+// Trilinear sample at grid coordinates as the clamped texture sampler returns it
+static inline float sample_grid(const Volume *volume, Vector3 p)
+{
+    return volume::sample_trilinear(volume, p.x, p.y, p.z);
+}
+
+static inline float remap(float value)
+{
+    return 1.0f - expf(-value);
+}
+
+static inline float get_luminance(Vector3 color)
+{
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+static inline Vector3 tonemap(Vector3 L, float exposure)
+{
+    return Vector3(1.0f - expf(-exposure * L.x), 1.0f - expf(-exposure * L.y), 1.0f - expf(-exposure * L.z));
+}
+
+// Point-sampled palette entry at u in [0, 1]
+static inline Vector3 get_palette(const float *palette, uint32_t size, float u)
+{
+    int32_t index = int32_t(u * float(size));
+    index = index < 0 ? 0 : (index >= int32_t(size) ? int32_t(size) - 1 : index);
+    return Vector3(palette[3 * index], palette[3 * index + 1], palette[3 * index + 2]);
+}
+
+static inline float trace_to_rho(const VolpathSettings *settings, float trace)
+{
+    float excess = trace - settings->trim_density;
+    return settings->sample_weight * ((excess > 0.0f ? excess : 0.0f) + settings->ambient_trace);
+}
+
+static inline float get_rho(VolpathContext *context, Vector3 p)
+{
+    ++context->trace_fetches;
+    return trace_to_rho(context->settings, sample_grid(&context->scene->trace, p));
+}
+
+static inline float get_halo(VolpathContext *context, Vector3 p)
+{
+    return 0.01f * context->settings->galaxy_weight * sample_grid(&context->scene->deposit, p);
+}
+
+static Vector3 get_halo_gradient(VolpathContext *context, Vector3 p, float dp)
+{
+    Vector3 gradient;
+    gradient.x = get_halo(context, p + Vector3(dp, 0.0f, 0.0f)) - get_halo(context, p - Vector3(dp, 0.0f, 0.0f));
+    gradient.y = get_halo(context, p + Vector3(0.0f, dp, 0.0f)) - get_halo(context, p - Vector3(0.0f, dp, 0.0f));
+    gradient.z = get_halo(context, p + Vector3(0.0f, 0.0f, dp)) - get_halo(context, p - Vector3(0.0f, 0.0f, dp));
+    return gradient / dp;
+}
+
+// Trace and halo emission at a point with density rho
+static Vector3 get_emission(VolpathContext *context, Vector3 p, float rho)
+{
+    VolpathScene *scene = context->scene;
+    Vector3 emission(0.0f, 0.0f, 0.0f);
+    if (context->settings->illumination & VI_TRACE)
+        emission += 0.05f * get_palette(scene->palette_trace, scene->palette_trace_size, remap(rho));
+    if (context->settings->illumination & VI_HALO)
+        emission += get_palette(scene->palette_data, scene->palette_data_size, remap(get_halo(context, p)));
+    return emission;
+}
+
+static inline float get_sky_L(VolpathContext *context)
+{
+    return (context->settings->illumination & VI_WHITE_SKY) ? context->settings->sigma_e : 0.0f;
+}
+
+static void ray_AABB_intersection(Vector3 rp, Vector3 rd, Vector3 c_low, Vector3 c_high, float *t_near, float *t_far)
+{
+    float t0 = (c_low.x - rp.x) / rd.x, t1 = (c_high.x - rp.x) / rd.x;
+    float t2 = (c_low.y - rp.y) / rd.y, t3 = (c_high.y - rp.y) / rd.y;
+    float t4 = (c_low.z - rp.z) / rd.z, t5 = (c_high.z - rp.z) / rd.z;
+    float t6 = fmaxf(fmaxf(fminf(t0, t1), fminf(t2, t3)), fminf(t4, t5));
+    float t7 = fminf(fminf(fmaxf(t0, t1), fmaxf(t2, t3)), fmaxf(t4, t5));
+    bool miss = t7 < 0.0f || t6 >= t7;
+    *t_near = miss ? -1.0f : t6;
+    *t_far = miss ? -1.0f : t7;
+}
+
+static Vector3 coord_normalized_to_texture(Vector3 coord, Vector3 c_low, Vector3 c_high, Vector3 size)
+{
+    Vector3 extent = c_high - c_low;
+    Vector3 relative = coord - c_low;
+    relative = Vector3(relative.x / extent.x, 1.0f - relative.y / extent.y, 1.0f - relative.z / extent.z);
+    return mul(relative, size);
+}
+
+static inline float delta_step(float sigma_max_inv, float xi)
+{
+    return -logf(xi > 0.001f ? xi : 0.001f) * sigma_max_inv;
+}
+
+// Start a walk at rp + t * rd, in the cell clamped to the grid
+static void majorant_walk_start(VolpathMajorant *majorant, Vector3 rp, Vector3 rd, float t, MajorantWalk *walk)
+{
+    float origin[3] = { rp.x, rp.y, rp.z };
+    float direction[3] = { rd.x, rd.y, rd.z };
+    int32_t cell_count[3] = { int32_t(majorant->width), int32_t(majorant->height), int32_t(majorant->depth) };
+    float block = float(majorant->block_size);
+    for (uint32_t a = 0; a < 3; ++a) {
+        int32_t cell = int32_t(floorf((origin[a] + t * direction[a]) / block));
+        walk->cell[a] = cell < 0 ? 0 : (cell >= cell_count[a] ? cell_count[a] - 1 : cell);
+        walk->step[a] = direction[a] >= 0.0f ? 1 : -1;
+        if (direction[a] != 0.0f) {
+            float boundary = float(walk->cell[a] + (walk->step[a] > 0 ? 1 : 0)) * block;
+            walk->t_next[a] = (boundary - origin[a]) / direction[a];
+            walk->t_delta[a] = block / fabsf(direction[a]);
+        } else {
+            walk->t_next[a] = 1.e30f;
+            walk->t_delta[a] = 1.e30f;
+        }
+    }
+}
+
+// Step into the next cell, false once the walk leaves the grid
+static bool majorant_walk_next(VolpathMajorant *majorant, MajorantWalk *walk)
+{
+    uint32_t a = (walk->t_next[0] <= walk->t_next[1] && walk->t_next[0] <= walk->t_next[2]) ? 0 : (walk->t_next[1] <= walk->t_next[2] ? 1 : 2);
+    walk->cell[a] += walk->step[a];
+    walk->t_next[a] += walk->t_delta[a];
+    uint32_t cell_count = a == 0 ? majorant->width : (a == 1 ? majorant->height : majorant->depth);
+    return walk->cell[a] >= 0 && uint32_t(walk->cell[a]) < cell_count;
+}
+
+// End of the current cell's ray segment that starts at t
+static inline float get_cell_end(MajorantWalk *walk, float t, float t_max)
+{
+    return fmaxf(fminf(fminf(fminf(walk->t_next[0], walk->t_next[1]), walk->t_next[2]), t_max), t);
+}
+
+static inline size_t get_cell_index(VolpathMajorant *majorant, MajorantWalk *walk)
+{
+    return (size_t(walk->cell[2]) * majorant->height + walk->cell[1]) * majorant->width + walk->cell[0];
+}
+
+// Rho bound of the current cell
+static inline float get_rho_majorant(VolpathContext *context, MajorantWalk *walk)
+{
+    VolpathMajorant *majorant = &context->scene->majorant;
+    return trace_to_rho(context->settings, majorant->trace_max[get_cell_index(majorant, walk)]);
+}
+
+// Lowest rho in the current cell, the control density of residual ratio tracking
+static inline float get_rho_control(VolpathContext *context, MajorantWalk *walk)
+{
+    VolpathMajorant *majorant = &context->scene->majorant;
+    return trace_to_rho(context->settings, majorant->trace_min[get_cell_index(majorant, walk)]);
+}
+
+// Exact exponential free path; unlike delta_step it does not clamp xi, which ratio tracking needs to stay unbiased
+static inline float free_path(float sigma_inv, float xi)
+{
+    return -logf(1.0f - xi) * sigma_inv;
+}
+
+// Keep a small estimate with probability |estimate| / RATIO_TRACKING_RR_THRESHOLD, raised to the threshold
+static inline bool russian_roulette(float *estimate, Rng *rng)
+{
+    float magnitude = fabsf(*estimate);
+    if (magnitude >= RATIO_TRACKING_RR_THRESHOLD)
+        return true;
+    if (random_float(rng) * RATIO_TRACKING_RR_THRESHOLD >= magnitude)
+        return false;
+    *estimate = *estimate < 0.0f ? -RATIO_TRACKING_RR_THRESHOLD : RATIO_TRACKING_RR_THRESHOLD;
+    return true;
+}
+
+static float delta_tracking(VolpathContext *context, Vector3 rp, Vector3 rd, float t_min, float t_max, Rng *rng)
+{
+    VolpathMajorant *majorant = &context->scene->majorant;
+    if (majorant->trace_max) {
+        // Each cell segment is tracked against its own majorant; empty cells are crossed without lookups.
+        // Returns t_max when the ray leaves the segment without a collision.
+        MajorantWalk walk;
+        majorant_walk_start(majorant, rp, rd, t_min, &walk);
+        float sigma_t = context->sigma_a + context->sigma_s;
+        float t = t_min;
+        while (t < t_max) {
+            float t_cell = get_cell_end(&walk, t, t_max);
+            float rho_majorant = get_rho_majorant(context, &walk);
+            if (rho_majorant > 0.0f) {
+                float t_candidate = t + delta_step(1.0f / (sigma_t * rho_majorant), random_float(rng));
+                if (t_candidate < t_cell) {
+                    t = t_candidate;
+                    if (random_float(rng) * rho_majorant < get_rho(context, rp + t * rd))
+                        return t;
+                    continue;
+                }
+            }
+            // Free paths are memoryless, so the walk restarts at the cell boundary
+            t = t_cell;
+            if (!majorant_walk_next(majorant, &walk))
+                break;
+        }
+        return t_max;
+    }
+
+    float t = t_min;
+    float event_rho = 0.0f;
+    do {
+        t += delta_step(context->sigma_max_inv, random_float(rng));
+        event_rho = get_rho(context, rp + t * rd);
+    } while (t <= t_max && random_float(rng) > event_rho * context->rho_max_inv);
+    return t;
+}
+
+// Transmittance between t_min and t_max by residual ratio tracking. In every majorant cell the minimum density is a
+// control whose optical depth is integrated exactly, and only the residual up to the cell maximum is sampled; each
+// tentative collision scales the estimate by the probability of a null collision. Unbiased for any majorant: with the
+// global trace_max fallback, denser voxels give negative factors instead of a bias. Estimates below RATIO_TRACKING_RR_THRESHOLD are ended by Russian roulette.
+static float ratio_tracking(VolpathContext *context, Vector3 rp, Vector3 rd, float t_min, float t_max, Rng *rng)
+{
+    float sigma_t = context->sigma_a + context->sigma_s;
+    float transmittance = 1.0f;
+    VolpathMajorant *majorant = &context->scene->majorant;
+    if (majorant->trace_max) {
+        MajorantWalk walk;
+        majorant_walk_start(majorant, rp, rd, t_min, &walk);
+        float t = t_min;
+        while (t < t_max) {
+            float t_cell = get_cell_end(&walk, t, t_max);
+            float rho_control = get_rho_control(context, &walk);
+            float rho_residual = get_rho_majorant(context, &walk) - rho_control;
+            transmittance *= expf(-sigma_t * rho_control * (t_cell - t));
+            if (rho_residual > 0.0f) {
+                float residual_inv = 1.0f / (sigma_t * rho_residual);
+                for (t += free_path(residual_inv, random_float(rng)); t < t_cell; t += free_path(residual_inv, random_float(rng))) {
+                    transmittance *= 1.0f - (get_rho(context, rp + t * rd) - rho_control) / rho_residual;
+                    if (!russian_roulette(&transmittance, rng))
+                        return 0.0f;
+                }
+            }
+            t = t_cell;
+            if (!majorant_walk_next(majorant, &walk))
+                break;
+        }
+        return transmittance;
+    }
+
+    for (float t = t_min + free_path(context->sigma_max_inv, random_float(rng)); t < t_max; t += free_path(context->sigma_max_inv, random_float(rng))) {
+        transmittance *= 1.0f - get_rho(context, rp + t * rd) * context->rho_max_inv;
+        if (!russian_roulette(&transmittance, rng))
+            return 0.0f;
+    }
+    return transmittance;
+}
+
+// Orthonormal vectors perpendicular to a unit direction; directions along y, where the shader divides by zero, use x and z
+static void generate_basis(Vector3 dir, Vector3 *v1, Vector3 *v2)
+{
+    float norm_squared = dir.x * dir.x + dir.z * dir.z;
+    if (norm_squared < 1.e-12f) {
+        *v1 = Vector3(1.0f, 0.0f, 0.0f);
+        *v2 = Vector3(0.0f, 0.0f, 1.0f);
+        return;
+    }
+    float inv_norm = 1.0f / sqrtf(norm_squared);
+    *v1 = Vector3(dir.z * inv_norm, 0.0f, -dir.x * inv_norm);
+    *v2 = math::cross(dir, *v1);
+}
+
+static Vector3 sample_HG(Vector3 v, float g, Rng *rng)
+{
+    float xi = random_float(rng);
+    float cos_theta;
+    if (fabsf(g) > 1.e-3f) {
+        float sqr_term = (1.0f - g * g) / (1.0f - g + 2.0f * g * xi);
+        cos_theta = (1.0f + g * g - sqr_term * sqr_term) / (2.0f * fabsf(g));
+    } else {
+        cos_theta = 1.0f - 2.0f * xi;
+    }
+    float sin_theta = sqrtf(math::max(0.0f, 1.0f - cos_theta * cos_theta));
+    float phi = VP_PI2 * random_float(rng);
+    Vector3 v1, v2;
+    generate_basis(v, &v1, &v2);
+    return (sin_theta * cosf(phi)) * v1 + (sin_theta * sinf(phi)) * v2 + cos_theta * v;
+}
+
+static float pdf_HG(float g, float cos_angle)
+{
+    float denominator_cubicrt = sqrtf(math::max(1.0f + g * g - 2.0f * g * cos_angle, NUMERICAL_EPSILON));
+    return (1.0f - g * g) / (denominator_cubicrt * denominator_cubicrt * denominator_cubicrt);
+}
+
+// Uniform direction. The shader also scales it by a random radius, which makes the next free path length depend on it;
+// here the direction stays unit length.
+static Vector3 uniform_unit_sphere(Rng *rng)
+{
+    float azimuth = random_float(rng) * VP_PI2;
+    float polar = acosf(2.0f * random_float(rng) - 1.0f);
+    return Vector3(cosf(azimuth) * sinf(polar), cosf(polar), sinf(azimuth) * sinf(polar));
+}
+
+// Light of a point source at `light` reaching rp, with an unbiased transmittance estimate; the falloff uses simulation voxels
+static float get_point_L(VolpathContext *context, Vector3 rp, Vector3 light, float intensity, Rng *rng)
+{
+    Vector3 ld = light - rp;
+    float l_distance = math::length(ld);
+    ld = ld / math::max(l_distance, NUMERICAL_EPSILON);
+    float transmittance = ratio_tracking(context, rp, ld, 0.0f, l_distance, rng);
+    float falloff_distance = l_distance * context->settings->voxel_scale;
+    return intensity * transmittance / math::max(falloff_distance * falloff_distance, 1.0f);
+}
+
+static Vector3 get_incident_L(VolpathContext *context, Vector3 rp, Vector3 rd, uint32_t bounce_count, Rng *rng)
+{
+    VolpathSettings *settings = context->settings;
+    Vector3 L(0.0f, 0.0f, 0.0f);
+    float throughput = 1.0f;
+
+    for (uint32_t n = 0; n < bounce_count; ++n) {
+        // Sample collision distance
+        float t_near, t_far;
+        ray_AABB_intersection(rp, rd, context->box_low, context->box_high, &t_near, &t_far);
+        float t_event = delta_tracking(context, rp, rd, 0.0f, t_far, rng);
+        if (t_event >= t_far)
+            return L + Vector3(1.0f, 1.0f, 1.0f) * (throughput * get_sky_L(context));
+        rp = rp + t_event * rd;
+        float rho_event = get_rho(context, rp);
+
+        // Get emitted light
+        Vector3 emission = get_emission(context, rp, rho_event);
+        if (settings->illumination & VI_POINT) {
+            float point_L = get_point_L(context, rp, context->light, POINT_LIGHT_INTENSITY * settings->galaxy_weight, rng);
+            emission += Vector3(point_L, point_L, point_L);
+        }
+        if (settings->illumination & VI_GALAXIES) {
+            // Next-event estimation towards one galaxy picked by the light BVH, weighted by the inverse of its probability
+            float pmf;
+            LightBVH *lights = &context->scene->lights;
+            uint32_t light = light_bvh::sample(lights, rp.x, rp.y, rp.z, random_float(rng), &pmf);
+            if (light != LIGHT_BVH_NONE) {
+                LightBVHPoint *galaxy = lights->lights + light;
+                float intensity = GALAXY_LIGHT_SCALE * settings->galaxy_weight * galaxy->power / pmf;
+                float galaxy_L = get_point_L(context, rp, Vector3(galaxy->x, galaxy->y, galaxy->z), intensity, rng);
+                emission += Vector3(galaxy_L, galaxy_L, galaxy_L);
+            }
+        }
+        L += (throughput * rho_event * settings->sigma_e) * emission;
+
+        // Adjust the path throughput (RR or modulate)
+        if (settings->russian_roulette && n >= RR_START_ORDER && random_float(rng) > context->albedo)
+            return L;
+        throughput *= context->albedo;
+
+        // Sample new direction and continue the walk
+        if (settings->gradient_guiding) {
+            Vector3 grad = get_halo_gradient(context, rp, 1.0f) / settings->voxel_scale;
+            bool has_gradient = fabsf(grad.x) > INTENSITY_EPSILON || fabsf(grad.y) > INTENSITY_EPSILON || fabsf(grad.z) > INTENSITY_EPSILON;
+            if (settings->guiding_strength > INTENSITY_EPSILON && has_gradient) {
+                float g = math::min(settings->guiding_strength * math::length(grad), settings->scattering_anisotropy);
+                Vector3 grad_norm = grad / math::length(grad);
+                Vector3 rd_new = sample_HG(grad_norm, g, rng);
+                throughput /= pdf_HG(g, math::dot(grad_norm, rd_new));
+                rd = rd_new;
+            } else {
+                rd = uniform_unit_sphere(rng);
+            }
+        } else {
+            rd = sample_HG(rd, settings->scattering_anisotropy, rng);
+        }
+    }
+    return L;
+}
+
+// Camera ray through the image position (x, y) [px] in grid coordinates
+static void get_primary_ray(VolpathContext *context, uint32_t width, uint32_t height, float x, float y, Vector3 *rp, Vector3 *rd)
+{
+    VolpathSettings *settings = context->settings;
+    float rx = x / float(width) * 2.0f - 1.0f;
+    float ry = y / float(height) * 2.0f - 1.0f;
+    ry /= context->aspect_ratio;
+
+    Vector3 screen_pos = context->camera
+        + (rx - CAMERA_OFFSET_RATIO * settings->camera_offset_x) * context->camera_x
+        + (ry - CAMERA_OFFSET_RATIO * settings->camera_offset_y) * context->camera_y
+        + SCREEN_DISTANCE * context->camera_z;
+    *rp = coord_normalized_to_texture(context->camera, context->domain_low, context->domain_high, context->grid_size);
+    *rd = coord_normalized_to_texture(screen_pos, context->domain_low, context->domain_high, context->grid_size) - *rp;
+    *rd = *rd / math::length(*rd);
+}
+
+// One radiance sample of a pixel, the main() of the shader
+static Vector3 get_pixel_L(VolpathContext *context, VolpathImage *image, uint32_t x, uint32_t y, Rng *rng)
+{
+    VolpathSettings *settings = context->settings;
+    Vector3 rp, rd;
+    float sx = float(x) + random_float(rng);
+    float sy = float(y) + random_float(rng);
+    get_primary_ray(context, image->width, image->height, sx, sy, &rp, &rd);
+    float t_near, t_far;
+    ray_AABB_intersection(rp, rd, context->box_low, context->box_high, &t_near, &t_far);
+    if (t_far < 0.0f)
+        return Vector3(1.0f, 1.0f, 1.0f) * get_sky_L(context);
+
+    // Integrate along the ray segment that intersects the box
+    t_near += RAY_EPSILON;
+    t_far -= RAY_EPSILON;
+    rp = rp + t_near * rd;
+    float segment_length = t_far - t_near;
+    Vector3 path_L(0.0f, 0.0f, 0.0f);
+    if (settings->sigma_s < INTENSITY_EPSILON) {
+        // No appreciable scattering: ray-march the emission-absorption model
+        int32_t step_count = int32_t(segment_length / MARCH_STEP);
+        if (step_count <= 0)
+            return path_L;
+        Vector3 dd = rd * (segment_length / float(step_count));
+        float tau = 0.0f;
+        float emission_scale = settings->sigma_e * settings->voxel_scale;
+        rp += (random_float(rng) - 0.5f) * dd;
+        float rho0 = get_rho(context, rp);
+        for (int32_t i = 0; i < step_count; ++i) {
+            rp += dd;
+            float rho1 = get_rho(context, rp);
+            float rho = 0.5f * (rho0 + rho1);
+            tau += rho;
+            float transmittance = expf(-(context->sigma_a + context->sigma_s) * tau);
+            path_L += (transmittance * rho * emission_scale) * get_emission(context, rp, rho);
+            rho0 = rho1;
+        }
+    } else {
+        // Significant scattering: full path-traced solution
+        path_L = get_incident_L(context, rp, rd, settings->bounce_count + 1, rng) * VP_PI2;
+    }
+    return path_L;
+}
+
+// Denoiser features of a pixel: the emission-absorption march of get_pixel_L along FEATURE_RAYS rays through the pixel,
+// averaging depth, density and emission color with the weights the march gives the emission. The rays antialias the
+// feature edges as the jittered samples antialias the image. Trace lookups are not counted as samples.
+static void set_pixel_features(VolpathContext *context, VolpathImage *image, uint32_t x, uint32_t y)
+{
+    VolpathContext feature_context = *context;
+    float sigma_t = feature_context.sigma_a + feature_context.sigma_s;
+    float weight_sum = 0.0f, depth_sum = 0.0f, density_sum = 0.0f;
+    Vector3 albedo_sum(0.0f, 0.0f, 0.0f);
+    for (uint32_t ray = 0; ray < FEATURE_RAYS; ++ray) {
+        Vector3 rp, rd;
+        get_primary_ray(&feature_context, image->width, image->height, float(x) + FEATURE_RAY_OFFSETS[ray][0],
+            float(y) + FEATURE_RAY_OFFSETS[ray][1], &rp, &rd);
+        float t_near, t_far;
+        ray_AABB_intersection(rp, rd, feature_context.box_low, feature_context.box_high, &t_near, &t_far);
+        if (t_far < 0.0f)
+            continue;
+        t_near = fmaxf(t_near, 0.0f) + RAY_EPSILON;
+        t_far -= RAY_EPSILON;
+        int32_t step_count = int32_t((t_far - t_near) / MARCH_STEP);
+        float dt = step_count > 0 ? (t_far - t_near) / float(step_count) : 0.0f;
+        float tau = 0.0f;
+        for (int32_t i = 0; i < step_count; ++i) {
+            float t = t_near + (float(i) + 0.5f) * dt;
+            Vector3 p = rp + t * rd;
+            float rho = get_rho(&feature_context, p);
+            tau += rho;
+            float weight = expf(-sigma_t * tau) * rho;
+            if (weight <= 0.0f)
+                continue;
+            weight_sum += weight;
+            depth_sum += weight * t;
+            density_sum += weight * rho;
+            albedo_sum += weight * get_emission(&feature_context, p, rho);
+            if (sigma_t * tau > FEATURE_OPTICAL_DEPTH)
+                break;
+        }
+    }
+    size_t pixel = size_t(y) * image->width + x;
+    float weight_inv = weight_sum > 0.0f ? 1.0f / weight_sum : 0.0f;
+    image->depth[pixel] = depth_sum * weight_inv;
+    image->density[pixel] = density_sum * weight_inv;
+    image->albedo[3 * pixel] = albedo_sum.x * weight_inv;
+    image->albedo[3 * pixel + 1] = albedo_sum.y * weight_inv;
+    image->albedo[3 * pixel + 2] = albedo_sum.z * weight_inv;
+}
+
+static VolpathContext get_context(VolpathScene *scene, VolpathSettings *settings, uint32_t width, uint32_t height)
+{
+    VolpathContext context = {};
+    context.scene = scene;
+    context.settings = settings;
+    context.camera = Vector3(settings->camera_x, settings->camera_y, settings->camera_z);
+    context.camera_z = math::normalize(-context.camera);
+    context.camera_x = math::normalize(math::cross(context.camera_z, Vector3(0.0f, 0.0f, 1.0f)));
+    context.camera_y = math::normalize(math::cross(context.camera_x, context.camera_z));
+
+    Volume *grid = &scene->trace;
+    context.grid_size = Vector3(float(grid->width), float(grid->height), float(grid->depth));
+    Vector3 diagonal = Vector3(1.0f, context.grid_size.y / context.grid_size.x, context.grid_size.z / context.grid_size.x);
+    context.domain_low = -0.5f * diagonal;
+    context.domain_high = 0.5f * diagonal;
+    Vector3 trim_min = Vector3(settings->trim_min[0], settings->trim_min[1], settings->trim_min[2]);
+    Vector3 trim_max = Vector3(settings->trim_max[0], settings->trim_max[1], settings->trim_max[2]);
+    context.box_low = mul(Vector3(math::max(0.0f, trim_min.x), math::max(0.0f, trim_min.y), math::max(0.0f, trim_min.z)), context.grid_size);
+    context.box_high = mul(Vector3(math::min(1.0f, trim_max.x), math::min(1.0f, trim_max.y), math::min(1.0f, trim_max.z)), context.grid_size);
+    // As in the shader: the trimmed box corner plus the trim center scaled by the upper corner
+    context.light = context.box_low + mul(0.5f * (trim_min + trim_max), context.box_high);
+
+    // Coefficients are per simulation voxel, the free paths are taken in scene voxels
+    context.sigma_s = settings->sigma_s * settings->voxel_scale;
+    context.sigma_a = settings->sigma_a * settings->voxel_scale;
+    context.albedo = settings->sigma_s / (settings->sigma_a + settings->sigma_s);
+    context.rho_max_inv = 1.0f / trace_to_rho(settings, settings->trace_max);
+    context.sigma_max_inv = context.rho_max_inv / (context.sigma_a + context.sigma_s);
+    context.aspect_ratio = float(width) / float(height);
+    return context;
+}
+
+VolpathSettings volpath::get_default_settings()
+{
+    VolpathSettings settings = {};
+    settings.width = 1280;
+    settings.height = 720;
+    settings.camera_x = 5.0f; // azimuth 0, polar PI/2, radius 5
+    settings.camera_y = 0.0f;
+    settings.camera_z = 0.0f;
+    settings.trim_max[0] = settings.trim_max[1] = settings.trim_max[2] = 1.0f;
+    settings.trim_density = 1.0e-5f;
+    settings.sample_weight = 0.01f;
+    settings.galaxy_weight = 0.25f;
+    settings.ambient_trace = 0.0f;
+    settings.trace_max = 100.0f;
+    settings.sigma_s = 0.0f;
+    settings.sigma_a = 0.5f;
+    settings.sigma_e = 10.0f;
+    settings.scattering_anisotropy = 0.9f;
+    settings.guiding_strength = 0.1f;
+    settings.exposure = 1.0f;
+    settings.bounce_count = 5;
+    settings.compressive_accumulation = true;
+    settings.illumination = VI_TRACE | VI_HALO;
+    settings.russian_roulette = true;
+    settings.gradient_guiding = false;
+    settings.tile_size = 32;
+    settings.voxel_scale = 1.0f;
+    settings.optical_thickness = 0.25f;
+    settings.highlight_density = 10.0f;
+    settings.histogram_base = 10.0f;
+    settings.overdensity_threshold_low = 1.0f;
+    settings.overdensity_threshold_high = 10.0f;
+    settings.background = 0.0f;
+    return settings;
+}
+
+bool volpath::load_state(const char *filename, VolpathSettings *settings)
+{
+    std::ifstream state(filename);
+    if (!state.is_open()) {
+        printf("Failed to open view state %s\n", filename);
+        return false;
+    }
+    // Same order as the F9 handler in main.cpp writes it
+    float polar, azimuth, radius, offset_z, compressive;
+    state >> polar >> azimuth >> radius;
+    state >> settings->camera_offset_x >> settings->camera_offset_y >> offset_z;
+    state >> settings->trim_min[0] >> settings->trim_max[0] >> settings->trim_min[1] >> settings->trim_max[1]
+        >> settings->trim_min[2] >> settings->trim_max[2];
+    state >> settings->sample_weight >> settings->galaxy_weight >> settings->optical_thickness >> settings->optical_thickness
+        >> settings->trim_density >> settings->highlight_density >> settings->overdensity_threshold_low >> settings->overdensity_threshold_high;
+    state >> settings->sigma_s >> settings->sigma_a >> settings->sigma_e >> settings->scattering_anisotropy
+        >> settings->exposure >> settings->trace_max >> settings->bounce_count >> settings->ambient_trace >> compressive;
+    if (state.fail()) {
+        printf("Failed to parse view state %s\n", filename);
+        return false;
+    }
+    settings->compressive_accumulation = compressive == 1.0f;
+    set_orbit(settings, polar, azimuth, radius);
+    return true;
+}
+
+void volpath::set_orbit(VolpathSettings *settings, float polar, float azimuth, float radius)
+{
+    settings->camera_x = cosf(azimuth) * sinf(polar) * radius;
+    settings->camera_y = sinf(azimuth) * sinf(polar) * radius;
+    settings->camera_z = cosf(polar) * radius;
+}
+
+bool volpath::load_palette(const char *filename, float **palette, uint32_t *size)
+{
+    *palette = nullptr;
+    *size = 0;
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    uint8_t header[18];
+    if (!file.is_open() || !file.read((char*)header, sizeof(header))) {
+        printf("Failed to read palette %s\n", filename);
+        return false;
+    }
+    uint32_t image_type = header[2];
+    uint32_t width = header[12] | (header[13] << 8);
+    uint32_t height = header[14] | (header[15] << 8);
+    uint32_t pixel_bytes = header[16] / 8;
+    bool top_down = (header[17] & 0x20) != 0;
+    if ((image_type != 2 && image_type != 10) || (pixel_bytes != 3 && pixel_bytes != 4) || width == 0 || height == 0) {
+        printf("Unsupported palette %s (truecolor TGA expected)\n", filename);
+        return false;
+    }
+    uint32_t color_map_bytes = (header[5] | (header[6] << 8)) * ((header[7] + 7) / 8);
+    file.seekg(sizeof(header) + header[0] + color_map_bytes);
+
+    // Decode the rows up to the middle one (RLE packets may span rows)
+    uint32_t middle_row = height / 2;
+    uint32_t stored_row = top_down ? middle_row : height - 1 - middle_row;
+    uint32_t pixel_count = (stored_row + 1) * width;
+    uint8_t *pixels = memory::alloc_heap<uint8_t>(pixel_count * pixel_bytes);
+    bool success = true;
+    if (image_type == 2) {
+        success = bool(file.read((char*)pixels, size_t(pixel_count) * pixel_bytes));
+    } else {
+        for (uint32_t i = 0; i < pixel_count && success;) {
+            uint8_t packet = 0, value[4];
+            success = bool(file.read((char*)&packet, 1));
+            uint32_t run = (packet & 0x7f) + 1;
+            if (packet & 0x80) {
+                success = success && bool(file.read((char*)value, pixel_bytes));
+                for (uint32_t r = 0; r < run && i < pixel_count; ++r, ++i)
+                    memcpy(pixels + size_t(i) * pixel_bytes, value, pixel_bytes);
+            } else {
+                for (uint32_t r = 0; r < run && success; ++r) {
+                    success = bool(file.read((char*)value, pixel_bytes));
+                    if (i < pixel_count)
+                        memcpy(pixels + size_t(i++) * pixel_bytes, value, pixel_bytes);
+                }
+            }
+        }
+    }
+    if (!success) {
+        printf("Failed to read palette %s\n", filename);
+        memory::free_heap(pixels);
+        return false;
+    }
+
+    *palette = memory::alloc_heap<float>(3 * width);
+    *size = width;
+    const uint8_t *row = pixels + size_t(stored_row) * width * pixel_bytes;
+    for (uint32_t x = 0; x < width; ++x) {
+        (*palette)[3 * x] = row[x * pixel_bytes + 2] / 255.0f; // BGR(A)
+        (*palette)[3 * x + 1] = row[x * pixel_bytes + 1] / 255.0f;
+        (*palette)[3 * x + 2] = row[x * pixel_bytes] / 255.0f;
+    }
+    memory::free_heap(pixels);
+    return true;
+}
+
+void volpath::build_majorant(VolpathScene *scene, uint32_t block_size)
+{
+    release(&scene->majorant);
+    Volume *trace = &scene->trace;
+    VolpathMajorant *majorant = &scene->majorant;
+    majorant->block_size = block_size;
+    majorant->width = (trace->width + block_size - 1) / block_size;
+    majorant->height = (trace->height + block_size - 1) / block_size;
+    majorant->depth = (trace->depth + block_size - 1) / block_size;
+    uint32_t cell_count = majorant->width * majorant->height * majorant->depth;
+    majorant->trace_min = memory::alloc_heap<float>(cell_count);
+    majorant->trace_max = memory::alloc_heap<float>(cell_count);
+
+    // Cells of one row per job; every cell scans its block and the one-voxel apron around it
+    jobs::parallel_for(majorant->height * majorant->depth, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t row = begin; row < end; ++row) {
+            uint32_t cy = row % majorant->height, cz = row / majorant->height;
+            for (uint32_t cx = 0; cx < majorant->width; ++cx) {
+                uint32_t x0 = cx * block_size > 0 ? cx * block_size - 1 : 0;
+                uint32_t y0 = cy * block_size > 0 ? cy * block_size - 1 : 0;
+                uint32_t z0 = cz * block_size > 0 ? cz * block_size - 1 : 0;
+                uint32_t x1 = (cx + 1) * block_size < trace->width ? (cx + 1) * block_size : trace->width - 1;
+                uint32_t y1 = (cy + 1) * block_size < trace->height ? (cy + 1) * block_size : trace->height - 1;
+                uint32_t z1 = (cz + 1) * block_size < trace->depth ? (cz + 1) * block_size : trace->depth - 1;
+                float trace_min = FLT_MAX, trace_max = -FLT_MAX;
+                for (uint32_t z = z0; z <= z1; ++z) {
+                    for (uint32_t y = y0; y <= y1; ++y) {
+                        const float *voxels = trace->data + volume::get_index(trace, 0, y, z);
+                        for (uint32_t x = x0; x <= x1; ++x) {
+                            trace_min = fminf(trace_min, voxels[x]);
+                            trace_max = fmaxf(trace_max, voxels[x]);
+                        }
+                    }
+                }
+                size_t cell = size_t(row) * majorant->width + cx;
+                majorant->trace_min[cell] = trace_min;
+                majorant->trace_max[cell] = trace_max;
+            }
+        }
+    });
+}
+
+void volpath::release(VolpathMajorant *majorant)
+{
+    memory::free_heap(majorant->trace_min);
+    memory::free_heap(majorant->trace_max);
+    *majorant = VolpathMajorant{};
+}
+
+void volpath::get_camera_ray(VolpathSettings *settings, Volume *grid, uint32_t width, uint32_t height, float x, float y,
+    float origin[3], float direction[3], float *t_near, float *t_far)
+{
+    VolpathScene scene = {};
+    scene.trace = *grid;
+    VolpathContext context = get_context(&scene, settings, width, height);
+    Vector3 rp, rd;
+    get_primary_ray(&context, width, height, x, y, &rp, &rd);
+    ray_AABB_intersection(rp, rd, context.box_low, context.box_high, t_near, t_far);
+    origin[0] = rp.x;
+    origin[1] = rp.y;
+    origin[2] = rp.z;
+    direction[0] = rd.x;
+    direction[1] = rd.y;
+    direction[2] = rd.z;
+}
+
+void volpath::get_camera_projection(VolpathSettings *settings, Volume *grid, uint32_t width, uint32_t height, float projection[12])
+{
+    VolpathScene scene = {};
+    scene.trace = *grid;
+    VolpathContext context = get_context(&scene, settings, width, height);
+
+    // Inverse of get_primary_ray: the screen position of a point is its offset from the camera in the camera basis, divided
+    // by the depth and shifted by the pan. Grid coordinates map to the normalized domain by a scale and an offset per axis.
+    float aspect_ratio = context.aspect_ratio;
+    Vector3 rows[3] = {
+        (0.5f * float(width)) * (SCREEN_DISTANCE * context.camera_x
+            + (1.0f + CAMERA_OFFSET_RATIO * settings->camera_offset_x) * context.camera_z),
+        (0.5f * float(height)) * (SCREEN_DISTANCE * aspect_ratio * context.camera_y
+            + (1.0f + CAMERA_OFFSET_RATIO * aspect_ratio * settings->camera_offset_y) * context.camera_z),
+        context.camera_z
+    };
+    Vector3 extent = context.domain_high - context.domain_low;
+    Vector3 scale(extent.x / context.grid_size.x, -extent.y / context.grid_size.y, -extent.z / context.grid_size.z);
+    Vector3 offset = Vector3(context.domain_low.x, context.domain_high.y, context.domain_high.z) - context.camera;
+    for (uint32_t row = 0; row < 3; ++row) {
+        projection[4 * row] = rows[row].x * scale.x;
+        projection[4 * row + 1] = rows[row].y * scale.y;
+        projection[4 * row + 2] = rows[row].z * scale.z;
+        projection[4 * row + 3] = math::dot(rows[row], offset);
+    }
+}
+
+VolpathImage volpath::get_image(uint32_t width, uint32_t height)
+{
+    VolpathImage image = {};
+    image.width = width;
+    image.height = height;
+    uint32_t pixel_count = width * height;
+    image.radiance = memory::alloc_heap<float>(3 * pixel_count);
+    image.display = memory::alloc_heap<float>(3 * pixel_count);
+    image.moment = memory::alloc_heap<float>(pixel_count);
+    image.depth = memory::alloc_heap<float>(pixel_count);
+    image.density = memory::alloc_heap<float>(pixel_count);
+    image.albedo = memory::alloc_heap<float>(3 * pixel_count);
+    image.samples = memory::alloc_heap<uint32_t>(pixel_count);
+    memset(image.radiance, 0, 3 * pixel_count * sizeof(float));
+    memset(image.display, 0, 3 * pixel_count * sizeof(float));
+    memset(image.moment, 0, pixel_count * sizeof(float));
+    memset(image.depth, 0, pixel_count * sizeof(float));
+    memset(image.density, 0, pixel_count * sizeof(float));
+    memset(image.albedo, 0, 3 * pixel_count * sizeof(float));
+    memset(image.samples, 0, pixel_count * sizeof(uint32_t));
+    return image;
+}
+
+void volpath::release(VolpathImage *image)
+{
+    memory::free_heap(image->radiance);
+    memory::free_heap(image->display);
+    memory::free_heap(image->moment);
+    memory::free_heap(image->depth);
+    memory::free_heap(image->density);
+    memory::free_heap(image->albedo);
+    memory::free_heap(image->samples);
+    *image = VolpathImage{};
+}
+
+// Adaptive sampling: whether the RMS over the tile's pixels of the standard error of the mean tonemapped luminance,
+// relative to that luminance, is below the target
+static bool is_tile_converged(VolpathImage *image, float target_error, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+{
+    float error_sum = 0.0f;
+    for (uint32_t y = y0; y < y1; ++y) {
+        for (uint32_t x = x0; x < x1; ++x) {
+            uint32_t pixel = y * image->width + x;
+            uint32_t n = image->samples[pixel];
+            if (n < MIN_ADAPTIVE_SAMPLES)
+                return false;
+            float luminance = get_luminance(Vector3(image->display[3 * pixel], image->display[3 * pixel + 1], image->display[3 * pixel + 2]));
+            float sample_variance = math::max(image->moment[pixel] - luminance * luminance, 0.0f) * float(n) / float(n - 1);
+            float scale = math::max(luminance, ERROR_LUMINANCE_FLOOR);
+            error_sum += sample_variance / (float(n) * scale * scale);
+        }
+    }
+    return error_sum <= target_error * target_error * float((x1 - x0) * (y1 - y0));
+}
+
+uint64_t volpath::render_pass(VolpathScene *scene, VolpathSettings *settings, VolpathImage *image, uint32_t sample_count)
+{
+    Volume *trace = &scene->trace, *deposit = &scene->deposit;
+    if (sample_count == 0 || !scene->palette_trace || !scene->palette_data)
+        return 0;
+    if (trace->width < 2 || trace->height < 2 || trace->depth < 2 || deposit->width != trace->width
+        || deposit->height != trace->height || deposit->depth != trace->depth) {
+        printf("Path tracer needs trace and deposit grids of the same size, at least 2 voxels per axis\n");
+        return 0;
+    }
+    VolpathContext context = get_context(scene, settings, image->width, image->height);
+    uint32_t tile_size = settings->tile_size > 0 ? settings->tile_size : 32;
+    uint32_t tiles_x = (image->width + tile_size - 1) / tile_size;
+    uint32_t tiles_y = (image->height + tile_size - 1) / tile_size;
+    uint32_t tile_count = tiles_x * tiles_y;
+    uint64_t *tile_fetches = memory::alloc_heap<uint64_t>(tile_count);
+    uint64_t *tile_samples = memory::alloc_heap<uint64_t>(tile_count);
+
+    jobs::parallel_for(tile_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t tile = begin; tile < end; ++tile) {
+            VolpathContext tile_context = context;
+            uint32_t x0 = (tile % tiles_x) * tile_size, y0 = (tile / tiles_x) * tile_size;
+            uint32_t x1 = x0 + tile_size < image->width ? x0 + tile_size : image->width;
+            uint32_t y1 = y0 + tile_size < image->height ? y0 + tile_size : image->height;
+            tile_fetches[tile] = 0;
+            tile_samples[tile] = 0;
+            if (settings->target_error > 0.0f && is_tile_converged(image, settings->target_error, x0, y0, x1, y1))
+                continue;
+            for (uint32_t y = y0; y < y1; ++y) {
+                for (uint32_t x = x0; x < x1; ++x) {
+                    uint32_t pixel = y * image->width + x;
+                    uint32_t first_sample = image->samples[pixel];
+                    if (first_sample == 0)
+                        set_pixel_features(&context, image, x, y);
+                    Vector3 radiance_sum(0.0f, 0.0f, 0.0f), display_sum(0.0f, 0.0f, 0.0f);
+                    float moment_sum = 0.0f;
+                    for (uint32_t s = 0; s < sample_count; ++s) {
+                        // Seeds depend only on the pixel and the sample index
+                        Rng rng;
+                        set_seed(&rng, wang_hash(1 + 73 * pixel), wang_hash(1 + pixel + (first_sample + s + 1) * 0x9E3779B9U));
+                        Vector3 L = get_pixel_L(&tile_context, image, x, y, &rng);
+                        Vector3 display_L = tonemap(L, settings->exposure);
+                        float luminance = get_luminance(display_L);
+                        radiance_sum += L;
+                        display_sum += display_L;
+                        moment_sum += luminance * luminance;
+                    }
+                    float old_weight = float(first_sample) / float(first_sample + sample_count);
+                    float new_weight = 1.0f / float(first_sample + sample_count);
+                    float *radiance = image->radiance + 3 * size_t(pixel);
+                    float *display = image->display + 3 * size_t(pixel);
+                    radiance[0] = radiance[0] * old_weight + radiance_sum.x * new_weight;
+                    radiance[1] = radiance[1] * old_weight + radiance_sum.y * new_weight;
+                    radiance[2] = radiance[2] * old_weight + radiance_sum.z * new_weight;
+                    display[0] = display[0] * old_weight + display_sum.x * new_weight;
+                    display[1] = display[1] * old_weight + display_sum.y * new_weight;
+                    display[2] = display[2] * old_weight + display_sum.z * new_weight;
+                    image->moment[pixel] = image->moment[pixel] * old_weight + moment_sum * new_weight;
+                    image->samples[pixel] = first_sample + sample_count;
+                }
+            }
+            tile_fetches[tile] = tile_context.trace_fetches;
+            tile_samples[tile] = uint64_t(sample_count) * (x1 - x0) * (y1 - y0);
+        }
+    });
+    uint64_t added_samples = 0;
+    for (uint32_t tile = 0; tile < tile_count; ++tile) {
+        image->trace_fetches += tile_fetches[tile];
+        added_samples += tile_samples[tile];
+    }
+    memory::free_heap(tile_fetches);
+    memory::free_heap(tile_samples);
+    image->total_samples += added_samples;
+    if (added_samples > 0)
+        image->sample_count += sample_count;
+    return added_samples;
+}
+
+uint32_t volpath::render(VolpathScene *scene, VolpathSettings *settings, VolpathImage *image, uint32_t target_samples, float time_budget)
+{
+    auto start_time = std::chrono::high_resolution_clock::now();
+    uint32_t pass_samples = 1;
+    uint32_t rendered_samples = 0;
+    while (target_samples == 0 || image->sample_count < target_samples) {
+        double elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+        uint32_t samples = pass_samples;
+        if (target_samples > 0 && target_samples - image->sample_count < samples)
+            samples = target_samples - image->sample_count;
+        if (time_budget > 0.0f) {
+            if (elapsed >= time_budget)
+                break;
+            // Fit the pass into the remaining time at the rate measured so far
+            if (rendered_samples > 0) {
+                double sample_seconds = elapsed / rendered_samples;
+                double remaining = (time_budget - elapsed) / sample_seconds;
+                if (remaining < double(samples))
+                    samples = remaining >= 1.0 ? uint32_t(remaining) : 1;
+            }
+        } else if (target_samples == 0) {
+            break;
+        }
+        if (render_pass(scene, settings, image, samples) == 0)
+            break;
+        rendered_samples += samples;
+        pass_samples = 2 * pass_samples < MAX_PASS_SAMPLES ? 2 * pass_samples : MAX_PASS_SAMPLES;
+    }
+    return image->sample_count;
+}
+
+bool volpath::save_hdr(VolpathImage *image, const char *filename)
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        printf("Failed to write image %s\n", filename);
+        return false;
+    }
+    file << "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " << image->height << " +X " << image->width << "\n";
+
+    // Flat (not run-length encoded) scanlines of shared-exponent RGBE pixels
+    uint8_t *scanline = memory::alloc_heap<uint8_t>(4 * image->width);
+    for (uint32_t y = 0; y < image->height; ++y) {
+        const float *row = image->radiance + 3 * size_t(y) * image->width;
+        for (uint32_t x = 0; x < image->width; ++x) {
+            float r = row[3 * x], g = row[3 * x + 1], b = row[3 * x + 2];
+            float largest = math::max(math::max(r, g), b);
+            uint8_t *rgbe = scanline + 4 * x;
+            if (!(largest > 1.e-32f)) {
+                rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+                continue;
+            }
+            int exponent;
+            float scale = frexpf(largest, &exponent) * 256.0f / largest;
+            rgbe[0] = uint8_t(math::max(r, 0.0f) * scale);
+            rgbe[1] = uint8_t(math::max(g, 0.0f) * scale);
+            rgbe[2] = uint8_t(math::max(b, 0.0f) * scale);
+            rgbe[3] = uint8_t(exponent + 128);
+        }
+        file.write((char*)scanline, 4 * image->width);
+    }
+    memory::free_heap(scanline);
+
+    bool success = file.good();
+    file.close();
+    if (!success)
+        printf("Failed to write image %s\n", filename);
+    return success;
+}
+
+// Uncompressed 24-bit TGA of BGR pixels, rows from the top
+static bool save_tga(const uint8_t *pixels, uint32_t width, uint32_t height, const char *filename)
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        printf("Failed to write image %s\n", filename);
+        return false;
+    }
+    uint8_t header[18] = {};
+    header[2] = 2; // Uncompressed truecolor
+    header[12] = uint8_t(width & 0xff);
+    header[13] = uint8_t(width >> 8);
+    header[14] = uint8_t(height & 0xff);
+    header[15] = uint8_t(height >> 8);
+    header[16] = 24;
+    header[17] = 0x20; // Top-left origin, rows in the order of the image
+    file.write((char*)header, sizeof(header));
+    file.write((char*)pixels, 3 * size_t(width) * height);
+
+    bool success = file.good();
+    file.close();
+    if (!success)
+        printf("Failed to write image %s\n", filename);
+    return success;
+}
+
+bool volpath::save_ldr(VolpathImage *image, VolpathSettings *settings, const char *filename)
+{
+    // ps_volpath: the compressive accumulator already holds tonemapped values, radiance is tonemapped for display
+    size_t pixel_count = size_t(image->width) * image->height;
+    uint8_t *pixels = memory::alloc_heap<uint8_t>(3 * pixel_count);
+    jobs::parallel_for(image->height, 16, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (size_t i = size_t(begin) * image->width; i < size_t(end) * image->width; ++i) {
+            Vector3 color = settings->compressive_accumulation
+                ? Vector3(image->display[3 * i], image->display[3 * i + 1], image->display[3 * i + 2])
+                : tonemap(Vector3(image->radiance[3 * i], image->radiance[3 * i + 1], image->radiance[3 * i + 2]), settings->exposure);
+            pixels[3 * i] = uint8_t(math::clamp(color.z, 0.0f, 1.0f) * 255.0f + 0.5f);
+            pixels[3 * i + 1] = uint8_t(math::clamp(color.y, 0.0f, 1.0f) * 255.0f + 0.5f);
+            pixels[3 * i + 2] = uint8_t(math::clamp(color.x, 0.0f, 1.0f) * 255.0f + 0.5f);
+        }
+    });
+    bool success = save_tga(pixels, image->width, image->height, filename);
+    memory::free_heap(pixels);
+    return success;
+}
+
+bool volpath::save_sample_map(VolpathImage *image, const char *filename)
+{
+    size_t pixel_count = size_t(image->width) * image->height;
+    uint8_t *pixels = memory::alloc_heap<uint8_t>(3 * pixel_count);
+    float scale = image->sample_count > 0 ? 255.0f / float(image->sample_count) : 0.0f;
+    for (size_t i = 0; i < pixel_count; ++i)
+        pixels[3 * i] = pixels[3 * i + 1] = pixels[3 * i + 2] = uint8_t(math::min(float(image->samples[i]) * scale, 255.0f) + 0.5f);
+    bool success = save_tga(pixels, image->width, image->height, filename);
+    memory::free_heap(pixels);
+    return success;
+}
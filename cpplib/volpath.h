@@ -0,0 +1,149 @@
+#pragma once
+#include <stdint.h>
+#include "volume.h"
+#include "light_bvh.h"
+
+// Light sources of the path tracer, combined as bit flags (the illumination defines of cs_volpath.hlsl)
+enum VolpathIllumination
+{
+    VI_TRACE = 1, // Trace emission colored by the trace palette
+    VI_HALO = 2, // Deposit (halo) emission colored by the data palette
+    VI_POINT = 4, // Point light in the center of the trimmed domain
+    VI_WHITE_SKY = 8, // Constant sky radiance sigma_e
+    VI_GALAXIES = 16 // Every catalog point of the scene's light BVH as a point light weighted by its deposit weight
+};
+
+// Camera and rendering parameters, named after the RenderingConfig fields they mirror
+struct VolpathSettings
+{
+    uint32_t width; // Image resolution [px]
+    uint32_t height;
+    float camera_x; // Orbit camera position around the domain center, in units of the domain width (eye_pos)
+    float camera_y;
+    float camera_z;
+    float camera_offset_x; // Screen-space pan of the camera
+    float camera_offset_y;
+    float trim_min[3]; // Rendered part of the domain, as fractions of the grid
+    float trim_max[3];
+    float trim_density; // Trace below this does not scatter or emit
+    float sample_weight; // Trace to extinction density scale
+    float galaxy_weight; // Deposit emission scale
+    float ambient_trace; // Trace added everywhere inside the domain
+    float trace_max; // Trace of the density majorant used by delta tracking
+    float sigma_s; // Scattering, absorption and emission coefficients
+    float sigma_a;
+    float sigma_e;
+    float scattering_anisotropy; // Henyey-Greenstein g
+    float guiding_strength; // Deposit gradient guiding, used with `gradient_guiding`
+    float exposure;
+    uint32_t bounce_count; // n_bounces
+    bool compressive_accumulation; // Average tonemapped samples instead of radiance
+    uint32_t illumination; // VolpathIllumination flags
+    bool russian_roulette;
+    bool gradient_guiding;
+    uint32_t tile_size; // Screen tiles processed by one job [px]
+    float target_error; // Adaptive sampling: a tile stops once the relative error of its pixels falls below this (0 = off)
+    float voxel_scale; // Simulation voxels per voxel of the scene grids (2^level for pyramid previews), keeps optical depths
+    float optical_thickness; // Transfer functions of the slice renderer (volmarch), fragment opacity per voxel
+    float highlight_density;
+    float histogram_base; // Width of the highlighted density band (HISTOGRAM_BASE of config.polyp)
+    float overdensity_threshold_low;
+    float overdensity_threshold_high;
+    float background; // Gray level the window is cleared to
+};
+
+const uint32_t VOLPATH_MAJORANT_BLOCK = 8; // Trace voxels per majorant cell and axis (PT_MAJORANT_BLOCK in main.cpp)
+
+// Trace bounds over blocks of voxels, the local majorants of delta tracking (cs_trace_majorant.hlsl)
+struct VolpathMajorant
+{
+    float *trace_min; // Per cell, over its block and the one-voxel apron that trilinear lookups inside it reach
+    float *trace_max;
+    uint32_t width; // Cells per axis
+    uint32_t height;
+    uint32_t depth;
+    uint32_t block_size;
+};
+
+// Grids and palettes the renderer samples; volumes use the simulation grid coordinates
+struct VolpathScene
+{
+    Volume trace;
+    Volume deposit;
+    float *palette_trace; // RGB entries
+    uint32_t palette_trace_size;
+    float *palette_data;
+    uint32_t palette_data_size;
+    VolpathMajorant majorant; // Optional; without it the tracking uses the global majorant trace_max
+    LightBVH lights; // Optional catalog points in the grid coordinates [vox], needed by VI_GALAXIES
+};
+
+// Progressive accumulation of the rendered samples
+struct VolpathImage
+{
+    float *radiance; // Mean radiance per pixel, RGB
+    float *display; // Mean tonemapped radiance per pixel, RGB (what the window shows with compressive accumulation)
+    float *moment; // Mean squared luminance of the tonemapped samples per pixel, for the variance of the display
+    // Features of the rays through the pixel for the denoiser, filled by the first pass and zero where they meet no density:
+    // depth [vox], trace density and emission color (RGB) averaged with the weights of the emission-absorption model
+    float *depth;
+    float *density;
+    float *albedo;
+    uint32_t *samples; // Samples per pixel so far, fewer than sample_count in tiles adaptive sampling has stopped
+    uint32_t width;
+    uint32_t height;
+    uint32_t sample_count; // Samples per pixel so far (pt_iteration), the most any pixel has
+    uint64_t total_samples; // Samples of all pixels so far
+    uint64_t trace_fetches; // Trace lookups of all samples so far
+};
+
+// `volpath` namespace is the CPU version of the progressive volumetric path tracer in shaders/cs_volpath.hlsl
+namespace volpath
+{
+    // Defaults of the interactive renderer in main.cpp
+    VolpathSettings get_default_settings();
+
+    // Camera and rendering settings from a view state saved by Polyphorm (F9, visu_state.tmp)
+    bool load_state(const char *filename, VolpathSettings *settings);
+
+    // Place the orbit camera as main.cpp does: polar and azimuth angles [rad], radius in units of the domain width
+    void set_orbit(VolpathSettings *settings, float polar, float azimuth, float radius);
+
+    // Middle row of a TGA palette image (where the shader samples it) as RGB floats in [0, 1]
+    bool load_palette(const char *filename, float **palette, uint32_t *size);
+
+    // Compute the majorant grid of the scene's trace in parallel; rebuild it whenever the trace changes
+    void build_majorant(VolpathScene *scene, uint32_t block_size = VOLPATH_MAJORANT_BLOCK);
+    void release(VolpathMajorant *majorant);
+
+    // Camera ray through the image position (x, y) [px] as the path tracer generates it: origin and unit direction in the
+    // grid coordinates of `grid` [vox], and the segment [t_near, t_far] inside the trimmed domain (both -1 on a miss)
+    void get_camera_ray(VolpathSettings *settings, Volume *grid, uint32_t width, uint32_t height, float x, float y,
+        float origin[3], float direction[3], float *t_near, float *t_far);
+
+    // The same camera as a pinhole projection: 3 x 4 row-major matrix taking grid coordinates of `grid` [vox] to
+    // homogeneous image positions (x w, y w, w) [px], w being the depth along the view axis (w <= 0 behind the camera)
+    void get_camera_projection(VolpathSettings *settings, Volume *grid, uint32_t width, uint32_t height, float projection[12]);
+
+    VolpathImage get_image(uint32_t width, uint32_t height);
+    void release(VolpathImage *image);
+
+    // Add `sample_count` samples per pixel to the image. Screen tiles are rendered in parallel; every pixel sample has its
+    // own random sequence, so the result does not depend on the thread count or the tile order.
+    // With a target_error, tiles whose pixels have at least 16 samples and an RMS relative standard error of the mean
+    // tonemapped luminance below the target are skipped. Returns the number of samples added (0 once every tile converged).
+    uint64_t render_pass(VolpathScene *scene, VolpathSettings *settings, VolpathImage *image, uint32_t sample_count);
+
+    // Render until the image has `target_samples` samples per pixel, `time_budget` seconds have passed (0 = no limit) or
+    // every tile has converged to the target_error. Returns the samples per pixel reached.
+    uint32_t render(VolpathScene *scene, VolpathSettings *settings, VolpathImage *image, uint32_t target_samples, float time_budget);
+
+    // Write the mean radiance as a Radiance RGBE (.hdr) image
+    bool save_hdr(VolpathImage *image, const char *filename);
+
+    // Write the image as the window displays it (tonemapped with the exposure) as a 24-bit TGA
+    bool save_ldr(VolpathImage *image, VolpathSettings *settings, const char *filename);
+
+    // Write the convergence map of adaptive sampling, the samples of every pixel relative to sample_count, as a gray TGA
+    bool save_sample_map(VolpathImage *image, const char *filename);
+}
@@ -0,0 +1,210 @@
+#include "volume.h"
+#include "memory.h"
+#include "jobs.h"
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <fstream>
+
+Volume volume::get(uint32_t width, uint32_t height, uint32_t depth)
+{
+    Volume volume = {};
+    volume.width = width;
+    volume.height = height;
+    volume.depth = depth;
+    size_t voxel_count = size_t(width) * height * depth;
+    volume.data = memory::alloc_heap<float>(voxel_count);
+    if (volume.data)
+        memset(volume.data, 0, voxel_count * sizeof(float));
+    return volume;
+}
+
+Volume volume::get_from_half(uint16_t *data, uint32_t width, uint32_t height, uint32_t depth, uint32_t channel_count, uint32_t channel)
+{
+    Volume volume = {};
+    volume.width = width;
+    volume.height = height;
+    volume.depth = depth;
+    volume.data = memory::alloc_heap<float>(size_t(width) * height * depth);
+    if (!volume.data)
+        return volume;
+
+    // Convert slice by slice in parallel
+    jobs::parallel_for(depth, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t z = begin; z < end; ++z) {
+            size_t slice_start = size_t(z) * width * height;
+            for (size_t i = slice_start; i < slice_start + size_t(width) * height; ++i) {
+                volume.data[i] = half_to_float(data[i * channel_count + channel]);
+            }
+        }
+    });
+    return volume;
+}
+
+void volume::release(Volume *volume)
+{
+    memory::free_heap(volume->data);
+    volume->data = NULL;
+    volume->width = 0;
+    volume->height = 0;
+    volume->depth = 0;
+}
+
+size_t volume::get_voxel_count(Volume *volume)
+{
+    return size_t(volume->width) * volume->height * volume->depth;
+}
+
+double volume::get_mean(Volume *volume)
+{
+    uint32_t thread_count = jobs::get_thread_count();
+    double *sums = memory::alloc_heap<double>(thread_count);
+    memset(sums, 0, thread_count * sizeof(double));
+    size_t slice_size = size_t(volume->width) * volume->height;
+    jobs::parallel_for(volume->depth, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        for (uint32_t z = begin; z < end; ++z) {
+            float *slice = volume->data + z * slice_size;
+            double sum = 0.0;
+            for (size_t i = 0; i < slice_size; ++i) {
+                sum += slice[i];
+            }
+            sums[thread_index] += sum;
+        }
+    });
+    double total = 0.0;
+    for (uint32_t t = 0; t < thread_count; ++t) {
+        total += sums[t];
+    }
+    memory::free_heap(sums);
+    return total / double(get_voxel_count(volume));
+}
+
+float volume::get_clamped(Volume *volume, int32_t x, int32_t y, int32_t z)
+{
+    x = x < 0 ? 0 : (x >= int32_t(volume->width) ? int32_t(volume->width) - 1 : x);
+    y = y < 0 ? 0 : (y >= int32_t(volume->height) ? int32_t(volume->height) - 1 : y);
+    z = z < 0 ? 0 : (z >= int32_t(volume->depth) ? int32_t(volume->depth) - 1 : z);
+    return volume->data[get_index(volume, x, y, z)];
+}
+
+float volume::sample(Volume *volume, float x, float y, float z)
+{
+    // Shift to voxel-center coordinates
+    float x0 = floorf(x - 0.5f);
+    float y0 = floorf(y - 0.5f);
+    float z0 = floorf(z - 0.5f);
+    float fx = x - 0.5f - x0;
+    float fy = y - 0.5f - y0;
+    float fz = z - 0.5f - z0;
+    int32_t ix = int32_t(x0);
+    int32_t iy = int32_t(y0);
+    int32_t iz = int32_t(z0);
+
+    float c00 = get_clamped(volume, ix, iy, iz) * (1.0f - fx) + get_clamped(volume, ix + 1, iy, iz) * fx;
+    float c10 = get_clamped(volume, ix, iy + 1, iz) * (1.0f - fx) + get_clamped(volume, ix + 1, iy + 1, iz) * fx;
+    float c01 = get_clamped(volume, ix, iy, iz + 1) * (1.0f - fx) + get_clamped(volume, ix + 1, iy, iz + 1) * fx;
+    float c11 = get_clamped(volume, ix, iy + 1, iz + 1) * (1.0f - fx) + get_clamped(volume, ix + 1, iy + 1, iz + 1) * fx;
+    float c0 = c00 * (1.0f - fy) + c10 * fy;
+    float c1 = c01 * (1.0f - fy) + c11 * fy;
+    return c0 * (1.0f - fz) + c1 * fz;
+}
+
+Volume volume::resample(Volume *source, uint32_t width, uint32_t height, uint32_t depth)
+{
+    Volume result = get(width, height, depth);
+    if (!result.data)
+        return result;
+
+    float scale_x = float(source->width) / float(width);
+    float scale_y = float(source->height) / float(height);
+    float scale_z = float(source->depth) / float(depth);
+    jobs::parallel_for(depth, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t z = begin; z < end; ++z) {
+            for (uint32_t y = 0; y < height; ++y) {
+                float *row = result.data + get_index(&result, 0, y, z);
+                for (uint32_t x = 0; x < width; ++x) {
+                    row[x] = sample(source, (x + 0.5f) * scale_x, (y + 0.5f) * scale_y, (z + 0.5f) * scale_z);
+                }
+            }
+        }
+    });
+    return result;
+}
+
+bool volume::save(Volume *volume, const char *filename)
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        printf("Failed to write volume to %s\n", filename);
+        return false;
+    }
+    file.write((char*)volume->data, get_voxel_count(volume) * sizeof(float));
+    file.close();
+    return true;
+}
+
+float volume::half_to_float(uint16_t value)
+{
+    uint32_t sign = uint32_t(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1F;
+    uint32_t mantissa = value & 0x3FF;
+    uint32_t bits;
+
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else {
+            // Denormal half, renormalize into a regular float
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                --exponent;
+            }
+            mantissa &= 0x3FF;
+            bits = sign | (exponent << 23) | (mantissa << 13);
+        }
+    } else if (exponent == 0x1F) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+uint16_t volume::float_to_half(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+    uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+    int32_t exponent = int32_t((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if (((bits >> 23) & 0xFF) == 0xFF) {
+        return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+    }
+    if (exponent >= 0x1F) {
+        return sign | 0x7C00;
+    }
+    if (exponent <= 0) {
+        if (exponent < -10)
+            return sign;
+        // Denormal half, round to nearest even
+        mantissa |= 0x800000;
+        uint32_t shift = uint32_t(14 - exponent);
+        uint32_t half_mantissa = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half_mantissa & 1)))
+            ++half_mantissa;
+        return sign | uint16_t(half_mantissa);
+    }
+
+    uint32_t half_bits = (uint32_t(exponent) << 10) | (mantissa >> 13);
+    uint32_t remainder = mantissa & 0x1FFF;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half_bits & 1)))
+        ++half_bits; // May carry into the exponent, which is the correct rounding behavior
+    return sign | uint16_t(half_bits);
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <emmintrin.h>
+
+// Volume is a CPU-side copy of a single-channel simulation grid (trace or deposit), stored as float32 in x-fastest order.
+struct Volume
+{
+    float *data;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+};
+
+// `volume` namespace handles CPU-side grids used by the analysis and export passes
+namespace volume
+{
+    // Allocate a zero-initialized volume
+    Volume get(uint32_t width, uint32_t height, uint32_t depth);
+
+    // Convert one channel of a float16 grid (as captured from the GPU) into a float32 volume
+    Volume get_from_half(uint16_t *data, uint32_t width, uint32_t height, uint32_t depth, uint32_t channel_count = 1, uint32_t channel = 0);
+
+    // Release volume memory
+    void release(Volume *volume);
+
+    // Number of voxels in the volume
+    size_t get_voxel_count(Volume *volume);
+
+    // Mean voxel value (parallel, double precision accumulation)
+    double get_mean(Volume *volume);
+
+    // Linear index of the voxel at integer coordinates
+    inline size_t get_index(Volume *volume, uint32_t x, uint32_t y, uint32_t z)
+    {
+        return (size_t(z) * volume->height + y) * volume->width + x;
+    }
+
+    // Voxel value at coordinates clamped to the volume bounds
+    float get_clamped(Volume *volume, int32_t x, int32_t y, int32_t z);
+
+    // Trilinearly interpolated value at continuous grid coordinates (voxel centers at integer + 0.5)
+    float sample(Volume *volume, float x, float y, float z);
+
+    // Cell and fraction along one axis for clamped trilinear filtering
+    inline void get_filter_cell(float x, uint32_t size, int32_t *cell, float *fraction)
+    {
+        float u = x - 0.5f;
+        if (!(u > 0.0f)) {
+            *cell = 0;
+            *fraction = 0.0f;
+        } else if (u >= float(size - 1)) {
+            *cell = int32_t(size) - 2;
+            *fraction = 1.0f;
+        } else {
+            *cell = int32_t(u);
+            *fraction = u - float(*cell);
+        }
+    }
+
+    // Same value as sample(), inlined for the renderers; needs at least 2 voxels per axis. The four rows of the cell are
+    // loaded as x-pairs and interpolated along x in one SSE operation, then along y and z.
+    inline float sample_trilinear(const Volume *volume, float x, float y, float z)
+    {
+        int32_t cx, cy, cz;
+        float fx, fy, fz;
+        get_filter_cell(x, volume->width, &cx, &fx);
+        get_filter_cell(y, volume->height, &cy, &fy);
+        get_filter_cell(z, volume->depth, &cz, &fz);
+        size_t row = volume->width;
+        size_t plane = row * volume->height;
+        const float *corner = volume->data + size_t(cz) * plane + size_t(cy) * row + size_t(cx);
+
+        __m128 rows_z0 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)corner), (const __m64*)(corner + row));
+        __m128 rows_z1 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(corner + plane)), (const __m64*)(corner + plane + row));
+        __m128 low = _mm_shuffle_ps(rows_z0, rows_z1, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 high = _mm_shuffle_ps(rows_z0, rows_z1, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 along_x = _mm_add_ps(low, _mm_mul_ps(_mm_set1_ps(fx), _mm_sub_ps(high, low))); // (y0 z0, y1 z0, y0 z1, y1 z1)
+        __m128 next_y = _mm_shuffle_ps(along_x, along_x, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128 along_y = _mm_add_ps(along_x, _mm_mul_ps(_mm_set1_ps(fy), _mm_sub_ps(next_y, along_x))); // z0 in lane 0, z1 in lane 2
+        float value_z0 = _mm_cvtss_f32(along_y);
+        float value_z1 = _mm_cvtss_f32(_mm_shuffle_ps(along_y, along_y, _MM_SHUFFLE(2, 2, 2, 2)));
+        return value_z0 + fz * (value_z1 - value_z0);
+    }
+
+    // Trilinearly resample a volume covering the same domain onto a grid of a different resolution
+    Volume resample(Volume *source, uint32_t width, uint32_t height, uint32_t depth);
+
+    // Write raw float32 voxels (x-fastest) to a file
+    bool save(Volume *volume, const char *filename);
+
+    // IEEE 754 half <-> float conversions
+    float half_to_float(uint16_t value);
+    uint16_t float_to_half(float value);
+}
@@ -0,0 +1,628 @@
+#include "volume_file.h"
+#include "memory.h"
+#include "jobs.h"
+#include "compression.h"
+#include "volume.h"
+#include <string.h>
+#include <stdio.h>
+#include <float.h>
+
+static const char VOLUME_FILE_MAGIC[8] = { 'P', 'P', 'V', 'O', 'L', 'U', 'M', 'E' };
+static const uint32_t VOLUME_FILE_BATCH_BRICKS = 64; // Bricks packed or unpacked in parallel between file accesses
+
+struct BrickExtent
+{
+    uint32_t x, y, z; // First voxel
+    uint32_t width, height, depth; // Clipped to the grid
+};
+
+// Resolution and brick grid of one stored image: the full-resolution grid or one reduction of a pyramid level
+struct VolumeImage
+{
+    uint32_t width, height, depth;
+    uint32_t brick_count_x, brick_count_y, brick_count_z;
+    uint32_t first_brick; // Position of the image's first brick in the brick index
+};
+
+static uint32_t get_stored_level_count(VolumeFileHeader *header)
+{
+    return header->level_count > 0 ? header->level_count : 1;
+}
+
+static uint32_t get_image_count(VolumeFileHeader *header)
+{
+    return 1 + 2 * (get_stored_level_count(header) - 1);
+}
+
+static uint32_t get_image_index(uint32_t level, VolumeReduction reduction)
+{
+    return level == 0 ? 0 : 2 * level - 1 + uint32_t(reduction);
+}
+
+static uint32_t get_brick_count(VolumeImage *image)
+{
+    return image->brick_count_x * image->brick_count_y * image->brick_count_z;
+}
+
+static VolumeImage get_image(VolumeFileHeader *header, uint32_t image_index)
+{
+    VolumeImage image = {};
+    uint32_t first_brick = 0;
+    for (uint32_t i = 0; i <= image_index; ++i) {
+        volume_file::get_level_size(header, (i + 1) / 2, &image.width, &image.height, &image.depth);
+        image.brick_count_x = (image.width + header->brick_size - 1) / header->brick_size;
+        image.brick_count_y = (image.height + header->brick_size - 1) / header->brick_size;
+        image.brick_count_z = (image.depth + header->brick_size - 1) / header->brick_size;
+        image.first_brick = first_brick;
+        first_brick += get_brick_count(&image);
+    }
+    return image;
+}
+
+static uint32_t get_total_brick_count(VolumeFileHeader *header)
+{
+    VolumeImage last = get_image(header, get_image_count(header) - 1);
+    return last.first_brick + get_brick_count(&last);
+}
+
+static BrickExtent get_brick_extent(VolumeFileHeader *header, VolumeImage *image, uint32_t brick)
+{
+    BrickExtent extent = {};
+    uint32_t bx = brick % image->brick_count_x;
+    uint32_t by = (brick / image->brick_count_x) % image->brick_count_y;
+    uint32_t bz = brick / (image->brick_count_x * image->brick_count_y);
+    extent.x = bx * header->brick_size;
+    extent.y = by * header->brick_size;
+    extent.z = bz * header->brick_size;
+    extent.width = image->width - extent.x < header->brick_size ? image->width - extent.x : header->brick_size;
+    extent.height = image->height - extent.y < header->brick_size ? image->height - extent.y : header->brick_size;
+    extent.depth = image->depth - extent.z < header->brick_size ? image->depth - extent.z : header->brick_size;
+    return extent;
+}
+
+static VolumeFileHeader get_header(VolumeFileInfo *info)
+{
+    VolumeFileHeader header = {};
+    memcpy(header.magic, VOLUME_FILE_MAGIC, sizeof(header.magic));
+    header.version = VOLUME_FILE_VERSION;
+    header.width = info->width;
+    header.height = info->height;
+    header.depth = info->depth;
+    header.channel_count = info->channel_count;
+    header.data_type = info->data_type;
+    header.brick_size = info->brick_size;
+    header.brick_count_x = (info->width + info->brick_size - 1) / info->brick_size;
+    header.brick_count_y = (info->height + info->brick_size - 1) / info->brick_size;
+    header.brick_count_z = (info->depth + info->brick_size - 1) / info->brick_size;
+    header.compression = info->compression;
+    header.parameter_count = info->parameter_count;
+    header.level_count = info->level_count > 0 ? info->level_count : 1;
+    memcpy(header.world_to_grid, info->world_to_grid, sizeof(header.world_to_grid));
+    if (info->description)
+        strncpy(header.description, info->description, sizeof(header.description) - 1);
+    header.header_size = uint32_t(sizeof(VolumeFileHeader) + info->parameter_count * sizeof(VolumeParameter) + get_total_brick_count(&header) * sizeof(VolumeBrick));
+    return header;
+}
+
+VolumeFileInfo volume_file::get_default_info(uint32_t width, uint32_t height, uint32_t depth, uint32_t channel_count, VolumeDataType data_type)
+{
+    VolumeFileInfo info = {};
+    info.width = width;
+    info.height = height;
+    info.depth = depth;
+    info.channel_count = channel_count;
+    info.data_type = data_type;
+    info.brick_size = 64;
+    info.compression = VC_SHUFFLE_LZ;
+    info.level_count = 1;
+    info.world_to_grid[0] = info.world_to_grid[5] = info.world_to_grid[10] = 1.0f; // Identity
+    info.description = "";
+    return info;
+}
+
+void volume_file::set_world_box(VolumeFileInfo *info, float size_x, float size_y, float size_z, float center_x, float center_y, float center_z)
+{
+    // grid = (world - (center - 0.5 * size)) / size * resolution, same as world_to_grid in main.cpp
+    float scale[3] = { float(info->width) / size_x, float(info->height) / size_y, float(info->depth) / size_z };
+    float corner[3] = { center_x - 0.5f * size_x, center_y - 0.5f * size_y, center_z - 0.5f * size_z };
+    memset(info->world_to_grid, 0, sizeof(info->world_to_grid));
+    for (uint32_t i = 0; i < 3; ++i) {
+        info->world_to_grid[4 * i + i] = scale[i];
+        info->world_to_grid[4 * i + 3] = -corner[i] * scale[i];
+    }
+}
+
+VolumeParameter volume_file::get_parameter(const char *name, double value)
+{
+    VolumeParameter parameter = {};
+    strncpy(parameter.name, name, sizeof(parameter.name) - 1);
+    parameter.value = value;
+    return parameter;
+}
+
+uint32_t volume_file::get_type_size(VolumeDataType data_type)
+{
+    switch (data_type) {
+        case VDT_FLOAT16: return 2;
+        case VDT_FLOAT32: return 4;
+        case VDT_UINT8: return 1;
+        default: return 0;
+    }
+}
+
+uint32_t volume_file::get_level_count(uint32_t width, uint32_t height, uint32_t depth, uint32_t min_size)
+{
+    uint32_t size = width > height ? width : height;
+    size = size > depth ? size : depth;
+    uint32_t level_count = 1;
+    while (min_size > 0 && size > min_size) {
+        size = (size + 1) / 2;
+        ++level_count;
+    }
+    return level_count;
+}
+
+void volume_file::get_level_size(VolumeFileHeader *header, uint32_t level, uint32_t *width, uint32_t *height, uint32_t *depth)
+{
+    uint32_t scale = (1u << level) - 1;
+    *width = (header->width + scale) >> level;
+    *height = (header->height + scale) >> level;
+    *depth = (header->depth + scale) >> level;
+}
+
+// Largest stored size of a brick
+static size_t get_brick_capacity(VolumeFileHeader *header, size_t brick_bytes)
+{
+    return header->compression == VC_SHUFFLE_LZ ? compression::get_bound(brick_bytes) : brick_bytes;
+}
+
+// Buffers shared by all images of a file being written
+struct BrickWriter
+{
+    std::ofstream *file;
+    VolumeFileHeader *header;
+    VolumeBrick *bricks;
+    uint8_t *batch;
+    uint8_t *scratch;
+    size_t brick_bytes;
+    size_t brick_capacity;
+    uint64_t offset;
+};
+
+// Pack, compress and write the bricks of one image and record them in the brick index
+static void write_image(BrickWriter *writer, uint32_t image_index, void *data)
+{
+    VolumeFileHeader *header = writer->header;
+    VolumeImage image = get_image(header, image_index);
+    uint32_t brick_count = get_brick_count(&image);
+    bool compressed = header->compression == VC_SHUFFLE_LZ;
+    uint32_t type_size = volume_file::get_type_size(VolumeDataType(header->data_type));
+    size_t voxel_bytes = size_t(header->channel_count) * type_size;
+
+    // Bricks are packed into per-thread scratch and compressed into their batch slot (or packed there directly if raw)
+    size_t batch_sizes[VOLUME_FILE_BATCH_BRICKS];
+    for (uint32_t first = 0; first < brick_count; first += VOLUME_FILE_BATCH_BRICKS) {
+        uint32_t batch_count = brick_count - first < VOLUME_FILE_BATCH_BRICKS ? brick_count - first : VOLUME_FILE_BATCH_BRICKS;
+        jobs::parallel_for(batch_count, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+            for (uint32_t b = begin; b < end; ++b) {
+                BrickExtent extent = get_brick_extent(header, &image, first + b);
+                uint8_t *brick = compressed ? writer->scratch + thread_index * writer->brick_bytes : writer->batch + b * writer->brick_capacity;
+                size_t row_bytes = extent.width * voxel_bytes;
+                for (uint32_t z = 0; z < extent.depth; ++z) {
+                    for (uint32_t y = 0; y < extent.height; ++y) {
+                        size_t source = ((size_t(extent.z + z) * image.height + extent.y + y) * image.width + extent.x) * voxel_bytes;
+                        memcpy(brick + (size_t(z) * extent.height + y) * row_bytes, (uint8_t*)data + source, row_bytes);
+                    }
+                }
+                size_t size = size_t(extent.width) * extent.height * extent.depth * voxel_bytes;
+                batch_sizes[b] = compressed ? compression::encode(brick, size, type_size, writer->batch + b * writer->brick_capacity) : size;
+            }
+        });
+        for (uint32_t b = 0; b < batch_count; ++b) {
+            VolumeBrick *brick = writer->bricks + image.first_brick + first + b;
+            brick->offset = writer->offset;
+            brick->size = batch_sizes[b];
+            writer->file->write((char*)(writer->batch + b * writer->brick_capacity), batch_sizes[b]);
+            writer->offset += batch_sizes[b];
+        }
+    }
+}
+
+static void store_values(float *values, size_t count, VolumeDataType data_type, void *data)
+{
+    jobs::parallel_for(uint32_t(count), 1 << 16, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            if (data_type == VDT_FLOAT16) {
+                ((uint16_t*)data)[i] = volume::float_to_half(values[i]);
+            } else if (data_type == VDT_FLOAT32) {
+                ((float*)data)[i] = values[i];
+            } else {
+                float value = values[i] < 0.0f ? 0.0f : (values[i] > 255.0f ? 255.0f : values[i]);
+                ((uint8_t*)data)[i] = uint8_t(value + 0.5f);
+            }
+        }
+    });
+}
+
+// Full-resolution voxels covered by voxel `index` of a level along an axis of `size` voxels at level 0
+static uint32_t get_covered_count(uint32_t level, uint32_t index, uint32_t size)
+{
+    uint32_t begin = index << level;
+    uint32_t end = (index + 1) << level;
+    return (end < size ? end : size) - begin;
+}
+
+// Reduce the level `level` (mean and max images, loaded by the callbacks) to level + 1. Means are weighted by the
+// full-resolution voxels each source voxel covers, so the clipped voxels at the upper faces stay exact averages.
+template <typename LoadMean, typename LoadMax>
+static void reduce_level(VolumeFileHeader *header, uint32_t level, LoadMean load_mean, LoadMax load_max, float *mean, float *max)
+{
+    uint32_t size[3], target_size[3];
+    volume_file::get_level_size(header, level, &size[0], &size[1], &size[2]);
+    volume_file::get_level_size(header, level + 1, &target_size[0], &target_size[1], &target_size[2]);
+    uint32_t full_size[3] = { header->width, header->height, header->depth };
+    uint32_t channel_count = header->channel_count;
+
+    // Covered voxel counts per axis, the weight of a source voxel is their product
+    float *weights[3];
+    for (uint32_t a = 0; a < 3; ++a) {
+        weights[a] = memory::alloc_heap<float>(size[a]);
+        for (uint32_t i = 0; i < size[a]; ++i)
+            weights[a][i] = float(get_covered_count(level, i, full_size[a]));
+    }
+
+    // Each job reduces whole target rows, accumulating the up to four source rows of a target row at a time
+    size_t row_values = size_t(target_size[0]) * channel_count;
+    jobs::parallel_for(target_size[2], 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        float *row_sums = memory::alloc_heap<float>(2 * row_values);
+        float *row_weights = row_sums + row_values;
+        for (uint32_t z = begin; z < end; ++z) {
+            for (uint32_t y = 0; y < target_size[1]; ++y) {
+                size_t target = (size_t(z) * target_size[1] + y) * row_values;
+                for (size_t i = 0; i < row_values; ++i) {
+                    row_sums[i] = 0.0f;
+                    row_weights[i] = 0.0f;
+                    max[target + i] = -FLT_MAX;
+                }
+                for (uint32_t sz = 2 * z; sz < 2 * z + 2 && sz < size[2]; ++sz) {
+                    for (uint32_t sy = 2 * y; sy < 2 * y + 2 && sy < size[1]; ++sy) {
+                        float row_weight = weights[2][sz] * weights[1][sy];
+                        size_t source = (size_t(sz) * size[1] + sy) * size[0] * channel_count;
+                        for (uint32_t sx = 0; sx < size[0]; ++sx) {
+                            float weight = row_weight * weights[0][sx];
+                            size_t out = size_t(sx / 2) * channel_count;
+                            for (uint32_t c = 0; c < channel_count; ++c) {
+                                size_t index = source + size_t(sx) * channel_count + c;
+                                row_sums[out + c] += weight * load_mean(index);
+                                row_weights[out + c] += weight;
+                                float value = load_max(index);
+                                max[target + out + c] = value > max[target + out + c] ? value : max[target + out + c];
+                            }
+                        }
+                    }
+                }
+                for (size_t i = 0; i < row_values; ++i)
+                    mean[target + i] = row_sums[i] / row_weights[i];
+            }
+        }
+        memory::free_heap(row_sums);
+    });
+
+    for (uint32_t a = 0; a < 3; ++a)
+        memory::free_heap(weights[a]);
+}
+
+// Values of a pyramid level (all channels), 0 past the stored levels
+static size_t get_level_value_count(VolumeFileHeader *header, uint32_t level)
+{
+    if (level >= get_stored_level_count(header))
+        return 0;
+    uint32_t width, height, depth;
+    volume_file::get_level_size(header, level, &width, &height, &depth);
+    return size_t(width) * height * depth * header->channel_count;
+}
+
+uint64_t volume_file::get_write_scratch_bytes(VolumeFileInfo *info)
+{
+    VolumeFileHeader header = get_header(info);
+    size_t brick_bytes = size_t(header.brick_size) * header.brick_size * header.brick_size * header.channel_count * get_type_size(info->data_type);
+    uint64_t bytes = uint64_t(VOLUME_FILE_BATCH_BRICKS) * get_brick_capacity(&header, brick_bytes);
+    if (header.compression == VC_SHUFFLE_LZ)
+        bytes += uint64_t(jobs::get_thread_count()) * brick_bytes;
+    // Mean and max of level 1, of level 2 for reducing the levels after it, and level 1 in the file's data type
+    size_t level_values = get_level_value_count(&header, 1);
+    bytes += uint64_t(VR_COUNT) * (level_values + get_level_value_count(&header, 2)) * sizeof(float);
+    bytes += uint64_t(level_values) * get_type_size(info->data_type);
+    return bytes;
+}
+
+bool volume_file::write(const char *filename, VolumeFileInfo *info, void *data, uint64_t *stored_bytes)
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        printf("Failed to write volume file %s\n", filename);
+        return false;
+    }
+
+    VolumeFileHeader header = get_header(info);
+    uint32_t brick_count = get_total_brick_count(&header);
+    size_t voxel_bytes = size_t(header.channel_count) * get_type_size(info->data_type);
+    BrickWriter writer = {};
+    writer.file = &file;
+    writer.header = &header;
+    writer.bricks = memory::alloc_heap<VolumeBrick>(brick_count);
+    writer.brick_bytes = size_t(header.brick_size) * header.brick_size * header.brick_size * voxel_bytes;
+    writer.brick_capacity = get_brick_capacity(&header, writer.brick_bytes);
+    writer.batch = memory::alloc_heap<uint8_t>(VOLUME_FILE_BATCH_BRICKS * writer.brick_capacity);
+    if (header.compression == VC_SHUFFLE_LZ)
+        writer.scratch = memory::alloc_heap<uint8_t>(jobs::get_thread_count() * writer.brick_bytes);
+    writer.offset = header.header_size;
+
+    // Header and parameters, the brick index is written once the brick sizes are known
+    file.write((char*)&header, sizeof(header));
+    if (info->parameter_count > 0)
+        file.write((char*)info->parameters, info->parameter_count * sizeof(VolumeParameter));
+    file.seekp(header.header_size);
+    write_image(&writer, 0, data);
+
+    // Pyramid levels are reduced in float32 from the level below and converted to the file's data type for writing.
+    // Odd levels are reduced into the [0] buffers, even ones into the [1] buffers, which only need the size of level 2.
+    uint32_t level_count = get_stored_level_count(&header);
+    if (level_count > 1) {
+        size_t value_count = get_level_value_count(&header, 1);
+        size_t even_value_count = get_level_value_count(&header, 2);
+        float *reduced[VR_COUNT][2] = {};
+        for (uint32_t r = 0; r < VR_COUNT; ++r) {
+            reduced[r][0] = memory::alloc_heap<float>(value_count);
+            if (even_value_count > 0)
+                reduced[r][1] = memory::alloc_heap<float>(even_value_count);
+        }
+        uint8_t *level_data = memory::alloc_heap<uint8_t>(value_count * get_type_size(info->data_type));
+
+        VolumeDataType data_type = info->data_type;
+        if (data_type == VDT_FLOAT16) {
+            auto load_source = [&](size_t index) { return volume::half_to_float(((uint16_t*)data)[index]); };
+            reduce_level(&header, 0, load_source, load_source, reduced[VR_MEAN][0], reduced[VR_MAX][0]);
+        } else if (data_type == VDT_FLOAT32) {
+            auto load_source = [&](size_t index) { return ((float*)data)[index]; };
+            reduce_level(&header, 0, load_source, load_source, reduced[VR_MEAN][0], reduced[VR_MAX][0]);
+        } else {
+            auto load_source = [&](size_t index) { return float(((uint8_t*)data)[index]); };
+            reduce_level(&header, 0, load_source, load_source, reduced[VR_MEAN][0], reduced[VR_MAX][0]);
+        }
+        for (uint32_t level = 1; level < level_count; ++level) {
+            uint32_t current = (level - 1) % 2;
+            value_count = get_level_value_count(&header, level);
+            for (uint32_t r = 0; r < VR_COUNT; ++r) {
+                store_values(reduced[r][current], value_count, data_type, level_data);
+                write_image(&writer, get_image_index(level, VolumeReduction(r)), level_data);
+            }
+            if (level + 1 < level_count) {
+                float *mean = reduced[VR_MEAN][current];
+                float *max = reduced[VR_MAX][current];
+                reduce_level(&header, level, [&](size_t index) { return mean[index]; }, [&](size_t index) { return max[index]; },
+                    reduced[VR_MEAN][1 - current], reduced[VR_MAX][1 - current]);
+            }
+        }
+
+        memory::free_heap(level_data);
+        for (uint32_t r = 0; r < VR_COUNT; ++r) {
+            memory::free_heap(reduced[r][0]);
+            if (reduced[r][1])
+                memory::free_heap(reduced[r][1]);
+        }
+    }
+
+    memory::free_heap(writer.batch);
+    if (writer.scratch)
+        memory::free_heap(writer.scratch);
+    if (stored_bytes)
+        *stored_bytes = writer.offset;
+
+    file.seekp(sizeof(header) + info->parameter_count * sizeof(VolumeParameter));
+    file.write((char*)writer.bricks, brick_count * sizeof(VolumeBrick));
+    bool success = file.good();
+    file.close();
+    memory::free_heap(writer.bricks);
+    if (!success)
+        printf("Failed to write volume file %s\n", filename);
+    return success;
+}
+
+bool volume_file::open(const char *filename, VolumeFileReader *reader)
+{
+    *reader = VolumeFileReader{};
+    reader->file = new std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!reader->file->is_open()) {
+        printf("Failed to open volume file %s\n", filename);
+        close(reader);
+        return false;
+    }
+    reader->file->read((char*)&reader->header, sizeof(VolumeFileHeader));
+    if (!reader->file->good() || memcmp(reader->header.magic, VOLUME_FILE_MAGIC, sizeof(VOLUME_FILE_MAGIC)) != 0
+        || reader->header.version > VOLUME_FILE_VERSION || reader->header.compression >= VC_COUNT || reader->header.level_count > 32
+        || reader->header.brick_size == 0 || reader->header.data_type >= VDT_COUNT) {
+        printf("%s is not a supported volume file\n", filename);
+        close(reader);
+        return false;
+    }
+
+    VolumeFileHeader *header = &reader->header;
+    uint32_t brick_count = get_total_brick_count(header);
+    reader->parameters = memory::alloc_heap<VolumeParameter>(header->parameter_count + 1);
+    reader->bricks = memory::alloc_heap<VolumeBrick>(brick_count);
+    reader->file->read((char*)reader->parameters, header->parameter_count * sizeof(VolumeParameter));
+    reader->file->read((char*)reader->bricks, brick_count * sizeof(VolumeBrick));
+    if (!reader->file->good()) {
+        printf("Failed to read the brick index of %s\n", filename);
+        close(reader);
+        return false;
+    }
+    return true;
+}
+
+double volume_file::get_parameter_value(VolumeFileReader *reader, const char *name, double fallback)
+{
+    for (uint32_t i = 0; i < reader->header.parameter_count; ++i) {
+        if (strncmp(reader->parameters[i].name, name, sizeof(reader->parameters[i].name)) == 0)
+            return reader->parameters[i].value;
+    }
+    return fallback;
+}
+
+bool volume_file::read_region(VolumeFileReader *reader, uint32_t x, uint32_t y, uint32_t z, uint32_t width, uint32_t height, uint32_t depth, void *data)
+{
+    return read_level_region(reader, 0, VR_MEAN, x, y, z, width, height, depth, data);
+}
+
+bool volume_file::read_level_region(VolumeFileReader *reader, uint32_t level, VolumeReduction reduction,
+    uint32_t x, uint32_t y, uint32_t z, uint32_t width, uint32_t height, uint32_t depth, void *data)
+{
+    VolumeFileHeader *header = &reader->header;
+    if (level >= get_stored_level_count(header) || reduction >= VR_COUNT)
+        return false;
+    VolumeImage image = get_image(header, get_image_index(level, reduction));
+    if (x + width > image.width || y + height > image.height || z + depth > image.depth)
+        return false;
+    if (width == 0 || height == 0 || depth == 0)
+        return true;
+    bool compressed = header->compression == VC_SHUFFLE_LZ;
+    uint32_t type_size = get_type_size(VolumeDataType(header->data_type));
+    size_t voxel_bytes = size_t(header->channel_count) * type_size;
+    size_t brick_bytes = size_t(header->brick_size) * header->brick_size * header->brick_size * voxel_bytes;
+    size_t brick_capacity = get_brick_capacity(header, brick_bytes);
+
+    // Bricks overlapping the region
+    uint32_t size = header->brick_size;
+    uint32_t bx0 = x / size, bx1 = (x + width - 1) / size;
+    uint32_t by0 = y / size, by1 = (y + height - 1) / size;
+    uint32_t bz0 = z / size, bz1 = (z + depth - 1) / size;
+    uint32_t overlap_x = bx1 - bx0 + 1;
+    uint32_t overlap_y = by1 - by0 + 1;
+    uint32_t overlap_count = overlap_x * overlap_y * (bz1 - bz0 + 1);
+
+    // Stored bricks are read one batch at a time, then decompressed and copied out in parallel
+    uint8_t *batch = memory::alloc_heap<uint8_t>(VOLUME_FILE_BATCH_BRICKS * brick_capacity);
+    uint8_t *scratch = compressed ? memory::alloc_heap<uint8_t>(jobs::get_thread_count() * brick_bytes) : nullptr;
+    uint32_t batch_indices[VOLUME_FILE_BATCH_BRICKS];
+    bool success = true;
+    for (uint32_t first = 0; first < overlap_count && success; first += VOLUME_FILE_BATCH_BRICKS) {
+        uint32_t batch_count = overlap_count - first < VOLUME_FILE_BATCH_BRICKS ? overlap_count - first : VOLUME_FILE_BATCH_BRICKS;
+        for (uint32_t b = 0; b < batch_count && success; ++b) {
+            uint32_t i = first + b;
+            uint32_t bx = bx0 + i % overlap_x;
+            uint32_t by = by0 + (i / overlap_x) % overlap_y;
+            uint32_t bz = bz0 + i / (overlap_x * overlap_y);
+            uint32_t index = image.first_brick + (bz * image.brick_count_y + by) * image.brick_count_x + bx;
+            batch_indices[b] = index;
+            success = reader->bricks[index].size <= brick_capacity;
+            if (success) {
+                reader->file->seekg(std::streamoff(reader->bricks[index].offset));
+                reader->file->read((char*)(batch + b * brick_capacity), std::streamsize(reader->bricks[index].size));
+                success = reader->file->good();
+            }
+        }
+        if (!success)
+            break;
+
+        bool decoded[VOLUME_FILE_BATCH_BRICKS];
+        jobs::parallel_for(batch_count, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+            for (uint32_t b = begin; b < end; ++b) {
+                uint32_t index = batch_indices[b];
+                BrickExtent extent = get_brick_extent(header, &image, index - image.first_brick);
+                uint8_t *brick = batch + b * brick_capacity;
+                size_t stored_size = size_t(reader->bricks[index].size);
+                size_t brick_size = size_t(extent.width) * extent.height * extent.depth * voxel_bytes;
+                if (compressed) {
+                    uint8_t *unpacked = scratch + thread_index * brick_bytes;
+                    decoded[b] = compression::decode(brick, stored_size, type_size, unpacked, brick_size);
+                    brick = unpacked;
+                } else {
+                    decoded[b] = stored_size == brick_size;
+                }
+                if (!decoded[b])
+                    continue;
+
+                // Overlap of the brick and the region
+                uint32_t x0 = extent.x > x ? extent.x : x;
+                uint32_t y0 = extent.y > y ? extent.y : y;
+                uint32_t z0 = extent.z > z ? extent.z : z;
+                uint32_t x1 = extent.x + extent.width < x + width ? extent.x + extent.width : x + width;
+                uint32_t y1 = extent.y + extent.height < y + height ? extent.y + extent.height : y + height;
+                uint32_t z1 = extent.z + extent.depth < z + depth ? extent.z + extent.depth : z + depth;
+                size_t row_bytes = (x1 - x0) * voxel_bytes;
+                for (uint32_t vz = z0; vz < z1; ++vz) {
+                    for (uint32_t vy = y0; vy < y1; ++vy) {
+                        size_t source = ((size_t(vz - extent.z) * extent.height + (vy - extent.y)) * extent.width + (x0 - extent.x)) * voxel_bytes;
+                        size_t target = ((size_t(vz - z) * height + (vy - y)) * width + (x0 - x)) * voxel_bytes;
+                        memcpy((uint8_t*)data + target, brick + source, row_bytes);
+                    }
+                }
+            }
+        });
+        for (uint32_t b = 0; b < batch_count; ++b)
+            success = success && decoded[b];
+    }
+    memory::free_heap(batch);
+    if (scratch)
+        memory::free_heap(scratch);
+    if (!success)
+        printf("Failed to read volume region\n");
+    return success;
+}
+
+bool volume_file::read_volume(VolumeFileReader *reader, uint32_t level, uint32_t channel, Volume *volume)
+{
+    *volume = Volume{};
+    VolumeFileHeader *header = &reader->header;
+    if (level >= get_stored_level_count(header) || channel >= header->channel_count)
+        return false;
+    uint32_t width, height, depth;
+    get_level_size(header, level, &width, &height, &depth);
+    *volume = volume::get(width, height, depth);
+    if (!volume->data)
+        return false;
+
+    uint32_t type_size = get_type_size(VolumeDataType(header->data_type));
+    uint32_t channel_count = header->channel_count;
+    uint32_t slab_depth = header->brick_size;
+    size_t slab_values = size_t(width) * height * slab_depth * channel_count;
+    uint8_t *slab = memory::alloc_heap<uint8_t>(slab_values * type_size);
+    bool success = true;
+    for (uint32_t z = 0; z < depth && success; z += slab_depth) {
+        uint32_t slab_end = z + slab_depth < depth ? z + slab_depth : depth;
+        success = read_level_region(reader, level, VR_MEAN, 0, 0, z, width, height, slab_end - z, slab);
+        if (!success)
+            break;
+        uint32_t slab_rows = height * (slab_end - z);
+        float *out = volume->data + volume::get_index(volume, 0, 0, z);
+        jobs::parallel_for(slab_rows, 64, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (size_t i = size_t(begin) * width; i < size_t(end) * width; ++i) {
+                size_t value = i * channel_count + channel;
+                if (header->data_type == VDT_FLOAT16)
+                    out[i] = volume::half_to_float(((uint16_t*)slab)[value]);
+                else if (header->data_type == VDT_FLOAT32)
+                    out[i] = ((float*)slab)[value];
+                else
+                    out[i] = float(slab[value]);
+            }
+        });
+    }
+    memory::free_heap(slab);
+    if (!success)
+        volume::release(volume);
+    return success;
+}
+
+void volume_file::close(VolumeFileReader *reader)
+{
+    if (reader->file) {
+        reader->file->close();
+        delete reader->file;
+    }
+    if (reader->parameters)
+        memory::free_heap(reader->parameters);
+    if (reader->bricks)
+        memory::free_heap(reader->bricks);
+    *reader = VolumeFileReader{};
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <fstream>
+#include "volume.h"
+
+// Polyphorm volume file (.pvol) layout, all values little-endian:
+//   VolumeFileHeader | VolumeParameter[parameter_count] | VolumeBrick[brick count of all images] | brick data
+// Bricks are cubes of brick_size voxels (clipped at the upper grid faces) stored in x-fastest brick order,
+// voxels inside a brick are x-fastest with channels interleaved, exactly like the exported textures.
+// Files with level_count > 1 also hold a mip pyramid: level l has ceil(size / 2^l) voxels per axis, so its voxel i covers
+// the full-resolution voxels [i * 2^l, (i + 1) * 2^l). Every level above 0 is stored twice, reduced by mean and by max,
+// and the brick index lists the images in the order level 0, level 1 mean, level 1 max, level 2 mean, ...
+
+const uint32_t VOLUME_FILE_VERSION = 3; // 2: compressed bricks, 3: mip pyramid
+
+enum VolumeDataType
+{
+    VDT_FLOAT16 = 0,
+    VDT_FLOAT32 = 1,
+    VDT_UINT8 = 2,
+    VDT_COUNT
+};
+
+enum VolumeCompression
+{
+    VC_NONE = 0, // Bricks stored as they are
+    VC_SHUFFLE_LZ = 1, // Bricks encoded by compression::encode (byte shuffle, LZ77, Huffman)
+    VC_COUNT
+};
+
+enum VolumeReduction
+{
+    VR_MEAN = 0, // Mean of the covered voxels
+    VR_MAX = 1, // Maximum of the covered voxels
+    VR_COUNT
+};
+
+struct VolumeFileHeader
+{
+    char magic[8]; // "PPVOLUME"
+    uint32_t version;
+    uint32_t header_size; // Bytes before the first brick: header, parameters and brick index
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t channel_count;
+    uint32_t data_type; // VolumeDataType
+    uint32_t brick_size;
+    uint32_t brick_count_x;
+    uint32_t brick_count_y;
+    uint32_t brick_count_z;
+    uint32_t compression; // VolumeCompression
+    uint32_t parameter_count;
+    uint32_t level_count; // Pyramid levels including the full resolution (0 in files before version 3, meaning 1)
+    uint32_t reserved[2];
+    float world_to_grid[12]; // Row-major 3x4 affine transform from world [Mpc] to grid [vox] coordinates
+    char description[256]; // Zero-terminated, e.g. the dataset name
+};
+
+// Named scalar stored in the header, e.g. one SimulationConfig field
+struct VolumeParameter
+{
+    char name[56]; // Zero-terminated
+    double value;
+};
+
+// Location of a brick's data in the file
+struct VolumeBrick
+{
+    uint64_t offset;
+    uint64_t size; // Stored bytes
+};
+
+// Everything needed to write a volume file besides the voxel data
+struct VolumeFileInfo
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t channel_count;
+    VolumeDataType data_type;
+    uint32_t brick_size;
+    VolumeCompression compression;
+    uint32_t level_count; // 1 = full resolution only
+    float world_to_grid[12];
+    const char *description;
+    VolumeParameter *parameters;
+    uint32_t parameter_count;
+};
+
+// Open file with its header, parameters and brick index loaded
+struct VolumeFileReader
+{
+    std::ifstream *file;
+    VolumeFileHeader header;
+    VolumeParameter *parameters;
+    VolumeBrick *bricks;
+};
+
+// `volume_file` namespace writes and reads bricked, self-describing volume files
+namespace volume_file
+{
+    VolumeFileInfo get_default_info(uint32_t width, uint32_t height, uint32_t depth, uint32_t channel_count, VolumeDataType data_type);
+
+    // Set the world-to-grid transform for a grid spanning a box of `size` [Mpc] around `center`
+    void set_world_box(VolumeFileInfo *info, float size_x, float size_y, float size_z, float center_x, float center_y, float center_z);
+
+    // Fill a parameter entry
+    VolumeParameter get_parameter(const char *name, double value);
+
+    // Bytes of one value of the data type
+    uint32_t get_type_size(VolumeDataType data_type);
+
+    // Pyramid levels needed to reduce the longest side of the grid to at most `min_size` voxels
+    uint32_t get_level_count(uint32_t width, uint32_t height, uint32_t depth, uint32_t min_size);
+
+    // Resolution of a pyramid level
+    void get_level_size(VolumeFileHeader *header, uint32_t level, uint32_t *width, uint32_t *height, uint32_t *depth);
+
+    // Write `data` (x-fastest, channels interleaved) as a bricked volume file; bricks are packed and compressed in parallel.
+    // The pyramid levels requested by info->level_count are computed from `data` in parallel and stored in the same file.
+    // The resulting file size is returned in `stored_bytes` if given.
+    bool write(const char *filename, VolumeFileInfo *info, void *data, uint64_t *stored_bytes = nullptr);
+
+    // Memory write() allocates besides `data` for the volume described by `info` (brick batch and pyramid reduction)
+    uint64_t get_write_scratch_bytes(VolumeFileInfo *info);
+
+    // Open a volume file and load its header, parameters and brick index
+    bool open(const char *filename, VolumeFileReader *reader);
+
+    // Value of a header parameter, or `fallback` if not present
+    double get_parameter_value(VolumeFileReader *reader, const char *name, double fallback);
+
+    // Read the sub-volume [x, x + width) x [y, y + height) x [z, z + depth) into `data` (x-fastest, channels interleaved),
+    // touching only the bricks that overlap it; bricks are decompressed in parallel
+    bool read_region(VolumeFileReader *reader, uint32_t x, uint32_t y, uint32_t z, uint32_t width, uint32_t height, uint32_t depth, void *data);
+
+    // Same as read_region in the coordinates of a pyramid level; level 0 ignores the reduction
+    bool read_level_region(VolumeFileReader *reader, uint32_t level, VolumeReduction reduction,
+        uint32_t x, uint32_t y, uint32_t z, uint32_t width, uint32_t height, uint32_t depth, void *data);
+
+    // Read one channel of a pyramid level (mean reduction) into a new float32 volume, converting from the stored type.
+    // The file is read in slabs of bricks, so only the volume itself has to fit in memory.
+    bool read_volume(VolumeFileReader *reader, uint32_t level, uint32_t channel, Volume *volume);
+
+    // Close the file and release the index
+    void close(VolumeFileReader *reader);
+}
@@ -10,8 +10,25 @@
 #include <cassert>
 #include <mmsystem.h>
 #include "logging.h"
+#include "volume.h"
+#include "morphology.h"
+#include "spectrum.h"
+#include "calibration.h"
+#include "kdtree.h"
+#include "light_bvh.h"
+#include "distance.h"
+#include "skeleton.h"
+#include "isosurface.h"
+#include "export.h"
+#include "volume_file.h"
+#include "export_queue.h"
+#include "trajectory.h"
+#include "table.h"
+#include "dataset_cache.h"
+#include "jobs.h"
 #include <sstream>
 #include <fstream>
+#include <iomanip>
 
 //*** Truncation from double to float warning
 #pragma warning(disable:4305)
@@ -39,8 +56,23 @@
 
 //*** How to initialize the agents in their 3D domain: Uncomment exactly one!
 #define AGENTS_INIT_AROUND_DATA
+// #define AGENTS_INIT_AROUND_SPARSE_DATA // Favors isolated data points and, on reset (F2), data with low measured trace
 // #define AGENTS_INIT_RANDOMLY
 
+//*** Analysis products computed on the CPU along with the F6 export: Uncomment the ones needed
+// #define EXPORT_MORPHOLOGY // Void/sheet/filament/knot classification of the trace (export/morphology*)
+// #define EXPORT_POWER_SPECTRUM // Power spectra, cross-spectrum and correlation functions of trace and deposit (export/power_spectrum.txt)
+// #define EXPORT_CALIBRATION // Monotone trace -> reference density mapping and the calibrated density grid (export/calibration*)
+// #define EXPORT_FILAMENT_DISTANCE // Distance of each data point to the nearest filament, added to export/halos_measurements.csv
+// #define EXPORT_SKELETON // Filament network graph from thinning of the thresholded trace (export/skeleton*)
+// #define EXPORT_ISOSURFACE // Trace isosurfaces at ISOSURFACE_TRACE_LEVELS as triangle meshes for external renderers (export/isosurface_*)
+
+// The analyses run on the export thread on the snapshot taken for the export. All but the morphology, which streams the
+// half-float snapshot in slabs, read the trace as a full-resolution float volume.
+#if defined(EXPORT_POWER_SPECTRUM) || defined(EXPORT_CALIBRATION) || defined(EXPORT_FILAMENT_DISTANCE) || defined(EXPORT_SKELETON) || defined(EXPORT_ISOSURFACE)
+#define EXPORT_TRACE_VOLUME
+#endif
+
 //====================================================================
 
 #ifdef REGIME_SDSS
@@ -190,8 +222,32 @@ const int32_t THREAD_GROUP_SIZE = 1000; // Divisible by 10! Must align with sett
 const uint32_t N_HISTOGRAM_BINS = 17; // Must align with settings inside the histo shader!
 const int32_t PT_GROUP_SIZE_X = 10; // Must align with settings inside the PT shader!
 const int32_t PT_GROUP_SIZE_Y = 10; // Must align with settings inside the PT shader!
+const int32_t PT_MAJORANT_BLOCK = 8; // Trace voxels per majorant cell, must align with the PT and majorant shaders!
+const int32_t PT_MAJORANT_GROUP_SIZE = 4; // Must align with settings inside the majorant shader!
+const int32_t DENOISE_GROUP_SIZE = 8; // Must align with settings inside the denoise shader!
+const int32_t DENOISE_PASSES = 3; // A-trous passes of the path tracer's denoiser, as in denoise::get_default_settings
 const int32_t N_AGENTS_TO_CAPTURE = 1e3;
-const int32_t N_AGENT_TIMESTEPS_TO_CAPTURE = 10;
+const int32_t N_AGENT_TIMESTEPS_TO_CAPTURE = 500; // Length of a capture; F5 stops it earlier
+const TrajectorySelectionMode AGENT_CAPTURE_SELECTION = TSM_COUNT; // Agents recorded by F5: TSM_COUNT = N_AGENTS_TO_CAPTURE of them, TSM_STRIDE = every AGENT_CAPTURE_STRIDE-th, TSM_REGION = up to N_AGENTS_TO_CAPTURE inside the region
+const uint32_t AGENT_CAPTURE_STRIDE = 1000;
+const float AGENT_CAPTURE_REGION_MIN[3] = { 0.4, 0.4, 0.4 }; // Capture region as fractions of the simulation domain
+const float AGENT_CAPTURE_REGION_MAX[3] = { 0.6, 0.6, 0.6 };
+const uint32_t AGENT_CAPTURE_QUANTIZATION_BITS = 16; // Bits per captured position coordinate, 0 = lossless float32
+const uint32_t AGENT_CAPTURE_KEYFRAME_INTERVAL = 32; // Captured timesteps between keyframes of the delta encoding
+const uint32_t TRAJECTORY_GATHER_GROUP_SIZE = 64; // Must align with settings inside the agent gather shader!
+const uint32_t TRAJECTORY_GATHER_ROW_GROUPS = 1024; // Must align with settings inside the agent gather shader!
+const uint32_t TRAJECTORY_READBACK_LATENCY = 3; // Staging buffers in flight: captured steps are read back this many frames later
+const float MORPHOLOGY_SMOOTHING_MPC = 2.0; // Gaussian scale of the Hessian used for the morphology classification
+const uint32_t SEEDING_NEIGHBORS = 8; // Neighbor count that defines the sparseness of data points for AGENTS_INIT_AROUND_SPARSE_DATA
+const float FILAMENT_TRACE_THRESHOLD = 3.0; // Voxels with trace above this multiple of the mean trace count as filaments for EXPORT_FILAMENT_DISTANCE
+const float SKELETON_MIN_BRANCH_MPC = 2.0; // Dangling skeleton branches shorter than this are pruned from the filament graph
+const float ISOSURFACE_TRACE_LEVELS[] = { 3.0, 10.0 }; // Isosurfaces extracted by EXPORT_ISOSURFACE, as multiples of the mean trace
+const MeshFileFormat ISOSURFACE_FORMAT = MFF_PLY_BINARY; // MFF_OBJ, MFF_PLY_TEXT or MFF_PLY_BINARY
+const char *CALIBRATION_REFERENCE_GRID = ""; // Volume file (.pvol) or raw float32 cube spanning the dataset bounds (e.g. simulation overdensity); if empty, the trace is calibrated against halo masses
+const int32_t EXPORT_INTERVAL = 0; // Export trace, deposit and halo measurements every this many iterations (suffixed with the iteration), 0 = only on F6
+const uint32_t EXPORT_QUEUE_LENGTH = 4; // Exports that may wait for the background writer before the simulation is held back
+const uint64_t EXPORT_STAGING_MB = 4096; // Memory budget of the snapshots waiting for the background writer, including their write scratch
+const uint32_t EXPORT_PYRAMID_MIN_RESOLUTION = 64; // Exported grids also store 2x reduced levels (mean and max) down to this longest side, 0 = full resolution only
 
 //====================================================================
 
@@ -221,6 +277,39 @@ int nearest_multiple_of(int32_t n, int32_t m)
     return n + (m - r);
 }
 
+// Reference grid of EXPORT_CALIBRATION: a volume file (.pvol) with the resolution in its header, or a raw float32 cube
+bool load_reference_grid(const char *filename, Volume *volume)
+{
+    *volume = Volume{};
+    size_t length = strlen(filename);
+    if (length > 5 && strcmp(filename + length - 5, ".pvol") == 0) {
+        VolumeFileReader reader = {};
+        if (!volume_file::open(filename, &reader))
+            return false;
+        bool success = volume_file::read_volume(&reader, 0, 0, volume);
+        if (!success)
+            printf("Failed to read reference grid %s\n", filename);
+        volume_file::close(&reader);
+        return success;
+    }
+
+    File file = file_system::read_file(filename);
+    if (!file.data) {
+        printf("Failed to read reference grid %s\n", filename);
+        return false;
+    }
+    uint32_t side = uint32_t(round(cbrt(double(file.size / sizeof(float)))));
+    if (uint64_t(side) * side * side * sizeof(float) != file.size) {
+        printf("Reference grid %s is not a float32 cube (%u bytes)\n", filename, file.size);
+        file_system::release_file(file);
+        return false;
+    }
+    *volume = volume::get(side, side, side);
+    memcpy(volume->data, file.data, file.size);
+    file_system::release_file(file);
+    return true;
+}
+
 enum VisualizationMode {
     VM_VOLUME,
     VM_VOLUME_HIGHLIGHT,
@@ -302,6 +391,21 @@ struct RenderingConfig {
     int compressive_accumulation;
     float guiding_strength;
     float scattering_anisotropy;
+
+    int denoise_step;
+    float denoise_sigma_luminance;
+    float denoise_sigma_depth;
+    float denoise_sigma_density;
+
+    float denoise_sigma_albedo;
+    float target_error;
+    float prev_camera_x;
+    float prev_camera_y;
+
+    float prev_camera_z;
+    float prev_camera_offset_x;
+    float prev_camera_offset_y;
+    int reproject_history;
 };
 
 struct StatisticsConfig {
@@ -371,22 +475,22 @@ int main(int argc, char **argv)
         printf("Data or metadata file missing!\n\n");
         return 0;
     }
+    std::stringstream metadata_text;
+    metadata_text << metadata_file.rdbuf();
+    metadata_file.close();
+    std::string metadata_string = metadata_text.str();
     float data_x_min, data_x_max, data_y_min, data_y_max, data_z_min, data_z_max;
     float mean_weight;
     int data_count;
-    std::getline(metadata_file, varname, '='); metadata_file >> data_count;
-    std::getline(metadata_file, varname, '='); metadata_file >> data_x_min;
-    std::getline(metadata_file, varname, '='); metadata_file >> data_x_max;
-    std::getline(metadata_file, varname, '='); metadata_file >> data_y_min;
-    std::getline(metadata_file, varname, '='); metadata_file >> data_y_max;
-    std::getline(metadata_file, varname, '='); metadata_file >> data_z_min;
-    std::getline(metadata_file, varname, '='); metadata_file >> data_z_max;
-    std::getline(metadata_file, varname, '='); metadata_file >> mean_weight;
-    metadata_file.close();
+    std::getline(metadata_text, varname, '='); metadata_text >> data_count;
+    std::getline(metadata_text, varname, '='); metadata_text >> data_x_min;
+    std::getline(metadata_text, varname, '='); metadata_text >> data_x_max;
+    std::getline(metadata_text, varname, '='); metadata_text >> data_y_min;
+    std::getline(metadata_text, varname, '='); metadata_text >> data_y_max;
+    std::getline(metadata_text, varname, '='); metadata_text >> data_z_min;
+    std::getline(metadata_text, varname, '='); metadata_text >> data_z_max;
+    std::getline(metadata_text, varname, '='); metadata_text >> mean_weight;
 
-        // Load binary data points
-    File raw_data = file_system::read_file((filename + ".bin").c_str());
-    float *input_data = (float*)raw_data.data;
     printf("\n-> input data points: %d\n", data_count);
     printf("-> number of agents: %d\n", NUM_AGENTS);
     int32_t NUM_PARTICLES = NUM_AGENTS + data_count;
@@ -420,6 +524,79 @@ int main(int argc, char **argv)
     printf("-> simulation grid resolution: %d x %d x %d\n", GRID_RESOLUTION_X, GRID_RESOLUTION_Y, GRID_RESOLUTION_Z);
     printf("-> simulation domain: %.2f x %.2f x %.2f Mpc\n", WORLD_SIZE_X, WORLD_SIZE_Y, WORLD_SIZE_Z);
 
+        // Data points in grid space: mapped from the dataset cache (<dataset>.pcache) if the catalog, its metadata and the grid
+        // settings are unchanged, otherwise converted from the catalog and cached for the next launch
+    #ifdef HALO_COLOR_ANALYSIS
+    const uint32_t INPUT_STRIDE = 5;
+    #else
+    const uint32_t INPUT_STRIDE = 4;
+    #endif
+    // Version of the conversion below (weighting and normalization), part of the cache key: bump it whenever the loop changes
+    const uint32_t DATA_CONVERSION_VERSION = 1;
+    std::string cache_filename = filename + ".pcache";
+    DatasetCacheKey cache_key;
+    DatasetCache data_points;
+    bool cache_hit = dataset_cache::get_key((filename + ".bin").c_str(), metadata_string.data(), metadata_string.size(), GRID_RESOLUTION, GRID_PADDING, INPUT_STRIDE,
+        DATA_CONVERSION_VERSION, &cache_key)
+        && dataset_cache::open(cache_filename.c_str(), (filename + ".bin").c_str(), &cache_key, &data_points);
+    if (cache_hit && (data_points.header.point_count != uint32_t(data_count) || data_points.header.grid_size[0] != GRID_RESOLUTION_X
+        || data_points.header.grid_size[1] != GRID_RESOLUTION_Y || data_points.header.grid_size[2] != GRID_RESOLUTION_Z)) {
+        dataset_cache::close(&data_points);
+        cache_hit = false;
+    }
+    if (cache_hit) {
+        printf("-> data points mapped from %s\n", cache_filename.c_str());
+    } else {
+        File raw_data = file_system::read_file((filename + ".bin").c_str());
+        float *input_data = (float*)raw_data.data;
+        if (!input_data || raw_data.size < uint64_t(data_count) * INPUT_STRIDE * sizeof(float)) {
+            printf("Data or metadata file missing!\n\n");
+            return 0;
+        }
+        if (cache_key.source_hash == 0)
+            cache_key.source_hash = dataset_cache::hash(raw_data.data, raw_data.size);
+
+        DatasetCacheHeader cache_header = {};
+        cache_header.point_count = data_count;
+        cache_header.key = cache_key;
+        cache_header.grid_size[0] = GRID_RESOLUTION_X;
+        cache_header.grid_size[1] = GRID_RESOLUTION_Y;
+        cache_header.grid_size[2] = GRID_RESOLUTION_Z;
+        cache_header.world_size[0] = WORLD_SIZE_X;
+        cache_header.world_size[1] = WORLD_SIZE_Y;
+        cache_header.world_size[2] = WORLD_SIZE_Z;
+        cache_header.world_center[0] = WORLD_CENTER_X;
+        cache_header.world_center[1] = WORLD_CENTER_Y;
+        cache_header.world_center[2] = WORLD_CENTER_Z;
+        cache_header.mean_weight = mean_weight;
+        dataset_cache::create(cache_header, &data_points);
+        float **planes = data_points.planes;
+        jobs::parallel_for(data_count, 16384, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t i = begin; i < end; ++i) {
+                float *point = input_data + INPUT_STRIDE * i;
+
+                // TODO EVALUATE DIFFERENT APPROACHES FROM UI !! (and bump DATA_CONVERSION_VERSION)
+                
+                // float weight = 1.0;
+                // float weight = point[3];
+                float weight = log10f(1.0 + point[3]);
+
+                planes[DCP_X][i] = world_to_grid(point[0], WORLD_SIZE_X, WORLD_CENTER_X, float(GRID_RESOLUTION_X));
+                planes[DCP_Y][i] = world_to_grid(point[1], WORLD_SIZE_Y, WORLD_CENTER_Y, float(GRID_RESOLUTION_Y));
+                planes[DCP_Z][i] = world_to_grid(point[2], WORLD_SIZE_Z, WORLD_CENTER_Z, float(GRID_RESOLUTION_Z));
+                if (mean_weight > 0.0)
+                    planes[DCP_WEIGHT][i] = (1.0e6 / float(data_count)) * (weight / mean_weight);
+                else
+                    planes[DCP_WEIGHT][i] = weight;
+                planes[DCP_COLOR][i] = INPUT_STRIDE > 4 ? point[4] : 0.0; // Halo color flag (-1 ~ red, +1 ~ blue)
+                planes[DCP_MASS][i] = point[3];
+            }
+        });
+        file_system::release_file(raw_data);
+        if (dataset_cache::save(cache_filename.c_str(), &data_points))
+            printf("-> data points cached in %s\n", cache_filename.c_str());
+    }
+
         // Write out proxy sightline coords
     // float sightline_x = world_to_grid(0.0, WORLD_SIZE_X, WORLD_CENTER_X, GRID_RESOLUTION_X);
     // float sightline_y = world_to_grid(0.0, WORLD_SIZE_Y, WORLD_CENTER_Y, GRID_RESOLUTION_Y);
@@ -519,6 +696,13 @@ int main(int argc, char **argv)
     assert(graphics::is_ready(&sort_shader));
     printf("cs_agents_sort shader compiled...\n");
 
+    // Gathering of the agents selected for a trajectory capture
+    File gather_shader_file = file_system::read_file("cs_agents_gather.hlsl");
+    ComputeShader gather_shader = graphics::get_compute_shader_from_code((char *)gather_shader_file.data, gather_shader_file.size);
+    file_system::release_file(gather_shader_file);
+    assert(graphics::is_ready(&gather_shader));
+    printf("cs_agents_gather shader compiled...\n");
+
     // Decay/diffusion shader
     File decay_compute_shader_file = file_system::read_file("cs_field_decay.hlsl");
     ComputeShader decay_compute_shader = graphics::get_compute_shader_from_code((char *)decay_compute_shader_file.data, decay_compute_shader_file.size);
@@ -554,6 +738,18 @@ int main(int argc, char **argv)
     assert(graphics::is_ready(&cs_volpath));
     printf("cs_volpath shader compiled...\n");
 
+    File file_cs_trace_majorant = file_system::read_file("cs_trace_majorant.hlsl");
+    ComputeShader cs_trace_majorant = graphics::get_compute_shader_from_code((char *)file_cs_trace_majorant.data, file_cs_trace_majorant.size);
+    file_system::release_file(file_cs_trace_majorant);
+    assert(graphics::is_ready(&cs_trace_majorant));
+    printf("cs_trace_majorant shader compiled...\n");
+
+    File file_cs_denoise = file_system::read_file("cs_denoise.hlsl");
+    ComputeShader cs_denoise = graphics::get_compute_shader_from_code((char *)file_cs_denoise.data, file_cs_denoise.size);
+    file_system::release_file(file_cs_denoise);
+    assert(graphics::is_ready(&cs_denoise));
+    printf("cs_denoise shader compiled...\n");
+
     File file_ps_volpath = file_system::read_file("ps_volpath.hlsl");
     PixelShader ps_volpath = graphics::get_pixel_shader_from_code((char *)file_ps_volpath.data, file_ps_volpath.size);
     file_system::release_file(file_ps_volpath);
@@ -573,8 +769,31 @@ int main(int argc, char **argv)
     #else
     Texture3D trace_tex = graphics::get_texture3D(NULL, GRID_RESOLUTION_X, GRID_RESOLUTION_Y, GRID_RESOLUTION_Z, DXGI_FORMAT_R16_FLOAT, 2);
     #endif
+    // Trace min/max per block of voxels, the local majorants of the path tracer
+    const uint32_t MAJORANT_RESOLUTION_X = (GRID_RESOLUTION_X + PT_MAJORANT_BLOCK - 1) / PT_MAJORANT_BLOCK;
+    const uint32_t MAJORANT_RESOLUTION_Y = (GRID_RESOLUTION_Y + PT_MAJORANT_BLOCK - 1) / PT_MAJORANT_BLOCK;
+    const uint32_t MAJORANT_RESOLUTION_Z = (GRID_RESOLUTION_Z + PT_MAJORANT_BLOCK - 1) / PT_MAJORANT_BLOCK;
+    Texture3D majorant_tex = graphics::get_texture3D(NULL, MAJORANT_RESOLUTION_X, MAJORANT_RESOLUTION_Y, MAJORANT_RESOLUTION_Z, DXGI_FORMAT_R32G32_FLOAT, 8);
+    #ifdef VELOCITY_ANALYSIS
+    const uint32_t TRACE_CHANNELS = 4;
+    #else
+    const uint32_t TRACE_CHANNELS = 1;
+    #endif
+    #ifdef HALO_COLOR_ANALYSIS
+    const uint32_t DEPOSIT_CHANNELS = 2;
+    #else
+    const uint32_t DEPOSIT_CHANNELS = 1;
+    #endif
     Texture2D display_tex = graphics::get_texture2D(NULL, window_width, window_height, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
     Texture2D display_tex_uint = graphics::get_texture2D(NULL, window_width, window_height, DXGI_FORMAT_R32_UINT, 4);
+    // Denoiser features the path tracer writes next to display_tex, and the ping-pong targets of the filter passes
+    Texture2D features_tex = graphics::get_texture2D(NULL, window_width, window_height, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
+    Texture2D albedo_tex = graphics::get_texture2D(NULL, window_width, window_height, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
+    Texture2D denoise_tex_A = graphics::get_texture2D(NULL, window_width, window_height, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
+    Texture2D denoise_tex_B = graphics::get_texture2D(NULL, window_width, window_height, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
+    // Accumulator and features of the previous view, swapped with display_tex and features_tex when the camera moves
+    Texture2D history_tex = graphics::get_texture2D(NULL, window_width, window_height, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
+    Texture2D history_features_tex = graphics::get_texture2D(NULL, window_width, window_height, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
     Texture2D palette_trace_tex = graphics::load_texture2D(COLOR_PALETTE_TRACE);
     Texture2D palette_data_tex = graphics::load_texture2D(COLOR_PALETTE_DATA);
 
@@ -593,54 +812,77 @@ int main(int argc, char **argv)
     float *particles_theta = memory::alloc_heap<float>(NUM_PARTICLES);
     float *particles_weights = memory::alloc_heap<float>(NUM_PARTICLES);
     float *halos_densities = memory::alloc_heap<float>(data_count);
+    bool halos_measured = false;
 
     unsigned int *density_histogram = memory::alloc_heap<unsigned int>(N_HISTOGRAM_BINS);
     for (int i = 0; i < N_HISTOGRAM_BINS; ++i) {
         density_histogram[i] = 0;
     }
 
-    auto update_particles = [&input_data, &data_count]
+    auto update_particles = [&data_points, &data_count, &halos_densities, &halos_measured]
         (float *px, float *py, float *pz, float *pp, float *pt, float *pw, int count, uint32_t gx, uint32_t gy, uint32_t gz, float wx, float wy, float wz, float cx, float cy, float cz, float mw)
     {
+        float *seeding_cdf = NULL;
+        float *seeding_radius = NULL;
         for (int i = 0; i < count; ++i) {
 
-            // These are the data points, read from input
+            // These are the data points, already converted to grid space
             if (i < data_count) {
-                #ifdef HALO_COLOR_ANALYSIS
-                int start_index = int(5*i);
-                #else
-                int start_index = int(4*i);
-                #endif
-
-                float x = input_data[start_index];
-                float y = input_data[start_index + 1];
-                float z = input_data[start_index + 2];
-
-                // TODO EVALUATE DIFFERENT APPROACHES FROM UI !!
-                
-                // float weight = 1.0;
-                // float weight = input_data[start_index + 3];
-                float weight = log10f(1.0 + input_data[start_index + 3]);
-                float color = 0.0;
-                #ifdef HALO_COLOR_ANALYSIS
-                color = input_data[start_index + 4];
-                #endif
-
-                px[i] = world_to_grid(x, wx, cx, float(gx));
-                py[i] = world_to_grid(y, wy, cy, float(gy));
-                pz[i] = world_to_grid(z, wz, cz, float(gz));
-                
-                if (mw > 0.0)
-                    pw[i] = (1.0e6 / float(data_count)) * (weight / mw);
-                else
-                    pw[i] = weight;
-
+                px[i] = data_points.planes[DCP_X][i];
+                py[i] = data_points.planes[DCP_Y][i];
+                pz[i] = data_points.planes[DCP_Z][i];
+                pw[i] = data_points.planes[DCP_WEIGHT][i];
                 pt[i] = -5.0; // Marker value for input data
-                pp[i] = color; // Halo color flag (-1 ~ red, +1 ~ blue)
+                pp[i] = data_points.planes[DCP_COLOR][i]; // Halo color flag (-1 ~ red, +1 ~ blue)
             }
 
             // These are free-flowing physarum agents
             else {
+                #ifdef AGENTS_INIT_AROUND_SPARSE_DATA // Seed proportionally to the volume each data point represents
+                if (i == data_count) {
+                    KDTree data_tree = kdtree::build(px, py, pz, data_count);
+                    uint32_t *neighbor_indices = memory::alloc_heap<uint32_t>(data_count * (SEEDING_NEIGHBORS + 1));
+                    float *neighbor_distances = memory::alloc_heap<float>(data_count * (SEEDING_NEIGHBORS + 1));
+                    kdtree::find_nearest_batch(&data_tree, px, py, pz, data_count, SEEDING_NEIGHBORS + 1, neighbor_indices, neighbor_distances);
+
+                    double mean_trace = 0.0;
+                    if (halos_measured) {
+                        for (int d = 0; d < data_count; ++d) mean_trace += halos_densities[d];
+                        mean_trace /= double(data_count);
+                    }
+                    const float max_spread = 0.025 * math::min(math::min(gx, gy), gz);
+                    seeding_cdf = memory::alloc_heap<float>(data_count);
+                    seeding_radius = memory::alloc_heap<float>(data_count);
+                    double total_weight = 0.0;
+                    for (int d = 0; d < data_count; ++d) {
+                        float radius = math::min(math::max(neighbor_distances[d * (SEEDING_NEIGHBORS + 1) + SEEDING_NEIGHBORS], 1.0f), max_spread);
+                        double weight = double(radius) * radius * radius;
+                        if (mean_trace > 0.0) // Under-explored data (low trace from the previous run) get more agents
+                            weight *= mean_trace / (halos_densities[d] + 0.1 * mean_trace);
+                        total_weight += weight;
+                        seeding_cdf[d] = float(total_weight);
+                        seeding_radius[d] = radius;
+                    }
+                    for (int d = 0; d < data_count; ++d) seeding_cdf[d] /= float(total_weight);
+
+                    memory::free_heap(neighbor_indices);
+                    memory::free_heap(neighbor_distances);
+                    kdtree::release(&data_tree);
+                }
+                float xi_data = random::uniform();
+                int lower = 0, upper = data_count - 1;
+                while (lower < upper) {
+                    int middle = (lower + upper) / 2;
+                    if (seeding_cdf[middle] < xi_data) lower = middle + 1; else upper = middle;
+                }
+                float radius = seeding_radius[lower] * cbrtf(random::uniform());
+                float cos_polar = 1.0 - 2.0 * random::uniform();
+                float sin_polar = math::sqrt(math::max(0.0, 1.0 - cos_polar * cos_polar));
+                float azimuth = math::PI2 * random::uniform();
+                px[i] = px[lower] + radius * sin_polar * math::cos(azimuth);
+                py[i] = py[lower] + radius * sin_polar * math::sin(azimuth);
+                pz[i] = pz[lower] + radius * cos_polar;
+                #endif
                 #ifdef AGENTS_INIT_AROUND_DATA // Initialize the agents around data points to speed up convergence
                 int random_data_index = (int)random::uniform(0.0, (float)(data_count-1));
                 const float random_spread = 0.025;
@@ -662,6 +904,8 @@ int main(int argc, char **argv)
             }
 
         }
+        if (seeding_cdf) memory::free_heap(seeding_cdf);
+        if (seeding_radius) memory::free_heap(seeding_radius);
     };
     update_particles(particles_x, particles_y, particles_z, particles_phi, particles_theta, particles_weights,
                     NUM_PARTICLES, GRID_RESOLUTION_X, GRID_RESOLUTION_Y, GRID_RESOLUTION_Z, WORLD_SIZE_X, WORLD_SIZE_Y, WORLD_SIZE_Z, WORLD_CENTER_X, WORLD_CENTER_Y, WORLD_CENTER_Z, mean_weight);
@@ -684,6 +928,16 @@ int main(int argc, char **argv)
     StructuredBuffer halos_densities_buffer = graphics::get_structured_buffer(sizeof(float), data_count);
     graphics::update_structured_buffer(&halos_densities_buffer, halos_densities);
 
+    // Light BVH over the data points for the galaxy lights of the path tracer (GALAXY_ILLUMINATION in cs_volpath.hlsl)
+    LightBVH galaxy_lights = light_bvh::build(data_points.planes[DCP_X], data_points.planes[DCP_Y], data_points.planes[DCP_Z],
+        data_points.planes[DCP_WEIGHT], data_count);
+    StructuredBuffer light_nodes_buffer = graphics::get_structured_buffer(sizeof(LightBVHNode), galaxy_lights.node_count);
+    graphics::update_structured_buffer(&light_nodes_buffer, galaxy_lights.nodes);
+    StructuredBuffer lights_buffer = graphics::get_structured_buffer(sizeof(LightBVHPoint), galaxy_lights.light_count + 1);
+    graphics::update_structured_buffer(&lights_buffer, galaxy_lights.lights);
+    printf("-> light BVH of %u galaxies, %u nodes\n", galaxy_lights.light_count, galaxy_lights.node_count);
+    light_bvh::release(&galaxy_lights);
+
     // Set up 3D texture quad mesh.
     float super_quad_vertices_template[] = {
         -1.0f, -1.0f, 0.0f, 1.0f,
@@ -783,6 +1037,18 @@ int main(int argc, char **argv)
     rendering_config.compressive_accumulation = 1;
     rendering_config.guiding_strength = 0.1;
     rendering_config.scattering_anisotropy = 0.9;
+    rendering_config.denoise_step = 1;
+    rendering_config.denoise_sigma_luminance = 1.5;
+    rendering_config.denoise_sigma_depth = 0.01;
+    rendering_config.denoise_sigma_density = 0.05;
+    rendering_config.denoise_sigma_albedo = 0.05;
+    rendering_config.target_error = 0.0;
+    rendering_config.prev_camera_x = eye_pos.x;
+    rendering_config.prev_camera_y = eye_pos.y;
+    rendering_config.prev_camera_z = eye_pos.z;
+    rendering_config.prev_camera_offset_x = 0.0;
+    rendering_config.prev_camera_offset_y = 0.0;
+    rendering_config.reproject_history = 0;
     ConstantBuffer rendering_settings_buffer = graphics::get_constant_buffer(sizeof(RenderingConfig));
     graphics::update_constant_buffer(&rendering_settings_buffer, &rendering_config);
     graphics::set_constant_buffer(&rendering_settings_buffer, 4);
@@ -817,6 +1083,73 @@ int main(int argc, char **argv)
     statistics_config.world_depth = int(GRID_RESOLUTION_Z);
     ConstantBuffer statistics_config_buffer = graphics::get_constant_buffer(sizeof(StatisticsConfig));
 
+    // Download a simulation grid into half-float staging memory; nullptr (with nothing left allocated) if the readback fails
+    auto capture_grid = [](Texture3D *texture, uint32_t channel_count) -> uint16_t* {
+        size_t value_count = size_t(texture->width) * texture->height * texture->depth * channel_count;
+        uint16_t *half_data = memory::alloc_heap<uint16_t>(value_count);
+        if (!graphics::capture_texture3D(texture, half_data, value_count * sizeof(uint16_t))) {
+            memory::free_heap(half_data);
+            return nullptr;
+        }
+        return half_data;
+    };
+
+    // Header of an exported grid, recording the grid placement and the simulation settings at the time of the capture.
+    // The parameters are allocated and released by write_volume.
+    auto get_volume_info = [&](Texture3D *texture, uint32_t channel_count) {
+        VolumeFileInfo info = volume_file::get_default_info(texture->width, texture->height, texture->depth, channel_count, VDT_FLOAT16);
+        volume_file::set_world_box(&info, WORLD_SIZE_X, WORLD_SIZE_Y, WORLD_SIZE_Z, WORLD_CENTER_X, WORLD_CENTER_Y, WORLD_CENTER_Z);
+        info.description = DATASET_NAME;
+        info.level_count = volume_file::get_level_count(texture->width, texture->height, texture->depth, EXPORT_PYRAMID_MIN_RESOLUTION);
+        VolumeParameter parameter_list[] = {
+            volume_file::get_parameter("sense_spread", simulation_config.sense_spread),
+            volume_file::get_parameter("sense_distance", simulation_config.sense_distance),
+            volume_file::get_parameter("turn_angle", simulation_config.turn_angle),
+            volume_file::get_parameter("move_distance", simulation_config.move_distance),
+            volume_file::get_parameter("deposit_value", simulation_config.deposit_value),
+            volume_file::get_parameter("decay_factor", simulation_config.decay_factor),
+            volume_file::get_parameter("center_attraction", simulation_config.center_attraction),
+            volume_file::get_parameter("world_width", simulation_config.world_width),
+            volume_file::get_parameter("world_height", simulation_config.world_height),
+            volume_file::get_parameter("world_depth", simulation_config.world_depth),
+            volume_file::get_parameter("move_sense_coef", simulation_config.move_sense_coef),
+            volume_file::get_parameter("normalization_factor", simulation_config.normalization_factor),
+            volume_file::get_parameter("n_data_points", simulation_config.n_data_points),
+            volume_file::get_parameter("n_agents", simulation_config.n_agents),
+            volume_file::get_parameter("n_iteration", simulation_config.n_iteration),
+            volume_file::get_parameter("world_size_x", WORLD_SIZE_X),
+            volume_file::get_parameter("world_size_y", WORLD_SIZE_Y),
+            volume_file::get_parameter("world_size_z", WORLD_SIZE_Z),
+            volume_file::get_parameter("world_center_x", WORLD_CENTER_X),
+            volume_file::get_parameter("world_center_y", WORLD_CENTER_Y),
+            volume_file::get_parameter("world_center_z", WORLD_CENTER_Z),
+            volume_file::get_parameter("move_distance_mpc", measure_grid_to_world(simulation_config.move_distance, WORLD_SIZE_X, float(GRID_RESOLUTION_X))),
+            volume_file::get_parameter("sense_distance_mpc", measure_grid_to_world(simulation_config.sense_distance, WORLD_SIZE_X, float(GRID_RESOLUTION_X))),
+        };
+        info.parameter_count = sizeof(parameter_list) / sizeof(parameter_list[0]);
+        info.parameters = memory::alloc_heap<VolumeParameter>(info.parameter_count);
+        memcpy(info.parameters, parameter_list, sizeof(parameter_list));
+        return info;
+    };
+
+    // Write a captured grid as a bricked volume file and release its staging memory (runs on the export thread)
+    auto write_volume = [](std::string filename, VolumeFileInfo info, uint16_t *half_data) {
+        Timer export_timer = timer::get();
+        timer::start(&export_timer);
+        uint64_t staging_bytes = uint64_t(info.width) * info.height * info.depth * info.channel_count * sizeof(uint16_t);
+        uint64_t stored_bytes = 0;
+        if (volume_file::write(filename.c_str(), &info, half_data, &stored_bytes)) {
+            float seconds = timer::end(&export_timer);
+            double raw_mb = staging_bytes / 1e6;
+            printf("%s: %.1f MB -> %.1f MB (ratio %.2f) in %.2f s (%.0f MB/s)\n", filename.c_str(), raw_mb, stored_bytes / 1e6,
+                raw_mb * 1e6 / double(stored_bytes), seconds, raw_mb / (seconds > 0.0f ? seconds : 1.0f));
+        }
+        memory::free_heap(info.parameters);
+        memory::free_heap(half_data);
+    };
+
+    export_queue::start(EXPORT_QUEUE_LENGTH, EXPORT_STAGING_MB << 20);
+
     Timer timer = timer::get();
     timer::start(&timer);
 
@@ -836,12 +1169,79 @@ int main(int argc, char **argv)
     bool turning_camera = false;
     bool render_dof = true;
     bool store_deposit = false;
+    bool scheduled_export = false;
+    int32_t last_export_period = 0;
     bool capture_screen = false;
     bool make_screenshot = false;
     bool capture_agents = false;
+    TrajectoryFile *trajectory_file = nullptr; // Used by the export thread while a capture runs
+    uint32_t *trajectory_agents = nullptr; // Selected agents, ascending indices relative to the first agent
+    uint32_t trajectory_agent_count = 0;
+    StructuredBuffer trajectory_indices_buffer = {}; // Particle buffer index of every selected agent
+    StructuredBuffer trajectory_gather_buffer = {}; // Positions and weights of the selected agents, gathered for readback
+    int32_t trajectory_step = 0;
+    StagingBuffer trajectory_staging[TRAJECTORY_READBACK_LATENCY] = {}; // Ring of gathered steps waiting for readback
+    int32_t trajectory_staging_iteration[TRAJECTORY_READBACK_LATENCY] = {};
+    uint32_t trajectory_staging_next = 0; // Slot the next step is copied into
+    uint32_t trajectory_staging_pending = 0; // Steps copied but not read back yet, oldest first
+
+    // Read back the gathered steps whose GPU copy has completed (all of them if `wait`) and queue writing them in order
+    auto read_trajectory_steps = [&](bool wait) {
+        while (trajectory_staging_pending > 0) {
+            uint32_t slot = (trajectory_staging_next + TRAJECTORY_READBACK_LATENCY - trajectory_staging_pending) % TRAJECTORY_READBACK_LATENCY;
+            if (!wait && !graphics::is_staging_buffer_ready(&trajectory_staging[slot]))
+                break;
+            --trajectory_staging_pending;
+
+            uint32_t count = trajectory_agent_count;
+            uint64_t staging_bytes = uint64_t(4) * count * sizeof(float);
+            export_queue::reserve(staging_bytes);
+            float *snapshot = memory::alloc_heap<float>(4 * size_t(count));
+            if (!graphics::read_staging_buffer(&trajectory_staging[slot], snapshot, staging_bytes)) {
+                memory::free_heap(snapshot);
+                export_queue::submit([]() {}, staging_bytes);
+                continue;
+            }
+            TrajectoryFile *file = trajectory_file;
+            int32_t iteration = trajectory_staging_iteration[slot];
+            export_queue::submit([=]() {
+                trajectory::write_step(file, iteration, snapshot, snapshot + count, snapshot + 2 * count, snapshot + 3 * count);
+                memory::free_heap(snapshot);
+            }, staging_bytes);
+        }
+    };
+
+    // Read back the steps still in flight and queue closing the trajectory file behind them
+    auto finish_trajectory_capture = [&]() {
+        read_trajectory_steps(true);
+        TrajectoryFile *file = trajectory_file;
+        int32_t step_count = trajectory_step;
+        export_queue::reserve(0);
+        export_queue::submit([=]() {
+            trajectory::close(file);
+            memory::free_heap(file);
+            printf("Done exporting agents, %d timesteps.\n", step_count);
+        }, 0);
+        memory::free_heap(trajectory_agents);
+        graphics::release(&trajectory_indices_buffer);
+        graphics::release(&trajectory_gather_buffer);
+        for (uint32_t i = 0; i < TRAJECTORY_READBACK_LATENCY; ++i) {
+            graphics::release(&trajectory_staging[i]);
+            trajectory_staging[i] = {};
+        }
+        trajectory_staging_next = 0;
+        trajectory_staging_pending = 0;
+        trajectory_file = nullptr;
+        trajectory_agents = nullptr;
+        trajectory_indices_buffer = {};
+        trajectory_gather_buffer = {};
+    };
     bool compute_histogram = true;
     bool run_pt = true;
+    bool denoise_pt = false;
     bool reset_pt = false;
+    bool move_pt = false; // The camera moved: restart the accumulation from the reprojected image if reproject_pt is on
+    bool reproject_pt = true;
     bool sort_agents = false;
     float background_color = 0.0;
     VisualizationMode vis_mode = VisualizationMode::VM_PARTICLES;
@@ -875,25 +1275,25 @@ int main(int argc, char **argv)
         {
             if(!ui::is_registering_input()) {
                 if (math::abs(input::mouse_scroll_delta()) > 0)
-                    reset_pt = true;
+                    move_pt = true;
                 radius = math::max(radius - input::mouse_scroll_delta() * 0.1, 0.01);
                 if (input::mouse_left_button_down()) {
                     Vector2 dm = input::mouse_delta_position();
                     azimuth -= dm.x * 0.003;
                     polar -= dm.y * 0.003;
                     polar = math::clamp(polar, 0.01f, math::PI-0.01f);
-                    reset_pt |= (math::abs(dm.x) > 0 || math::abs(dm.y) > 0);
+                    move_pt |= (math::abs(dm.x) > 0 || math::abs(dm.y) > 0);
                 }
                 if (input::mouse_right_button_down()) {
                     Vector2 dm = input::mouse_delta_position();
                     camera_offset.x += radius * 0.03 * CAM_OFFSET * dm.x;
                     camera_offset.y -= radius * 0.03 * CAM_OFFSET * dm.y;
-                    reset_pt |= (math::abs(dm.x) > 0 || math::abs(dm.y) > 0);
+                    move_pt |= (math::abs(dm.x) > 0 || math::abs(dm.y) > 0);
                 }
             }
             if (turning_camera) {
                 azimuth += 0.01;
-                reset_pt = true;
+                move_pt = true;
             }
             eye_pos = Vector3(
                 math::cos(azimuth) * math::sin(polar),
@@ -912,6 +1312,10 @@ int main(int argc, char **argv)
             if (input::key_pressed(KeyCode::ESC)) is_running = false; 
             if (input::key_pressed(KeyCode::F1)) show_ui = !show_ui; 
             if (input::key_pressed(KeyCode::F2)) { // Reset particles + trails
+                #ifdef AGENTS_INIT_AROUND_SPARSE_DATA
+                if (halos_measured)
+                    graphics::capture_structured_buffer(&halos_densities_buffer, halos_densities, data_count, sizeof(float));
+                #endif
                 update_particles(particles_x, particles_y, particles_z, particles_phi, particles_theta, particles_weights,
                                 NUM_PARTICLES, GRID_RESOLUTION_X, GRID_RESOLUTION_Y, GRID_RESOLUTION_Z, WORLD_SIZE_X, WORLD_SIZE_Y, WORLD_SIZE_Z, WORLD_CENTER_X, WORLD_CENTER_Y, WORLD_CENTER_Z, mean_weight);
                 graphics::update_structured_buffer(&particles_buffer_x, particles_x);
@@ -1006,7 +1410,7 @@ int main(int argc, char **argv)
         }
 
         // Partial agent sorting
-        if (run_mold && sort_agents)
+        if (run_mold && sort_agents && !trajectory_file) // Sorting would shuffle the identities of captured agents
         {
             graphics::set_compute_shader(&sort_shader);
             graphics::set_structured_buffer(&particles_buffer_x, 2);
@@ -1063,6 +1467,7 @@ int main(int argc, char **argv)
 
             int32_t grid_z = (NUM_PARTICLES / 100) / THREAD_GROUP_SIZE;
             graphics::run_compute(10, 10, grid_z);
+            halos_measured = true;
 
             graphics::unset_texture_compute(0);
         }
@@ -1072,91 +1477,342 @@ int main(int argc, char **argv)
         {
             printf("Exporting simulation data...\n");
             store_deposit = false;
-            if (is_a)
-                graphics::save_texture3D(&trail_tex_A, "export/deposit");
-            else
-                graphics::save_texture3D(&trail_tex_B, "export/deposit");
-            graphics::save_texture3D(&trace_tex, "export/trace");
-
-            std::ofstream metadata;
-            metadata.open("export/export_metadata.txt", std::ofstream::out);
-            metadata << "dataset: " << DATASET_NAME << std::endl;
-            metadata << "number of data points: " << data_count << std::endl;
-            metadata << "number of agents: " << int(NUM_AGENTS) / 1e6 << "M" << std::endl;
-            metadata << "simulation grid resolution: " << int(GRID_RESOLUTION_X) << " x " << int(GRID_RESOLUTION_Y) << " x " << int(GRID_RESOLUTION_Z) << " [vox]" << std::endl;
-            metadata << "simulation grid size: " << WORLD_SIZE_X << " x " << WORLD_SIZE_Y << " x " << WORLD_SIZE_Z << " [mpc]" << std::endl;
-            metadata << "simulation grid center: (" << WORLD_CENTER_X << ", " << WORLD_CENTER_Y << ", " << WORLD_CENTER_Z << ") [mpc]" << std::endl;
-            metadata << std::endl;
-            metadata << "move distance: " << measure_grid_to_world(simulation_config.move_distance, WORLD_SIZE_X, float(GRID_RESOLUTION_X)) << " [mpc]" << std::endl;
-            metadata << "move distance grid: " << simulation_config.move_distance << " [vox]" << std::endl;
-            metadata << "sense distance: " << measure_grid_to_world(simulation_config.sense_distance, WORLD_SIZE_X, float(GRID_RESOLUTION_X)) << " [mpc]" << std::endl;
-            metadata << "sense distance grid: " << simulation_config.sense_distance << " [vox]" << std::endl;
-            metadata << "move spread: " << math::rad2deg(simulation_config.turn_angle) << " [deg]" << std::endl;
-            metadata << "sense spread: " << math::rad2deg(simulation_config.sense_spread) << " [deg]" << std::endl;
-            metadata << "persistence coefficient: " << simulation_config.decay_factor << std::endl;
-            metadata << "agent deposit: " << simulation_config.deposit_value << std::endl;
-            metadata << "sampling sharpness: " << simulation_config.move_sense_coef << std::endl;
-            metadata.close();
+            std::string export_suffix = "";
+            if (scheduled_export) {
+                std::stringstream suffix;
+                suffix << "_it" << std::setw(6) << std::setfill('0') << simulation_config.n_iteration;
+                export_suffix = suffix.str();
+                scheduled_export = false;
+            }
 
-            graphics::capture_structured_buffer(&halos_densities_buffer, halos_densities, data_count, sizeof(float));
-            std::ofstream halos_measurements;
-            halos_measurements.open("export/halos_measurements.csv", std::ofstream::out);
-            halos_measurements.precision(5);
-            halos_measurements << "M200b/10^12 | Trace | X (world) | Y (world) | Z (world) | X (grid) | Y (grid) | Z (grid) " << std::endl;
-            for (int i = 0; i < data_count; ++i) {
-                halos_measurements
-                    << particles_weights[i] << ","
-                    << halos_densities[i] << ","
-                    << grid_to_world(particles_x[i], WORLD_SIZE_X, WORLD_CENTER_X, GRID_RESOLUTION_X) << ","
-                    << grid_to_world(particles_y[i], WORLD_SIZE_Y, WORLD_CENTER_Y, GRID_RESOLUTION_Y) << ","
-                    << grid_to_world(particles_z[i], WORLD_SIZE_Z, WORLD_CENTER_Z, GRID_RESOLUTION_Z) << ","
-                    << particles_x[i] << ","
-                    << particles_y[i] << ","
-                    << particles_z[i] << std::endl;
+            // The deposit of the current step, the texture the renderers sample; every export of the deposit uses it.
+            // Each grid is read back once: the float conversions, the volume files, the filament distances, the halo
+            // table and the analyses all run in one export task that owns the snapshot, so only the readback holds the
+            // simulation back.
+            Texture3D *deposit_tex = is_a ? &trail_tex_A : &trail_tex_B;
+            const int halos_column_count = 6;
+            uint64_t voxel_count = uint64_t(GRID_RESOLUTION_X) * GRID_RESOLUTION_Y * GRID_RESOLUTION_Z;
+            uint64_t staging_bytes = voxel_count * (DEPOSIT_CHANNELS + TRACE_CHANNELS) * sizeof(uint16_t)
+                + uint64_t(data_count) * halos_column_count * sizeof(float);
+            #ifdef EXPORT_TRACE_VOLUME
+            staging_bytes += voxel_count * sizeof(float);
+            #endif
+            #ifdef EXPORT_POWER_SPECTRUM
+            staging_bytes += voxel_count * sizeof(float);
+            #endif
+            #ifdef EXPORT_FILAMENT_DISTANCE
+            staging_bytes += voxel_count * sizeof(float);
+            #endif
+            // The volume files are written one after the other, so the larger of their write scratches is in use at a time
+            VolumeFileInfo deposit_info = get_volume_info(deposit_tex, DEPOSIT_CHANNELS);
+            VolumeFileInfo trace_info = get_volume_info(&trace_tex, TRACE_CHANNELS);
+            uint64_t deposit_scratch_bytes = volume_file::get_write_scratch_bytes(&deposit_info);
+            uint64_t trace_scratch_bytes = volume_file::get_write_scratch_bytes(&trace_info);
+            staging_bytes += deposit_scratch_bytes > trace_scratch_bytes ? deposit_scratch_bytes : trace_scratch_bytes;
+            export_queue::reserve(staging_bytes);
+
+            std::string deposit_filename = "export/deposit" + export_suffix + ".pvol";
+            std::string trace_filename = "export/trace" + export_suffix + ".pvol";
+            uint16_t *deposit_half = capture_grid(deposit_tex, DEPOSIT_CHANNELS);
+            uint16_t *trace_half = capture_grid(&trace_tex, TRACE_CHANNELS);
+            if (!deposit_half) {
+                printf("%s skipped\n", deposit_filename.c_str());
+                memory::free_heap(deposit_info.parameters);
+            }
+            if (!trace_half) {
+                printf("%s skipped\n", trace_filename.c_str());
+                memory::free_heap(trace_info.parameters);
             }
-            halos_measurements.close();
 
-            printf("Done exporting simulation data.\n");
+            graphics::capture_structured_buffer(&halos_densities_buffer, halos_densities, data_count, sizeof(float));
+
+            // Snapshot of the per-halo columns (mass, trace, grid position, filament distance), formatted by the export thread
+            float *halos_snapshot = memory::alloc_heap<float>(data_count * halos_column_count);
+            memcpy(halos_snapshot, particles_weights, data_count * sizeof(float));
+            memcpy(halos_snapshot + data_count, halos_densities, data_count * sizeof(float));
+            memcpy(halos_snapshot + 2 * data_count, particles_x, data_count * sizeof(float));
+            memcpy(halos_snapshot + 3 * data_count, particles_y, data_count * sizeof(float));
+            memcpy(halos_snapshot + 4 * data_count, particles_z, data_count * sizeof(float));
+            memset(halos_snapshot + 5 * data_count, 0, data_count * sizeof(float));
+
+            std::string halos_filename = "export/halos_measurements" + export_suffix;
+            int halos_count = data_count;
+            uint32_t grid_width = trace_tex.width, grid_height = trace_tex.height, grid_depth = trace_tex.depth;
+            export_queue::submit([=]() mutable {
+                // First channels as float volumes for the analyses, empty if the readback failed
+                Volume trace_volume = {};
+                Volume deposit_volume = {};
+                #ifdef EXPORT_TRACE_VOLUME
+                if (trace_half)
+                    trace_volume = volume::get_from_half(trace_half, grid_width, grid_height, grid_depth, TRACE_CHANNELS, 0);
+                #endif
+                #ifdef EXPORT_POWER_SPECTRUM
+                if (deposit_half)
+                    deposit_volume = volume::get_from_half(deposit_half, grid_width, grid_height, grid_depth, DEPOSIT_CHANNELS, 0);
+                #endif
+
+                // The morphology streams the half-float trace in z-slabs, so it runs before the trace snapshot is released
+                #ifdef EXPORT_MORPHOLOGY
+                if (trace_half) {
+                    printf("Classifying trace morphology...\n");
+                    MorphologySettings morphology_settings = morphology::get_default_settings();
+                    morphology_settings.sigma = measure_world_to_grid(MORPHOLOGY_SMOOTHING_MPC, WORLD_SIZE_X, float(GRID_RESOLUTION_X));
+                    Volume trace_grid = { nullptr, grid_width, grid_height, grid_depth }; // Size of the class grid
+                    uint8_t *morphology_classes = memory::alloc_heap<uint8_t>(volume::get_voxel_count(&trace_grid));
+                    MorphologyStatistics morphology_statistics = morphology::classify_half(trace_half, grid_width, grid_height, grid_depth,
+                        TRACE_CHANNELS, 0, morphology_settings, morphology_classes);
+                    morphology::save(morphology_classes, &trace_grid, morphology_settings, &morphology_statistics, ("export/morphology" + export_suffix).c_str());
+                    printf("-> volume fractions: void %.3f | sheet %.3f | filament %.3f | knot %.3f\n",
+                        morphology_statistics.volume_fraction[MC_VOID], morphology_statistics.volume_fraction[MC_SHEET],
+                        morphology_statistics.volume_fraction[MC_FILAMENT], morphology_statistics.volume_fraction[MC_KNOT]);
+                    memory::free_heap(morphology_classes);
+                }
+                #endif
+
+                if (deposit_half)
+                    write_volume(deposit_filename, deposit_info, deposit_half);
+                if (trace_half)
+                    write_volume(trace_filename, trace_info, trace_half);
+
+                #ifdef EXPORT_FILAMENT_DISTANCE
+                if (trace_volume.data) {
+                    printf("Computing filament distances...\n");
+                    float filament_threshold = FILAMENT_TRACE_THRESHOLD * float(volume::get_mean(&trace_volume));
+                    Volume distance_volume = distance::transform(&trace_volume, filament_threshold,
+                        measure_grid_to_world(1.0, WORLD_SIZE_X, float(GRID_RESOLUTION_X)),
+                        measure_grid_to_world(1.0, WORLD_SIZE_Y, float(GRID_RESOLUTION_Y)),
+                        measure_grid_to_world(1.0, WORLD_SIZE_Z, float(GRID_RESOLUTION_Z)));
+                    float *filament_distances = halos_snapshot + 5 * halos_count;
+                    for (int i = 0; i < halos_count; ++i) {
+                        filament_distances[i] = volume::sample(&distance_volume, halos_snapshot[2 * halos_count + i],
+                            halos_snapshot[3 * halos_count + i], halos_snapshot[4 * halos_count + i]);
+                    }
+                    volume::save(&distance_volume, ("export/filament_distance" + export_suffix + ".bin").c_str());
+                    volume::release(&distance_volume);
+                }
+                #endif
+
+                float *world_positions = memory::alloc_heap<float>(3 * halos_count);
+                for (int i = 0; i < halos_count; ++i) {
+                    world_positions[i] = grid_to_world(halos_snapshot[2 * halos_count + i], WORLD_SIZE_X, WORLD_CENTER_X, GRID_RESOLUTION_X);
+                    world_positions[halos_count + i] = grid_to_world(halos_snapshot[3 * halos_count + i], WORLD_SIZE_Y, WORLD_CENTER_Y, GRID_RESOLUTION_Y);
+                    world_positions[2 * halos_count + i] = grid_to_world(halos_snapshot[4 * halos_count + i], WORLD_SIZE_Z, WORLD_CENTER_Z, GRID_RESOLUTION_Z);
+                }
+                TableColumn columns[] = {
+                    { "M200b/10^12", "", halos_snapshot },
+                    { "Trace", "", halos_snapshot + halos_count },
+                    { "X world", "Mpc", world_positions },
+                    { "Y world", "Mpc", world_positions + halos_count },
+                    { "Z world", "Mpc", world_positions + 2 * halos_count },
+                    { "X grid", "vox", halos_snapshot + 2 * halos_count },
+                    { "Y grid", "vox", halos_snapshot + 3 * halos_count },
+                    { "Z grid", "vox", halos_snapshot + 4 * halos_count },
+                    { "Filament distance", "Mpc", halos_snapshot + 5 * halos_count },
+                };
+                #ifdef EXPORT_FILAMENT_DISTANCE
+                uint32_t column_count = 9;
+                #else
+                uint32_t column_count = 8;
+                #endif
+                table::save_binary((halos_filename + ".pcol").c_str(), columns, column_count, halos_count);
+                table::save_text((halos_filename + ".csv").c_str(), columns, column_count, halos_count);
+                printf("%s: %d halos\n", halos_filename.c_str(), halos_count);
+                memory::free_heap(world_positions);
+
+                #ifdef EXPORT_POWER_SPECTRUM
+                if (trace_volume.data && deposit_volume.data) {
+                    printf("Computing power spectra...\n");
+                    PowerSpectrumSettings spectrum_settings = spectrum::get_default_settings(WORLD_SIZE_X, WORLD_SIZE_Y, WORLD_SIZE_Z);
+                    PowerSpectrum power_spectrum = spectrum::compute(&trace_volume, &deposit_volume, spectrum_settings);
+                    spectrum::save(&power_spectrum, ("export/power_spectrum" + export_suffix + ".txt").c_str());
+                    printf("-> %d k-bins%s\n", power_spectrum.bin_count, power_spectrum.out_of_core ? " (out-of-core)" : "");
+                    spectrum::release(&power_spectrum);
+                }
+                #endif
+
+                #ifdef EXPORT_CALIBRATION
+                if (trace_volume.data) {
+                    printf("Calibrating trace density...\n");
+                    CalibrationSettings calibration_settings = calibration::get_default_settings();
+                    CalibrationHistogram calibration_histogram = {};
+                    Volume reference_volume = {};
+                    if (CALIBRATION_REFERENCE_GRID[0] != 0 && !load_reference_grid(CALIBRATION_REFERENCE_GRID, &reference_volume)) {
+                        printf("-> calibration skipped\n");
+                    } else {
+                        if (reference_volume.data) {
+                            // Voxel pairs against the reference grid, resampled to the simulation resolution
+                            Volume reference_resampled = volume::resample(&reference_volume, GRID_RESOLUTION_X, GRID_RESOLUTION_Y, GRID_RESOLUTION_Z);
+                            calibration_histogram = calibration::build_histogram(trace_volume.data, reference_resampled.data, volume::get_voxel_count(&trace_volume), calibration_settings);
+                            volume::release(&reference_resampled);
+                            volume::release(&reference_volume);
+                        } else {
+                            // Halo pairs: trace at the halo positions (from the snapshot) against the halo masses
+                            calibration_histogram = calibration::build_histogram(halos_snapshot + halos_count, data_points.planes[DCP_MASS], halos_count, calibration_settings);
+                        }
+
+                        CalibrationMapping calibration_mapping = calibration::fit(&calibration_histogram);
+                        Volume calibrated_volume = volume::get(trace_volume.width, trace_volume.height, trace_volume.depth);
+                        calibration::apply(&calibration_mapping, trace_volume.data, calibrated_volume.data, volume::get_voxel_count(&trace_volume));
+                        calibration::save(&calibration_histogram, &calibration_mapping, ("export/calibration" + export_suffix).c_str());
+                        volume::save(&calibrated_volume, ("export/calibrated_density" + export_suffix + ".bin").c_str());
+                        printf("-> fitted on %llu samples\n", (unsigned long long)calibration_histogram.sample_count);
+                        calibration::release(&calibration_mapping);
+                        calibration::release(&calibration_histogram);
+                        volume::release(&calibrated_volume);
+                    }
+                }
+                #endif
+
+                #ifdef EXPORT_SKELETON
+                if (trace_volume.data) {
+                    printf("Extracting filament skeleton...\n");
+                    SkeletonSettings skeleton_settings = skeleton::get_default_settings();
+                    skeleton_settings.threshold = FILAMENT_TRACE_THRESHOLD * float(volume::get_mean(&trace_volume));
+                    skeleton_settings.min_branch_length = SKELETON_MIN_BRANCH_MPC;
+                    skeleton_settings.voxel_size_x = measure_grid_to_world(1.0, WORLD_SIZE_X, float(GRID_RESOLUTION_X));
+                    skeleton_settings.voxel_size_y = measure_grid_to_world(1.0, WORLD_SIZE_Y, float(GRID_RESOLUTION_Y));
+                    skeleton_settings.voxel_size_z = measure_grid_to_world(1.0, WORLD_SIZE_Z, float(GRID_RESOLUTION_Z));
+                    skeleton_settings.origin_x = grid_to_world(0.0, WORLD_SIZE_X, WORLD_CENTER_X, float(GRID_RESOLUTION_X));
+                    skeleton_settings.origin_y = grid_to_world(0.0, WORLD_SIZE_Y, WORLD_CENTER_Y, float(GRID_RESOLUTION_Y));
+                    skeleton_settings.origin_z = grid_to_world(0.0, WORLD_SIZE_Z, WORLD_CENTER_Z, float(GRID_RESOLUTION_Z));
+                    uint8_t *skeleton_mask = memory::alloc_heap<uint8_t>(volume::get_voxel_count(&trace_volume));
+                    uint32_t thinning_iterations = skeleton::thin(&trace_volume, skeleton_settings, skeleton_mask);
+                    SkeletonGraph skeleton_graph = skeleton::build_graph(skeleton_mask, &trace_volume, skeleton_settings);
+                    skeleton::save(&skeleton_graph, skeleton_mask, &trace_volume, skeleton_settings, ("export/skeleton" + export_suffix).c_str());
+                    printf("-> %d thinning iterations, %d nodes, %d edges\n", thinning_iterations, skeleton_graph.node_count, skeleton_graph.edge_count);
+                    skeleton::release(&skeleton_graph);
+                    memory::free_heap(skeleton_mask);
+                }
+                #endif
+
+                #ifdef EXPORT_ISOSURFACE
+                if (trace_volume.data) {
+                    printf("Extracting trace isosurfaces...\n");
+                    IsosurfaceSettings isosurface_settings = isosurface::get_default_settings();
+                    isosurface_settings.voxel_size_x = measure_grid_to_world(1.0, WORLD_SIZE_X, float(GRID_RESOLUTION_X));
+                    isosurface_settings.voxel_size_y = measure_grid_to_world(1.0, WORLD_SIZE_Y, float(GRID_RESOLUTION_Y));
+                    isosurface_settings.voxel_size_z = measure_grid_to_world(1.0, WORLD_SIZE_Z, float(GRID_RESOLUTION_Z));
+                    isosurface_settings.origin_x = grid_to_world(0.0, WORLD_SIZE_X, WORLD_CENTER_X, float(GRID_RESOLUTION_X));
+                    isosurface_settings.origin_y = grid_to_world(0.0, WORLD_SIZE_Y, WORLD_CENTER_Y, float(GRID_RESOLUTION_Y));
+                    isosurface_settings.origin_z = grid_to_world(0.0, WORLD_SIZE_Z, WORLD_CENTER_Z, float(GRID_RESOLUTION_Z));
+                    float mean_trace = float(volume::get_mean(&trace_volume));
+                    for (uint32_t i = 0; i < sizeof(ISOSURFACE_TRACE_LEVELS) / sizeof(ISOSURFACE_TRACE_LEVELS[0]); ++i) {
+                        isosurface_settings.iso_value = ISOSURFACE_TRACE_LEVELS[i] * mean_trace;
+                        IsosurfaceMesh isosurface_mesh;
+                        if (!isosurface::extract(&trace_volume, isosurface_settings, &isosurface_mesh))
+                            continue;
+                        std::stringstream mesh_filename;
+                        mesh_filename << "export/isosurface_" << ISOSURFACE_TRACE_LEVELS[i] << export_suffix << (ISOSURFACE_FORMAT == MFF_OBJ ? ".obj" : ".ply");
+                        exports::export_mesh(mesh_filename.str().c_str(), ISOSURFACE_FORMAT, isosurface_mesh.positions, isosurface_mesh.normals,
+                            isosurface_mesh.vertex_count, isosurface_mesh.indices, isosurface_mesh.triangle_count);
+                        printf("-> %s: %d vertices, %d triangles\n", mesh_filename.str().c_str(), isosurface_mesh.vertex_count, isosurface_mesh.triangle_count);
+                        isosurface::release(&isosurface_mesh);
+                    }
+                }
+                #endif
+
+                memory::free_heap(halos_snapshot);
+                volume::release(&deposit_volume);
+                volume::release(&trace_volume);
+            }, staging_bytes);
+
+            printf("Simulation data snapshot taken, %d export(s) pending.\n", export_queue::get_pending_count());
         }
 
-        // Capture agents' coordinates
-        if (capture_agents)
+        // Start capturing agent trajectories: select the agents and create the file
+        if (capture_agents && !trajectory_file)
         {
-            static bool first_time_capture = true;
-            if (first_time_capture) {
-                first_time_capture = false;
-                std::ofstream agents;
-                agents.open("export/agents.txt", std::ofstream::out);
-                agents.close();
+            uint32_t agent_count = NUM_PARTICLES - data_count;
+            graphics::capture_structured_buffer(&particles_buffer_x, particles_x, NUM_PARTICLES, sizeof(float));
+            graphics::capture_structured_buffer(&particles_buffer_y, particles_y, NUM_PARTICLES, sizeof(float));
+            graphics::capture_structured_buffer(&particles_buffer_z, particles_z, NUM_PARTICLES, sizeof(float));
+            TrajectorySelection selection = {};
+            selection.mode = AGENT_CAPTURE_SELECTION;
+            selection.count = N_AGENTS_TO_CAPTURE;
+            selection.stride = AGENT_CAPTURE_STRIDE;
+            float grid_resolution[3] = { float(GRID_RESOLUTION_X), float(GRID_RESOLUTION_Y), float(GRID_RESOLUTION_Z) };
+            for (int i = 0; i < 3; ++i) {
+                selection.region_min[i] = AGENT_CAPTURE_REGION_MIN[i] * grid_resolution[i];
+                selection.region_max[i] = AGENT_CAPTURE_REGION_MAX[i] * grid_resolution[i];
             }
-
-            static int timestep_counter = 0;
-            if (timestep_counter >= N_AGENT_TIMESTEPS_TO_CAPTURE) {
+            trajectory_agents = memory::alloc_heap<uint32_t>(agent_count);
+            trajectory_agent_count = trajectory::select(particles_x + data_count, particles_y + data_count, particles_z + data_count,
+                agent_count, selection, trajectory_agents);
+
+            TrajectoryFileHeader header = {};
+            header.agent_count = trajectory_agent_count;
+            header.quantization_bits = AGENT_CAPTURE_QUANTIZATION_BITS;
+            header.keyframe_interval = AGENT_CAPTURE_KEYFRAME_INTERVAL;
+            header.grid_size[0] = float(GRID_RESOLUTION_X);
+            header.grid_size[1] = float(GRID_RESOLUTION_Y);
+            header.grid_size[2] = float(GRID_RESOLUTION_Z);
+            header.world_size[0] = WORLD_SIZE_X;
+            header.world_size[1] = WORLD_SIZE_Y;
+            header.world_size[2] = WORLD_SIZE_Z;
+            header.world_center[0] = WORLD_CENTER_X;
+            header.world_center[1] = WORLD_CENTER_Y;
+            header.world_center[2] = WORLD_CENTER_Z;
+            trajectory_file = memory::alloc_heap<TrajectoryFile>(1);
+            if (trajectory_agent_count == 0 || !trajectory::create("export/agents.ptraj", header, trajectory_agents, trajectory_file)) {
+                printf("No agents selected for capture.\n");
+                trajectory::close(trajectory_file);
+                memory::free_heap(trajectory_file);
+                memory::free_heap(trajectory_agents);
+                trajectory_file = nullptr;
+                trajectory_agents = nullptr;
                 capture_agents = false;
-                timestep_counter = 0;
-                printf("Done exporting agents.\n");
             } else {
-                printf("Exporting agents, timestep %d/%d...\n", timestep_counter+1, N_AGENT_TIMESTEPS_TO_CAPTURE);
-                graphics::capture_structured_buffer(&particles_buffer_x, particles_x, NUM_PARTICLES, sizeof(float));
-                graphics::capture_structured_buffer(&particles_buffer_y, particles_y, NUM_PARTICLES, sizeof(float));
-                graphics::capture_structured_buffer(&particles_buffer_z, particles_z, NUM_PARTICLES, sizeof(float));
-                graphics::capture_structured_buffer(&particles_buffer_weights, particles_weights, NUM_PARTICLES, sizeof(float));
-                std::ofstream agents;
-                agents.open("export/agents.txt", std::ofstream::out | std::ofstream::app);
-                agents << "*** timestep " << timestep_counter << " [X Y Z D] ***" << std::endl;
-                agents.precision(7);
-                for (int i = data_count; i < int(NUM_PARTICLES); ++i) {
-                    agents 
-                        << measure_grid_to_world(particles_x[i], WORLD_SIZE_X, float(GRID_RESOLUTION_X)) << " "
-                        << measure_grid_to_world(particles_y[i], WORLD_SIZE_Y, float(GRID_RESOLUTION_Y)) << " "
-                        << measure_grid_to_world(particles_z[i], WORLD_SIZE_Z, float(GRID_RESOLUTION_Z)) << " "
-                        << particles_weights[i] << std::endl;
+                uint32_t *particle_indices = memory::alloc_heap<uint32_t>(trajectory_agent_count);
+                for (uint32_t i = 0; i < trajectory_agent_count; ++i) {
+                    particle_indices[i] = data_count + trajectory_agents[i];
+                }
+                trajectory_indices_buffer = graphics::get_structured_buffer(sizeof(uint32_t), trajectory_agent_count);
+                graphics::update_structured_buffer(&trajectory_indices_buffer, particle_indices);
+                trajectory_gather_buffer = graphics::get_structured_buffer(sizeof(float), 4 * trajectory_agent_count);
+                for (uint32_t i = 0; i < TRAJECTORY_READBACK_LATENCY; ++i) {
+                    trajectory_staging[i] = graphics::get_staging_buffer(trajectory_gather_buffer.size);
                 }
-                agents.close();
-                ++timestep_counter;
+                memory::free_heap(particle_indices);
+                trajectory_step = 0;
+                printf("Exporting %d agents over %d timesteps...\n", trajectory_agent_count, N_AGENT_TIMESTEPS_TO_CAPTURE);
             }
         }
 
+        // Snapshot the selected agents; the readback lags a few frames behind, encoding and writing happen on the export thread
+        if (capture_agents && trajectory_file)
+        {
+            uint32_t count = trajectory_agent_count;
+            uint32_t group_count = (count + TRAJECTORY_GATHER_GROUP_SIZE - 1) / TRAJECTORY_GATHER_GROUP_SIZE;
+            graphics::set_compute_shader(&gather_shader);
+            graphics::set_structured_buffer(&trajectory_indices_buffer, 0);
+            graphics::set_structured_buffer(&trajectory_gather_buffer, 1);
+            graphics::set_structured_buffer(&particles_buffer_x, 2);
+            graphics::set_structured_buffer(&particles_buffer_y, 3);
+            graphics::set_structured_buffer(&particles_buffer_z, 4);
+            graphics::set_structured_buffer(&particles_buffer_weights, 7);
+            graphics::run_compute(group_count < TRAJECTORY_GATHER_ROW_GROUPS ? group_count : TRAJECTORY_GATHER_ROW_GROUPS,
+                (group_count + TRAJECTORY_GATHER_ROW_GROUPS - 1) / TRAJECTORY_GATHER_ROW_GROUPS, 1);
+            graphics::unset_texture_compute(0);
+            graphics::unset_texture_compute(1);
+
+            // Copy the step into the next staging buffer of the ring, reading back the oldest first if the ring is full
+            if (trajectory_staging_pending == TRAJECTORY_READBACK_LATENCY)
+                read_trajectory_steps(true);
+            graphics::copy_to_staging_buffer(&trajectory_gather_buffer, &trajectory_staging[trajectory_staging_next]);
+            trajectory_staging_iteration[trajectory_staging_next] = simulation_config.n_iteration;
+            trajectory_staging_next = (trajectory_staging_next + 1) % TRAJECTORY_READBACK_LATENCY;
+            ++trajectory_staging_pending;
+            read_trajectory_steps(false);
+
+            ++trajectory_step;
+            if (trajectory_step >= N_AGENT_TIMESTEPS_TO_CAPTURE)
+                capture_agents = false;
+        }
+
+        // Capture finished or toggled off (F5)
+        if (!capture_agents && trajectory_file)
+            finish_trajectory_capture();
+
         // Rendering
         {
             graphics::set_render_targets_viewport(&render_target_window);
@@ -1253,14 +1909,42 @@ int main(int argc, char **argv)
                 graphics::unset_texture(1);
             }
             else if (vis_mode == VisualizationMode::VM_PATH_TRACING) {
-                if (reset_pt) {
-                    reset_pt = false;
+                if (move_pt && !reset_pt && reproject_pt && rendering_config.pt_iteration > 0) {
+                    // Keep the image of the previous view as history, the next iteration reprojects it into the new one
+                    Texture2D swap_tex = display_tex;
+                    display_tex = history_tex;
+                    history_tex = swap_tex;
+                    swap_tex = features_tex;
+                    features_tex = history_features_tex;
+                    history_features_tex = swap_tex;
+                    rendering_config.reproject_history = 1;
+                    rendering_config.pt_iteration = 0;
+                } else if (reset_pt || move_pt) {
+                    // A move before the pending reprojection ran still reprojects the same history
+                    if (reset_pt || !reproject_pt)
+                        rendering_config.reproject_history = 0;
                     rendering_config.pt_iteration = 0;
                 }
+                reset_pt = false;
+                move_pt = false;
                 graphics::update_constant_buffer(&rendering_settings_buffer, &rendering_config);
+                if (run_pt && rendering_config.pt_iteration < 1e5 && (run_mold || rendering_config.pt_iteration == 0)) {
+                    // Rebuild the majorants whenever the trace may have changed
+                    graphics::set_compute_shader(&cs_trace_majorant);
+                    graphics::set_texture_sampled_compute(&trace_tex, 0);
+                    graphics::set_texture_compute(&majorant_tex, 1);
+                    graphics::run_compute(
+                        (MAJORANT_RESOLUTION_X + PT_MAJORANT_GROUP_SIZE - 1) / PT_MAJORANT_GROUP_SIZE,
+                        (MAJORANT_RESOLUTION_Y + PT_MAJORANT_GROUP_SIZE - 1) / PT_MAJORANT_GROUP_SIZE,
+                        (MAJORANT_RESOLUTION_Z + PT_MAJORANT_GROUP_SIZE - 1) / PT_MAJORANT_GROUP_SIZE);
+                    graphics::unset_texture_sampled_compute(0);
+                    graphics::unset_texture_compute(1);
+                }
                 if (run_pt && rendering_config.pt_iteration < 1e5) {
                     graphics::set_compute_shader(&cs_volpath);
                     graphics::set_texture_compute(&display_tex, 0);
+                    graphics::set_texture_compute(&features_tex, 1);
+                    graphics::set_texture_compute(&albedo_tex, 2);
                     graphics::set_texture_sampled_compute(&trace_tex, 1);
                     graphics::set_texture_sampler_compute(&tex_sampler_trace, 1);
                     if (is_a) {
@@ -1273,20 +1957,59 @@ int main(int argc, char **argv)
                     graphics::set_texture_sampler_compute(&tex_sampler_color_palette, 3);
                     graphics::set_texture_sampled_compute(&palette_data_tex, 4);
                     graphics::set_texture_sampler_compute(&tex_sampler_color_palette, 4);
+                    graphics::set_texture_sampled_compute(&majorant_tex, 5);
+                    graphics::set_texture_sampled_compute(&history_tex, 6);
+                    graphics::set_texture_sampled_compute(&history_features_tex, 7);
+                    graphics::set_structured_buffer(&light_nodes_buffer, 3);
+                    graphics::set_structured_buffer(&lights_buffer, 4);
                     graphics::run_compute(
                         rendering_config.screen_width / int(PT_GROUP_SIZE_X),
                         rendering_config.screen_height / int(PT_GROUP_SIZE_Y),
                         1);
+                    graphics::unset_texture_sampled_compute(6);
+                    graphics::unset_texture_sampled_compute(7);
                     graphics::unset_texture_compute(0);
+                    graphics::unset_texture_compute(1);
+                    graphics::unset_texture_compute(2);
                     graphics::unset_texture_sampled_compute(1);
                     graphics::unset_texture_sampled_compute(2);
                     graphics::unset_texture_sampled_compute(3);
+                    graphics::unset_texture_sampled_compute(5);
                     rendering_config.pt_iteration++;
+                    rendering_config.prev_camera_x = rendering_config.camera_x;
+                    rendering_config.prev_camera_y = rendering_config.camera_y;
+                    rendering_config.prev_camera_z = rendering_config.camera_z;
+                    rendering_config.prev_camera_offset_x = rendering_config.camera_offset_x;
+                    rendering_config.prev_camera_offset_y = rendering_config.camera_offset_y;
+                }
+
+                // Filter the accumulated image for display; the accumulation itself stays untouched
+                Texture2D *pt_image = &display_tex;
+                if (denoise_pt && rendering_config.pt_iteration > 0) {
+                    graphics::set_compute_shader(&cs_denoise);
+                    graphics::set_texture_sampled_compute(&features_tex, 1);
+                    graphics::set_texture_sampled_compute(&albedo_tex, 2);
+                    for (int32_t pass = 0; pass < DENOISE_PASSES; ++pass) {
+                        Texture2D *filtered = (pass % 2 == 0) ? &denoise_tex_A : &denoise_tex_B;
+                        rendering_config.denoise_step = 1 << pass;
+                        graphics::update_constant_buffer(&rendering_settings_buffer, &rendering_config);
+                        graphics::set_texture_sampled_compute(pt_image, 0);
+                        graphics::set_texture_compute(filtered, 0);
+                        graphics::run_compute(
+                            (int32_t(rendering_config.screen_width) + DENOISE_GROUP_SIZE - 1) / DENOISE_GROUP_SIZE,
+                            (int32_t(rendering_config.screen_height) + DENOISE_GROUP_SIZE - 1) / DENOISE_GROUP_SIZE,
+                            1);
+                        graphics::unset_texture_compute(0);
+                        graphics::unset_texture_sampled_compute(0);
+                        pt_image = filtered;
+                    }
+                    graphics::unset_texture_sampled_compute(1);
+                    graphics::unset_texture_sampled_compute(2);
                 }
 
                 graphics::set_vertex_shader(&vertex_shader_2d);
                 graphics::set_pixel_shader(&ps_volpath);
-                graphics::set_texture(&display_tex, 0);
+                graphics::set_texture(pt_image, 0);
                 graphics::set_texture_sampler(&tex_sampler_display, 0);
                 graphics::draw_mesh(&quad_mesh);
                 graphics::unset_texture(0);
@@ -1598,6 +2321,7 @@ int main(int argc, char **argv)
                 float f_bounces = float(rendering_config.n_bounces);
                 reset_pt |= ui::add_slider(&panel, "N BOUNCES", &f_bounces, 0.0, 30.0);
                 rendering_config.n_bounces = int(f_bounces);
+                // Majorant of the tracking only without LOCAL_MAJORANTS in cs_volpath.hlsl
                 float trmax = log(rendering_config.trace_max) / log(HISTOGRAM_BASE);
                 reset_pt |= ui::add_slider(&panel, "TRACE_MAX", &trmax, -4.0, 4.0);
                 rendering_config.trace_max = math::pow(HISTOGRAM_BASE, trmax);
@@ -1613,6 +2337,10 @@ int main(int argc, char **argv)
                 bool compress_L = bool(rendering_config.compressive_accumulation);
                 reset_pt |= ui::add_toggle(&panel, "COMPRESSIVE EXPOSURE", &compress_L);
                 rendering_config.compressive_accumulation = int(compress_L);
+                // Relative error at which groups of pixels stop sampling, 0 samples every pixel every iteration
+                ui::add_slider(&panel, "TARGET ERROR", &rendering_config.target_error, 0.0, 0.1);
+                ui::add_toggle(&panel, "DENOISE", &denoise_pt);
+                ui::add_toggle(&panel, "REPROJECT ON MOVE", &reproject_pt);
                 ui::add_toggle(&panel, "RENDER!", &run_pt);
             }
 
@@ -1622,10 +2350,27 @@ int main(int argc, char **argv)
 
         if (run_mold) {
             ++simulation_config.n_iteration;
+            if (EXPORT_INTERVAL > 0) {
+                // Agent sorting advances the counter in larger steps, so export whenever a multiple of the interval is crossed
+                int32_t export_period = simulation_config.n_iteration / (EXPORT_INTERVAL > 0 ? EXPORT_INTERVAL : 1);
+                if (export_period > last_export_period) {
+                    store_deposit = true;
+                    scheduled_export = true;
+                }
+                last_export_period = export_period;
+            }
         }
         graphics::swap_frames();
     }
 
+    // Let the background writer finish the queued exports
+    if (trajectory_file)
+        finish_trajectory_capture();
+    if (export_queue::get_pending_count() > 0)
+        printf("Waiting for %d pending export(s)...\n", export_queue::get_pending_count());
+    export_queue::stop();
+    dataset_cache::close(&data_points);
+
     ui::release();
     graphics::release(&render_target_window);
     graphics::release(&depth_buffer);
@@ -1642,13 +2387,22 @@ int main(int argc, char **argv)
     graphics::release(&sort_shader);
     graphics::release(&decay_compute_shader);
     graphics::release(&cs_density_histo);
+    graphics::release(&cs_trace_majorant);
+    graphics::release(&cs_denoise);
     graphics::release(&quad_mesh);
     graphics::release(&super_quad_mesh);
     graphics::release(&trail_tex_A);
     graphics::release(&trail_tex_B);
     graphics::release(&trace_tex);
+    graphics::release(&majorant_tex);
     graphics::release(&display_tex);
     graphics::release(&display_tex_uint);
+    graphics::release(&features_tex);
+    graphics::release(&albedo_tex);
+    graphics::release(&denoise_tex_A);
+    graphics::release(&denoise_tex_B);
+    graphics::release(&history_tex);
+    graphics::release(&history_features_tex);
     graphics::release(&palette_trace_tex);
     graphics::release(&palette_data_tex);
     graphics::release(&tex_sampler_trace);
@@ -1663,6 +2417,8 @@ int main(int argc, char **argv)
     graphics::release(&particles_buffer_weights);
     graphics::release(&density_histogram_buffer);
     graphics::release(&halos_densities_buffer);
+    graphics::release(&light_nodes_buffer);
+    graphics::release(&lights_buffer);
     graphics::release(&rendering_settings_buffer);
     graphics::release();
 
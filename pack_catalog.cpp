@@ -0,0 +1,249 @@
+#include "catalog.h"
+#include "memory.h"
+#include "jobs.h"
+#include <fstream>
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Converts a point catalog (CSV, Rockstar halo list or OBJ vertices) into the <name>.bin and <name>_metadata.txt inputs of Polyphorm.
+// Parsing, transforms and cuts run on all CPU threads.
+
+static void print_usage()
+{
+    printf("Usage: pack_catalog <catalog file> [options]\n");
+    printf("  --format csv|rockstar|obj  Input format (default: rockstar for .list files, obj for .obj files, csv otherwise)\n");
+    printf("  --separator <c>          CSV field separator, 'space' or 'tab' for whitespace (default ',')\n");
+    printf("  --header-lines <n>       CSV lines before the data, the first holds the column names (default 1)\n");
+    printf("  --x/--y/--z <column>     Position columns, as 0-based index or header name\n");
+    printf("  --mass <column>          Mass column, 'none' gives all points weight 1\n");
+    printf("  --color <column>         Optional 5th value per point (for HALO_COLOR_ANALYSIS)\n");
+    printf("  --spherical              X/Y/Z columns hold right ascension [deg], declination [deg] and distance\n");
+    printf("  --log-mass               Mass column holds log10 of the mass\n");
+    printf("  --mass-min <value>       Keep rows with mass column value above this (in column units)\n");
+    printf("  --mass-unit <value>      Weight = mass / unit (default 1e12)\n");
+    printf("  --position-scale <value> Multiply the positions (default 1)\n");
+    printf("  --subsample <factor>     Keep about 1 in <factor> rows, chosen pseudo-randomly by their place in the file\n");
+    printf("  --roi <x0> <x1> <y0> <y1> <z0> <z1>  Keep points inside the box, bounds included (output coordinates)\n");
+    printf("  --roi-exclusive          Exclude the upper bounds of the box\n");
+    printf("  --celestial              Preset for RA/Dec/distance/log-mass CSV files: --spherical --log-mass\n");
+    printf("                           --x 1 --y 2 --z 3 --mass 4 --mass-min 0\n");
+    printf("  --massivenus             Preset for MassiveNuS Rockstar lists: Mvir weights and the box below 256 Mpc/h,\n");
+    printf("                           --mass 2 --mass-min 0 --roi -inf 256 -inf 256 -inf 256 --roi-exclusive\n");
+    printf("  --threads <n>            Number of worker threads (default: all)\n");
+    printf("  --output <name>          Output name without extension (default: <catalog name>_t=<mass-min>, <model name>_n=<count> for OBJ)\n");
+}
+
+static bool ends_with(const char *text, const char *suffix)
+{
+    size_t text_length = strlen(text);
+    size_t suffix_length = strlen(suffix);
+    return text_length >= suffix_length && strcmp(text + text_length - suffix_length, suffix) == 0;
+}
+
+// Column given as an index or a header name
+static bool resolve_column(const char *text, size_t size, CatalogSettings *settings, const char *column, int32_t *index)
+{
+    if (strcmp(column, "none") == 0) {
+        *index = -1;
+        return true;
+    }
+    char *number_end;
+    long value = strtol(column, &number_end, 10);
+    if (*number_end == 0 && number_end != column) {
+        *index = int32_t(value);
+        return value >= 0;
+    }
+    *index = catalog::find_column(text, size, settings, column);
+    if (*index < 0)
+        printf("Column '%s' not found in the catalog header\n", column);
+    return *index >= 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || strcmp(argv[1], "--help") == 0) {
+        print_usage();
+        return 1;
+    }
+    const char *input_name = argv[1];
+
+    // Options are collected first, the format decides the defaults of everything else
+    const char *format_name = ends_with(input_name, ".list") ? "rockstar" : (ends_with(input_name, ".obj") ? "obj" : "csv");
+    const char *columns[CC_COUNT] = {};
+    const char *separator = nullptr;
+    const char *header_lines = nullptr;
+    const char *mass_min = nullptr;
+    const char *mass_unit = nullptr;
+    const char *position_scale = nullptr;
+    const char *subsample = nullptr;
+    const char *output_name = nullptr;
+    const char *roi[6] = {};
+    bool spherical = false;
+    bool log_mass = false;
+    bool roi_exclusive = false;
+    for (int i = 2; i < argc; ++i) {
+        const char *option = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(option, "--format") == 0 && has_value) format_name = argv[++i];
+        else if (strcmp(option, "--separator") == 0 && has_value) separator = argv[++i];
+        else if (strcmp(option, "--header-lines") == 0 && has_value) header_lines = argv[++i];
+        else if (strcmp(option, "--x") == 0 && has_value) columns[CC_X] = argv[++i];
+        else if (strcmp(option, "--y") == 0 && has_value) columns[CC_Y] = argv[++i];
+        else if (strcmp(option, "--z") == 0 && has_value) columns[CC_Z] = argv[++i];
+        else if (strcmp(option, "--mass") == 0 && has_value) columns[CC_MASS] = argv[++i];
+        else if (strcmp(option, "--color") == 0 && has_value) columns[CC_COLOR] = argv[++i];
+        else if (strcmp(option, "--spherical") == 0) spherical = true;
+        else if (strcmp(option, "--log-mass") == 0) log_mass = true;
+        else if (strcmp(option, "--mass-min") == 0 && has_value) mass_min = argv[++i];
+        else if (strcmp(option, "--mass-unit") == 0 && has_value) mass_unit = argv[++i];
+        else if (strcmp(option, "--position-scale") == 0 && has_value) position_scale = argv[++i];
+        else if (strcmp(option, "--subsample") == 0 && has_value) subsample = argv[++i];
+        else if (strcmp(option, "--roi-exclusive") == 0) roi_exclusive = true;
+        else if (strcmp(option, "--output") == 0 && has_value) output_name = argv[++i];
+        else if (strcmp(option, "--threads") == 0 && has_value) jobs::set_thread_count(uint32_t(atoi(argv[++i])));
+        else if (strcmp(option, "--roi") == 0 && i + 6 < argc) {
+            for (int a = 0; a < 6; ++a)
+                roi[a] = argv[++i];
+        } else if (strcmp(option, "--celestial") == 0) {
+            spherical = true;
+            log_mass = true;
+            columns[CC_X] = "1";
+            columns[CC_Y] = "2";
+            columns[CC_Z] = "3";
+            columns[CC_MASS] = "4";
+            mass_min = "0.0";
+        } else if (strcmp(option, "--massivenus") == 0) {
+            columns[CC_MASS] = "2";
+            mass_min = "0.0";
+            for (int a = 0; a < 3; ++a) {
+                roi[2 * a] = "-inf";
+                roi[2 * a + 1] = "256";
+            }
+            roi_exclusive = true;
+        } else {
+            printf("Unknown option %s\n", option);
+            print_usage();
+            return 1;
+        }
+    }
+
+    CatalogFormat format;
+    if (strcmp(format_name, "csv") == 0) {
+        format = CF_CSV;
+    } else if (strcmp(format_name, "rockstar") == 0) {
+        format = CF_ROCKSTAR;
+    } else if (strcmp(format_name, "obj") == 0) {
+        format = CF_OBJ;
+    } else {
+        printf("Unknown format %s\n", format_name);
+        return 1;
+    }
+    CatalogSettings settings = catalog::get_default_settings(format);
+    if (separator)
+        settings.separator = strcmp(separator, "space") == 0 ? ' ' : (strcmp(separator, "tab") == 0 ? '\t' : separator[0]);
+    if (header_lines)
+        settings.header_lines = uint32_t(atoi(header_lines));
+    settings.spherical = spherical;
+    settings.log_mass = log_mass;
+    if (mass_min)
+        settings.mass_min = atof(mass_min);
+    if (mass_unit)
+        settings.mass_unit = atof(mass_unit);
+    if (position_scale)
+        settings.position_scale = atof(position_scale);
+    if (subsample)
+        settings.keep_fraction = 1.0 / (atof(subsample) > 1.0 ? atof(subsample) : 1.0);
+    if (roi[0]) {
+        settings.use_roi = true;
+        settings.roi_exclusive_max = roi_exclusive;
+        for (int a = 0; a < 3; ++a) {
+            settings.roi_min[a] = float(atof(roi[2 * a]));
+            settings.roi_max[a] = float(atof(roi[2 * a + 1]));
+        }
+    }
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::ifstream input_file(input_name, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!input_file.is_open()) {
+        printf("Failed to open %s\n", input_name);
+        return 1;
+    }
+    uint64_t size = uint64_t(input_file.tellg());
+    if (size >= UINT32_MAX) {
+        printf("%s is too large (%llu bytes), split the catalog into files below 4GB\n", input_name, (unsigned long long)size);
+        return 1;
+    }
+    char *text = memory::alloc_heap<char>(size + 1);
+    input_file.seekg(0);
+    input_file.read(text, size);
+    input_file.close();
+    text[size] = 0;
+    auto read_time = std::chrono::high_resolution_clock::now();
+
+    if (format == CF_ROCKSTAR) {
+        // Rockstar lists name their columns, so the defaults follow the header when it is present
+        const char *names[CC_COUNT] = { "X", "Y", "Z", "M200b", nullptr };
+        for (int32_t i = 0; i < CC_COUNT; ++i) {
+            int32_t index = names[i] ? catalog::find_column(text, size_t(size), &settings, names[i]) : -1;
+            if (index >= 0)
+                settings.columns[i] = index;
+        }
+    }
+    for (int32_t i = 0; i < CC_COUNT; ++i) {
+        if (columns[i] && !resolve_column(text, size_t(size), &settings, columns[i], &settings.columns[i])) {
+            memory::free_heap(text);
+            return 1;
+        }
+    }
+
+    Catalog points;
+    bool success = catalog::load(text, size_t(size), settings, &points);
+    memory::free_heap(text);
+    auto parse_time = std::chrono::high_resolution_clock::now();
+    if (!success)
+        return 1;
+
+    char default_name[512];
+    if (!output_name) {
+        // <catalog name>_t=<threshold> as the Python packing script named its outputs
+        size_t stem_length = strlen(input_name);
+        const char *extension = strrchr(input_name, '.');
+        const char *directory = strrchr(input_name, '/') > strrchr(input_name, '\\') ? strrchr(input_name, '/') : strrchr(input_name, '\\');
+        if (extension && extension > directory)
+            stem_length = extension - input_name;
+        if (format == CF_OBJ) {
+            // <model name>_n=<point count> as the OBJ packing scripts named theirs
+            snprintf(default_name, sizeof(default_name), "%.*s_n=%llu", int(stem_length), input_name, (unsigned long long)points.count);
+        } else {
+            snprintf(default_name, sizeof(default_name), "%.*s_t=%g", int(stem_length), input_name, mass_min ? settings.mass_min : 0.0);
+            if (!strchr(default_name + stem_length, '.') && !strchr(default_name + stem_length, 'e'))
+                strncat(default_name, ".0", sizeof(default_name) - strlen(default_name) - 1);
+        }
+        output_name = default_name;
+    }
+    success = catalog::save(&points, output_name);
+    auto end_time = std::chrono::high_resolution_clock::now();
+
+    if (points.count > 0) {
+        printf("Min/Max X: %g %g\n", points.min[0], points.max[0]);
+        printf("Min/Max Y: %g %g\n", points.min[1], points.max[1]);
+        printf("Min/Max Z: %g %g\n", points.min[2], points.max[2]);
+        printf("Mean weight: %g\n", points.mean_weight);
+        printf("Example record:");
+        for (uint32_t i = 0; i < points.stride; ++i)
+            printf(" %g", points.data[i]);
+        printf("\n");
+    }
+    printf("Number of records: %u of %llu rows (%llu unparseable)\n", points.count,
+        (unsigned long long)points.row_count, (unsigned long long)points.invalid_count);
+    double read_seconds = std::chrono::duration<double>(read_time - start_time).count();
+    double parse_seconds = std::chrono::duration<double>(parse_time - read_time).count();
+    double write_seconds = std::chrono::duration<double>(end_time - parse_time).count();
+    printf("Read %.2fs, parse %.2fs (%.0f MB/s, %u threads), write %.2fs -> %s.bin\n", read_seconds, parse_seconds,
+        double(size) / (parse_seconds > 0.0 ? parse_seconds : 1e-9) / (1024.0 * 1024.0), jobs::get_thread_count(), write_seconds, output_name);
+
+    catalog::release(&points);
+    return success ? 0 : 1;
+}
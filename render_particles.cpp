@@ -0,0 +1,130 @@
+#include "splat.h"
+#include "volpath.h"
+#include "trajectory.h"
+#include "memory.h"
+#include "jobs.h"
+#include <fstream>
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Renders the steps of an agent trajectory capture (.ptraj, F5) as particle mode frames on the CPU, using the view state
+// Polyphorm saves with F9. Writes <output>_<step>.tga (as the window shows it) for every rendered step.
+
+static void print_usage()
+{
+    printf("Usage: render_particles <agents.ptraj> [options]\n");
+    printf("  --state <file>           View state saved by Polyphorm with F9 (default: visu_state.tmp if present)\n");
+    printf("  --width/--height <px>    Image resolution (default 1280 x 720)\n");
+    printf("  --first <n>              First step to render (default 0)\n");
+    printf("  --count <n>              Number of steps to render (default: all)\n");
+    printf("  --every <n>              Render every n-th step (default 1)\n");
+    printf("  --sample-weight <value>  Override the agent brightness of the view state\n");
+    printf("  --tile <px>              Screen tile size of one job (default 32)\n");
+    printf("  --threads <n>            Number of worker threads (default: all)\n");
+    printf("  --output <name>          Output name prefix (default: particles)\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || strcmp(argv[1], "--help") == 0) {
+        print_usage();
+        return 1;
+    }
+    const char *trajectory_name = argv[1];
+    const char *state_name = nullptr;
+    const char *output_name = "particles";
+    const char *sample_weight = nullptr;
+    VolpathSettings settings = volpath::get_default_settings();
+    uint32_t first_step = 0;
+    uint32_t step_count = 0xffffffff;
+    uint32_t step_stride = 1;
+    for (int i = 2; i < argc; ++i) {
+        const char *option = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(option, "--state") == 0 && has_value) state_name = argv[++i];
+        else if (strcmp(option, "--width") == 0 && has_value) settings.width = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--height") == 0 && has_value) settings.height = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--first") == 0 && has_value) first_step = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--count") == 0 && has_value) step_count = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--every") == 0 && has_value) step_stride = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--sample-weight") == 0 && has_value) sample_weight = argv[++i];
+        else if (strcmp(option, "--tile") == 0 && has_value) settings.tile_size = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--threads") == 0 && has_value) jobs::set_thread_count(uint32_t(atoi(argv[++i])));
+        else if (strcmp(option, "--output") == 0 && has_value) output_name = argv[++i];
+        else {
+            printf("Unknown option %s\n", option);
+            print_usage();
+            return 1;
+        }
+    }
+    if (settings.width == 0 || settings.height == 0 || step_count == 0 || step_stride == 0) {
+        printf("Nothing to render, check --width, --height, --count and --every\n");
+        return 1;
+    }
+    if (!state_name && std::ifstream("visu_state.tmp").is_open()) {
+        state_name = "visu_state.tmp";
+        printf("Using the view state in visu_state.tmp\n");
+    }
+    if (state_name && !volpath::load_state(state_name, &settings))
+        return 1;
+    if (sample_weight)
+        settings.sample_weight = float(atof(sample_weight));
+    // The particle mode shows the window colors, which the compressive accumulation keeps in the display buffer
+    settings.compressive_accumulation = true;
+
+    TrajectoryFile file = {};
+    if (!trajectory::open(trajectory_name, &file))
+        return 1;
+    uint32_t agent_count = file.header.agent_count;
+    SplatParticles particles = {};
+    particles.x = memory::alloc_heap<float>(agent_count);
+    particles.y = memory::alloc_heap<float>(agent_count);
+    particles.z = memory::alloc_heap<float>(agent_count);
+    particles.count = agent_count;
+    for (uint32_t axis = 0; axis < 3; ++axis)
+        particles.grid_size[axis] = uint32_t(file.header.grid_size[axis]);
+    float *weights = memory::alloc_heap<float>(agent_count);
+    printf("Rendering %u x %u px, %u agents in a %u x %u x %u grid, %u threads\n", settings.width, settings.height, agent_count,
+        particles.grid_size[0], particles.grid_size[1], particles.grid_size[2], jobs::get_thread_count());
+
+    SplatBuffers buffers = {};
+    VolpathImage image = volpath::get_image(settings.width, settings.height);
+    bool success = true;
+    uint32_t rendered_count = 0;
+    double read_seconds = 0.0, render_seconds = 0.0;
+    int32_t iteration;
+    for (uint32_t step = 0; success && rendered_count < step_count; ++step) {
+        auto start_time = std::chrono::high_resolution_clock::now();
+        if (!trajectory::read_step(&file, &iteration, particles.x, particles.y, particles.z, weights))
+            break;
+        if (step < first_step || (step - first_step) % step_stride != 0)
+            continue;
+        auto read_time = std::chrono::high_resolution_clock::now();
+        splat::render(&particles, &settings, &buffers, &image);
+        auto render_time = std::chrono::high_resolution_clock::now();
+        read_seconds += std::chrono::duration<double>(read_time - start_time).count();
+        render_seconds += std::chrono::duration<double>(render_time - read_time).count();
+
+        char ldr_name[512];
+        snprintf(ldr_name, sizeof(ldr_name), "%s_%05u.tga", output_name, step);
+        success = volpath::save_ldr(&image, &settings, ldr_name);
+        ++rendered_count;
+    }
+    if (rendered_count == 0)
+        printf("No steps of %s to render from step %u\n", trajectory_name, first_step);
+    else
+        printf("Rendered %u steps, read %.3fs, splat %.3fs (%.1f ms and %.1f Mparticles/s per step) -> %s_*.tga\n", rendered_count,
+            read_seconds, render_seconds, render_seconds / rendered_count * 1e3,
+            double(agent_count) * rendered_count / (render_seconds > 0.0 ? render_seconds : 1e-9) * 1e-6, output_name);
+
+    volpath::release(&image);
+    splat::release(&buffers);
+    trajectory::close(&file);
+    memory::free_heap(particles.x);
+    memory::free_heap(particles.y);
+    memory::free_heap(particles.z);
+    memory::free_heap(weights);
+    return success && rendered_count > 0 ? 0 : 1;
+}
@@ -0,0 +1,386 @@
+#include "volpath.h"
+#include "volmarch.h"
+#include "volume_file.h"
+#include "camera_path.h"
+#include "denoise.h"
+#include "dataset_cache.h"
+#include "export_queue.h"
+#include "memory.h"
+#include "jobs.h"
+#include <fstream>
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Renders exported trace and deposit volumes (.pvol) with the CPU version of the volumetric path tracer, or one of the
+// volume modes with the CPU ray marcher, using the view state Polyphorm saves with F9. Writes <output>.hdr (mean
+// radiance, linear colors of the volume modes) and <output>.tga (as the window shows it); frames of a camera path are
+// written as <output>_<frame>.hdr and .tga.
+
+static void print_usage()
+{
+    printf("Usage: render_volpath <trace.pvol> [options]\n");
+    printf("  --mode <name>            pt (path tracing) or a volume mode: trace, highlight, overdensity, velocity, halocolor\n");
+    printf("                           (default pt; velocity and halocolor need volumes of the analysis builds)\n");
+    printf("  --deposit <file>         Deposit volume for the halo emission (default: deposit.pvol next to the trace)\n");
+    printf("  --state <file>           View state saved by Polyphorm with F9 (default: visu_state.tmp if present)\n");
+    printf("  --palette-trace <file>   Trace palette TGA (default data/palette_sunset3.tga)\n");
+    printf("  --palette-data <file>    Data palette TGA (default data/palette_hot.tga)\n");
+    printf("  --width/--height <px>    Image resolution (default 1280 x 720)\n");
+    printf("  --spp <n>                Samples per pixel (default 256, 0 = until the time budget is used)\n");
+    printf("  --time <seconds>         Time budget, stops before --spp is reached (default: none)\n");
+    printf("  --target-error <value>   Stop sampling screen tiles whose relative error is below this, e.g. 0.02; writes the\n");
+    printf("                           samples per pixel as <output>.spp.tga (default 0 = sample every pixel)\n");
+    printf("  --level <n>              Render a pyramid level of the volumes as a quick preview (default 0)\n");
+    printf("  --sigma-s <value>        Override the scattering coefficient of the view state\n");
+    printf("  --denoise <passes>       Filter the path traced image with the A-trous denoiser (default 0 = off, 3 is typical)\n");
+    printf("  --lights <file>          Light the scene by every data point of a dataset cache (<dataset>.pcache), sampled\n");
+    printf("                           by importance at every scattering event\n");
+    printf("  --global-majorant        Track against trace_max everywhere instead of the local majorant grid\n");
+    printf("  --histogram-base <value> HISTOGRAM_BASE of config.polyp, the width of the highlight band (default 10)\n");
+    printf("  --background <value>     Gray level behind the volume modes (default 0)\n");
+    printf("  --no-skipping            March the volume modes through empty space instead of skipping it\n");
+    printf("  --path <file>            Render the frames of a keyframed camera path instead of a still (see cpplib/camera_path.h)\n");
+    printf("  --first <n>              First frame of the path to render (default 0)\n");
+    printf("  --count <n>              Number of frames to render (default: to the last keyframe)\n");
+    printf("  --tile <px>              Screen tile size of one job (default 32)\n");
+    printf("  --threads <n>            Number of worker threads (default: all)\n");
+    printf("  --output <name>          Output name without extension (default: volpath)\n");
+}
+
+// One channel of a pyramid level of a volume file
+static bool load_grid(const char *filename, uint32_t level, uint32_t channel, Volume *volume)
+{
+    VolumeFileReader reader = {};
+    if (!volume_file::open(filename, &reader))
+        return false;
+    bool success = volume_file::read_volume(&reader, level, channel, volume);
+    if (!success)
+        printf("Failed to read channel %u of level %u of %s\n", channel, level, filename);
+    volume_file::close(&reader);
+    return success;
+}
+
+// Data points of a dataset cache as the galaxy lights of the scene, in the coordinates of the grid's pyramid level
+static bool load_lights(const char *filename, Volume *grid, uint32_t level, LightBVH *lights)
+{
+    DatasetCache cache;
+    if (!dataset_cache::load(filename, &cache))
+        return false;
+    uint32_t *grid_size = cache.header.grid_size;
+    uint32_t scale = 1U << level;
+    if ((grid_size[0] + scale - 1) >> level != grid->width || (grid_size[1] + scale - 1) >> level != grid->height
+        || (grid_size[2] + scale - 1) >> level != grid->depth) {
+        printf("Dataset cache %s was built for a %u x %u x %u grid\n", filename, grid_size[0], grid_size[1], grid_size[2]);
+        dataset_cache::close(&cache);
+        return false;
+    }
+
+    uint32_t count = cache.header.point_count;
+    float *x = memory::alloc_heap<float>(count + 1);
+    float *y = memory::alloc_heap<float>(count + 1);
+    float *z = memory::alloc_heap<float>(count + 1);
+    float scale_inv = 1.0f / float(scale);
+    for (uint32_t i = 0; i < count; ++i) {
+        x[i] = cache.planes[DCP_X][i] * scale_inv;
+        y[i] = cache.planes[DCP_Y][i] * scale_inv;
+        z[i] = cache.planes[DCP_Z][i] * scale_inv;
+    }
+    *lights = light_bvh::build(x, y, z, cache.planes[DCP_WEIGHT], count);
+    memory::free_heap(x);
+    memory::free_heap(y);
+    memory::free_heap(z);
+    dataset_cache::close(&cache);
+    return true;
+}
+
+// Frames to render; a still has no camera path and keeps the view of the state
+struct FrameRange
+{
+    CameraPath *path;
+    uint32_t first;
+    uint32_t end;
+};
+
+static const uint32_t MAX_QUEUED_IMAGES = 4; // Rendered frames waiting for the export thread
+static bool write_failed = false; // Set by the export thread, read after export_queue::flush()
+
+static void get_output_name(const char *output_name, FrameRange *frames, uint32_t frame, const char *extension, char name[512])
+{
+    if (frames->path)
+        snprintf(name, 512, "%s_%05u.%s", output_name, frame, extension);
+    else
+        snprintf(name, 512, "%s.%s", output_name, extension);
+}
+
+// Write the .hdr and .tga of a frame asynchronously: the export queue owns a copy of the image while the next frame renders.
+// The convergence map of adaptive sampling is written too when `map_name` is given.
+static void save_image(VolpathImage *image, VolpathSettings *settings, const char *hdr_name, const char *ldr_name,
+    const char *map_name = nullptr)
+{
+    size_t pixel_count = size_t(image->width) * image->height;
+    size_t value_count = 3 * pixel_count;
+    uint64_t staging_bytes = 2 * value_count * sizeof(float) + (map_name ? pixel_count * sizeof(uint32_t) : 0);
+    export_queue::reserve(staging_bytes);
+    VolpathImage staged = volpath::get_image(image->width, image->height);
+    memcpy(staged.radiance, image->radiance, value_count * sizeof(float));
+    memcpy(staged.display, image->display, value_count * sizeof(float));
+    if (map_name)
+        memcpy(staged.samples, image->samples, pixel_count * sizeof(uint32_t));
+    staged.sample_count = image->sample_count;
+    VolpathSettings staged_settings = *settings;
+    char staged_hdr_name[512], staged_ldr_name[512], staged_map_name[512];
+    snprintf(staged_hdr_name, sizeof(staged_hdr_name), "%s", hdr_name);
+    snprintf(staged_ldr_name, sizeof(staged_ldr_name), "%s", ldr_name);
+    snprintf(staged_map_name, sizeof(staged_map_name), "%s", map_name ? map_name : "");
+    export_queue::submit([staged, staged_settings, staged_hdr_name, staged_ldr_name, staged_map_name]() mutable {
+        if (!volpath::save_hdr(&staged, staged_hdr_name) || !volpath::save_ldr(&staged, &staged_settings, staged_ldr_name))
+            write_failed = true;
+        if (staged_map_name[0] != '\0' && !volpath::save_sample_map(&staged, staged_map_name))
+            write_failed = true;
+        volpath::release(&staged);
+    }, staging_bytes);
+}
+
+// Render a volume mode with the ray marcher, loading only the grids the mode reads
+static bool render_volume_mode(const char *mode_name, VolmarchMode mode, const char *trace_name, const char *deposit_name,
+    const char *palette_trace_name, uint32_t level, bool skip_empty, VolpathSettings *settings, FrameRange *frames,
+    const char *output_name)
+{
+    auto start_time = std::chrono::high_resolution_clock::now();
+    VolmarchScene scene = {};
+    bool success = load_grid(trace_name, level, 0, &scene.trace);
+    if (mode == VMM_TRACE)
+        success = success && volpath::load_palette(palette_trace_name, &scene.palette_trace, &scene.palette_trace_size);
+    if (mode == VMM_HIGHLIGHT || mode == VMM_HALOCOLOR)
+        success = success && load_grid(deposit_name, level, 0, &scene.deposit);
+    if (mode == VMM_HALOCOLOR)
+        success = success && load_grid(deposit_name, level, 1, &scene.halo_color);
+    if (mode == VMM_VELOCITY) {
+        for (uint32_t c = 0; c < 3; ++c)
+            success = success && load_grid(trace_name, level, c + 1, &scene.velocity[c]);
+    }
+    if (success && skip_empty)
+        volmarch::build_bricks(&scene);
+    auto load_time = std::chrono::high_resolution_clock::now();
+
+    if (success) {
+        printf("Rendering %u x %u px, grid %u x %u x %u (level %u), volume mode %s, %u threads, load %.2fs\n", settings->width,
+            settings->height, scene.trace.width, scene.trace.height, scene.trace.depth, level, mode_name, jobs::get_thread_count(),
+            std::chrono::duration<double>(load_time - start_time).count());
+        // The marcher leaves the window colors in the display buffer, where the compressive accumulation keeps them
+        settings->compressive_accumulation = true;
+        VolpathImage image = volpath::get_image(settings->width, settings->height);
+        for (uint32_t frame = frames->first; frame < frames->end && success; ++frame) {
+            if (frames->path)
+                camera_path::apply(frames->path, frame, settings);
+            auto frame_start = std::chrono::high_resolution_clock::now();
+            image.sample_count = 0;
+            image.trace_fetches = 0;
+            volmarch::render(&scene, settings, mode, &image);
+            auto render_time = std::chrono::high_resolution_clock::now();
+            success = image.sample_count > 0;
+            if (!success)
+                break;
+
+            char hdr_name[512], ldr_name[512];
+            get_output_name(output_name, frames, frame, "hdr", hdr_name);
+            get_output_name(output_name, frames, frame, "tga", ldr_name);
+            save_image(&image, settings, hdr_name, ldr_name);
+            double render_seconds = std::chrono::duration<double>(render_time - frame_start).count();
+            double pixel_count = double(settings->width) * settings->height;
+            printf("Render %.2fs (%.1f trace fetches per pixel) -> %s, %s\n", render_seconds,
+                double(image.trace_fetches) / pixel_count, hdr_name, ldr_name);
+        }
+        volpath::release(&image);
+    }
+
+    volmarch::release(&scene.bricks);
+    volume::release(&scene.trace);
+    volume::release(&scene.deposit);
+    volume::release(&scene.halo_color);
+    for (uint32_t c = 0; c < 3; ++c)
+        volume::release(&scene.velocity[c]);
+    memory::free_heap(scene.palette_trace);
+    return success;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || strcmp(argv[1], "--help") == 0) {
+        print_usage();
+        return 1;
+    }
+    const char *trace_name = argv[1];
+    const char *deposit_name = nullptr;
+    const char *state_name = nullptr;
+    const char *palette_trace_name = "data/palette_sunset3.tga";
+    const char *palette_data_name = "data/palette_hot.tga";
+    const char *output_name = "volpath";
+    const char *sigma_s = nullptr;
+    const char *mode_name = "pt";
+    const char *path_name = nullptr;
+    const char *lights_name = nullptr;
+    VolpathSettings settings = volpath::get_default_settings();
+    DenoiseSettings denoise_settings = denoise::get_default_settings();
+    denoise_settings.iteration_count = 0;
+    uint32_t target_samples = 256;
+    float time_budget = 0.0f;
+    uint32_t level = 0;
+    uint32_t first_frame = 0;
+    uint32_t frame_count = 0xffffffff;
+    bool local_majorants = true;
+    bool skip_empty = true;
+    for (int i = 2; i < argc; ++i) {
+        const char *option = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(option, "--mode") == 0 && has_value) mode_name = argv[++i];
+        else if (strcmp(option, "--deposit") == 0 && has_value) deposit_name = argv[++i];
+        else if (strcmp(option, "--state") == 0 && has_value) state_name = argv[++i];
+        else if (strcmp(option, "--palette-trace") == 0 && has_value) palette_trace_name = argv[++i];
+        else if (strcmp(option, "--palette-data") == 0 && has_value) palette_data_name = argv[++i];
+        else if (strcmp(option, "--width") == 0 && has_value) settings.width = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--height") == 0 && has_value) settings.height = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--spp") == 0 && has_value) target_samples = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--time") == 0 && has_value) time_budget = float(atof(argv[++i]));
+        else if (strcmp(option, "--target-error") == 0 && has_value) settings.target_error = float(atof(argv[++i]));
+        else if (strcmp(option, "--level") == 0 && has_value) level = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--sigma-s") == 0 && has_value) sigma_s = argv[++i];
+        else if (strcmp(option, "--denoise") == 0 && has_value) denoise_settings.iteration_count = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--lights") == 0 && has_value) lights_name = argv[++i];
+        else if (strcmp(option, "--global-majorant") == 0) local_majorants = false;
+        else if (strcmp(option, "--histogram-base") == 0 && has_value) settings.histogram_base = float(atof(argv[++i]));
+        else if (strcmp(option, "--background") == 0 && has_value) settings.background = float(atof(argv[++i]));
+        else if (strcmp(option, "--no-skipping") == 0) skip_empty = false;
+        else if (strcmp(option, "--path") == 0 && has_value) path_name = argv[++i];
+        else if (strcmp(option, "--first") == 0 && has_value) first_frame = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--count") == 0 && has_value) frame_count = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--tile") == 0 && has_value) settings.tile_size = uint32_t(atoi(argv[++i]));
+        else if (strcmp(option, "--threads") == 0 && has_value) jobs::set_thread_count(uint32_t(atoi(argv[++i])));
+        else if (strcmp(option, "--output") == 0 && has_value) output_name = argv[++i];
+        else {
+            printf("Unknown option %s\n", option);
+            print_usage();
+            return 1;
+        }
+    }
+    VolmarchMode mode = VMM_TRACE;
+    bool path_traced = strcmp(mode_name, "pt") == 0;
+    if (!path_traced && !volmarch::get_mode(mode_name, &mode)) {
+        printf("Unknown mode %s\n", mode_name);
+        print_usage();
+        return 1;
+    }
+    if (settings.width == 0 || settings.height == 0 || (path_traced && target_samples == 0 && time_budget <= 0.0f)) {
+        printf("Nothing to render, check --width, --height, --spp and --time\n");
+        return 1;
+    }
+
+    char default_deposit[512];
+    if (!deposit_name) {
+        const char *directory = strrchr(trace_name, '/') > strrchr(trace_name, '\\') ? strrchr(trace_name, '/') : strrchr(trace_name, '\\');
+        int directory_length = directory ? int(directory - trace_name + 1) : 0;
+        snprintf(default_deposit, sizeof(default_deposit), "%.*sdeposit.pvol", directory_length, trace_name);
+        deposit_name = default_deposit;
+    }
+    if (!state_name && std::ifstream("visu_state.tmp").is_open()) {
+        state_name = "visu_state.tmp";
+        printf("Using the view state in visu_state.tmp\n");
+    }
+    if (state_name && !volpath::load_state(state_name, &settings))
+        return 1;
+    if (sigma_s)
+        settings.sigma_s = float(atof(sigma_s));
+    settings.voxel_scale = float(1U << level);
+
+    // A camera path overrides the camera and trim of the view state frame by frame
+    CameraPath path = {};
+    FrameRange frames = { nullptr, 0, 1 };
+    if (path_name) {
+        if (!camera_path::load(path_name, &path))
+            return 1;
+        frames.path = &path;
+        frames.first = first_frame;
+        frames.end = path.frame_count;
+        if (first_frame < path.frame_count && frame_count < path.frame_count - first_frame)
+            frames.end = first_frame + frame_count;
+        if (frames.first >= frames.end) {
+            printf("No frames to render, the camera path %s ends at frame %u\n", path_name, path.frame_count - 1);
+            camera_path::release(&path);
+            return 1;
+        }
+    }
+    export_queue::start(MAX_QUEUED_IMAGES, uint64_t(MAX_QUEUED_IMAGES) * 6 * sizeof(float) * settings.width * settings.height);
+
+    bool success = true;
+    if (!path_traced) {
+        success = render_volume_mode(mode_name, mode, trace_name, deposit_name, palette_trace_name, level, skip_empty, &settings,
+            &frames, output_name);
+    } else {
+        auto start_time = std::chrono::high_resolution_clock::now();
+        VolpathScene scene = {};
+        success = load_grid(trace_name, level, 0, &scene.trace) && load_grid(deposit_name, level, 0, &scene.deposit)
+            && volpath::load_palette(palette_trace_name, &scene.palette_trace, &scene.palette_trace_size)
+            && volpath::load_palette(palette_data_name, &scene.palette_data, &scene.palette_data_size);
+        if (success && local_majorants)
+            volpath::build_majorant(&scene);
+        if (success && lights_name) {
+            success = load_lights(lights_name, &scene.trace, level, &scene.lights);
+            settings.illumination |= VI_GALAXIES;
+            if (success)
+                printf("%u galaxy lights from %s (%u BVH nodes)\n", scene.lights.light_count, lights_name, scene.lights.node_count);
+        }
+        auto load_time = std::chrono::high_resolution_clock::now();
+
+        if (success) {
+            printf("Rendering %u x %u px, grid %u x %u x %u (level %u), %s, %u threads, load %.2fs\n", settings.width, settings.height,
+                scene.trace.width, scene.trace.height, scene.trace.depth, level,
+                settings.sigma_s < 1.e-4f ? "emission-absorption" : "path traced", jobs::get_thread_count(),
+                std::chrono::duration<double>(load_time - start_time).count());
+            for (uint32_t frame = frames.first; frame < frames.end; ++frame) {
+                if (frames.path)
+                    camera_path::apply(frames.path, frame, &settings);
+                auto frame_start = std::chrono::high_resolution_clock::now();
+                VolpathImage image = volpath::get_image(settings.width, settings.height);
+                uint32_t samples = volpath::render(&scene, &settings, &image, target_samples, time_budget);
+                if (denoise_settings.iteration_count > 0) {
+                    VolpathImage filtered = volpath::get_image(settings.width, settings.height);
+                    denoise::filter(&image, &denoise_settings, &filtered);
+                    volpath::release(&image);
+                    image = filtered;
+                }
+                auto render_time = std::chrono::high_resolution_clock::now();
+
+                char hdr_name[512], ldr_name[512], map_name[512];
+                get_output_name(output_name, &frames, frame, "hdr", hdr_name);
+                get_output_name(output_name, &frames, frame, "tga", ldr_name);
+                get_output_name(output_name, &frames, frame, "spp.tga", map_name);
+                bool adaptive = settings.target_error > 0.0f;
+                save_image(&image, &settings, hdr_name, ldr_name, adaptive ? map_name : nullptr);
+                double render_seconds = std::chrono::duration<double>(render_time - frame_start).count();
+                double sample_count = double(image.total_samples);
+                printf("Render %.2fs (%u spp, %.2f Msamples/s, %.1f trace fetches per sample) -> %s, %s\n", render_seconds, samples,
+                    sample_count / (render_seconds > 0.0 ? render_seconds : 1e-9) * 1e-6,
+                    double(image.trace_fetches) / (sample_count > 0.0 ? sample_count : 1.0), hdr_name, ldr_name);
+                if (adaptive) {
+                    double mean_samples = sample_count / (double(settings.width) * settings.height);
+                    printf("Adaptive sampling: %.1f spp on average, %.1f%% of uniform sampling -> %s\n", mean_samples,
+                        100.0 * mean_samples / (samples > 0 ? samples : 1), map_name);
+                }
+                volpath::release(&image);
+            }
+        }
+
+        volpath::release(&scene.majorant);
+        light_bvh::release(&scene.lights);
+        volume::release(&scene.trace);
+        volume::release(&scene.deposit);
+        memory::free_heap(scene.palette_trace);
+        memory::free_heap(scene.palette_data);
+    }
+
+    export_queue::stop();
+    camera_path::release(&path);
+    return success && !write_failed ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+#define GATHER_GROUP_SIZE 64 // Must align with TRAJECTORY_GATHER_GROUP_SIZE in main.cpp
+#define GATHER_ROW_GROUPS 1024 // Must align with TRAJECTORY_GATHER_ROW_GROUPS in main.cpp
+
+RWStructuredBuffer<uint> agent_indices: register(u0);
+RWStructuredBuffer<float> gathered: register(u1);
+RWStructuredBuffer<float> particles_x: register(u2);
+RWStructuredBuffer<float> particles_y: register(u3);
+RWStructuredBuffer<float> particles_z: register(u4);
+RWStructuredBuffer<float> particles_weights: register(u7);
+
+// Copy the agents of a trajectory capture into a compact buffer with one plane per attribute (x, y, z, weight),
+// so reading a captured step back costs only as much as the selection
+[numthreads(GATHER_GROUP_SIZE, 1, 1)]
+void main(uint3 dispatchThreadId : SV_DispatchThreadID) {
+    uint count, stride;
+    agent_indices.GetDimensions(count, stride);
+    uint i = dispatchThreadId.y * GATHER_ROW_GROUPS * GATHER_GROUP_SIZE + dispatchThreadId.x;
+    if (i >= count)
+        return;
+
+    uint agent = agent_indices[i];
+    gathered[i] = particles_x[agent];
+    gathered[count + i] = particles_y[agent];
+    gathered[2 * count + i] = particles_z[agent];
+    gathered[3 * count + i] = particles_weights[agent];
+}
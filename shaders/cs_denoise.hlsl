@@ -0,0 +1,135 @@
+#define DENOISE_GROUP_SIZE 8 // Must align with DENOISE_GROUP_SIZE in main.cpp
+#define LUMINANCE_EPSILON 1.e-3 // Keeps converged pixels from stopping every edge
+#define DEPTH_EPSILON 1.0
+
+Texture2D<float4> tex_input : register(t0); // Accumulated colors and sample counts on the first pass, then colors and variance
+Texture2D<float4> tex_features : register(t1); // Feature sums and luminance moment of cs_volpath
+Texture2D<float4> tex_albedo : register(t2);
+RWTexture2D<float4> tex_output : register(u0); // Filtered colors and their luminance variance
+
+cbuffer ConfigBuffer : register(b4)
+{
+    float4x4 projection_matrix;
+    float4x4 view_matrix;
+    float4x4 model_matrix;
+	int texcoord_map;
+	float trim_x_min;
+    float trim_x_max;
+    float trim_y_min;
+    float trim_y_max;
+    float trim_z_min;
+    float trim_z_max;
+    float trim_density;
+    float grid_x;
+    float grid_y;
+    float grid_z;
+    float screen_width;
+    float screen_height;
+	float sample_weight;
+	float optical_thickness;
+	float highlight_density;
+	float galaxy_weight;
+	float histogram_base;
+    float overdensity_threshold_low;
+    float overdensity_threshold_high;
+    float camera_x;
+    float camera_y;
+    float camera_z;
+    int pt_iteration;
+    float sigma_s;
+    float sigma_a;
+    float sigma_e;
+    float trace_max;
+    float camera_offset_x;
+    float camera_offset_y;
+    float exposure;
+    int n_bounces;
+    float ambient_trace;
+    int compressive_accumulation;
+    float guiding_strength;
+    float scattering_anisotropy;
+    int denoise_step;
+    float denoise_sigma_luminance;
+    float denoise_sigma_depth;
+    float denoise_sigma_density;
+    float denoise_sigma_albedo;
+};
+
+static const float KERNEL[5] = { 1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0 }; // B3 spline
+static const float VARIANCE_KERNEL[3] = { 0.25, 0.5, 0.25 };
+
+float get_luminance(float3 color) {
+    return dot(color, float3(0.2126, 0.7152, 0.0722));
+}
+
+// Variance of the accumulated luminance: from its second moment on the first pass, filtered along in alpha afterwards
+float get_variance(int2 pixel) {
+    float4 color = tex_input.Load(int3(pixel, 0));
+    if (denoise_step > 1)
+        return color.a;
+    float luminance = get_luminance(color.rgb);
+    return max(tex_features.Load(int3(pixel, 0)).w - luminance * luminance, 0.0) / max(color.a, 1.0);
+}
+
+void get_features(int2 pixel, out float depth, out float log_density, out float3 albedo) {
+    float4 sums = tex_features.Load(int3(pixel, 0));
+    float weight_inv = sums.x > 0.0 ? 1.0 / sums.x : 0.0;
+    depth = sums.y * weight_inv;
+    log_density = log(1.0 + sums.z * weight_inv);
+    albedo = tex_albedo.Load(int3(pixel, 0)).rgb * weight_inv;
+}
+
+// One pass of the edge-avoiding A-trous filter of cpplib/denoise.cpp over the path traced image: a 5 x 5 B3-spline
+// kernel with taps denoise_step px apart, weighted down across feature edges and luminance differences the noise
+// does not explain. main.cpp runs the passes with steps 1, 2, 4, ... ping-ponging between two textures.
+[numthreads(DENOISE_GROUP_SIZE, DENOISE_GROUP_SIZE, 1)]
+void main(uint3 dispatchThreadId : SV_DispatchThreadID) {
+    int2 pixel = int2(dispatchThreadId.xy);
+    int2 size = int2(screen_width, screen_height);
+    if (any(pixel >= size))
+        return;
+
+    // Few samples estimate the variance poorly, so the edge-stopping uses it blurred over 3 x 3 px
+    float variance = 0.0, variance_weight = 0.0;
+    for (int vy = -1; vy <= 1; ++vy) {
+        for (int vx = -1; vx <= 1; ++vx) {
+            int2 q = pixel + int2(vx, vy);
+            if (any(q < 0) || any(q >= size))
+                continue;
+            float weight = VARIANCE_KERNEL[vx + 1] * VARIANCE_KERNEL[vy + 1];
+            variance += weight * get_variance(q);
+            variance_weight += weight;
+        }
+    }
+    float luminance_scale = 1.0 / (denoise_sigma_luminance * sqrt(variance / variance_weight) + LUMINANCE_EPSILON);
+
+    float luminance = get_luminance(tex_input.Load(int3(pixel, 0)).rgb);
+    float depth, log_density;
+    float3 albedo;
+    get_features(pixel, depth, log_density, albedo);
+
+    float3 color_sum = float3(0.0, 0.0, 0.0);
+    float variance_sum = 0.0, weight_sum = 0.0;
+    for (int dy = -2; dy <= 2; ++dy) {
+        for (int dx = -2; dx <= 2; ++dx) {
+            int2 q = pixel + int2(dx, dy) * denoise_step;
+            if (any(q < 0) || any(q >= size))
+                continue;
+            float3 q_color = tex_input.Load(int3(q, 0)).rgb;
+            float q_depth, q_log_density;
+            float3 q_albedo;
+            get_features(q, q_depth, q_log_density, q_albedo);
+            float edge = abs(luminance - get_luminance(q_color)) * luminance_scale
+                + abs(depth - q_depth) / (denoise_sigma_depth * max(depth, q_depth) + DEPTH_EPSILON)
+                + abs(log_density - q_log_density) / denoise_sigma_density
+                + length(albedo - q_albedo) / denoise_sigma_albedo;
+            float weight = KERNEL[dx + 2] * KERNEL[dy + 2] * exp(-edge);
+            color_sum += weight * q_color;
+            variance_sum += weight * weight * get_variance(q);
+            weight_sum += weight;
+        }
+    }
+
+    // The center tap always contributes, so the weight sum is positive
+    tex_output[pixel] = float4(color_sum / weight_sum, variance_sum / (weight_sum * weight_sum));
+}
@@ -0,0 +1,32 @@
+#define MAJORANT_BLOCK 8 // Must align with PT_MAJORANT_BLOCK in main.cpp and cs_volpath.hlsl
+#define MAJORANT_GROUP_SIZE 4
+
+Texture3D tex_trace : register(t0);
+RWTexture3D<float2> tex_majorant : register(u1);
+
+// Min/max trace of one block of voxels for the path tracer's local majorants. The block is extended by the one-voxel
+// apron that trilinear lookups inside it reach, so the bounds hold for every filtered sample.
+[numthreads(MAJORANT_GROUP_SIZE, MAJORANT_GROUP_SIZE, MAJORANT_GROUP_SIZE)]
+void main(uint3 dispatchThreadId : SV_DispatchThreadID) {
+    uint3 cell = dispatchThreadId.xyz;
+    uint3 cell_count, grid;
+    tex_majorant.GetDimensions(cell_count.x, cell_count.y, cell_count.z);
+    tex_trace.GetDimensions(grid.x, grid.y, grid.z);
+    if (any(cell >= cell_count))
+        return;
+
+    int3 lo = max(int3(cell * MAJORANT_BLOCK) - 1, int3(0, 0, 0));
+    int3 hi = min(int3(cell * MAJORANT_BLOCK) + MAJORANT_BLOCK, int3(grid) - 1);
+    float trace_min = 3.4e38;
+    float trace_max = -3.4e38;
+    for (int z = lo.z; z <= hi.z; ++z) {
+        for (int y = lo.y; y <= hi.y; ++y) {
+            for (int x = lo.x; x <= hi.x; ++x) {
+                float trace = tex_trace.Load(int4(x, y, z, 0)).r;
+                trace_min = min(trace_min, trace);
+                trace_max = max(trace_max, trace);
+            }
+        }
+    }
+    tex_majorant[cell] = float2(trace_min, trace_max);
+}
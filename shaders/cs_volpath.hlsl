@@ -6,20 +6,37 @@
 #define RAY_EPSILON 1.e-5
 #define INTENSITY_EPSILON 1.e-4
 #define NUMERICAL_EPSILON 1.e-4
+#define RATIO_TRACKING_RR_THRESHOLD 0.1 // Transmittance estimates below this play Russian roulette
+#define MAJORANT_BLOCK 8 // Must align with PT_MAJORANT_BLOCK in main.cpp and cs_trace_majorant.hlsl
+#define FEATURE_ITERATIONS 4 // Iterations that add their primary ray to the denoiser features
+#define FEATURE_OPTICAL_DEPTH 7.0 // Feature rays stop where less than 0.1% of the light gets through
+#define MIN_ADAPTIVE_SAMPLES 16 // Samples per pixel before a group may stop, so sparse bright paths are seen
+#define ERROR_LUMINANCE_FLOOR 0.01 // Pixels darker than this need an absolute error, not a relative one
+#define SCREEN_DISTANCE 4.5
+#define CAMERA_OFFSET_RATIO 0.45
+#define HISTORY_MAX_SAMPLES 64.0 // Reprojected history counts as at most this many samples, so new ones sharpen it again
+#define HISTORY_DEPTH_TOLERANCE 0.05 // Relative depth difference at which the confidence in a history pixel drops to 1/e
+#define POINT_LIGHT_INTENSITY 100.0 // Of the POINT light, before galaxy_weight
+#define GALAXY_LIGHT_SCALE 1.e-4 // Galaxy intensity per deposit weight; the weights sum to 10^6, the POINT light's 100
+#define ONE_MINUS_EPSILON 0.99999994
 
 // Control flags
 #define TEMPORAL_ACCUMULATION
 #define RUSSIAN_ROULETTE
+#define LOCAL_MAJORANTS // Track against the per-block trace maxima in tex_majorant instead of trace_max
 // #define GRADIENT_GUIDING
 // #define TRACE_SHARPENING
 
 // Illumination types
 // #define WHITESKY_ILLUMINATION
 // #define POINT_ILLUMINATION
+// #define GALAXY_ILLUMINATION // Every data point as a point light, one picked from the light BVH per scattering event
 #define HALO_ILLUMINATION
 #define TRACE_ILLUMINATION
 
-RWTexture2D<float4> tex_accumulator: register(u0);
+RWTexture2D<float4> tex_accumulator: register(u0); // Mean color and sample count
+RWTexture2D<float4> tex_features : register(u1); // Denoiser features: weight, depth and density sums, luminance moment
+RWTexture2D<float4> tex_albedo : register(u2); // Denoiser features: emission color sum
 Texture3D tex_trace : register(t1);
 SamplerState tex_trace_sampler : register(s1);
 Texture3D tex_deposit : register(t2);
@@ -28,6 +45,21 @@ Texture2D tex_palette_trace : register(t3);
 SamplerState tex_palette_trace_sampler : register(s3);
 Texture2D tex_palette_data : register(t4);
 SamplerState tex_palette_data_sampler : register(s4);
+Texture3D<float2> tex_majorant : register(t5);
+Texture2D<float4> tex_history : register(t6); // Accumulator and features of the previous view, for the reprojection
+Texture2D<float4> tex_history_features : register(t7);
+
+// Light BVH over the data points (cpplib/light_bvh.h): pre-order nodes, leaves reference a range of `lights`
+struct LightNode {
+    float3 bounds_min;
+    float power;
+    float3 bounds_max;
+    uint right; // 0 for leaves
+    uint begin;
+    uint end;
+};
+RWStructuredBuffer<LightNode> light_nodes : register(u3);
+RWStructuredBuffer<float4> lights : register(u4); // Grid position [vox] and deposit weight
 
 cbuffer ConfigBuffer : register(b4)
 {
@@ -70,8 +102,22 @@ cbuffer ConfigBuffer : register(b4)
     int compressive_accumulation;
     float guiding_strength;
     float scattering_anisotropy;
+    int denoise_step;
+    float denoise_sigma_luminance;
+    float denoise_sigma_depth;
+    float denoise_sigma_density;
+    float denoise_sigma_albedo;
+    float target_error;
+    float prev_camera_x; // Camera of the last iteration before the view changed
+    float prev_camera_y;
+    float prev_camera_z;
+    float prev_camera_offset_x;
+    float prev_camera_offset_y;
+    int reproject_history; // Iteration 0 starts from the reprojected history instead of an empty accumulator
 };
 
+groupshared float group_error[PT_GROUP_SIZE_X * PT_GROUP_SIZE_Y];
+
 struct RNG {
     #define BAD_W 0x464fffffU
     #define BAD_Z 0x9068ffffU
@@ -212,7 +258,71 @@ float delta_step(float sigma_max_inv, float xi) {
 	return -log(max(xi, 0.001)) * sigma_max_inv;
 }
 
+// Rho bounds of a majorant grid cell (trace min/max over a block of voxels and its interpolation apron)
+float2 get_rho_bounds(int3 cell) {
+    float2 trace_bounds = tex_majorant.Load(int4(cell, 0));
+    return float2(trace_to_rho(trace_bounds.x), trace_to_rho(trace_bounds.y));
+}
+
+float get_rho_majorant(int3 cell) {
+    return trace_to_rho(tex_majorant.Load(int4(cell, 0)).y);
+}
+
+// Start a DDA walk through the majorant grid at rp + t * rd
+void majorant_walk_start(float3 rp, float3 rd, float t, out int3 cell, out int3 cell_step, out float3 t_next, out float3 t_delta) {
+    uint3 cell_count;
+    tex_majorant.GetDimensions(cell_count.x, cell_count.y, cell_count.z);
+    cell = clamp(int3(floor((rp + t * rd) / MAJORANT_BLOCK)), int3(0, 0, 0), int3(cell_count) - 1);
+    cell_step = int3(rd.x >= 0.0 ? 1 : -1, rd.y >= 0.0 ? 1 : -1, rd.z >= 0.0 ? 1 : -1);
+    float3 boundary = float3(cell + max(cell_step, int3(0, 0, 0))) * MAJORANT_BLOCK;
+    t_next = (rd != 0.0) ? (boundary - rp) / rd : 1.e30;
+    t_delta = (rd != 0.0) ? MAJORANT_BLOCK / abs(rd) : 1.e30;
+}
+
+// Step into the next cell along the ray, false once the walk leaves the grid
+bool majorant_walk_next(inout int3 cell, int3 cell_step, inout float3 t_next, float3 t_delta) {
+    uint3 cell_count;
+    tex_majorant.GetDimensions(cell_count.x, cell_count.y, cell_count.z);
+    if (t_next.x <= t_next.y && t_next.x <= t_next.z) {
+        cell.x += cell_step.x;
+        t_next.x += t_delta.x;
+    } else if (t_next.y <= t_next.z) {
+        cell.y += cell_step.y;
+        t_next.y += t_delta.y;
+    } else {
+        cell.z += cell_step.z;
+        t_next.z += t_delta.z;
+    }
+    return all(cell >= 0) && all(cell < int3(cell_count));
+}
+
 float delta_tracking(float3 rp, float3 rd, float t_min, float t_max, float rho_max_inv, inout RNG rng) {
+    #ifdef LOCAL_MAJORANTS
+    // Each cell segment is tracked against its own majorant; empty cells are crossed without lookups
+    float sigma_t = sigma_a + sigma_s;
+    int3 cell, cell_step;
+    float3 t_next, t_delta;
+    majorant_walk_start(rp, rd, t_min, cell, cell_step, t_next, t_delta);
+    float t = t_min;
+    while (t < t_max) {
+        float t_cell = clamp(min(min(t_next.x, t_next.y), t_next.z), t, t_max);
+        float rho_majorant = get_rho_majorant(cell);
+        if (rho_majorant > 0.0) {
+            float t_candidate = t + delta_step(1.0 / (sigma_t * rho_majorant), rng.random_float());
+            if (t_candidate < t_cell) {
+                t = t_candidate;
+                if (rng.random_float() * rho_majorant < get_rho(rp + t * rd))
+                    return t;
+                continue;
+            }
+        }
+        // Free paths are memoryless, so the walk restarts at the cell boundary
+        t = t_cell;
+        if (!majorant_walk_next(cell, cell_step, t_next, t_delta))
+            break;
+    }
+    return t_max;
+    #else
 	float sigma_max_inv = rho_max_inv / (sigma_a + sigma_s);
     float t = t_min;
     float event_rho = 0.0;
@@ -222,22 +332,62 @@ float delta_tracking(float3 rp, float3 rd, float t_min, float t_max, float rho_m
 	} while (t <= t_max && rng.random_float() > event_rho * rho_max_inv);
 
 	return t;
+    #endif
 }
 
-float occlusion_tracking(float3 rp, float3 rd, float t_min, float t_max, float rho_max_inv, float subsampling, inout RNG rng) {
-	float sigma_max_inv = rho_max_inv / (sigma_a + sigma_s);
-    float t = t_min;
-    float rho_sum = 0.0;
-    int iSteps = 0;
-	do {
-		t += subsampling * delta_step(sigma_max_inv, rng.random_float());
-		rho_sum += get_rho(rp + t * rd);
-        ++iSteps;
-	} while (t <= t_max);
-    rho_sum /= float(iSteps);
-    float transmittance = exp(-(sigma_s + sigma_a) * rho_sum * (t_max - t_min));
+// Exact exponential free path; unlike delta_step it does not clamp xi, which ratio tracking needs to stay unbiased
+float free_path(float sigma_inv, float xi) {
+    return -log(1.0 - xi) * sigma_inv;
+}
 
-	return transmittance;
+// Keep a small estimate with probability |estimate| / RATIO_TRACKING_RR_THRESHOLD, raised to the threshold
+bool russian_roulette(inout float estimate, inout RNG rng) {
+    float magnitude = abs(estimate);
+    if (magnitude >= RATIO_TRACKING_RR_THRESHOLD)
+        return true;
+    if (rng.random_float() * RATIO_TRACKING_RR_THRESHOLD >= magnitude)
+        return false;
+    estimate = sign(estimate) * RATIO_TRACKING_RR_THRESHOLD;
+    return true;
+}
+
+// Transmittance between t_min and t_max by residual ratio tracking. The cell minimum is a control density integrated
+// exactly, only the residual up to the cell maximum is sampled, and each tentative collision scales the estimate by the
+// probability of a null collision. Unbiased for any majorant (with trace_max, denser voxels give negative factors).
+float ratio_tracking(float3 rp, float3 rd, float t_min, float t_max, float rho_max_inv, inout RNG rng) {
+    float sigma_t = sigma_a + sigma_s;
+    float transmittance = 1.0;
+    #ifdef LOCAL_MAJORANTS
+    int3 cell, cell_step;
+    float3 t_next, t_delta;
+    majorant_walk_start(rp, rd, t_min, cell, cell_step, t_next, t_delta);
+    float t = t_min;
+    while (t < t_max) {
+        float t_cell = clamp(min(min(t_next.x, t_next.y), t_next.z), t, t_max);
+        float2 rho_bounds = get_rho_bounds(cell);
+        float rho_residual = rho_bounds.y - rho_bounds.x;
+        transmittance *= exp(-sigma_t * rho_bounds.x * (t_cell - t));
+        if (rho_residual > 0.0) {
+            float residual_inv = 1.0 / (sigma_t * rho_residual);
+            for (t += free_path(residual_inv, rng.random_float()); t < t_cell; t += free_path(residual_inv, rng.random_float())) {
+                transmittance *= 1.0 - (get_rho(rp + t * rd) - rho_bounds.x) / rho_residual;
+                if (!russian_roulette(transmittance, rng))
+                    return 0.0;
+            }
+        }
+        t = t_cell;
+        if (!majorant_walk_next(cell, cell_step, t_next, t_delta))
+            break;
+    }
+    #else
+    float sigma_max_inv = rho_max_inv / sigma_t;
+    for (float t = t_min + free_path(sigma_max_inv, rng.random_float()); t < t_max; t += free_path(sigma_max_inv, rng.random_float())) {
+        transmittance *= 1.0 - get_rho(rp + t * rd) * rho_max_inv;
+        if (!russian_roulette(transmittance, rng))
+            return 0.0;
+    }
+    #endif
+    return transmittance;
 }
 
 void generate_basis(float3 dir, out float3 v1, out float3 v2)
@@ -272,6 +422,78 @@ float pdf_HG(float g, float cos_angle) {
     return (1.0 - g*g) / (denominator_cubicrt * denominator_cubicrt * denominator_cubicrt);
 }
 
+// Power over the squared distance to the node center, which is clamped by the node extent for points in or near the node
+float get_light_importance(LightNode node, float3 p) {
+    float3 d = p - 0.5 * (node.bounds_min + node.bounds_max);
+    float3 e = 0.5 * (node.bounds_max - node.bounds_min);
+    return node.power / max(max(dot(d, d), dot(e, e)), 1.0);
+}
+
+// Pick a light for p as light_bvh::sample does: descend by the importance of the children, rescaling xi at every level,
+// then pick within the leaf by the power over the squared distance of every light. Returns -1 if there is no power.
+int sample_light(float3 p, float xi, out float pmf) {
+    pmf = 0.0;
+    LightNode node = light_nodes[0];
+    if (node.power <= 0.0)
+        return -1;
+    float probability = 1.0;
+    xi = clamp(xi, 0.0, ONE_MINUS_EPSILON);
+    uint index = 0;
+    while (node.right != 0) {
+        LightNode left = light_nodes[index + 1];
+        LightNode right = light_nodes[node.right];
+        float importance_left = get_light_importance(left, p);
+        float importance_sum = importance_left + get_light_importance(right, p);
+        if (importance_sum <= 0.0)
+            return -1;
+        float p_left = importance_left / importance_sum;
+        if (xi < p_left) {
+            xi /= p_left;
+            probability *= p_left;
+            index = index + 1;
+            node = left;
+        } else {
+            xi = (xi - p_left) / (1.0 - p_left);
+            probability *= 1.0 - p_left;
+            index = node.right;
+            node = right;
+        }
+        xi = min(xi, ONE_MINUS_EPSILON);
+    }
+
+    float weight_sum = 0.0;
+    for (uint i = node.begin; i < node.end; ++i) {
+        float3 d = p - lights[i].xyz;
+        weight_sum += lights[i].w / max(dot(d, d), 1.0);
+    }
+    if (weight_sum <= 0.0)
+        return -1;
+    float target = xi * weight_sum;
+    float sum = 0.0;
+    int picked = -1;
+    float picked_weight = 0.0;
+    for (uint j = node.begin; j < node.end && sum <= target; ++j) {
+        float3 d = p - lights[j].xyz;
+        float weight = lights[j].w / max(dot(d, d), 1.0);
+        if (weight > 0.0) {
+            picked = int(j);
+            picked_weight = weight;
+        }
+        sum += weight;
+    }
+    pmf = probability * picked_weight / weight_sum;
+    return picked;
+}
+
+// Light of a point source at lp reaching rp, with an unbiased transmittance estimate
+float get_point_L(float3 rp, float3 lp, float intensity, float rho_max_inv, inout RNG rng) {
+    float3 ld = lp - rp;
+    float l_distance = length(ld);
+    ld /= max(l_distance, NUMERICAL_EPSILON);
+    float transmittance = ratio_tracking(rp, ld, 0.0, l_distance, rho_max_inv, rng);
+    return intensity * transmittance / max(l_distance * l_distance, 1.0);
+}
+
 float3 get_incident_L(float3 rp, float3 rd, float3 c_low, float3 c_high, int nBounces, int nRRStartOrder, inout RNG rng) {
     float3 L = float3(0.0, 0.0, 0.0);
     float throughput = 1.0;
@@ -305,12 +527,14 @@ float3 get_incident_L(float3 rp, float3 rd, float3 c_low, float3 c_high, int nBo
         emission += get_emitted_data_L(halo_event);
         #endif
         #ifdef POINT_ILLUMINATION
-        float3 ld = lp - rp;
-        float l_distance = length(ld);
-        ld = normalize(ld);
-        // Modified delta-tracking transmittance estimator
-        float transmittance = occlusion_tracking(rp, ld, 0.0, l_distance, rho_max_inv, 10.0, rng);
-        emission += 100.0 * galaxy_weight * transmittance / max(l_distance * l_distance, 1.0);
+        emission += get_point_L(rp, lp, POINT_LIGHT_INTENSITY * galaxy_weight, rho_max_inv, rng);
+        #endif
+        #ifdef GALAXY_ILLUMINATION
+        // Next-event estimation towards one galaxy picked by the light BVH, weighted by the inverse of its probability
+        float light_pmf;
+        int light = sample_light(rp, rng.random_float(), light_pmf);
+        if (light >= 0)
+            emission += get_point_L(rp, lights[light].xyz, GALAXY_LIGHT_SCALE * galaxy_weight * lights[light].w / light_pmf, rho_max_inv, rng);
         #endif
         L += throughput * rho_event * sigma_e * emission;
 
@@ -344,15 +568,129 @@ float3 get_incident_L(float3 rp, float3 rd, float3 c_low, float3 c_high, int nBo
     return L;
 }
 
+// Feature sums of the emission-absorption march along a primary ray for cs_denoise: the emission weights of the march,
+// and depth, density and emission color weighted with them (cpplib/volpath.cpp marches the same features)
+void add_features(float3 rp, float3 rd, float2 t, inout float4 features, inout float3 albedo) {
+    float sigma_t = sigma_a + sigma_s;
+    int iSteps = int((t.y - t.x) / 1.71);
+    float dt = (t.y - t.x) / float(max(iSteps, 1));
+    float tau = 0.0;
+    for (int i = 0; i < iSteps; ++i) {
+        float t_step = t.x + (float(i) + 0.5) * dt;
+        float3 p = rp + t_step * rd;
+        float rho = get_rho(p);
+        tau += rho;
+        float weight = exp(-sigma_t * tau) * rho;
+        float3 emission = float3(0.0, 0.0, 0.0);
+        #ifdef TRACE_ILLUMINATION
+        emission += get_emitted_trace_L(rho);
+        #endif
+        #ifdef HALO_ILLUMINATION
+        emission += get_emitted_data_L(get_halo(p));
+        #endif
+        features.xyz += weight * float3(1.0, t_step, rho);
+        albedo += weight * emission;
+        if (sigma_t * tau > FEATURE_OPTICAL_DEPTH)
+            break;
+    }
+}
+
+void get_camera_basis(float3 camera_pos, out float3 camX, out float3 camY, out float3 camZ) {
+    camZ = normalize(-camera_pos);
+    camX = normalize(cross(camZ, float3(0, 0, 1)));
+    camY = normalize(cross(camX, camZ));
+}
+
+// Image position [px] in the previous view of a point in texture coordinates, and its distance to the previous camera
+// [vox]; the distance is negative behind the camera. Inverts the ray generation of main() for the previous camera.
+float3 project_to_previous_view(float3 p, float3 c_low, float3 c_high, float3 grid_res) {
+    float3 coord_rel = p / grid_res;
+    coord_rel.y = 1.0 - coord_rel.y;
+    coord_rel.z = 1.0 - coord_rel.z;
+    float3 p_normalized = c_low + coord_rel * (c_high - c_low);
+    float3 camera_pos = float3(prev_camera_x, prev_camera_y, prev_camera_z);
+    float3 camX, camY, camZ;
+    get_camera_basis(camera_pos, camX, camY, camZ);
+    float3 v = p_normalized - camera_pos;
+    float view_depth = dot(v, camZ);
+    if (view_depth <= 0.0)
+        return float3(-1.0, -1.0, -1.0);
+    float rx = dot(v, camX) * SCREEN_DISTANCE / view_depth + CAMERA_OFFSET_RATIO * prev_camera_offset_x;
+    float ry = dot(v, camY) * SCREEN_DISTANCE / view_depth + CAMERA_OFFSET_RATIO * prev_camera_offset_y;
+    float aspect_ratio = float(screen_width) / float(screen_height);
+    float2 position = float2((rx + 1.0) * 0.5 * screen_width, (ry * aspect_ratio + 1.0) * 0.5 * screen_height);
+    return float3(position, length(p - coord_normalized_to_texture(camera_pos, c_low, c_high, grid_res)));
+}
+
+// Accumulated color, sample count (alpha) and luminance moment of the previous view where the pixel's features lie.
+// The point at the feature depth is projected into the previous view and its 2 x 2 history pixels are blended with
+// bilinear weights times their confidence, which falls with the difference of their depth to the point's. The blend
+// counts as the confident part of their samples, up to HISTORY_MAX_SAMPLES.
+float4 get_reprojected_history(float3 rp, float3 rd, float4 features, float3 c_low, float3 c_high, float3 grid_res,
+                               out float moment) {
+    moment = 0.0;
+    if (features.x <= 0.0)
+        return float4(0.0, 0.0, 0.0, 0.0);
+    float3 previous = project_to_previous_view(rp + features.y / features.x * rd, c_low, c_high, grid_res);
+    if (previous.z <= 0.0)
+        return float4(0.0, 0.0, 0.0, 0.0);
+    float2 position = previous.xy - 0.5;
+    int2 base = int2(floor(position));
+    float2 f = position - float2(base);
+    float4 history = float4(0.0, 0.0, 0.0, 0.0);
+    float weight_sum = 0.0;
+    for (int i = 0; i < 4; ++i) {
+        int2 q = base + int2(i & 1, i >> 1);
+        if (any(q < 0) || q.x >= int(screen_width) || q.y >= int(screen_height))
+            continue;
+        float4 q_features = tex_history_features.Load(int3(q, 0));
+        if (q_features.x <= 0.0)
+            continue;
+        float q_depth = q_features.y / q_features.x;
+        float confidence = exp(-abs(q_depth - previous.z) / (HISTORY_DEPTH_TOLERANCE * previous.z));
+        float weight = ((i & 1) ? f.x : 1.0 - f.x) * ((i >> 1) ? f.y : 1.0 - f.y) * confidence;
+        float4 q_history = tex_history.Load(int3(q, 0));
+        history += weight * q_history;
+        moment += weight * q_features.w;
+        weight_sum += weight;
+    }
+    if (weight_sum < 1.e-3) {
+        moment = 0.0;
+        return float4(0.0, 0.0, 0.0, 0.0);
+    }
+    moment /= weight_sum;
+    return float4(history.rgb / weight_sum, min(history.a, HISTORY_MAX_SAMPLES));
+}
+
 [numthreads(PT_GROUP_SIZE_X, PT_GROUP_SIZE_Y, 1)]
 void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 groupID : SV_GroupID,
           uint3 dispatchThreadId : SV_DispatchThreadID) {
     uint2 pixel_xy = dispatchThreadId.xy;
     uint idx = threadIDInGroup + PT_GROUP_SIZE_X * PT_GROUP_SIZE_Y * groupID;
 
-    // If PT has been reset, zero-out the accumulation buffer
-    if (pt_iteration == 0)
-        tex_accumulator[pixel_xy] = float4(0.0, 0.0, 0.0, 0.0);
+    // If PT has been reset, zero-out the features; the accumulator follows once they give the depth for the reprojection
+    if (pt_iteration == 0) {
+        tex_features[pixel_xy] = float4(0.0, 0.0, 0.0, 0.0);
+        tex_albedo[pixel_xy] = float4(0.0, 0.0, 0.0, 0.0);
+    }
+
+    // Adaptive sampling: a group of pixels stops once the RMS over its pixels of the standard error of the mean
+    // luminance, relative to that luminance, is below target_error (the branch is uniform, as is the decision)
+    if (target_error > 0.0 && pt_iteration >= MIN_ADAPTIVE_SAMPLES) {
+        float4 accumulated = tex_accumulator[pixel_xy];
+        float n = max(accumulated.a, 2.0);
+        float luminance = dot(accumulated.rgb, float3(0.2126, 0.7152, 0.0722));
+        float sample_variance = max(tex_features[pixel_xy].w - luminance * luminance, 0.0) * n / (n - 1.0);
+        float scale = max(luminance, ERROR_LUMINANCE_FLOOR);
+        uint thread_index = threadIDInGroup.y * PT_GROUP_SIZE_X + threadIDInGroup.x;
+        group_error[thread_index] = sample_variance / (n * scale * scale);
+        GroupMemoryBarrierWithGroupSync();
+        float error_sum = 0.0;
+        for (uint i = 0; i < PT_GROUP_SIZE_X * PT_GROUP_SIZE_Y; ++i)
+            error_sum += group_error[i];
+        if (error_sum <= target_error * target_error * float(PT_GROUP_SIZE_X * PT_GROUP_SIZE_Y))
+            return;
+    }
 
     // Initialize RNG with a unique seed for each iteration
     RNG rng;
@@ -368,18 +706,14 @@ void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 groupID : SV_GroupID,
     ry /= aspect_ratio;
 
     // Initialize ray origin and direction
-    const float screen_distance = 4.5;
-    const float cam_offset_ratio = 0.45;
     float3 camera_pos = float3(camera_x, camera_y, camera_z);
-    float3 camZ = normalize(-camera_pos);
-    float3 camY = float3(0,0,1);
-	float3 camX = normalize(cross(camZ, camY));
-	camY = normalize(cross(camX, camZ));
+    float3 camX, camY, camZ;
+    get_camera_basis(camera_pos, camX, camY, camZ);
     float3 screen_pos =
         camera_pos
-        + (rx - cam_offset_ratio * camera_offset_x) * camX
-        + (ry - cam_offset_ratio * camera_offset_y) * camY
-        + screen_distance * camZ;
+        + (rx - CAMERA_OFFSET_RATIO * camera_offset_x) * camX
+        + (ry - CAMERA_OFFSET_RATIO * camera_offset_y) * camY
+        + SCREEN_DISTANCE * camZ;
 
     // Get intersection of the ray with the volume AABB
     float3 grid_res = float3(grid_x, grid_y, grid_z);
@@ -392,6 +726,24 @@ void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 groupID : SV_GroupID,
     float3 c_high_trimmed = float3(min(1.0,trim_x_max), min(1.0,trim_y_max), min(1.0,trim_z_max)) * grid_res;
     float2 t = ray_AABB_intersection(rp, rd, c_low_trimmed, c_high_trimmed);
 
+    // The first iterations also march the denoiser features, antialiased by the jitter of their rays
+    float4 features = tex_features[pixel_xy];
+    if (pt_iteration < FEATURE_ITERATIONS && t.y >= 0) {
+        float3 albedo = tex_albedo[pixel_xy].rgb;
+        add_features(rp, rd, float2(max(t.x, 0.0) + RAY_EPSILON, t.y - RAY_EPSILON), features, albedo);
+        tex_albedo[pixel_xy] = float4(albedo, 0.0);
+    }
+
+    // A reset starts from nothing, a camera move from the previous view's image where it is still visible
+    if (pt_iteration == 0) {
+        float4 history = float4(0.0, 0.0, 0.0, 0.0);
+        float history_moment = 0.0;
+        if (reproject_history == 1)
+            history = get_reprojected_history(rp, rd, features, c_low, c_high, grid_res, history_moment);
+        tex_accumulator[pixel_xy] = history;
+        features.w = history_moment;
+    }
+
     // Integrate...
     float3 path_L = float3(0.0, 0.0, 0.0);
     if (t.y >= 0) {
@@ -443,13 +795,16 @@ void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 groupID : SV_GroupID,
     // Accumulate LDR or HDR values?
     path_L = (compressive_accumulation == 1) ? tonemap(path_L, exposure) : path_L;
 
-    // Write out results for the current iteration
+    // Write out results for the current iteration; pixels of stopped groups have fewer samples than pt_iteration
+    float luminance = dot(path_L, float3(0.2126, 0.7152, 0.0722));
     #ifdef TEMPORAL_ACCUMULATION
     float4 current_value = tex_accumulator[pixel_xy];
-    tex_accumulator[pixel_xy] =
-        current_value * float(pt_iteration) / float(pt_iteration + 1)
-        + float4(path_L, 1.0) / float(pt_iteration + 1);
+    float n = current_value.a;
+    features.w = (features.w * n + luminance * luminance) / (n + 1.0);
+    tex_accumulator[pixel_xy] = float4((current_value.rgb * n + path_L) / (n + 1.0), n + 1.0);
     #else
+    features.w = luminance * luminance;
     tex_accumulator[pixel_xy] = float4(path_L, 1.0);
     #endif
+    tex_features[pixel_xy] = features;
 }
\ No newline at end of file